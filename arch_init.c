@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -41,6 +42,13 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "cpus.h"
+#include "qemu-thread.h"
+#include "qemu_socket.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "qmp-commands.h"
+#include "qerror.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -93,6 +101,20 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_POSTCOPY_DISCARD 0x80
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC 0x200
+
+/* Version 5 of the "ram" section may contain RAM_SAVE_FLAG_COMPRESS_PAGE,
+   RAM_SAVE_FLAG_XBZRLE, RAM_SAVE_FLAG_POSTCOPY_DISCARD or
+   RAM_SAVE_FLAG_MULTIFD_SYNC records; it is only used when one of the
+   compress, xbzrle, postcopy-ram or multifd capabilities is enabled, so
+   that destinations which cannot parse them refuse the stream. */
+#define RAM_SAVE_VERSION_ID      4
+#define RAM_SAVE_VERSION_ID_CAPS 5
+
+#define ENCODING_FLAG_XBZRLE 0x1
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -111,13 +133,764 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
 
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+static RAMBlock *last_sent_block;
+static uint64_t bytes_transferred;
+
+/* Dirty rate measurement.  Every write to RAM sets DIRTY_RATE_FLAG and
+ * ram_list.rate_dirty_pages counts the pages that have it, so at the end of
+ * a period it holds the number of distinct pages the guest dirtied.  The
+ * flags are then cleared for the next period.
+ *
+ * The rate is measured during migration, where the periods end at the
+ * dirty log syncs, and after dirty-rate-start, where a timer ends them.
+ * Either way dirty logging has to be on for KVM and vhost to report
+ * writes. */
+#define DIRTY_RATE_PERIOD_MS     1000
+#define DIRTY_RATE_PERIOD_MIN_MS 100
+#define DIRTY_RATE_PERIOD_MAX_MS 60000
+
+static struct {
+    bool migrating;
+    bool sampling;
+    QEMUTimer *timer;
+    int64_t period;
+    int64_t period_start;
+    uint64_t period_bytes_start;
+    bool has_pages_rate;
+    uint64_t pages_rate;
+    int high_rate_count;
+} dirty_stats = { .period = DIRTY_RATE_PERIOD_MS };
+
+static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flag)
+{
+    if (block == last_sent_block) {
+        qemu_put_be64(f, offset | RAM_SAVE_FLAG_CONTINUE | flag);
+        return;
+    }
+
+    qemu_put_be64(f, offset | flag);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    last_sent_block = block;
+}
+
+/***********************************************************/
+/* XBZRLE delta encoding */
+
+/* With the xbzrle capability, the last copy sent of each page is kept in an
+ * LRU cache.  When a cached page is dirtied again only an XOR + run-length
+ * encoded delta against the cached copy is sent.  Pages are not cached
+ * during the first pass over RAM, where nothing could be gained.
+ */
+
+static struct {
+    /* buffer used for XBZRLE encoding */
+    uint8_t *encoded_buf;
+    /* buffer for storing page content */
+    uint8_t *current_buf;
+    /* cache for XBZRLE */
+    PageCache *cache;
+} XBZRLE;
+
+typedef struct AccountingInfo {
+    uint64_t xbzrle_bytes;
+    uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_overflows;
+    uint64_t xbzrle_bytes_saved;
+} AccountingInfo;
+
+static AccountingInfo acct_info;
+static bool ram_xbzrle;
+static bool ram_bulk_stage;
+
+static void acct_clear(void)
+{
+    memset(&acct_info, 0, sizeof(acct_info));
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return acct_info.xbzrle_bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return acct_info.xbzrle_pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_pages + acct_info.xbzrle_overflows;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return acct_info.xbzrle_cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return acct_info.xbzrle_overflows;
+}
+
+uint64_t xbzrle_mig_bytes_saved(void)
+{
+    return acct_info.xbzrle_bytes_saved;
+}
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    int64_t num_pages = new_size / TARGET_PAGE_SIZE;
+
+    if (num_pages <= 0) {
+        return -1;
+    }
+
+    if (XBZRLE.cache != NULL) {
+        PageCache *new_cache = cache_resize(XBZRLE.cache, num_pages);
+
+        if (!new_cache) {
+            return -1;
+        }
+        XBZRLE.cache = new_cache;
+    }
+
+    return num_pages * TARGET_PAGE_SIZE;
+}
+
+static void xbzrle_cleanup(void)
+{
+    if (XBZRLE.cache) {
+        cache_fini(XBZRLE.cache);
+        g_free(XBZRLE.encoded_buf);
+        g_free(XBZRLE.current_buf);
+        XBZRLE.cache = NULL;
+        XBZRLE.encoded_buf = NULL;
+        XBZRLE.current_buf = NULL;
+    }
+    ram_xbzrle = false;
+}
+
+static int xbzrle_setup(void)
+{
+    /* a cache left over by an earlier migration is stale */
+    xbzrle_cleanup();
+
+    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE,
+                              TARGET_PAGE_SIZE);
+    if (!XBZRLE.cache) {
+        return -ENOMEM;
+    }
+    XBZRLE.encoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
+    ram_xbzrle = true;
+    acct_clear();
+
+    return 0;
+}
+
+/* Send the page at @current_data, as a delta if it is in the cache.  The
+ * page is first copied so that the data that is encoded, cached and sent
+ * is the same even if the guest keeps writing to it.  Returns the number
+ * of bytes written, 0 if the page did not change since it was last sent,
+ * or -1 if the caller has to send the full page itself.
+ */
+static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
+                            ram_addr_t current_addr, RAMBlock *block,
+                            ram_addr_t offset)
+{
+    uint8_t *prev_cached_page;
+    int encoded_len;
+
+    prev_cached_page = cache_lookup(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
+        acct_info.xbzrle_cache_miss++;
+        if (!ram_bulk_stage) {
+            *current_data = cache_insert(XBZRLE.cache, current_addr,
+                                         *current_data);
+        }
+        return -1;
+    }
+
+    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE);
+
+    /* update the cache; the full page is sent from the cached copy */
+    memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+
+    if (encoded_len == 0) {
+        return 0;
+    } else if (encoded_len < 0) {
+        acct_info.xbzrle_overflows++;
+        *current_data = prev_cached_page;
+        return -1;
+    }
+
+    save_block_hdr(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+
+    acct_info.xbzrle_pages++;
+    acct_info.xbzrle_bytes += encoded_len + 1 + 2;
+    acct_info.xbzrle_bytes_saved += TARGET_PAGE_SIZE - (encoded_len + 1 + 2);
+
+    return encoded_len + 1 + 2;
+}
+
+/***********************************************************/
+/* multi-threaded page compression */
+
+/* With the compress capability, every dirty page found by ram_save_block()
+ * is handed to a pool of worker threads in round-robin order.  A worker
+ * checks for a duplicate page and otherwise deflates it into its own
+ * buffer; the migration thread writes the results to the stream in the
+ * order the pages were handed out, so a page that is sent again later in
+ * the same round always overrides the older copy on the destination.
+ *
+ * The pool is created on first use and kept across migrations.
+ */
+
+enum {
+    COMPRESS_IDLE,
+    COMPRESS_PENDING,
+    COMPRESS_DONE,
+};
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    int state;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int level;
+    /* results, valid in COMPRESS_DONE */
+    int flag;
+    unsigned int len;
+    int error;
+    /* owned by the worker */
+    z_stream stream;
+    int stream_level;
+    uint8_t *buf;
+    unsigned int buf_size;
+} CompressParam;
+
+static CompressParam *comp_param[MAX_MIGRATE_COMPRESS_THREADS];
+static int comp_threads_created;
+static int comp_threads;
+static int comp_next;
+static int comp_level;
+static bool ram_compress;
+
+static int compress_page(CompressParam *param)
+{
+    z_stream *stream = &param->stream;
+    uint8_t *p = param->block->host + param->offset;
+
+    if (is_dup_page(p, *p)) {
+        param->flag = RAM_SAVE_FLAG_COMPRESS;
+        param->buf[0] = *p;
+        param->len = 1;
+        return 0;
+    }
+
+    if (deflateReset(stream) != Z_OK) {
+        return -EIO;
+    }
+    if (param->level != param->stream_level) {
+        if (deflateParams(stream, param->level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -EIO;
+        }
+        param->stream_level = param->level;
+    }
+
+    stream->next_in = p;
+    stream->avail_in = TARGET_PAGE_SIZE;
+    stream->next_out = param->buf;
+    stream->avail_out = param->buf_size;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -EIO;
+    }
+
+    param->flag = RAM_SAVE_FLAG_COMPRESS_PAGE;
+    param->len = param->buf_size - stream->avail_out;
+    return 0;
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    for (;;) {
+        while (param->state != COMPRESS_PENDING) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        qemu_mutex_unlock(&param->mutex);
+
+        param->error = compress_page(param);
+
+        qemu_mutex_lock(&param->mutex);
+        param->state = COMPRESS_DONE;
+        qemu_cond_signal(&param->cond);
+    }
+
+    return NULL;
+}
+
+static CompressParam *compress_param_new(int level)
+{
+    CompressParam *param = g_malloc0(sizeof(*param));
+
+    if (deflateInit(&param->stream, level) != Z_OK) {
+        g_free(param);
+        return NULL;
+    }
+    param->stream_level = level;
+    param->buf_size = deflateBound(&param->stream, TARGET_PAGE_SIZE);
+    param->buf = g_malloc(param->buf_size);
+    param->state = COMPRESS_IDLE;
+    qemu_mutex_init(&param->mutex);
+    qemu_cond_init(&param->cond);
+    qemu_thread_create(&param->thread, do_data_compress, param);
+
+    return param;
+}
+
+static int compress_threads_setup(void)
+{
+    comp_threads = migrate_compress_threads();
+    comp_level = migrate_compress_level();
+    comp_next = 0;
+
+    while (comp_threads_created < comp_threads) {
+        CompressParam *param = compress_param_new(comp_level);
+
+        if (!param) {
+            return -ENOMEM;
+        }
+        comp_param[comp_threads_created++] = param;
+    }
+
+    return 0;
+}
+
+/* Wait for @param to finish its page and write the result to @f.  With a
+   NULL @f the result is dropped, which is used on cancel. */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes_sent = 0;
+
+    qemu_mutex_lock(&param->mutex);
+    while (param->state == COMPRESS_PENDING) {
+        qemu_cond_wait(&param->cond, &param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    if (param->state != COMPRESS_DONE) {
+        return 0;
+    }
+    param->state = COMPRESS_IDLE;
+
+    if (!f) {
+        return 0;
+    }
+    if (param->error) {
+        qemu_file_set_error(f, param->error);
+        return 0;
+    }
+
+    save_block_hdr(f, param->block, param->offset, param->flag);
+    if (param->flag == RAM_SAVE_FLAG_COMPRESS_PAGE) {
+        qemu_put_be32(f, param->len);
+    }
+    qemu_put_buffer(f, param->buf, param->len);
+    bytes_sent = param->len;
+
+    return bytes_sent;
+}
+
+static int flush_compressed_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    /* oldest request first */
+    for (i = 0; i < comp_threads; i++) {
+        bytes_sent += flush_compressed_page(f,
+                          comp_param[(comp_next + i) % comp_threads]);
+    }
+
+    return bytes_sent;
+}
+
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset)
+{
+    CompressParam *param = comp_param[comp_next];
+    int bytes_sent;
+
+    comp_next = (comp_next + 1) % comp_threads;
+    bytes_sent = flush_compressed_page(f, param);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = block;
+    param->offset = offset;
+    param->level = comp_level;
+    param->state = COMPRESS_PENDING;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/***********************************************************/
+/* multiple channels */
+
+/* With the multifd capability, RAM pages are sent over extra connections
+ * to the destination, each served by a thread on both sides.  Pages are
+ * sharded by address, so all the copies of a page travel on the same
+ * channel and arrive in order, while pages on different channels may be
+ * placed in any order.  The main channel only carries the "ram" section
+ * framing, a RAM_SAVE_FLAG_MULTIFD_SYNC record once every channel has been
+ * flushed, and the device state.
+ *
+ * A channel starts with MULTIFD_MAGIC, the number of channels and its
+ * index, followed by page records as on the main channel and a final
+ * RAM_SAVE_FLAG_EOS.
+ */
+
+#define MULTIFD_MAGIC 0x4d464443 /* "MFDC" */
+#define MULTIFD_QUEUE_SIZE 128
+
+typedef struct MultiFDPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+    bool dup;
+    uint8_t ch;
+} MultiFDPage;
+
+typedef struct MultiFDSendChannel {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    int fd;
+    MultiFDPage queue[MULTIFD_QUEUE_SIZE];
+    int head;
+    int count;
+    bool finish;
+    bool quit;
+    bool done;
+    int error;
+    RAMBlock *last_block;
+    uint8_t hdr[8 + 1 + 256 + 1];
+} MultiFDSendChannel;
+
+static MultiFDSendChannel *multifd_send;
+static int multifd_send_channels;
+static bool ram_multifd;
+
+#ifndef _WIN32
+
+static int multifd_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
 
+static int multifd_send_page(MultiFDSendChannel *c, MultiFDPage *page)
+{
+    RAMBlock *block = page->block;
+    struct iovec iov[2];
+    int len = 8;
+
+    if (block == c->last_block) {
+        stq_be_p(c->hdr, page->offset | RAM_SAVE_FLAG_CONTINUE |
+                 (page->dup ? RAM_SAVE_FLAG_COMPRESS : RAM_SAVE_FLAG_PAGE));
+    } else {
+        stq_be_p(c->hdr, page->offset |
+                 (page->dup ? RAM_SAVE_FLAG_COMPRESS : RAM_SAVE_FLAG_PAGE));
+        c->hdr[len++] = strlen(block->idstr);
+        memcpy(c->hdr + len, block->idstr, strlen(block->idstr));
+        len += strlen(block->idstr);
+        c->last_block = block;
+    }
+
+    iov[0].iov_base = c->hdr;
+    if (page->dup) {
+        c->hdr[len++] = page->ch;
+        iov[0].iov_len = len;
+        return multifd_writev_full(c->fd, iov, 1);
+    }
+
+    /* a page that changes while it is sent is dirty again anyway */
+    iov[0].iov_len = len;
+    iov[1].iov_base = block->host + page->offset;
+    iov[1].iov_len = TARGET_PAGE_SIZE;
+    return multifd_writev_full(c->fd, iov, 2);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    MultiFDPage page;
+    struct iovec iov;
+    int ret = 0;
+
+    for (;;) {
+        qemu_mutex_lock(&c->mutex);
+        while (!c->count && !c->finish && !c->quit) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+        }
+        if (c->quit || !c->count) {
+            qemu_mutex_unlock(&c->mutex);
+            break;
+        }
+        page = c->queue[c->head];
+        c->head = (c->head + 1) % MULTIFD_QUEUE_SIZE;
+        c->count--;
+        qemu_cond_broadcast(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+
+        ret = multifd_send_page(c, &page);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (!ret && !c->quit) {
+        stq_be_p(c->hdr, RAM_SAVE_FLAG_EOS);
+        iov.iov_base = c->hdr;
+        iov.iov_len = 8;
+        ret = multifd_writev_full(c->fd, &iov, 1);
+    }
+
+    qemu_mutex_lock(&c->mutex);
+    c->error = ret;
+    c->done = true;
+    /* wake up a producer waiting for room in the queue, and cleanup */
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->mutex);
+
+    return NULL;
+}
+
+/* Stop the send threads, after they sent their queue and the final EOS if
+   @flush is true.  Returns the first error a channel hit. */
+static int multifd_send_cleanup(bool flush)
+{
+    int i, ret = 0;
+
+    if (!multifd_send) {
+        return 0;
+    }
+
+    for (i = 0; i < multifd_send_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send[i];
+
+        qemu_mutex_lock(&c->mutex);
+        if (flush) {
+            c->finish = true;
+        } else {
+            c->quit = true;
+            /* unblock a thread stuck writing to a dead destination */
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        qemu_cond_broadcast(&c->cond);
+        qemu_mutex_unlock(&c->mutex);
+    }
+
+    for (i = 0; i < multifd_send_channels; i++) {
+        MultiFDSendChannel *c = &multifd_send[i];
+
+        qemu_mutex_lock(&c->mutex);
+        while (!c->done) {
+            qemu_cond_wait(&c->cond, &c->mutex);
+        }
+        qemu_mutex_unlock(&c->mutex);
+        if (c->error && !ret) {
+            ret = c->error;
+        }
+        close(c->fd);
+        qemu_mutex_destroy(&c->mutex);
+        qemu_cond_destroy(&c->cond);
+    }
+
+    g_free(multifd_send);
+    multifd_send = NULL;
+    multifd_send_channels = 0;
+    return ret;
+}
+
+static int multifd_send_setup(void)
+{
+    int n = migrate_multifd_channels();
+    uint8_t hdr[12];
+    struct iovec iov;
+    int i, fd, ret;
+
+    multifd_send = g_malloc0(n * sizeof(*multifd_send));
+
+    for (i = 0; i < n; i++) {
+        MultiFDSendChannel *c = &multifd_send[i];
+
+        fd = migrate_open_channel();
+        if (fd < 0) {
+            fprintf(stderr, "multifd: cannot open channel %d: %s\n", i,
+                    strerror(-fd));
+            multifd_send_cleanup(false);
+            return fd;
+        }
+
+        stl_be_p(hdr, MULTIFD_MAGIC);
+        stl_be_p(hdr + 4, n);
+        stl_be_p(hdr + 8, i);
+        iov.iov_base = hdr;
+        iov.iov_len = sizeof(hdr);
+        ret = multifd_writev_full(fd, &iov, 1);
+        if (ret < 0) {
+            close(fd);
+            multifd_send_cleanup(false);
+            return ret;
+        }
+
+        c->fd = fd;
+        qemu_mutex_init(&c->mutex);
+        qemu_cond_init(&c->cond);
+        qemu_thread_create(&c->thread, multifd_send_thread, c);
+        multifd_send_channels++;
+    }
+
+    return 0;
+}
+
+#else
+
+static int multifd_send_cleanup(bool flush)
+{
+    return 0;
+}
+
+static int multifd_send_setup(void)
+{
+    return -ENOTSUP;
+}
+
+#endif
+
+/* Queue a page on its channel, waiting for room if the channel lags */
+static void multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, bool dup, uint8_t ch)
+{
+    int i = ((block->offset + offset) >> TARGET_PAGE_BITS) %
+            multifd_send_channels;
+    MultiFDSendChannel *c = &multifd_send[i];
+    MultiFDPage *page;
+
+    qemu_mutex_lock(&c->mutex);
+    while (c->count == MULTIFD_QUEUE_SIZE && !c->done) {
+        qemu_cond_wait(&c->cond, &c->mutex);
+    }
+    if (c->done) {
+        qemu_mutex_unlock(&c->mutex);
+        qemu_file_set_error(f, c->error ? c->error : -EIO);
+        return;
+    }
+
+    page = &c->queue[(c->head + c->count) % MULTIFD_QUEUE_SIZE];
+    page->block = block;
+    page->offset = offset;
+    page->dup = dup;
+    page->ch = ch;
+    c->count++;
+    qemu_cond_broadcast(&c->cond);
+    qemu_mutex_unlock(&c->mutex);
+}
+
+/* Clear the dirty bit of a page and queue or send it. */
+static void ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t current_addr = block->offset + offset;
+    uint8_t *p;
+
+    cpu_physical_memory_reset_dirty(current_addr,
+                                    current_addr + TARGET_PAGE_SIZE,
+                                    MIGRATION_DIRTY_FLAG);
+
+    p = block->host + offset;
+
+    if (ram_multifd) {
+        uint8_t ch = *p;
+        bool dup = is_dup_page(p, ch);
+
+        multifd_queue_page(f, block, offset, dup, ch);
+        bytes_transferred += dup ? 1 : TARGET_PAGE_SIZE;
+    } else if (ram_compress) {
+        bytes_transferred += ram_save_compressed_page(f, block, offset);
+    } else if (is_dup_page(p, *p)) {
+        save_block_hdr(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+        if (ram_xbzrle) {
+            /* keep a cached copy in sync with what was sent */
+            uint8_t *cached = cache_lookup(XBZRLE.cache, current_addr);
+            if (cached) {
+                memset(cached, *p, TARGET_PAGE_SIZE);
+            }
+        }
+    } else {
+        int bytes_sent = -1;
+
+        if (ram_xbzrle) {
+            bytes_sent = save_xbzrle_page(f, &p, current_addr, block, offset);
+        }
+        if (bytes_sent < 0) {
+            save_block_hdr(f, block, offset, RAM_SAVE_FLAG_PAGE);
+            if (p == block->host + offset) {
+                /* send straight from guest memory, a page that changes
+                   before it is on the wire is dirty again anyway */
+                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+            } else {
+                /* the xbzrle cache may evict this copy before the flush */
+                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+            }
+            bytes_sent = TARGET_PAGE_SIZE;
+        }
+        bytes_transferred += bytes_sent;
+    }
+}
+
+/* Returns 1 if a dirty page was found and queued or sent, 0 otherwise. */
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
     ram_addr_t current_addr;
-    int bytes_sent = 0;
+    int found = 0;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
@@ -126,74 +899,135 @@ static int ram_save_block(QEMUFile *f)
 
     do {
         if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+            ram_save_page(f, block, offset);
+            found = 1;
+            break;
+        }
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+        offset += TARGET_PAGE_SIZE;
+        if (offset >= block->length) {
+            offset = 0;
+            block = QLIST_NEXT(block, next);
+            if (!block) {
+                block = QLIST_FIRST(&ram_list.blocks);
+                ram_bulk_stage = false;
+            }
+        }
 
-            p = block->host + offset;
+        current_addr = block->offset + offset;
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
+    } while (current_addr != last_block->offset + last_offset);
+
+    last_block = block;
+    last_offset = offset;
+
+    return found;
+}
+
+/***********************************************************/
+/* postcopy, source side */
+
+/* When the migration switches to postcopy, the end of the "ram" section
+ * lists the runs of pages that are still dirty instead of sending them.
+ * After the device state, the stream continues with plain page records up
+ * to a final RAM_SAVE_FLAG_EOS.  Pages requested by the destination are
+ * sent first; the rest follow in address order.
+ */
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+
+void ram_postcopy_request(const char *idstr, uint64_t offset)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
 
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(idstr, block->idstr, sizeof(block->idstr))) {
             break;
         }
+    }
+    if (!block || offset >= block->length) {
+        fprintf(stderr, "postcopy: request for unknown page %s:%" PRIx64 "\n",
+                idstr, offset);
+        return;
+    }
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = offset & TARGET_PAGE_MASK;
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+}
+
+static void ram_postcopy_send_discards(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ram_addr_t offset = 0, start;
+
+        while (offset < block->length) {
+            if (!cpu_physical_memory_get_dirty(block->offset + offset,
+                                               MIGRATION_DIRTY_FLAG)) {
+                offset += TARGET_PAGE_SIZE;
+                continue;
+            }
+            start = offset;
+            while (offset < block->length &&
+                   cpu_physical_memory_get_dirty(block->offset + offset,
+                                                 MIGRATION_DIRTY_FLAG)) {
+                offset += TARGET_PAGE_SIZE;
+            }
+            save_block_hdr(f, block, start, RAM_SAVE_FLAG_POSTCOPY_DISCARD);
+            qemu_put_be32(f, (offset - start) >> TARGET_PAGE_BITS);
         }
+    }
+}
 
-        current_addr = block->offset + offset;
+/* Returns 1 once all pages have been sent. */
+int ram_postcopy_iterate(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    int ret;
 
-    } while (current_addr != last_block->offset + last_offset);
+    while ((req = QSIMPLEQ_FIRST(&page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        if (cpu_physical_memory_get_dirty(req->block->offset + req->offset,
+                                          MIGRATION_DIRTY_FLAG)) {
+            ram_save_page(f, req->block, req->offset);
+        }
+        g_free(req);
+    }
 
-    last_block = block;
-    last_offset = offset;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        if (ram_save_block(f) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            return 1;
+        }
+    }
 
-    return bytes_sent;
+    return ret < 0 ? ret : 0;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+static void ram_postcopy_cleanup(void)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    RAMPageRequest *req;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
-            }
-        }
+    while ((req = QSIMPLEQ_FIRST(&page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
     }
+}
 
-    return count;
+static ram_addr_t ram_save_remaining(void)
+{
+    return ram_list.migration_dirty_pages;
 }
 
 uint64_t ram_bytes_remaining(void)
@@ -201,6 +1035,11 @@ uint64_t ram_bytes_remaining(void)
     return ram_save_remaining() * TARGET_PAGE_SIZE;
 }
 
+uint64_t ram_dirty_pages_rate(void)
+{
+    return dirty_stats.pages_rate;
+}
+
 uint64_t ram_bytes_transferred(void)
 {
     return bytes_transferred;
@@ -250,96 +1089,553 @@ static void sort_ram_list(void)
     g_free(blocks);
 }
 
-int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+/* Auto-converge: when the guest dirtied more than half of what was sent
+ * during two periods in a row, throttle the vCPUs a bit more.  Not done
+ * in the first pass over RAM, which every guest has to wait out. */
+#define AUTO_CONVERGE_INITIAL_PCT   20
+#define AUTO_CONVERGE_INCREMENT_PCT 10
+
+static void ram_auto_converge(uint64_t bytes_dirty, uint64_t bytes_sent)
+{
+    if (bytes_dirty <= bytes_sent / 2) {
+        dirty_stats.high_rate_count = 0;
+        return;
+    }
+    if (++dirty_stats.high_rate_count < 2) {
+        return;
+    }
+    dirty_stats.high_rate_count = 0;
+
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(AUTO_CONVERGE_INITIAL_PCT);
+    } else {
+        cpu_throttle_set(cpu_throttle_get_percentage() +
+                         AUTO_CONVERGE_INCREMENT_PCT);
+    }
+}
+
+/* Clear DIRTY_RATE_FLAG everywhere and start a new period */
+static void dirty_rate_begin_period(int64_t now)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        DIRTY_RATE_FLAG);
+    }
+    dirty_stats.period_start = now;
+    dirty_stats.period_bytes_start = bytes_transferred;
+}
+
+static void dirty_rate_end_period(int64_t now)
+{
+    uint64_t pages = ram_list.rate_dirty_pages;
+
+    if (now <= dirty_stats.period_start) {
+        return;
+    }
+
+    dirty_stats.pages_rate = pages * 1000 / (now - dirty_stats.period_start);
+    dirty_stats.has_pages_rate = true;
+    if (dirty_stats.migrating && migrate_auto_converge() && !ram_bulk_stage) {
+        ram_auto_converge(pages * TARGET_PAGE_SIZE,
+                          bytes_transferred - dirty_stats.period_bytes_start);
+    }
+    dirty_rate_begin_period(now);
+}
+
+/* Dirty logging is needed while migrating or sampling */
+static void dirty_rate_update_tracking(void)
+{
+    int enable = dirty_stats.migrating || dirty_stats.sampling;
+
+    if (cpu_physical_memory_get_dirty_tracking() != enable) {
+        cpu_physical_memory_set_dirty_tracking(enable);
+    }
+}
+
+static void dirty_rate_timer(void *opaque)
+{
+    /* during migration the periods end at its syncs */
+    if (!dirty_stats.migrating) {
+        cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX);
+        dirty_rate_end_period(qemu_get_clock_ms(rt_clock));
+    }
+    qemu_mod_timer(dirty_stats.timer,
+                   qemu_get_clock_ms(rt_clock) + dirty_stats.period);
+}
+
+static void ram_dirty_rate_start_migration(void)
+{
+    dirty_stats.migrating = true;
+    dirty_stats.high_rate_count = 0;
+    if (!dirty_stats.sampling) {
+        dirty_stats.has_pages_rate = false;
+    }
+    dirty_rate_begin_period(qemu_get_clock_ms(rt_clock));
+    dirty_rate_update_tracking();
+}
+
+static void ram_dirty_rate_stop_migration(void)
+{
+    dirty_stats.migrating = false;
+    dirty_rate_update_tracking();
+}
+
+static int ram_sync_dirty_log(void)
+{
+    int64_t now;
+
+    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
+        return -EINVAL;
+    }
+
+    now = qemu_get_clock_ms(rt_clock);
+    if (now >= dirty_stats.period_start + dirty_stats.period) {
+        dirty_rate_end_period(now);
+    }
+    return 0;
+}
+
+void qmp_dirty_rate_start(bool has_period, int64_t period, Error **errp)
+{
+    if (!has_period) {
+        period = DIRTY_RATE_PERIOD_MS;
+    }
+    if (period < DIRTY_RATE_PERIOD_MIN_MS ||
+        period > DIRTY_RATE_PERIOD_MAX_MS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "period",
+                  "a value between 100 and 60000");
+        return;
+    }
+
+    dirty_stats.period = period;
+    if (!dirty_stats.timer) {
+        dirty_stats.timer = qemu_new_timer_ms(rt_clock, dirty_rate_timer,
+                                              NULL);
+    }
+    if (!dirty_stats.sampling && !dirty_stats.migrating) {
+        dirty_stats.has_pages_rate = false;
+        dirty_rate_begin_period(qemu_get_clock_ms(rt_clock));
+    }
+    dirty_stats.sampling = true;
+    dirty_rate_update_tracking();
+    qemu_mod_timer(dirty_stats.timer,
+                   dirty_stats.period_start + dirty_stats.period);
+}
+
+void qmp_dirty_rate_stop(Error **errp)
+{
+    if (!dirty_stats.sampling) {
+        return;
+    }
+    dirty_stats.sampling = false;
+    qemu_del_timer(dirty_stats.timer);
+    dirty_rate_update_tracking();
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+
+    info->active = dirty_stats.migrating || dirty_stats.sampling;
+    info->period = dirty_stats.period;
+    info->has_pages_rate = dirty_stats.has_pages_rate;
+    info->pages_rate = dirty_stats.pages_rate;
+    return info;
+}
+
+void ram_set_params(int blk_enable, int shared, void *opaque)
+{
+    qemu_savevm_set_version("ram", 0,
+                            migrate_use_compression() || migrate_use_xbzrle() ||
+                            migrate_postcopy_ram() || migrate_use_multifd() ?
+                            RAM_SAVE_VERSION_ID_CAPS : RAM_SAVE_VERSION_ID);
+}
+
+int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+{
+    ram_addr_t addr;
+    uint64_t bytes_transferred_last;
+    double bwidth = 0;
+    uint64_t expected_time = 0;
+    int ret;
+
+    if (stage < 0) {
+        if (ram_compress) {
+            flush_compressed_data(NULL);
+        }
+        xbzrle_cleanup();
+        ram_postcopy_cleanup();
+        if (ram_multifd) {
+            multifd_send_cleanup(false);
+            ram_multifd = false;
+        }
+        ram_dirty_rate_stop_migration();
+        cpu_throttle_stop();
+        return 0;
+    }
+
+    if (ram_sync_dirty_log() != 0) {
+        qemu_file_set_error(f, -EINVAL);
+        return -EINVAL;
+    }
+
+    if (stage == 3 && migration_in_postcopy()) {
+        /* the remaining pages are sent by ram_postcopy_iterate() */
+        if (ram_compress) {
+            bytes_transferred += flush_compressed_data(f);
+            ram_compress = false;
+        }
+        xbzrle_cleanup();
+        ram_dirty_rate_stop_migration();
+        cpu_throttle_stop();
+        ram_postcopy_send_discards(f);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 0;
+    }
+
+    if (stage == 1) {
+        RAMBlock *block;
+        bytes_transferred = 0;
+        last_block = NULL;
+        last_offset = 0;
+        last_sent_block = NULL;
+        sort_ram_list();
+
+        ram_compress = migrate_use_compression();
+        if (ram_compress) {
+            ret = compress_threads_setup();
+            if (ret < 0) {
+                ram_compress = false;
+                return ret;
+            }
+        }
+
+        ram_multifd = migrate_use_multifd();
+        if (ram_multifd) {
+            ret = multifd_send_setup();
+            if (ret < 0) {
+                ram_multifd = false;
+                return ret;
+            }
+        }
+
+        ram_bulk_stage = true;
+        if (migrate_use_xbzrle()) {
+            ret = xbzrle_setup();
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        /* Make sure all dirty bits are set */
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            for (addr = block->offset; addr < block->offset + block->length;
+                 addr += TARGET_PAGE_SIZE) {
+                if (!cpu_physical_memory_get_dirty(addr,
+                                                   MIGRATION_DIRTY_FLAG)) {
+                    cpu_physical_memory_set_dirty(addr);
+                }
+            }
+        }
+
+        /* Enable dirty memory tracking */
+        ram_dirty_rate_start_migration();
+
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, block->length);
+        }
+    }
+
+    bytes_transferred_last = bytes_transferred;
+    bwidth = qemu_get_clock_ns(rt_clock);
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        /* pages on the multifd channels bypass the main file's limit */
+        if (ram_multifd && bytes_transferred - bytes_transferred_last >
+            qemu_file_get_rate_limit(f)) {
+            break;
+        }
+        if (ram_save_block(f) == 0) { /* no more blocks */
+            break;
+        }
+    }
+
+    if (ram_compress) {
+        bytes_transferred += flush_compressed_data(f);
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+
+    /* if we haven't transferred anything this round, force expected_time to a
+     * a very high value, but without crashing */
+    if (bwidth == 0) {
+        bwidth = 0.000001;
+    }
+
+    /* try transferring iterative blocks of memory */
+    if (stage == 3) {
+        /* flush all remaining blocks regardless of rate limiting */
+        while (ram_save_block(f) != 0) {
+        }
+        if (ram_compress) {
+            bytes_transferred += flush_compressed_data(f);
+        }
+        if (ram_multifd) {
+            int n = multifd_send_channels;
+
+            ram_multifd = false;
+            ret = multifd_send_cleanup(true);
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                return ret;
+            }
+            qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+            qemu_put_be32(f, n);
+        }
+        xbzrle_cleanup();
+        ram_dirty_rate_stop_migration();
+        cpu_throttle_stop();
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+    return (stage == 2) && (expected_time <= migrate_max_downtime());
+}
+
+/* Parallel decompression on the destination.  Pages are handed to the
+ * workers round-robin; before anything else is written to a page that is
+ * still being decompressed, the loader waits for that worker, so the
+ * stream order is preserved.  With zero threads pages are inflated inline.
+ */
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool pending;
+    void *des;
+    unsigned int len;
+    int error;
+    z_stream stream;
+    uint8_t *compbuf;
+} DecompressParam;
+
+static DecompressParam *decomp_param[MAX_MIGRATE_COMPRESS_THREADS];
+static DecompressParam *decomp_inline;
+static int decomp_threads_created;
+static int decomp_threads;
+static int decomp_next;
+
+static int decompress_page(DecompressParam *param)
+{
+    z_stream *stream = &param->stream;
+
+    if (inflateReset(stream) != Z_OK) {
+        return -EIO;
+    }
+
+    stream->next_in = param->compbuf;
+    stream->avail_in = param->len;
+    stream->next_out = param->des;
+    stream->avail_out = TARGET_PAGE_SIZE;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    for (;;) {
+        while (!param->pending) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        qemu_mutex_unlock(&param->mutex);
+
+        ret = decompress_page(param);
+
+        qemu_mutex_lock(&param->mutex);
+        if (ret < 0 && !param->error) {
+            param->error = ret;
+        }
+        param->pending = false;
+        qemu_cond_signal(&param->cond);
+    }
+
+    return NULL;
+}
+
+static DecompressParam *decompress_param_new(bool threaded)
+{
+    DecompressParam *param = g_malloc0(sizeof(*param));
+
+    if (inflateInit(&param->stream) != Z_OK) {
+        g_free(param);
+        return NULL;
+    }
+    param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+    if (threaded) {
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param);
+    }
+
+    return param;
+}
+
+static int decompress_threads_setup(void)
+{
+    decomp_threads = migrate_decompress_threads();
+    decomp_next = 0;
+
+    if (!decomp_inline) {
+        decomp_inline = decompress_param_new(false);
+        if (!decomp_inline) {
+            return -ENOMEM;
+        }
+    }
+    while (decomp_threads_created < decomp_threads) {
+        DecompressParam *param = decompress_param_new(true);
+
+        if (!param) {
+            return -ENOMEM;
+        }
+        decomp_param[decomp_threads_created++] = param;
+    }
+
+    return 0;
+}
+
+static int wait_for_decompress(DecompressParam *param)
 {
-    ram_addr_t addr;
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    uint64_t expected_time = 0;
     int ret;
 
-    if (stage < 0) {
-        cpu_physical_memory_set_dirty_tracking(0);
-        return 0;
+    qemu_mutex_lock(&param->mutex);
+    while (param->pending) {
+        qemu_cond_wait(&param->cond, &param->mutex);
     }
+    ret = param->error;
+    param->error = 0;
+    qemu_mutex_unlock(&param->mutex);
 
-    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
-        qemu_file_set_error(f, -EINVAL);
-        return -EINVAL;
-    }
+    return ret;
+}
 
-    if (stage == 1) {
-        RAMBlock *block;
-        bytes_transferred = 0;
-        last_block = NULL;
-        last_offset = 0;
-        sort_ram_list();
+/* Wait for workers still writing to @host; NULL waits for all of them. */
+static int wait_for_decompress_page(void *host)
+{
+    int i, ret = 0;
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+    for (i = 0; i < decomp_threads; i++) {
+        DecompressParam *param = decomp_param[i];
+        int err;
+
+        if (host && param->des != host) {
+            continue;
         }
+        err = wait_for_decompress(param);
+        if (err < 0 && ret == 0) {
+            ret = err;
+        }
+    }
 
-        /* Enable dirty memory tracking */
-        cpu_physical_memory_set_dirty_tracking(1);
+    return ret;
+}
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+static int decompress_data(QEMUFile *f, void *host, unsigned int len)
+{
+    DecompressParam *param;
+    int ret;
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
-        }
+    if (!decomp_inline) {
+        fprintf(stderr, "Compressed page before RAM setup!\n");
+        return -EINVAL;
     }
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
-
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+    ret = wait_for_decompress_page(host);
+    if (ret < 0) {
+        return ret;
+    }
 
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
-            break;
-        }
+    if (decomp_threads == 0) {
+        param = decomp_inline;
+        param->des = host;
+        param->len = len;
+        qemu_get_buffer(f, param->compbuf, len);
+        return decompress_page(param);
     }
 
+    param = decomp_param[decomp_next];
+    decomp_next = (decomp_next + 1) % decomp_threads;
+    ret = wait_for_decompress(param);
     if (ret < 0) {
         return ret;
     }
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+    qemu_get_buffer(f, param->compbuf, len);
+    qemu_mutex_lock(&param->mutex);
+    param->des = host;
+    param->len = len;
+    param->pending = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
 
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
+    return 0;
+}
+
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    static uint8_t *xbzrle_buf;
+    unsigned int xh_len;
+    int xh_flags;
+
+    if (!xbzrle_buf) {
+        xbzrle_buf = g_malloc0(TARGET_PAGE_SIZE);
     }
 
-    /* try transferring iterative blocks of memory */
-    if (stage == 3) {
-        int bytes_sent;
+    /* extract RLE header */
+    xh_flags = qemu_get_byte(f);
+    xh_len = qemu_get_be16(f);
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
-        }
-        cpu_physical_memory_set_dirty_tracking(0);
+    if (xh_flags != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
+        return -EINVAL;
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    if (xh_len == 0 || xh_len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
+        return -EINVAL;
+    }
+    /* load data and decode */
+    qemu_get_buffer(f, xbzrle_buf, xh_len);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    /* decode RLE */
+    if (xbzrle_decode_buffer(xbzrle_buf, xh_len, host,
+                             TARGET_PAGE_SIZE) < 0) {
+        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+        return -EINVAL;
+    }
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    return 0;
 }
 
 static inline void *host_from_stream_offset(QEMUFile *f,
@@ -372,13 +1668,260 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* multifd, destination side: one thread per channel accepts a connection
+ * on the migration socket and places the pages it receives. */
+
+typedef struct MultiFDRecvChannel {
+    QemuThread thread;
+    int fd;
+    int error;
+    bool done;
+} MultiFDRecvChannel;
+
+static struct {
+    MultiFDRecvChannel *channels;
+    int count;
+    int listen_fd;
+    int main_fd;
+    bool joined;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+} multifd_recv;
+
+#ifndef _WIN32
+
+static void *multifd_host_from_stream(QEMUFile *f, RAMBlock **last_block,
+                                      ram_addr_t offset, int flags)
+{
+    RAMBlock *block = *last_block;
+    char id[256];
+    uint8_t len;
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        *last_block = block;
+    }
+
+    if (!block || offset >= block->length) {
+        return NULL;
+    }
+    return block->host + offset;
+}
+
+static int multifd_recv_pages(QEMUFile *f)
+{
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    int flags, error;
+    void *host;
+    uint8_t ch;
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != multifd_recv.count) {
+        fprintf(stderr, "multifd: bad channel header, the source must use "
+                "%d channels\n", multifd_recv.count);
+        return -EINVAL;
+    }
+    qemu_get_be32(f);
+
+    for (;;) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        error = qemu_file_get_error(f);
+        if (error) {
+            return error;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            return 0;
+        }
+
+        host = multifd_host_from_stream(f, &block, addr, flags);
+        if (!host) {
+            fprintf(stderr, "multifd: bad page address\n");
+            return -EINVAL;
+        }
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            ch = qemu_get_byte(f);
+            memset(host, ch, TARGET_PAGE_SIZE);
+            if (ch == 0 &&
+                (!kvm_enabled() || kvm_has_sync_mmu())) {
+                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            }
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else {
+            return -EINVAL;
+        }
+    }
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *c = opaque;
+    QEMUFile *f;
+    int fd;
+
+    do {
+        fd = qemu_accept(multifd_recv.listen_fd, NULL, NULL);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        c->error = -errno;
+        goto out;
+    }
+
+    qemu_mutex_lock(&multifd_recv.mutex);
+    c->fd = fd;
+    if (multifd_recv.quit) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    qemu_mutex_unlock(&multifd_recv.mutex);
+
+    f = qemu_fopen_socket(fd);
+    c->error = multifd_recv_pages(f);
+    qemu_fclose(f);
+
+out:
+    if (c->error) {
+        /* make the main channel fail too instead of waiting for a sync */
+        shutdown(multifd_recv.main_fd, SHUT_RD);
+    }
+
+    qemu_mutex_lock(&multifd_recv.mutex);
+    c->done = true;
+    qemu_cond_broadcast(&multifd_recv.cond);
+    qemu_mutex_unlock(&multifd_recv.mutex);
+    return NULL;
+}
+
+void multifd_recv_setup(int listen_fd, QEMUFile *f)
+{
+    int i;
+
+    multifd_recv.count = migrate_multifd_channels();
+    multifd_recv.channels = g_malloc0(multifd_recv.count *
+                                      sizeof(*multifd_recv.channels));
+    multifd_recv.listen_fd = listen_fd;
+    multifd_recv.main_fd = qemu_socket_fd(f);
+    multifd_recv.joined = false;
+    multifd_recv.quit = false;
+    qemu_mutex_init(&multifd_recv.mutex);
+    qemu_cond_init(&multifd_recv.cond);
+
+    for (i = 0; i < multifd_recv.count; i++) {
+        MultiFDRecvChannel *c = &multifd_recv.channels[i];
+
+        c->fd = -1;
+        qemu_thread_create(&c->thread, multifd_recv_thread, c);
+    }
+}
+
+static int multifd_recv_join(void)
+{
+    int i, ret = 0;
+
+    qemu_mutex_lock(&multifd_recv.mutex);
+    for (i = 0; i < multifd_recv.count; i++) {
+        MultiFDRecvChannel *c = &multifd_recv.channels[i];
+
+        while (!c->done) {
+            qemu_cond_wait(&multifd_recv.cond, &multifd_recv.mutex);
+        }
+        if (c->error && !ret) {
+            ret = c->error;
+        }
+    }
+    qemu_mutex_unlock(&multifd_recv.mutex);
+    multifd_recv.joined = true;
+
+    return ret;
+}
+
+/* RAM_SAVE_FLAG_MULTIFD_SYNC: wait for every channel to be done */
+static int multifd_recv_sync(QEMUFile *f)
+{
+    uint32_t count = qemu_get_be32(f);
+
+    if (!multifd_recv.channels || multifd_recv.joined) {
+        fprintf(stderr, "multifd: the multifd capability is not enabled\n");
+        return -EINVAL;
+    }
+    if (count != multifd_recv.count) {
+        fprintf(stderr, "multifd: the source uses %u channels, not %d\n",
+                count, multifd_recv.count);
+        return -EINVAL;
+    }
+
+    return multifd_recv_join();
+}
+
+void multifd_recv_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv.channels) {
+        return;
+    }
+
+    if (!multifd_recv.joined) {
+        qemu_mutex_lock(&multifd_recv.mutex);
+        multifd_recv.quit = true;
+        shutdown(multifd_recv.listen_fd, SHUT_RDWR);
+        for (i = 0; i < multifd_recv.count; i++) {
+            if (multifd_recv.channels[i].fd != -1) {
+                shutdown(multifd_recv.channels[i].fd, SHUT_RDWR);
+            }
+        }
+        qemu_mutex_unlock(&multifd_recv.mutex);
+        multifd_recv_join();
+    }
+
+    for (i = 0; i < multifd_recv.count; i++) {
+        if (multifd_recv.channels[i].fd != -1) {
+            close(multifd_recv.channels[i].fd);
+        }
+    }
+    qemu_mutex_destroy(&multifd_recv.mutex);
+    qemu_cond_destroy(&multifd_recv.cond);
+    g_free(multifd_recv.channels);
+    multifd_recv.channels = NULL;
+}
+
+#else
+
+void multifd_recv_setup(int listen_fd, QEMUFile *f)
+{
+}
+
+static int multifd_recv_sync(QEMUFile *f)
+{
+    return -ENOTSUP;
+}
+
+void multifd_recv_cleanup(void)
+{
+}
+
+#endif
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags;
     int error;
 
-    if (version_id < 3 || version_id > 4) {
+    if (version_id < 3 || version_id > RAM_SAVE_VERSION_ID_CAPS) {
         return -EINVAL;
     }
 
@@ -425,6 +1968,13 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                     total_ram_bytes -= length;
                 }
             }
+
+            if (version_id >= RAM_SAVE_VERSION_ID_CAPS) {
+                error = decompress_threads_setup();
+                if (error) {
+                    return error;
+                }
+            }
         }
 
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
@@ -438,6 +1988,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             if (!host) {
                 return -EINVAL;
             }
+            error = wait_for_decompress_page(host);
+            if (error) {
+                return error;
+            }
 
             ch = qemu_get_byte(f);
             memset(host, ch, TARGET_PAGE_SIZE);
@@ -454,8 +2008,84 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = qemu_get_ram_ptr(addr);
             else
                 host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+            error = wait_for_decompress_page(host);
+            if (error) {
+                return error;
+            }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+            unsigned int len;
+
+            if (version_id < RAM_SAVE_VERSION_ID_CAPS) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len == 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                fprintf(stderr, "Invalid compressed page length %u\n", len);
+                return -EINVAL;
+            }
+            error = decompress_data(f, host, len);
+            if (error) {
+                return error;
+            }
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host;
+
+            if (version_id < RAM_SAVE_VERSION_ID_CAPS) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+            error = wait_for_decompress_page(host);
+            if (error) {
+                return error;
+            }
+
+            error = load_xbzrle(f, host);
+            if (error) {
+                return error;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY_DISCARD) {
+            void *host;
+            uint32_t npages;
+
+            if (version_id < RAM_SAVE_VERSION_ID_CAPS) {
+                return -EINVAL;
+            }
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+            npages = qemu_get_be32(f);
+            postcopy_ram_discard_range(host,
+                                       (size_t)npages << TARGET_PAGE_BITS);
+        }
+        if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            if (version_id < RAM_SAVE_VERSION_ID_CAPS) {
+                return -EINVAL;
+            }
+            error = multifd_recv_sync(f);
+            if (error) {
+                return error;
+            }
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            error = wait_for_decompress_page(NULL);
+            if (error) {
+                return error;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -466,6 +2096,59 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+/* Receive the pages sent after a switch to postcopy.  Runs in its own
+   thread on the destination while the guest is already running. */
+int ram_postcopy_load(QEMUFile *f)
+{
+    uint8_t *buf = qemu_vmalloc(TARGET_PAGE_SIZE);
+    ram_addr_t addr;
+    int flags;
+    int error = 0;
+
+    do {
+        void *host;
+
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error = -EINVAL;
+                break;
+            }
+
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                uint8_t ch = qemu_get_byte(f);
+
+                if (ch == 0) {
+                    error = postcopy_place_zero_page(host);
+                } else {
+                    memset(buf, ch, TARGET_PAGE_SIZE);
+                    error = postcopy_place_page(host, buf);
+                }
+            } else {
+                qemu_get_buffer(f, buf, TARGET_PAGE_SIZE);
+                error = postcopy_place_page(host, buf);
+            }
+        } else if (!(flags & RAM_SAVE_FLAG_EOS)) {
+            fprintf(stderr, "Unexpected RAM flags %#x in postcopy stream\n",
+                    flags);
+            error = -EINVAL;
+        }
+
+        if (!error) {
+            error = qemu_file_get_error(f);
+        }
+    } while (!error && !(flags & RAM_SAVE_FLAG_EOS));
+
+    qemu_vfree(buf);
+
+    return error;
+}
+
 #ifdef HAS_AUDIO
 struct soundhw {
     const char *name;
@@ -47,6 +47,10 @@
 
 #define NOT_DONE 0x7fffffff /* used while emulated sync operation in progress */
 
+typedef enum {
+    BDRV_REQ_COPY_ON_READ = 0x1,
+} BdrvRequestFlags;
+
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -61,7 +65,8 @@ static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
                                          int64_t sector_num, int nb_sectors,
                                          QEMUIOVector *iov);
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags);
 static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
@@ -203,6 +208,57 @@ void bdrv_register(BlockDriver *bdrv)
 }
 
 /* create a new block device (by default it is empty) */
+/* throttling disk I/O limits */
+void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = false;
+
+    /* let the waiting requests through */
+    qemu_co_queue_restart_all(&bs->throttled_reqs);
+
+    if (bs->block_timer) {
+        qemu_del_timer(bs->block_timer);
+        qemu_free_timer(bs->block_timer);
+        bs->block_timer = NULL;
+    }
+}
+
+static void bdrv_block_timer(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    if (!bs->block_timer) {
+        bs->block_timer = qemu_new_timer_ns(rt_clock, bdrv_block_timer, bs);
+    }
+    bs->slice_start = 0;
+    bs->slice_end = 0;
+    memset(bs->slice_bytes, 0, sizeof(bs->slice_bytes));
+    memset(bs->slice_ios, 0, sizeof(bs->slice_ios));
+    bs->io_limits_enabled = true;
+}
+
+/* Are any limits set for the drive? */
+bool bdrv_io_limits_enabled(BlockDriverState *bs)
+{
+    BlockIOLimit *io_limits = &bs->io_limits;
+    return io_limits->bps[BLOCK_IO_LIMIT_READ]
+         || io_limits->bps[BLOCK_IO_LIMIT_WRITE]
+         || io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
+         || io_limits->iops[BLOCK_IO_LIMIT_READ]
+         || io_limits->iops[BLOCK_IO_LIMIT_WRITE]
+         || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
+}
+
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    bs->io_limits = *io_limits;
+}
+
 BlockDriverState *bdrv_new(const char *device_name)
 {
     BlockDriverState *bs;
@@ -213,6 +269,8 @@ BlockDriverState *bdrv_new(const char *device_name)
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
     bdrv_iostatus_disable(bs);
+    qemu_co_queue_init(&bs->throttled_reqs);
+    QLIST_INIT(&bs->tracked_requests);
     return bs;
 }
 
@@ -494,7 +552,8 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ);
 
     /*
      * Snapshots should be writable.
@@ -505,6 +564,15 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
 
     bs->keep_read_only = bs->read_only = !(open_flags & BDRV_O_RDWR);
 
+    /* Copy-on-read writes to the image, which must be writable */
+    if (flags & BDRV_O_COPY_ON_READ) {
+        if (bs->read_only) {
+            ret = -EINVAL;
+            goto free_and_fail;
+        }
+        bdrv_enable_copy_on_read(bs);
+    }
+
     /* Open the image, either directly or using a protocol */
     if (drv->bdrv_file_open) {
         ret = drv->bdrv_file_open(bs, filename, open_flags);
@@ -539,6 +607,7 @@ free_and_fail:
     g_free(bs->opaque);
     bs->opaque = NULL;
     bs->drv = NULL;
+    bs->copy_on_read = 0;
     return ret;
 }
 
@@ -667,8 +736,8 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
 
         /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+        back_flags = flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT |
+                               BDRV_O_NO_BACKING | BDRV_O_COPY_ON_READ);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -687,6 +756,11 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         bdrv_dev_change_media_cb(bs, true);
     }
 
+    /* throttling disk I/O limits */
+    if (bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_enable(bs);
+    }
+
     return 0;
 
 unlink_and_fail:
@@ -698,6 +772,10 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    if (bs->job) {
+        block_job_cancel_sync(bs->job);
+    }
+
     if (bs->drv) {
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
@@ -715,6 +793,7 @@ void bdrv_close(BlockDriverState *bs)
 #endif
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->copy_on_read = 0;
 
         if (bs->file != NULL) {
             bdrv_close(bs->file);
@@ -722,6 +801,11 @@ void bdrv_close(BlockDriverState *bs)
 
         bdrv_dev_change_media_cb(bs, false);
     }
+
+    /* throttling disk I/O limits */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
 }
 
 void bdrv_close_all(void)
@@ -733,6 +817,31 @@ void bdrv_close_all(void)
     }
 }
 
+/*
+ * Wait for all requests to complete, including those held back by I/O
+ * throttling.  Throttled requests are let through at once instead of
+ * waiting for their turn, since the throttling timer does not run here.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->io_limits_enabled) {
+            bs->io_limits_enabled = false;
+            qemu_co_queue_restart_all(&bs->throttled_reqs);
+        }
+    }
+
+    qemu_aio_flush();
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->block_timer) {
+            bs->io_limits_enabled = true;
+        }
+    }
+}
+
 /* make a BlockDriverState anonymous by removing from bdrv_state list.
    Also, NULL terminate the device_name to prevent double remove */
 void bdrv_make_anon(BlockDriverState *bs)
@@ -922,7 +1031,11 @@ int bdrv_commit(BlockDriverState *bs)
     buf = g_malloc(COMMIT_BUF_SECTORS * BDRV_SECTOR_SIZE);
 
     for (sector = 0; sector < total_sectors; sector += n) {
-        if (drv->bdrv_is_allocated(bs, sector, COMMIT_BUF_SECTORS, &n)) {
+        ret = bdrv_is_allocated(bs, sector, COMMIT_BUF_SECTORS, &n);
+        if (ret < 0) {
+            goto ro_cleanup;
+        }
+        if (ret) {
 
             if (bdrv_read(bs, sector, buf, n) != 0) {
                 ret = -EIO;
@@ -992,12 +1105,20 @@ int bdrv_change_backing_file(BlockDriverState *bs,
     const char *backing_file, const char *backing_fmt)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
 
-    if (drv->bdrv_change_backing_file != NULL) {
-        return drv->bdrv_change_backing_file(bs, backing_file, backing_fmt);
-    } else {
+    if (drv->bdrv_change_backing_file == NULL) {
         return -ENOTSUP;
     }
+
+    ret = drv->bdrv_change_backing_file(bs, backing_file, backing_fmt);
+    if (ret == 0) {
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+                backing_file ? backing_file : "");
+        pstrcpy(bs->backing_format, sizeof(bs->backing_format),
+                backing_fmt ? backing_fmt : "");
+    }
+    return ret;
 }
 
 static int bdrv_check_byte_request(BlockDriverState *bs, int64_t offset,
@@ -1044,7 +1165,7 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
 
     if (!rwco->is_write) {
         rwco->ret = bdrv_co_do_readv(rwco->bs, rwco->sector_num,
-                                     rwco->nb_sectors, rwco->qiov);
+                                     rwco->nb_sectors, rwco->qiov, 0);
     } else {
         rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
                                       rwco->nb_sectors, rwco->qiov);
@@ -1074,6 +1195,16 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
+    /*
+     * The throttling timer does not run while we wait for a synchronous
+     * request, so a throttled request would never complete.
+     */
+    if (bs->io_limits_enabled) {
+        fprintf(stderr, "Disabling I/O throttling on '%s' due "
+                "to synchronous I/O.\n", bdrv_get_device_name(bs));
+        bdrv_io_limits_disable(bs);
+    }
+
     if (qemu_in_coroutine()) {
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
@@ -1252,13 +1383,312 @@ int bdrv_pwrite_sync(BlockDriverState *bs, int64_t offset,
     return 0;
 }
 
+/*
+ * Handle a read request in coroutine context
+ */
+#define NANOSECONDS_PER_SECOND  1000000000.0
+
+/*
+ * How long must a request of @amount wait before it fits into @limit per
+ * second?  @dispatched is what the current slice has already used.  The
+ * limit pays for the time since the slice started plus one slice of burst.
+ */
+static int64_t bdrv_io_limit_wait(BlockDriverState *bs, int64_t now,
+                                  int64_t limit, double dispatched,
+                                  double amount)
+{
+    double elapsed, budget, used, wait;
+
+    if (!limit) {
+        return 0;
+    }
+
+    elapsed = (now - bs->slice_start) / NANOSECONDS_PER_SECOND;
+    budget = limit * BLOCK_IO_SLICE_TIME / NANOSECONDS_PER_SECOND;
+    used = dispatched - limit * elapsed;
+
+    /* a request that is too large for any slice is let through alone */
+    if (used <= 0 || used + amount <= budget) {
+        return 0;
+    }
+
+    wait = MIN(dispatched + amount - budget, dispatched) / limit;
+    return MAX(1, bs->slice_start +
+                  (int64_t)(wait * NANOSECONDS_PER_SECOND) - now);
+}
+
+/*
+ * Returns 0 and accounts the request if it can be dispatched now, or the
+ * time in ns until it should be tried again.
+ */
+static int64_t bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
+                                     bool is_write)
+{
+    BlockIOLimit *limits = &bs->io_limits;
+    double bytes = (double)nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t now, wait;
+    double elapsed;
+    int i;
+
+    /*
+     * Start a new slice once the current one is over.  The limits pay for
+     * the time that has passed; anything dispatched beyond that is carried
+     * over so that large requests are not free.
+     */
+    now = qemu_get_clock_ns(rt_clock);
+    if (now >= bs->slice_end) {
+        elapsed = (now - bs->slice_start) / NANOSECONDS_PER_SECOND;
+        for (i = 0; i < 3; i++) {
+            bs->slice_bytes[i] = MAX(0, bs->slice_bytes[i] -
+                                        limits->bps[i] * elapsed);
+            bs->slice_ios[i] = MAX(0, bs->slice_ios[i] -
+                                      limits->iops[i] * elapsed);
+        }
+        bs->slice_start = now;
+        bs->slice_end = now + BLOCK_IO_SLICE_TIME;
+    }
+
+    wait = bdrv_io_limit_wait(bs, now, limits->bps[is_write],
+                              bs->slice_bytes[is_write], bytes);
+    wait = MAX(wait, bdrv_io_limit_wait(bs, now,
+                                        limits->bps[BLOCK_IO_LIMIT_TOTAL],
+                                        bs->slice_bytes[BLOCK_IO_LIMIT_TOTAL],
+                                        bytes));
+    wait = MAX(wait, bdrv_io_limit_wait(bs, now, limits->iops[is_write],
+                                        bs->slice_ios[is_write], 1));
+    wait = MAX(wait, bdrv_io_limit_wait(bs, now,
+                                        limits->iops[BLOCK_IO_LIMIT_TOTAL],
+                                        bs->slice_ios[BLOCK_IO_LIMIT_TOTAL],
+                                        1));
+    if (wait > 0) {
+        return wait;
+    }
+
+    bs->slice_bytes[is_write] += bytes;
+    bs->slice_bytes[BLOCK_IO_LIMIT_TOTAL] += bytes;
+    bs->slice_ios[is_write]++;
+    bs->slice_ios[BLOCK_IO_LIMIT_TOTAL]++;
+    return 0;
+}
+
+/*
+ * Hold the request back until it fits into the I/O limits.  Requests are
+ * dispatched in the order they arrived: a request that still has to wait
+ * goes back to the head of the queue and keeps the others behind it.
+ */
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+    bool is_write, int nb_sectors)
+{
+    int64_t wait_time;
+
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        qemu_co_queue_wait(&bs->throttled_reqs);
+    }
+
+    while (bs->io_limits_enabled &&
+           (wait_time = bdrv_exceed_io_limits(bs, nb_sectors, is_write)) > 0) {
+        trace_bdrv_io_limits_intercept(bs, is_write, nb_sectors, wait_time);
+        qemu_mod_timer(bs->block_timer,
+                       qemu_get_clock_ns(rt_clock) + wait_time);
+        qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
+    }
+
+    qemu_co_queue_next(&bs->throttled_reqs);
+}
+
+struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co; /* owner, used for deadlock detection */
+    CoQueue wait_queue; /* coroutines blocked on this request */
+};
+
+/*
+ * Remove an active request from the tracked requests list
+ *
+ * This function should be called when a tracked request is completing.
+ */
+static void tracked_request_end(BdrvTrackedRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+/*
+ * Add an active request to the tracked requests list
+ */
+static void tracked_request_begin(BdrvTrackedRequest *req,
+                                  BlockDriverState *bs,
+                                  int64_t sector_num,
+                                  int nb_sectors, bool is_write)
+{
+    *req = (BdrvTrackedRequest){
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .is_write = is_write,
+        .co = qemu_coroutine_self(),
+    };
+
+    qemu_co_queue_init(&req->wait_queue);
+
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+}
+
+/*
+ * Round a region to cluster boundaries, without going past the end of
+ * the device
+ */
+static void round_to_clusters(BlockDriverState *bs,
+                              int64_t sector_num, int nb_sectors,
+                              int64_t *cluster_sector_num,
+                              int *cluster_nb_sectors)
+{
+    BlockDriverInfo bdi;
+    int64_t c, end;
+
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        *cluster_sector_num = sector_num;
+        *cluster_nb_sectors = nb_sectors;
+    } else {
+        c = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        *cluster_sector_num = (sector_num / c) * c;
+        end = MIN(((sector_num + nb_sectors + c - 1) / c) * c,
+                  bs->total_sectors);
+        *cluster_nb_sectors = end - *cluster_sector_num;
+    }
+}
+
+static bool tracked_request_overlaps(BdrvTrackedRequest *req,
+                                     int64_t sector_num, int nb_sectors)
+{
+    /*        aaaa   bbbb */
+    if (sector_num >= req->sector_num + req->nb_sectors) {
+        return false;
+    }
+    /* bbbb   aaaa        */
+    if (req->sector_num >= sector_num + nb_sectors) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Wait until no request in flight touches the clusters of a region
+ *
+ * Touching the same cluster counts as an overlap, so that a copy-on-read
+ * cannot interleave with a guest write that allocates the same cluster.
+ */
+static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    bool retry;
+
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (tracked_request_overlaps(req, cluster_sector_num,
+                                         cluster_nb_sectors)) {
+                /*
+                 * A request of our own coroutine means that a block driver
+                 * issued a nested request, which would deadlock here.
+                 */
+                assert(qemu_coroutine_self() != req->co);
+
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/*
+ * Populate the image from its backing file as a side effect of a read
+ *
+ * The whole clusters around the request are read into a bounce buffer and
+ * written back to the image, so that allocating them does not need any
+ * further backing file I/O.  The bounce buffer also protects the image
+ * from callers that modify the read buffer while the request is running.
+ */
+static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    size_t skip_bytes;
+    void *bounce_buffer;
+    int ret;
+
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    trace_bdrv_co_copy_on_readv(bs, sector_num, nb_sectors,
+                                cluster_sector_num, cluster_nb_sectors);
+
+    iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+                             &bounce_qiov);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Don't allocate space for zeroes if the format can avoid it */
+    ret = -ENOTSUP;
+    if (drv->bdrv_co_write_zeroes &&
+        buffer_is_zero(bounce_buffer, iov.iov_len)) {
+        ret = drv->bdrv_co_write_zeroes(bs, cluster_sector_num,
+                                        cluster_nb_sectors);
+    }
+    if (ret == -ENOTSUP) {
+        ret = drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
+                                  &bounce_qiov);
+    }
+    if (ret < 0) {
+        /*
+         * The data itself was read fine, but a failed copy must not go
+         * unnoticed when populating the image was the point of the read.
+         */
+        goto out;
+    }
+
+    bs->cor_bytes += iov.iov_len;
+    bs->cor_ops++;
+
+    skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
+    qemu_iovec_from_buffer(qiov, bounce_buffer + skip_bytes,
+                           nb_sectors * BDRV_SECTOR_SIZE);
+
+out:
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
 /*
  * Handle a read request in coroutine context
  */
 static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov,
+    BdrvRequestFlags flags)
 {
     BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
 
     if (!drv) {
         return -ENOMEDIUM;
@@ -1267,7 +1697,49 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
-    return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    /* throttling disk read I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, false, nb_sectors);
+    }
+
+    /* Without a backing file there is nothing to copy */
+    if (bs->copy_on_read && bs->backing_hd) {
+        flags |= BDRV_REQ_COPY_ON_READ;
+    }
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight++;
+    }
+
+    if (bs->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        int pnum;
+
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, &pnum);
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!ret || pnum != nb_sectors) {
+            ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
+            goto out;
+        }
+    }
+
+    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+
+out:
+    tracked_request_end(&req);
+
+    if (flags & BDRV_REQ_COPY_ON_READ) {
+        bs->copy_on_read_in_flight--;
+    }
+
+    return ret;
 }
 
 int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
@@ -1275,7 +1747,48 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_co_readv(bs, sector_num, nb_sectors);
 
-    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov);
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov, 0);
+}
+
+/*
+ * Copy-on-read is enabled as long as anyone asks for it: the drive option
+ * and background jobs may use it at the same time
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    bs->copy_on_read++;
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+/*
+ * Wait until no request is in flight on the device
+ */
+void coroutine_fn bdrv_co_wait_for_requests(BlockDriverState *bs)
+{
+    BdrvTrackedRequest *req;
+
+    while ((req = QLIST_FIRST(&bs->tracked_requests)) != NULL) {
+        assert(qemu_coroutine_self() != req->co);
+        qemu_co_queue_wait(&req->wait_queue);
+    }
+}
+
+/*
+ * Read and copy whatever the image takes from its backing file into the
+ * image itself, serialized against other requests on the same clusters
+ */
+int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_copy_on_readv_request(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_COPY_ON_READ);
 }
 
 /*
@@ -1285,6 +1798,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
 {
     BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
     int ret;
 
     if (!bs->drv) {
@@ -1297,8 +1811,21 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         return -EIO;
     }
 
+    /* throttling disk write I/O */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_intercept(bs, true, nb_sectors);
+    }
+
+    if (bs->copy_on_read_in_flight) {
+        wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    }
+
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+
     ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
 
+    tracked_request_end(&req);
+
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
@@ -1318,6 +1845,73 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
     return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov);
 }
 
+/* Largest zeroed buffer used when the driver can't zero in metadata */
+#define MAX_WRITE_ZEROES_BOUNCE_SECTORS 2048
+
+int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret = -ENOTSUP;
+    int n, done;
+
+    trace_bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    if (drv->bdrv_co_write_zeroes) {
+        if (bs->copy_on_read_in_flight) {
+            wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+        }
+
+        tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+        ret = drv->bdrv_co_write_zeroes(bs, sector_num, nb_sectors);
+        tracked_request_end(&req);
+
+        if (ret != -ENOTSUP) {
+            if (bs->dirty_bitmap) {
+                set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+            }
+
+            if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+                bs->wr_highest_sector = sector_num + nb_sectors - 1;
+            }
+            return ret;
+        }
+    }
+
+    /*
+     * Fall back to writing zeroed buffers.  Each chunk goes through
+     * bdrv_co_do_writev() so that it is throttled, tracked against
+     * copy-on-read and marked in the dirty bitmap like any other write.
+     */
+    n = MIN(nb_sectors, MAX_WRITE_ZEROES_BOUNCE_SECTORS);
+    iov.iov_base = qemu_blockalign(bs, n * BDRV_SECTOR_SIZE);
+    memset(iov.iov_base, 0, n * BDRV_SECTOR_SIZE);
+
+    ret = 0;
+    for (done = 0; done < nb_sectors && ret >= 0; done += n) {
+        n = MIN(nb_sectors - done, MAX_WRITE_ZEROES_BOUNCE_SECTORS);
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_do_writev(bs, sector_num + done, n, &qiov);
+    }
+    qemu_vfree(iov.iov_base);
+
+    return ret;
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
@@ -1518,6 +2112,14 @@ void bdrv_set_translation_hint(BlockDriverState *bs, int translation)
     bs->translation = translation;
 }
 
+void bdrv_set_metadata_cache_hint(BlockDriverState *bs, uint64_t l2_size,
+                                  uint64_t refcount_size, int clean_interval)
+{
+    bs->l2_cache_size = l2_size;
+    bs->refcount_cache_size = refcount_size;
+    bs->cache_clean_interval = clean_interval;
+}
+
 void bdrv_get_geometry_hint(BlockDriverState *bs,
                             int *pcyls, int *pheads, int *psecs)
 {
@@ -1789,10 +2391,49 @@ int bdrv_has_zero_init(BlockDriverState *bs)
  *
  * 'nb_sectors' is the max value 'pnum' should be set to.
  */
+typedef struct BdrvCoIsAllocatedData {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int ret;
+} BdrvCoIsAllocatedData;
+
+static void coroutine_fn bdrv_is_allocated_co_entry(void *opaque)
+{
+    BdrvCoIsAllocatedData *data = opaque;
+
+    data->ret = bdrv_co_is_allocated(data->bs, data->sector_num,
+                                     data->nb_sectors, data->pnum);
+}
+
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum)
 {
     int64_t n;
+
+    if (bs->drv->bdrv_co_is_allocated) {
+        Coroutine *co;
+        BdrvCoIsAllocatedData data = {
+            .bs = bs,
+            .sector_num = sector_num,
+            .nb_sectors = nb_sectors,
+            .pnum = pnum,
+            .ret = NOT_DONE,
+        };
+
+        if (qemu_in_coroutine()) {
+            bdrv_is_allocated_co_entry(&data);
+        } else {
+            co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
+            qemu_coroutine_enter(co, &data);
+            while (data.ret == NOT_DONE) {
+                qemu_aio_wait();
+            }
+        }
+        return data.ret;
+    }
+
     if (!bs->drv->bdrv_is_allocated) {
         if (sector_num >= bs->total_sectors) {
             *pnum = 0;
@@ -1805,6 +2446,27 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
+/*
+ * Same as bdrv_is_allocated, but lets the driver yield while it looks the
+ * sectors up instead of waiting for its metadata synchronously.
+ */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
+{
+    if (bs->drv->bdrv_co_is_allocated) {
+        /* Drivers may report ranges past the end of the device */
+        if (sector_num >= bs->total_sectors) {
+            *pnum = 0;
+            return 0;
+        }
+        nb_sectors = MIN(nb_sectors, bs->total_sectors - sector_num);
+
+        return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors,
+                                             pnum);
+    }
+    return bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+}
+
 void bdrv_mon_event(const BlockDriverState *bdrv,
                     BlockMonEventAction action, int is_read)
 {
@@ -1905,6 +2567,24 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->cor_bytes = bs->cor_bytes;
+    s->stats->cor_operations = bs->cor_ops;
+
+    if (bs->io_limits_enabled) {
+        s->stats->has_bps = s->stats->has_bps_rd = s->stats->has_bps_wr = true;
+        s->stats->bps = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
+        s->stats->bps_rd = bs->io_limits.bps[BLOCK_IO_LIMIT_READ];
+        s->stats->bps_wr = bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE];
+        s->stats->has_iops = s->stats->has_iops_rd = true;
+        s->stats->has_iops_wr = true;
+        s->stats->iops = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
+        s->stats->iops_rd = bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
+        s->stats->iops_wr = bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+    }
+
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        bs->drv->bdrv_get_cache_stats((BlockDriverState *)bs, s->stats);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -2576,7 +3256,7 @@ typedef struct BlockDriverAIOCBCoroutine {
 
 static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 static AIOPool bdrv_em_co_aio_pool = {
@@ -2601,7 +3281,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
 
     if (!acb->is_write) {
         acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
-            acb->req.nb_sectors, acb->req.qiov);
+            acb->req.nb_sectors, acb->req.qiov, 0);
     } else {
         acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
             acb->req.nb_sectors, acb->req.qiov);
@@ -2687,6 +3367,35 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
     return &acb->common;
 }
 
+static void coroutine_fn bdrv_aio_write_zeroes_co_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bdrv_co_write_zeroes(bs, acb->req.sector,
+                                          acb->req.nb_sectors);
+    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+BlockDriverAIOCB *bdrv_aio_write_zeroes(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, opaque);
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    co = qemu_coroutine_create(bdrv_aio_write_zeroes_co_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
 void bdrv_init(void)
 {
     module_call_init(MODULE_INIT_BLOCK);
@@ -3018,6 +3727,39 @@ BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
     return NULL;
 }
 
+/*
+ * Start queueing requests instead of submitting each one immediately.
+ *
+ * Protocols that don't batch ignore this.  Format drivers pass it down to
+ * their image file.  No request may be waited for before the matching
+ * bdrv_io_unplug() because it may not have reached the host yet.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+/*
+ * Submit the requests queued since bdrv_io_plug().  With nested plugs this
+ * only happens when the outermost one is released.
+ */
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 void bdrv_set_buffer_alignment(BlockDriverState *bs, int align)
 {
     bs->buffer_alignment = align;
@@ -3084,6 +3826,93 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+    bdrv_set_in_use(bs, 1);
+
+    job = g_malloc0(job_type->instance_size);
+    job->job_type = job_type;
+    job->bs = bs;
+    job->cb = cb;
+    job->opaque = opaque;
+    bs->job = job;
+    return job;
+}
+
+void block_job_complete(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+    bs->job = NULL;
+    g_free(job);
+    bdrv_set_in_use(bs, 0);
+}
+
+int block_job_set_speed(BlockJob *job, int64_t value)
+{
+    int ret;
+
+    if (!job->job_type->set_speed) {
+        return -ENOTSUP;
+    }
+    ret = job->job_type->set_speed(job, value);
+    if (ret == 0) {
+        job->speed = value;
+    }
+    return ret;
+}
+
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = true;
+
+    /* Don't make a sleeping job wait for its timer to notice */
+    if (job->co && !job->busy) {
+        qemu_coroutine_enter(job->co, NULL);
+    }
+}
+
+bool block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
+
+void block_job_cancel_sync(BlockJob *job)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    block_job_cancel(job);
+
+    /* Let the job's pending I/O, throttled or not, complete */
+    while (bs->job == job) {
+        bdrv_drain_all();
+    }
+}
+
+void coroutine_fn block_job_sleep_ns(BlockJob *job, QEMUClock *clock,
+                                     int64_t ns)
+{
+    assert(job->busy);
+
+    /* Check cancellation *before* setting busy = false, too!  */
+    if (block_job_is_cancelled(job)) {
+        return;
+    }
+
+    job->busy = false;
+    co_sleep_ns(clock, ns);
+    job->busy = true;
+}
+
 void bdrv_iostatus_enable(BlockDriverState *bs)
 {
     bs->iostatus_enabled = true;
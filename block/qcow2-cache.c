@@ -26,36 +26,86 @@
 #include "qemu-common.h"
 #include "qcow2.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/*
+ * Cached tables are looked up by their offset in the image through a hash
+ * table.  Tables that nobody holds a reference to are kept on an LRU list,
+ * least recently used first, so that both a lookup and picking a victim to
+ * replace take constant time no matter how large the cache is.
+ */
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    used;
     int     ref;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                table_array;
+    QLIST_HEAD(, Qcow2CachedTable)* buckets;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    unsigned int            bucket_mask;
     bool                    depends_on_flush;
     bool                    writethrough;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return c->table_array + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t off = (uint8_t *)table - c->table_array;
+    int i = off / c->table_size;
+
+    assert(off >= 0 && i < c->size && (off % c->table_size) == 0);
+    return i;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* tables are cluster aligned, so the low bits carry no information */
+    offset /= c->table_size;
+    return (offset ^ (offset >> 16)) & c->bucket_mask;
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     bool writethrough)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
+    unsigned int nb_buckets;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * s->cluster_size);
     c->writethrough = writethrough;
 
+    nb_buckets = 1;
+    while (nb_buckets < num_tables) {
+        nb_buckets <<= 1;
+    }
+    c->buckets = g_malloc0(sizeof(*c->buckets) * nb_buckets);
+    c->bucket_mask = nb_buckets - 1;
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -67,9 +117,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -119,8 +170,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -181,83 +232,97 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *t;
 
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+    QLIST_FOREACH(t, &c->buckets[qcow2_cache_hash(c, offset)], hash_next) {
+        if (t->offset == offset) {
+            return t;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
+    return NULL;
+}
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+/* Forget which table an entry held and make it the first to be reused */
+static void qcow2_cache_entry_discard(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    if (t->offset) {
+        QLIST_REMOVE(t, hash_next);
+        t->offset = 0;
+    }
+    if (t->ref == 0) {
+        QTAILQ_REMOVE(&c->lru, t, lru_next);
+        QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
     }
-    return min_index;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    t = qcow2_cache_lookup(c, offset);
+    if (t) {
+        c->hits++;
+        i = t - c->entries;
+        goto found;
     }
+    c->misses++;
 
-    /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
-    if (i < 0) {
-        return i;
+    /* If not, write back the least recently used table and replace it */
+    t = QTAILQ_FIRST(&c->lru);
+    if (!t) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
     }
+    i = t - c->entries;
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    /* Keep the entry off the LRU list while it is being loaded */
+    if (t->offset) {
+        QLIST_REMOVE(t, hash_next);
+        t->offset = 0;
+    }
+    QTAILQ_REMOVE(&c->lru, t, lru_next);
+    t->ref++;
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
+            t->ref--;
+            QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    QLIST_INSERT_HEAD(&c->buckets[qcow2_cache_hash(c, offset)], t, hash_next);
+    t->used = true;
+    *table = qcow2_cache_get_table_addr(c, i);
+    return 0;
 
-    /* And return the right table */
+    /* Take a reference to a table that is already cached */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (t->ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, t, lru_next);
+    }
+    t->used = true;
+    *table = qcow2_cache_get_table_addr(c, i);
     return 0;
 }
 
@@ -275,20 +340,16 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
+    Qcow2CachedTable *t = &c->entries[i];
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
-
-found:
-    c->entries[i].ref--;
+    t->ref--;
     *table = NULL;
 
-    assert(c->entries[i].ref >= 0);
+    assert(t->ref >= 0);
+    if (t->ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru, t, lru_next);
+    }
 
     if (c->writethrough) {
         return qcow2_cache_entry_flush(bs, c, i);
@@ -298,18 +359,55 @@ found:
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
+{
+    c->entries[qcow2_cache_get_table_idx(c, table)].dirty = true;
+}
+
+/*
+ * Drop the clean tables that nobody has used since the last call and give
+ * their memory back to the host.  This may run while a request is waiting
+ * for I/O: referenced and dirty tables are left alone.
+ */
+static void qcow2_cache_table_release(Qcow2Cache *c, int i)
+{
+#ifndef _WIN32
+    uintptr_t page_size = getpagesize();
+    uintptr_t start, end;
+
+    /* only whole host pages can be released */
+    start = (uintptr_t)qcow2_cache_get_table_addr(c, i);
+    end = (start + c->table_size) & ~(page_size - 1);
+    start = (start + page_size - 1) & ~(page_size - 1);
+    if (end > start) {
+        qemu_madvise((void *)start, end - start, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
+void qcow2_cache_clean_unused(Qcow2Cache *c)
 {
     int i;
 
     for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (t->ref || t->dirty || !t->offset) {
+            continue;
+        }
+        if (t->used) {
+            t->used = false;
+            continue;
         }
+
+        qcow2_cache_entry_discard(c, t);
+        qcow2_cache_table_release(c, i);
     }
-    abort();
+}
 
-found:
-    c->entries[i].dirty = true;
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
 }
 
 bool qcow2_cache_set_writethrough(BlockDriverState *bs, Qcow2Cache *c,
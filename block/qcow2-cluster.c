@@ -177,9 +177,17 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (s->use_lazy_refcounts) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* allocate a new entry in the l2 cache */
@@ -264,6 +272,18 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+static int count_contiguous_zero_clusters(uint64_t nb_clusters,
+                                          uint64_t *l2_table)
+{
+    int i = 0;
+
+    while (nb_clusters-- && qcow2_is_zero_cluster(be64_to_cpu(l2_table[i]))) {
+        i++;
+    }
+
+    return i;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -309,7 +329,9 @@ static int qcow2_read(BlockDriverState *bs, int64_t sector_num,
         }
 
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
-        if (!cluster_offset) {
+        if (qcow2_is_zero_cluster(cluster_offset)) {
+            memset(buf, 0, 512 * n);
+        } else if (!cluster_offset) {
             if (bs->backing_hd) {
                 /* read from the base image */
                 iov.iov_base = buf;
@@ -347,31 +369,66 @@ static int qcow2_read(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/*
+ * Copy the unmodified sectors of a newly allocated cluster from its old
+ * location.
+ *
+ * In coroutine context this runs without s->lock: the new cluster is not
+ * linked into the L2 table yet, so readers still see the old data, and
+ * writers to the same clusters wait on the in-flight allocation.  Only
+ * requests that really conflict are serialized this way, and allocating
+ * writes to different clusters can do their COW I/O in parallel.
+ */
 static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
                         uint64_t cluster_offset, int n_start, int n_end)
 {
     BDRVQcowState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
     int n, ret;
 
     n = n_end - n_start;
     if (n <= 0)
         return 0;
+
+    iov.iov_len = n * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
-    ret = qcow2_read(bs, start_sect + n_start, s->cluster_data, n);
-    if (ret < 0)
-        return ret;
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_unlock(&s->lock);
+        /* Call the driver directly; qcow2_co_readv takes s->lock itself
+         * for its metadata accesses */
+        ret = bs->drv->bdrv_co_readv(bs, start_sect + n_start, n, &qiov);
+    } else {
+        ret = qcow2_read(bs, start_sect + n_start, iov.iov_base, n);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
     if (s->crypt_method) {
         qcow2_encrypt_sectors(s, start_sect + n_start,
-                        s->cluster_data,
-                        s->cluster_data, n, 1,
+                        iov.iov_base, iov.iov_base, n, 1,
                         &s->aes_encrypt_key);
     }
+
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
-    ret = bdrv_write(bs->file, (cluster_offset >> 9) + n_start,
-        s->cluster_data, n);
-    if (ret < 0)
-        return ret;
-    return 0;
+    if (qemu_in_coroutine()) {
+        ret = bdrv_co_writev(bs->file, (cluster_offset >> 9) + n_start, n,
+                             &qiov);
+    } else {
+        ret = bdrv_write(bs->file, (cluster_offset >> 9) + n_start,
+                         iov.iov_base, n);
+    }
+
+out:
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+    qemu_vfree(iov.iov_base);
+    return ret < 0 ? ret : 0;
 }
 
 
@@ -453,6 +510,10 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     if (!*cluster_offset) {
         /* how many empty clusters ? */
         c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+    } else if (qcow2_is_zero_cluster(*cluster_offset)) {
+        /* how many clusters reading as zeroes ? */
+        c = count_contiguous_zero_clusters(nb_clusters, &l2_table[l2_index]);
+        *cluster_offset = QCOW_OFLAG_ZERO;
     } else {
         /* how many allocated clusters ? */
         c = count_contiguous_clusters(nb_clusters, s->cluster_size,
@@ -639,13 +700,22 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      *
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
-     * handled.
+     * handled.  With lazy refcounts, only the COW data must be stable.
      */
     if (cow) {
         qcow2_cache_depends_on_flush(s->l2_table_cache);
     }
 
-    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    if (s->use_lazy_refcounts) {
+        ret = qcow2_mark_dirty(bs);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
     ret = get_cluster_table(bs, m->offset, &l2_table, &l2_offset, &l2_index);
     if (ret < 0) {
         goto err;
@@ -730,9 +800,10 @@ again:
 
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
-    /* We keep all QCOW_OFLAG_COPIED clusters */
+    /* We keep all QCOW_OFLAG_COPIED clusters, unless they read as zeroes */
 
-    if (cluster_offset & QCOW_OFLAG_COPIED) {
+    if ((cluster_offset & QCOW_OFLAG_COPIED) &&
+        !qcow2_is_zero_cluster(cluster_offset)) {
         nb_clusters = count_contiguous_clusters(nb_clusters, s->cluster_size,
                 &l2_table[l2_index], 0, 0);
 
@@ -752,6 +823,13 @@ again:
     while (i < nb_clusters) {
         i += count_contiguous_clusters(nb_clusters - i, s->cluster_size,
                 &l2_table[l2_index], i, 0);
+        if (i >= nb_clusters) {
+            break;
+        }
+
+        /* zero clusters are replaced just like free ones */
+        i += count_contiguous_zero_clusters(nb_clusters - i,
+                &l2_table[l2_index + i]);
         if ((i >= nb_clusters) || be64_to_cpu(l2_table[l2_index + i])) {
             break;
         }
@@ -783,8 +861,8 @@ again:
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
-            /* No intersection */
+        if (end <= old_start || start >= old_end) {
+            /* No intersection, adjacent allocations can run in parallel */
         } else {
             if (start < old_start) {
                 /* Stop at the start of a running allocation */
@@ -943,6 +1021,53 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
+/*
+ * This turns as many clusters of nb_clusters as possible into zero clusters
+ * at once (i.e. all clusters in the same L2 table), frees their storage and
+ * returns the number of zeroed clusters.
+ */
+static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
+    unsigned int nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2_offset, *l2_table;
+    int l2_index;
+    int ret;
+    int i;
+
+    ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Limit nb_clusters to one L2 table */
+    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t old_offset;
+
+        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        if (old_offset == QCOW_OFLAG_ZERO) {
+            continue;
+        }
+
+        /* First update the L2 entry, then drop the old cluster */
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+
+        if (old_offset != 0) {
+            qcow2_free_any_clusters(bs, old_offset & ~QCOW_OFLAG_COPIED, 1);
+        }
+    }
+
+    ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return nb_clusters;
+}
+
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors)
 {
@@ -951,7 +1076,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     unsigned int nb_clusters;
     int ret;
 
-    end_offset = offset + (nb_sectors << BDRV_SECTOR_BITS);
+    end_offset = offset + ((uint64_t)nb_sectors << BDRV_SECTOR_BITS);
 
     /* Round start up and end down */
     offset = align_offset(offset, s->cluster_size);
@@ -965,7 +1090,53 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     /* Each L2 table is handled by its own loop iteration */
     while (nb_clusters > 0) {
-        ret = discard_single_l2(bs, offset, nb_clusters);
+        /* Don't let the backing file show through where it was hidden */
+        if (s->qcow_version >= 3 && bs->backing_hd) {
+            ret = zero_single_l2(bs, offset, nb_clusters);
+        } else {
+            ret = discard_single_l2(bs, offset, nb_clusters);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        nb_clusters -= ret;
+        offset += (ret * s->cluster_size);
+    }
+
+    return 0;
+}
+
+/*
+ * Make whole clusters read as zeroes by only updating metadata.  offset and
+ * nb_sectors must be cluster aligned.
+ *
+ * Version 3 images get zero clusters.  Version 2 images have no such thing,
+ * but without a backing file unallocated clusters read as zeroes as well, so
+ * the clusters can be discarded instead.  Returns -ENOTSUP otherwise.
+ */
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int nb_clusters;
+    int ret;
+
+    assert((offset & (s->cluster_size - 1)) == 0);
+    assert((nb_sectors & (s->cluster_sectors - 1)) == 0);
+
+    if (s->qcow_version < 3) {
+        if (bs->backing_hd) {
+            return -ENOTSUP;
+        }
+        return qcow2_discard_clusters(bs, offset, nb_sectors);
+    }
+
+    nb_clusters = nb_sectors >> (s->cluster_bits - BDRV_SECTOR_BITS);
+
+    /* Each L2 table is handled by its own loop iteration */
+    while (nb_clusters > 0) {
+        ret = zero_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
             return ret;
         }
@@ -668,6 +668,12 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
         return;
     }
 
+    /* zero clusters may not have any storage */
+    cluster_offset &= ~QCOW_OFLAG_ZERO;
+    if (cluster_offset == 0) {
+        return;
+    }
+
     qcow2_free_clusters(bs, cluster_offset, nb_clusters << s->cluster_bits);
 
     return;
@@ -736,6 +742,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
             for(j = 0; j < s->l2_size; j++) {
                 offset = be64_to_cpu(l2_table[j]);
+                if (offset == QCOW_OFLAG_ZERO) {
+                    /* zero cluster without storage, nothing to count */
+                    continue;
+                }
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
@@ -911,6 +921,18 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
         offset = be64_to_cpu(l2_table[i]);
+        if (qcow2_is_zero_cluster(offset)) {
+            if (s->qcow_version < 3) {
+                fprintf(stderr, "ERROR: zero cluster %d in a version 2 "
+                    "image\n", i);
+                res->corruptions++;
+            }
+            /* zero clusters written by this driver have no storage */
+            offset &= ~QCOW_OFLAG_ZERO;
+            if ((offset & ~QCOW_OFLAG_COPIED) == 0) {
+                continue;
+            }
+        }
         if (offset != 0) {
             if (offset & QCOW_OFLAG_COMPRESSED) {
                 /* Compressed clusters don't have QCOW_OFLAG_COPIED */
@@ -1058,12 +1080,15 @@ fail:
 }
 
 /*
- * Checks an image for refcount consistency.
+ * Checks an image for refcount consistency.  With repair set, the refcounts
+ * are also rewritten to match the references that were found; this is how
+ * a dirty image with lazy refcounts is brought up to date.
  *
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool repair)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t size;
@@ -1147,8 +1172,18 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res)
         refcount2 = refcount_table[i];
         if (refcount1 != refcount2) {
             fprintf(stderr, "%s cluster %d refcount=%d reference=%d\n",
+                   repair ? "Repairing" :
                    refcount1 < refcount2 ? "ERROR" : "Leaked",
                    i, refcount1, refcount2);
+            if (repair) {
+                ret = update_cluster_refcount(bs, i, refcount2 - refcount1);
+                if (ret >= 0) {
+                    continue;
+                }
+                fprintf(stderr, "Can't repair refcount for cluster %d: %s\n",
+                        i, strerror(-ret));
+                res->check_errors++;
+            }
             if (refcount1 < refcount2) {
                 res->corruptions++;
             } else {
@@ -29,6 +29,7 @@
 #include "block/qcow2.h"
 #include "qemu-error.h"
 #include "qerror.h"
+#include "qemu-timer.h"
 
 /*
   Differences with QCOW:
@@ -139,6 +140,121 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 }
 
 
+/*
+ * Write the feature bit fields of a version 3 header from the values in
+ * BDRVQcowState.  Version 2 images have no feature bits.
+ */
+int qcow2_update_features(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    struct {
+        uint64_t incompatible_features;
+        uint64_t compatible_features;
+        uint64_t autoclear_features;
+    } QEMU_PACKED features;
+
+    if (s->qcow_version < 3) {
+        return 0;
+    }
+
+    features.incompatible_features = cpu_to_be64(s->incompatible_features);
+    features.compatible_features = cpu_to_be64(s->compatible_features);
+    features.autoclear_features = cpu_to_be64(s->autoclear_features);
+
+    return bdrv_pwrite_sync(bs->file,
+        offsetof(QCowHeader, incompatible_features),
+        &features, sizeof(features));
+}
+
+/*
+ * Set the dirty bit before the first refcount update is allowed to lag
+ * behind the tables that depend on it.
+ */
+int qcow2_mark_dirty(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
+        return 0;
+    }
+
+    assert(s->qcow_version >= 3);
+    s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+    ret = qcow2_update_features(bs);
+    if (ret < 0) {
+        s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    }
+    return ret;
+}
+
+/* Write out all metadata, after which the refcounts on disk are accurate */
+static int qcow2_mark_clean(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        return 0;
+    }
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    return qcow2_update_features(bs);
+}
+
+/* Turn the cache sizes requested for the drive into numbers of tables */
+static int qcow2_cache_sizes(BlockDriverState *bs, int *l2_cache_size,
+                             int *refcount_cache_size)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (bs->l2_cache_size > MAX_CACHE_SIZE ||
+        bs->refcount_cache_size > MAX_CACHE_SIZE) {
+        error_report("qcow2: metadata cache sizes must not exceed %d bytes",
+                     MAX_CACHE_SIZE);
+        return -EINVAL;
+    }
+
+    *l2_cache_size = L2_CACHE_SIZE;
+    if (bs->l2_cache_size) {
+        *l2_cache_size = MAX(bs->l2_cache_size / s->cluster_size,
+                             MIN_L2_CACHE_SIZE);
+    }
+
+    *refcount_cache_size = REFCOUNT_CACHE_SIZE;
+    if (bs->refcount_cache_size) {
+        *refcount_cache_size = MAX(bs->refcount_cache_size / s->cluster_size,
+                                   MIN_REFCOUNT_CACHE_SIZE);
+    }
+
+    return 0;
+}
+
+static void qcow2_cache_clean_timer_start(BDRVQcowState *s)
+{
+    qemu_mod_timer(s->cache_clean_timer, qemu_get_clock_ns(rt_clock) +
+                   get_ticks_per_sec() * s->cache_clean_interval);
+}
+
+static void qcow2_cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_clean_unused(s->l2_table_cache);
+    qcow2_cache_clean_unused(s->refcount_block_cache);
+    qcow2_cache_clean_timer_start(s);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -146,6 +262,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    int l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -169,7 +286,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -EINVAL;
         goto fail;
     }
-    if (header.version != QCOW_VERSION) {
+    if (header.version < QCOW_VERSION || header.version > QCOW_MAX_VERSION) {
         char version[64];
         snprintf(version, sizeof(version), "QCOW version %d", header.version);
         qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
@@ -177,6 +294,53 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -ENOTSUP;
         goto fail;
     }
+    s->qcow_version = header.version;
+
+    /* Initialise version 3 header fields */
+    if (header.version == 2) {
+        header.incompatible_features    = 0;
+        header.compatible_features      = 0;
+        header.autoclear_features       = 0;
+        header.refcount_order           = 4;
+        header.header_length            = QCOW2_V2_HEADER_SIZE;
+    } else {
+        be64_to_cpus(&header.incompatible_features);
+        be64_to_cpus(&header.compatible_features);
+        be64_to_cpus(&header.autoclear_features);
+        be32_to_cpus(&header.refcount_order);
+        be32_to_cpus(&header.header_length);
+    }
+
+    if (header.header_length < QCOW2_V2_HEADER_SIZE ||
+        (header.version >= 3 && header.header_length < sizeof(header))) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->header_length = header.header_length;
+
+    if (header.incompatible_features & ~QCOW2_INCOMPAT_MASK) {
+        char feature[64];
+        snprintf(feature, sizeof(feature), "incompatible features %" PRIx64,
+                 header.incompatible_features & ~QCOW2_INCOMPAT_MASK);
+        qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
+            bs->device_name, "qcow2", feature);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    s->incompatible_features    = header.incompatible_features;
+    s->compatible_features      = header.compatible_features;
+    s->autoclear_features       = header.autoclear_features;
+
+    /* Only 16-bit refcounts are supported */
+    if (header.refcount_order != 4) {
+        char feature[64];
+        snprintf(feature, sizeof(feature), "%d bit reference counts",
+                 1 << header.refcount_order);
+        qerror_report(QERR_UNKNOWN_BLOCK_FORMAT_FEATURE,
+            bs->device_name, "qcow2", feature);
+        ret = -ENOTSUP;
+        goto fail;
+    }
     if (header.cluster_bits < MIN_CLUSTER_BITS ||
         header.cluster_bits > MAX_CLUSTER_BITS) {
         ret = -EINVAL;
@@ -230,9 +394,13 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
+    ret = qcow2_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    if (ret < 0) {
+        goto fail;
+    }
     writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
         writethrough);
 
     s->cluster_cache = g_malloc(s->cluster_size);
@@ -255,7 +423,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     } else {
         ext_end = s->cluster_size;
     }
-    if (qcow2_read_extensions(bs, sizeof(header), ext_end)) {
+    if (qcow2_read_extensions(bs, s->header_length, ext_end)) {
         ret = -EINVAL;
         goto fail;
     }
@@ -278,13 +446,56 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         goto fail;
     }
 
+    /* Clear the autoclear bits of features we don't know about */
+    if ((flags & BDRV_O_RDWR) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
+        ret = qcow2_update_features(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    s->use_lazy_refcounts =
+        !!(s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS);
+
+    /* The last user crashed with refcount updates still in its cache */
+    if ((flags & BDRV_O_RDWR) && !qcow2_need_accurate_refcounts(s)) {
+        BdrvCheckResult result = {0};
+
+        ret = qcow2_check_refcounts(bs, &result, true);
+        if (ret < 0) {
+            goto fail;
+        }
+        /* Anything left over could not be repaired; keep the dirty bit */
+        if (result.corruptions || result.check_errors) {
+            fprintf(stderr, "qcow2: could not repair refcounts of dirty "
+                    "image (%d corruptions, %d check errors)\n",
+                    result.corruptions, result.check_errors);
+            ret = -EIO;
+            goto fail;
+        }
+        ret = qcow2_mark_clean(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
+    s->cache_clean_interval = bs->cache_clean_interval;
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = qemu_new_timer_ns(rt_clock,
+                                                 qcow2_cache_clean_timer_cb,
+                                                 bs);
+        qcow2_cache_clean_timer_start(s);
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
-        qcow2_check_refcounts(bs, &result);
+        qcow2_check_refcounts(bs, &result, false);
     }
 #endif
     return ret;
@@ -343,18 +554,20 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
-static int qcow2_is_allocated(BlockDriverState *bs, int64_t sector_num,
-                              int nb_sectors, int *pnum)
+static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
 {
+    BDRVQcowState *s = bs->opaque;
     uint64_t cluster_offset;
     int ret;
 
     *pnum = nb_sectors;
-    /* FIXME We can get errors here, but the bdrv_is_allocated interface can't
-     * pass them on today */
+    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
+    qemu_co_mutex_unlock(&s->lock);
     if (ret < 0) {
         *pnum = 0;
+        return ret;
     }
 
     return (cluster_offset != 0);
@@ -414,7 +627,9 @@ static int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
 
-        if (!cluster_offset) {
+        if (qcow2_is_zero_cluster(cluster_offset)) {
+            qemu_iovec_memset(&hd_qiov, 0, 512 * cur_nr_sectors);
+        } else if (!cluster_offset) {
 
             if (bs->backing_hd) {
                 /* read from the base image */
@@ -622,9 +837,20 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    if (s->cache_clean_timer) {
+        qemu_del_timer(s->cache_clean_timer);
+        qemu_free_timer(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
+    /* a read-only user has not repaired a dirty image */
+    if (s->flags & BDRV_O_RDWR) {
+        qcow2_mark_clean(bs);
+    }
+
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
@@ -699,7 +925,7 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
         backing_file_len = strlen(backing_file);
     }
 
-    size_t header_size = sizeof(QCowHeader) + backing_file_len
+    size_t header_size = s->header_length + backing_file_len
         + backing_fmt_len;
 
     if (header_size > s->cluster_size) {
@@ -707,7 +933,7 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
     }
 
     /* Rewrite backing file name and qcow2 extensions */
-    size_t ext_size = header_size - sizeof(QCowHeader);
+    size_t ext_size = header_size - s->header_length;
     uint8_t buf[ext_size];
     size_t offset = 0;
     size_t backing_file_offset = 0;
@@ -728,10 +954,10 @@ static int qcow2_update_ext_header(BlockDriverState *bs,
         }
 
         memcpy(buf + offset, backing_file, backing_file_len);
-        backing_file_offset = sizeof(QCowHeader) + offset;
+        backing_file_offset = s->header_length + offset;
     }
 
-    ret = bdrv_pwrite_sync(bs->file, sizeof(QCowHeader), buf, ext_size);
+    ret = bdrv_pwrite_sync(bs->file, s->header_length, buf, ext_size);
     if (ret < 0) {
         goto fail;
     }
@@ -819,7 +1045,7 @@ static int preallocate(BlockDriverState *bs)
 static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, int prealloc,
-                         QEMUOptionParameter *options)
+                         QEMUOptionParameter *options, int version)
 {
     /* Calulate cluster_bits */
     int cluster_bits;
@@ -847,6 +1073,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
      */
     BlockDriverState* bs;
     QCowHeader header;
+    size_t header_length;
     uint8_t* refcount_table;
     int ret;
 
@@ -863,7 +1090,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
     /* Write the header */
     memset(&header, 0, sizeof(header));
     header.magic = cpu_to_be32(QCOW_MAGIC);
-    header.version = cpu_to_be32(QCOW_VERSION);
+    header.version = cpu_to_be32(version);
     header.cluster_bits = cpu_to_be32(cluster_bits);
     header.size = cpu_to_be64(0);
     header.l1_table_offset = cpu_to_be64(0);
@@ -877,7 +1104,19 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
     }
 
-    ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
+    if (version >= 3) {
+        header_length = sizeof(header);
+        header.refcount_order = cpu_to_be32(4);
+        header.header_length = cpu_to_be32(header_length);
+        if (flags & BLOCK_FLAG_LAZY_REFCOUNTS) {
+            header.compatible_features =
+                cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
+        }
+    } else {
+        header_length = QCOW2_V2_HEADER_SIZE;
+    }
+
+    ret = bdrv_pwrite(bs, 0, &header, header_length);
     if (ret < 0) {
         goto out;
     }
@@ -951,6 +1190,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     int flags = 0;
     size_t cluster_size = DEFAULT_CLUSTER_SIZE;
     int prealloc = 0;
+    int version = QCOW_VERSION;
 
     /* Read out options */
     while (options && options->name) {
@@ -976,10 +1216,28 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
                     options->value.s);
                 return -EINVAL;
             }
+        } else if (!strcmp(options->name, BLOCK_OPT_COMPAT_LEVEL)) {
+            if (!options->value.s || !strcmp(options->value.s, "0.10")) {
+                version = 2;
+            } else if (!strcmp(options->value.s, "1.1")) {
+                version = 3;
+            } else {
+                fprintf(stderr, "Invalid compatibility level: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
+        } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
+            flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
         }
         options++;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_LAZY_REFCOUNTS)) {
+        fprintf(stderr, "Lazy refcounts only supported with compatibility "
+                "level 1.1 (use compat=1.1)\n");
+        return -EINVAL;
+    }
+
     if (backing_file && prealloc) {
         fprintf(stderr, "Backing file and preallocation cannot be used at "
             "the same time\n");
@@ -987,7 +1245,7 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
     }
 
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
-                         cluster_size, prealloc, options);
+                         cluster_size, prealloc, options, version);
 }
 
 static int qcow2_make_empty(BlockDriverState *bs)
@@ -1023,6 +1281,65 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     return ret;
 }
 
+/* Write explicit zeroes to a range that doesn't cover a whole cluster */
+static coroutine_fn int qcow2_write_zero_sectors(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    if (nb_sectors == 0) {
+        return 0;
+    }
+
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = qemu_blockalign(bs, iov.iov_len);
+    memset(iov.iov_base, 0, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = qcow2_co_writev(bs, sector_num, nb_sectors, &qiov);
+
+    qemu_vfree(iov.iov_base);
+    return ret;
+}
+
+static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int head, tail;
+    int ret;
+
+    /* Only whole clusters can be zeroed in the metadata */
+    head = -sector_num & (s->cluster_sectors - 1);
+    if (head >= nb_sectors) {
+        return -ENOTSUP;
+    }
+    tail = (sector_num + nb_sectors) & (s->cluster_sectors - 1);
+    if (head + tail == nb_sectors) {
+        return -ENOTSUP;
+    }
+    if (s->qcow_version < 3 && bs->backing_hd) {
+        return -ENOTSUP;
+    }
+
+    ret = qcow2_write_zero_sectors(bs, sector_num, head);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_zero_clusters(bs, (sector_num + head) << BDRV_SECTOR_BITS,
+        nb_sectors - head - tail);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_write_zero_sectors(bs, sector_num + nb_sectors - tail, tail);
+}
+
 static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1177,10 +1494,33 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static void qcow2_get_cache_stats(BlockDriverState *bs,
+                                  BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    stats->has_l2_cache_hits = stats->has_l2_cache_misses = true;
+    stats->l2_cache_hits = hits;
+    stats->l2_cache_misses = misses;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    stats->has_refcount_cache_hits = stats->has_refcount_cache_misses = true;
+    stats->refcount_cache_hits = hits;
+    stats->refcount_cache_misses = misses;
+}
+
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result)
 {
-    return qcow2_check_refcounts(bs, result);
+    BDRVQcowState *s = bs->opaque;
+
+    if (!qcow2_need_accurate_refcounts(s)) {
+        fprintf(stderr, "Image was not closed cleanly; its refcounts are "
+                "repaired when it is next opened read-write\n");
+    }
+    return qcow2_check_refcounts(bs, result, false);
 }
 
 #if 0
@@ -1266,6 +1606,16 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_STRING,
         .help = "Preallocation mode (allowed values: off, metadata)"
     },
+    {
+        .name = BLOCK_OPT_COMPAT_LEVEL,
+        .type = OPT_STRING,
+        .help = "Compatibility level (0.10 or 1.1)"
+    },
+    {
+        .name = BLOCK_OPT_LAZY_REFCOUNTS,
+        .type = OPT_FLAG,
+        .help = "Postpone refcount updates"
+    },
     { NULL }
 };
 
@@ -1276,7 +1626,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
     .bdrv_create        = qcow2_create,
-    .bdrv_is_allocated  = qcow2_is_allocated,
+    .bdrv_co_is_allocated = qcow2_co_is_allocated,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1286,6 +1636,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_flush_to_disk  = qcow2_co_flush_to_disk,
 
     .bdrv_co_discard        = qcow2_co_discard,
+    .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
 
@@ -1295,6 +1646,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
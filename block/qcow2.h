@@ -34,6 +34,8 @@
 
 #define QCOW_MAGIC (('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 #define QCOW_VERSION 2
+/* newest version this driver can read and create */
+#define QCOW_MAX_VERSION 3
 
 #define QCOW_CRYPT_NONE 0
 #define QCOW_CRYPT_AES  1
@@ -44,16 +46,25 @@
 #define QCOW_OFLAG_COPIED     (1LL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
 #define QCOW_OFLAG_COMPRESSED (1LL << 62)
+/* The cluster reads as all zeros (version 3 only, not for compressed
+ * clusters).  Zero clusters written by this driver have no storage. */
+#define QCOW_OFLAG_ZERO       (1LL << 0)
 
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of tables in the metadata caches */
 #define L2_CACHE_SIZE 16
+#define REFCOUNT_CACHE_SIZE 4
 
 /* Must be at least 4 to cover all cases of refcount table growth */
-#define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
+#define MIN_L2_CACHE_SIZE 2
+
+/* Upper bound for the cache sizes that can be requested, in bytes */
+#define MAX_CACHE_SIZE (INT_MAX / 2)
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -71,8 +82,30 @@ typedef struct QCowHeader {
     uint32_t refcount_table_clusters;
     uint32_t nb_snapshots;
     uint64_t snapshots_offset;
+
+    /* The following fields are only valid for version >= 3 */
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+
+    uint32_t refcount_order;
+    uint32_t header_length;
 } QCowHeader;
 
+/* size of the version 2 header, which ends with snapshots_offset */
+#define QCOW2_V2_HEADER_SIZE offsetof(QCowHeader, incompatible_features)
+
+/* The refcounts on disk may be stale, set while lazy refcounts are in use */
+#define QCOW2_INCOMPAT_DIRTY            ((uint64_t)1 << 0)
+
+/* Refcount updates are not ordered before the L2 updates that need them */
+#define QCOW2_COMPAT_LAZY_REFCOUNTS     ((uint64_t)1 << 0)
+
+/* Feature bits of version 3 images that this driver knows about */
+#define QCOW2_INCOMPAT_MASK     QCOW2_INCOMPAT_DIRTY
+#define QCOW2_COMPAT_MASK       QCOW2_COMPAT_LAZY_REFCOUNTS
+#define QCOW2_AUTOCLEAR_MASK    0
+
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
     uint32_t l1_size;
@@ -103,6 +136,8 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    QEMUTimer *cache_clean_timer;
+    int cache_clean_interval;
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -127,6 +162,13 @@ typedef struct BDRVQcowState {
     QCowSnapshot *snapshots;
 
     int flags;
+    int qcow_version;
+
+    uint64_t incompatible_features;
+    uint64_t compatible_features;
+    uint64_t autoclear_features;
+    uint32_t header_length;
+    bool use_lazy_refcounts;
 } BDRVQcowState;
 
 /* XXX: use std qcow open function ? */
@@ -155,6 +197,22 @@ typedef struct QCowL2Meta
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
+/* Does the L2 entry describe a cluster that reads as all zeroes? */
+static inline bool qcow2_is_zero_cluster(uint64_t l2_entry)
+{
+    return !(l2_entry & QCOW_OFLAG_COMPRESSED) && (l2_entry & QCOW_OFLAG_ZERO);
+}
+
+/*
+ * Must refcount blocks reach the disk before the tables that reference the
+ * clusters?  Not while the image is marked dirty: an unclean shutdown then
+ * makes the next read-write open rebuild the refcounts anyway.
+ */
+static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
+{
+    return !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY);
+}
+
 static inline int size_to_clusters(BDRVQcowState *s, int64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -178,6 +236,8 @@ static inline int64_t align_offset(int64_t offset, int n)
 /* qcow2.c functions */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
+int qcow2_update_features(BlockDriverState *bs);
+int qcow2_mark_dirty(BlockDriverState *bs);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
@@ -193,7 +253,8 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
-int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res);
+int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                          bool repair);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
@@ -215,6 +276,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset,
+    int nb_sectors);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -244,5 +307,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_clean_unused(Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
 
 #endif
@@ -26,7 +26,33 @@
 
 
 /* posix-aio-compat.c - thread pool based implementation */
+enum {
+    PAIO_QUEUE_RW,      /* reads and writes */
+    PAIO_QUEUE_SYNC,    /* flushes and ioctls */
+    PAIO_QUEUE_MAX,
+};
+
+typedef struct PaioQueueStats {
+    const char *name;
+    int depth;
+    int max_depth;
+    int active;
+    int max_active;
+    uint64_t dispatched;
+    int64_t total_wait_ns;
+    int64_t max_wait_ns;
+} PaioQueueStats;
+
+typedef struct PaioPoolStats {
+    int threads;
+    int idle_threads;
+    int min_threads;
+    int max_threads;
+    PaioQueueStats queues[PAIO_QUEUE_MAX];
+} PaioPoolStats;
+
 int paio_init(void);
+void paio_get_stats(PaioPoolStats *stats);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
@@ -39,5 +65,7 @@ void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx);
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
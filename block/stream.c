@@ -0,0 +1,218 @@
+/*
+ * Image streaming
+ *
+ * Copyright IBM, Corp. 2011
+ *
+ * Authors:
+ *  Stefan Hajnoczi   <stefanha@linux.vnet.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+
+enum {
+    /*
+     * Size of data buffer for populating the image file.  This should be large
+     * enough to process multiple clusters in a single call, so that populating
+     * contiguous regions of the image is efficient.
+     */
+    STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct {
+    int64_t next_slice_time;
+    uint64_t slice_quota;
+    uint64_t dispatched;
+} RateLimit;
+
+/*
+ * Returns 0 and accounts n bytes if they can be copied now, or the time
+ * in ns until the next try
+ */
+static int64_t ratelimit_calculate_delay(RateLimit *limit, uint64_t n)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    uint64_t slices;
+
+    if (limit->next_slice_time <= now) {
+        /* Chunks can be larger than a slice's quota, carry the excess over */
+        slices = (now - limit->next_slice_time) / SLICE_TIME + 1;
+        if (limit->dispatched > slices * limit->slice_quota) {
+            limit->dispatched -= slices * limit->slice_quota;
+        } else {
+            limit->dispatched = 0;
+        }
+        limit->next_slice_time += slices * SLICE_TIME;
+    }
+    if (limit->dispatched < limit->slice_quota) {
+        limit->dispatched += n;
+        return 0;
+    }
+    return limit->next_slice_time - now;
+}
+
+static void ratelimit_set_speed(RateLimit *limit, uint64_t speed)
+{
+    limit->slice_quota = speed / (1000000000ULL / SLICE_TIME);
+}
+
+typedef struct StreamBlockJob {
+    BlockJob common;
+    RateLimit limit;
+} StreamBlockJob;
+
+static int coroutine_fn stream_populate(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        void *buf)
+{
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Copy-on-read the unallocated clusters */
+    return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+/*
+ * Make the image independent of its backing file, now that it no longer
+ * reads anything from it
+ */
+static int coroutine_fn stream_drop_backing_file(BlockDriverState *bs)
+{
+    int ret;
+
+    /* Requests that started before their clusters were copied may still
+     * be reading from the backing file */
+    bdrv_co_wait_for_requests(bs);
+
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_delete(bs->backing_hd);
+        bs->backing_hd = NULL;
+    }
+    return 0;
+}
+
+static void coroutine_fn stream_run(void *opaque)
+{
+    StreamBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end;
+    int ret = 0;
+    int n = 0;
+    void *buf;
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        block_job_complete(&s->common, s->common.len);
+        return;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+
+    /* Turn on copy-on-read for the whole block device so that guest read
+     * requests help us make progress.
+     */
+    bdrv_enable_copy_on_read(bs);
+
+    for (sector_num = 0; sector_num < end; sector_num += n) {
+        uint64_t delay_ns = 0;
+
+wait:
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that qemu_aio_flush() returns.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        ret = bdrv_co_is_allocated(bs, sector_num,
+                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
+        trace_stream_one_iteration(s, sector_num, n, ret);
+        if (ret == 0) {
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                     n * BDRV_SECTOR_SIZE);
+                if (delay_ns > 0) {
+                    /* Recheck cancellation and that sectors are unallocated */
+                    goto wait;
+                }
+            }
+            ret = stream_populate(bs, sector_num, n, buf);
+        }
+        if (ret < 0) {
+            break;
+        }
+        ret = 0;
+
+        /* Publish progress */
+        s->common.offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    bdrv_disable_copy_on_read(bs);
+
+    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+        ret = stream_drop_backing_file(bs);
+    }
+
+    qemu_vfree(buf);
+    block_job_complete(&s->common, ret);
+}
+
+static int stream_set_speed(BlockJob *job, int64_t value)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value);
+    return 0;
+}
+
+static BlockJobType stream_job_type = {
+    .instance_size = sizeof(StreamBlockJob),
+    .job_type      = "stream",
+    .set_speed     = stream_set_speed,
+};
+
+int stream_start(BlockDriverState *bs, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    StreamBlockJob *s;
+    Coroutine *co;
+
+    if (!bs->backing_hd || speed < 0) {
+        return -EINVAL;
+    }
+
+    s = block_job_create(&stream_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY; /* bs must already be in use */
+    }
+    block_job_set_speed(&s->common, speed);
+
+    co = qemu_coroutine_create(stream_run);
+    trace_stream_start(bs, s, co, opaque);
+
+    s->common.co = co;
+    s->common.busy = true;
+    qemu_coroutine_enter(co, s);
+    return 0;
+}
@@ -33,6 +33,7 @@
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
+#define BLOCK_FLAG_LAZY_REFCOUNTS 8
 
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
@@ -43,6 +44,80 @@
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
 #define BLOCK_OPT_SUBFMT        "subformat"
+#define BLOCK_OPT_COMPAT_LEVEL  "compat"
+#define BLOCK_OPT_LAZY_REFCOUNTS "lazy_refcounts"
+
+#define BLOCK_IO_LIMIT_READ     0
+#define BLOCK_IO_LIMIT_WRITE    1
+#define BLOCK_IO_LIMIT_TOTAL    2
+
+/* I/O limits are accounted over slices of this length, in ns */
+#define BLOCK_IO_SLICE_TIME     100000000
+
+typedef struct BlockIOLimit {
+    int64_t bps[3];
+    int64_t iops[3];
+} BlockIOLimit;
+
+typedef struct BdrvTrackedRequest BdrvTrackedRequest;
+
+typedef struct BlockJob BlockJob;
+
+/**
+ * BlockJobType:
+ *
+ * A class type for block job objects.
+ */
+typedef struct BlockJobType {
+    /** Derived BlockJob struct size */
+    size_t instance_size;
+
+    /** String describing the operation, part of query-block-jobs QMP API */
+    const char *job_type;
+
+    /** Optional callback for job types that support setting a speed limit */
+    int (*set_speed)(BlockJob *job, int64_t value);
+} BlockJobType;
+
+/**
+ * BlockJob:
+ *
+ * Long-running operation on a BlockDriverState.
+ */
+struct BlockJob {
+    /** The job type, including the job vtable */
+    const BlockJobType *job_type;
+
+    /** The block device on which the job is operating */
+    BlockDriverState *bs;
+
+    /** The coroutine that executes the job */
+    Coroutine *co;
+
+    /** Set to true if the job should cancel itself */
+    bool cancelled;
+
+    /**
+     * Set to false while the job sleeps in block_job_sleep_ns(), so that
+     * block_job_cancel() can wake it up instead of waiting for the timer.
+     */
+    bool busy;
+
+    /** Offset that is published by the query-block-jobs QMP API */
+    int64_t offset;
+
+    /** Length that is published by the query-block-jobs QMP API */
+    int64_t len;
+
+    /** Speed that was set with block_job_set_speed, in bytes per second */
+    int64_t speed;
+
+    /** The completion function that will be called when the job completes */
+    BlockDriverCompletionFunc *cb;
+
+    /** The opaque value that is passed to the completion function */
+    void *opaque;
+};
 
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
@@ -65,6 +140,9 @@ struct BlockDriver {
     int (*bdrv_create)(const char *filename, QEMUOptionParameter *options);
     int (*bdrv_is_allocated)(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum);
+    /* Same as bdrv_is_allocated, for drivers that may yield to look it up */
+    int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -86,6 +164,12 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
+    /*
+     * Make a range read as zeroes without writing data, if possible.
+     * Returning -ENOTSUP makes the block layer write zeroes instead.
+     */
+    int coroutine_fn (*bdrv_co_write_zeroes)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors);
 
     /*
      * Invalidate any cached meta-data.
@@ -128,6 +212,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    void (*bdrv_get_cache_stats)(BlockDriverState *bs,
+                                 BlockDeviceStats *stats);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -149,6 +235,13 @@ struct BlockDriver {
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
 
+    /*
+     * Requests issued between plug and unplug may be queued and handed to
+     * the host in a single system call on unplug.  Calls nest.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /* List of options for creating images, terminated by name == NULL */
     QEMUOptionParameter *create_options;
 
@@ -219,7 +312,22 @@ struct BlockDriverState {
     /* NOTE: the following infos are only hints for real hardware
        drivers. They are not used by the block driver */
     int cyls, heads, secs, translation;
+    /* metadata cache sizes in bytes for image formats, 0 means default */
+    uint64_t l2_cache_size, refcount_cache_size;
+    int cache_clean_interval;
     BlockErrorAction on_read_error, on_write_error;
+
+    /* I/O throttling, requests over the limits wait in throttled_reqs */
+    BlockIOLimit io_limits;
+    bool io_limits_enabled;
+    CoQueue throttled_reqs;
+    QEMUTimer *block_timer;
+    int64_t slice_start;
+    int64_t slice_end;
+    /* dispatched since slice_start, less what the limits allowed before */
+    double slice_bytes[3];
+    double slice_ios[3];
+
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
@@ -228,8 +336,23 @@ struct BlockDriverState {
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
+
+    /* requests in flight, overlapping ones wait while copy-on-read runs */
+    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    int copy_on_read_in_flight;
+
+    /* if non-zero, reads populate the image from its backing file */
+    int copy_on_read;
+    /* data copied from the backing file by copy-on-read */
+    uint64_t cor_bytes;
+    uint64_t cor_ops;
+
+    /* long-running background operation */
+    BlockJob *job;
 };
 
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+
 struct BlockDriverAIOCB {
     AIOPool *pool;
     BlockDriverState *bs;
@@ -240,6 +363,95 @@ struct BlockDriverAIOCB {
 
 void get_tmp_filename(char *filename, int size);
 
+int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+void coroutine_fn bdrv_co_wait_for_requests(BlockDriverState *bs);
+
+/**
+ * block_job_create:
+ * @job_type: The class object for the newly-created job.
+ * @bs: The block device on which the job runs.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ *
+ * Create a new long-running block device job and return it.  The job
+ * keeps the device in use until block_job_complete() is called.  Returns
+ * NULL if the device is already in use.
+ */
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque);
+
+/**
+ * block_job_complete:
+ * @job: The job being completed.
+ * @ret: The status code.
+ *
+ * Call the completion function that was registered at creation time, and
+ * free @job.
+ */
+void block_job_complete(BlockJob *job, int ret);
+
+/**
+ * block_job_set_speed:
+ * @job: The job to set the speed for.
+ * @value: The new speed limit in bytes per second, 0 for unlimited.
+ *
+ * Returns -ENOTSUP if the job type does not support a speed limit.
+ */
+int block_job_set_speed(BlockJob *job, int64_t value);
+
+/**
+ * block_job_cancel:
+ * @job: The job to be canceled.
+ *
+ * Asynchronously cancel the specified job.  The job notices at its next
+ * iteration and completes with the cancelled flag set.
+ */
+void block_job_cancel(BlockJob *job);
+
+/**
+ * block_job_is_cancelled:
+ * @job: The job being queried.
+ *
+ * Returns whether the job is scheduled for cancellation.
+ */
+bool block_job_is_cancelled(BlockJob *job);
+
+/**
+ * block_job_sleep_ns:
+ * @job: The job that calls the function.
+ * @clock: The clock to sleep on.
+ * @ns: How many nanoseconds to stop for.
+ *
+ * Put the job to sleep (assuming that it wasn't canceled) for @ns
+ * nanoseconds.  Canceling the job will interrupt the wait immediately.
+ * The job must not have any I/O in flight when it calls this.
+ */
+void coroutine_fn block_job_sleep_ns(BlockJob *job, QEMUClock *clock,
+                                     int64_t ns);
+
+/**
+ * block_job_cancel_sync:
+ * @job: The job to be canceled.
+ *
+ * Cancel the job and wait for it to complete.
+ */
+void block_job_cancel_sync(BlockJob *job);
+
+/**
+ * stream_start:
+ * @bs: The active image of the chain to populate.
+ * @speed: The maximum speed in bytes per second, or 0 for unlimited.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ *
+ * Copy every cluster that @bs still takes from its backing file chain into
+ * @bs, then drop the backing file.  Returns -EBUSY if @bs is in use and
+ * -EINVAL if it has no backing file or @speed is negative.
+ */
+int stream_start(BlockDriverState *bs, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
 void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
@@ -15,6 +15,12 @@
 #include "qemu-config.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qmp-commands.h"
+#include "qjson.h"
+#include "trace.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
@@ -199,6 +205,26 @@ void drive_get_ref(DriveInfo *dinfo)
     dinfo->refcount++;
 }
 
+static bool do_check_io_limits(BlockIOLimit *io_limits)
+{
+    bool bps_flag;
+    bool iops_flag;
+
+    assert(io_limits);
+
+    bps_flag  = (io_limits->bps[BLOCK_IO_LIMIT_TOTAL] != 0)
+                 && ((io_limits->bps[BLOCK_IO_LIMIT_READ] != 0)
+                 || (io_limits->bps[BLOCK_IO_LIMIT_WRITE] != 0));
+    iops_flag = (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] != 0)
+                 && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
+                 || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
+    if (bps_flag || iops_flag) {
+        return false;
+    }
+
+    return true;
+}
+
 static int parse_block_error_action(const char *buf, int is_read)
 {
     if (!strcmp(buf, "ignore")) {
@@ -236,6 +262,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    bool copy_on_read;
+    uint64_t l2_cache_size, refcount_cache_size, cache_clean_interval;
+    BlockIOLimit io_limits;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -251,7 +280,47 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     secs  = qemu_opt_get_number(opts, "secs", 0);
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    cache_clean_interval = qemu_opt_get_number(opts, "cache-clean-interval", 0);
+    if (cache_clean_interval > INT_MAX) {
+        error_report("invalid cache-clean-interval %" PRIu64,
+                     cache_clean_interval);
+        return NULL;
+    }
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", false);
+
+    /* disk I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr", 0);
+
+    /* "-1" is parsed with strtoull() and comes out negative here */
+    if (io_limits.bps[BLOCK_IO_LIMIT_TOTAL] < 0 ||
+        io_limits.bps[BLOCK_IO_LIMIT_READ] < 0 ||
+        io_limits.bps[BLOCK_IO_LIMIT_WRITE] < 0 ||
+        io_limits.iops[BLOCK_IO_LIMIT_TOTAL] < 0 ||
+        io_limits.iops[BLOCK_IO_LIMIT_READ] < 0 ||
+        io_limits.iops[BLOCK_IO_LIMIT_WRITE] < 0) {
+        error_report("bps/iops values must be non-negative");
+        return NULL;
+    }
+
+    if (!do_check_io_limits(&io_limits)) {
+        error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
+                     "cannot be used at the same time");
+        return NULL;
+    }
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -465,6 +534,11 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_metadata_cache_hint(dinfo->bdrv, l2_cache_size,
+                                 refcount_cache_size, cache_clean_interval);
+
+    /* disk I/O throttling, enabled when the image is opened */
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
     switch(type) {
     case IF_IDE:
@@ -520,6 +594,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
+    if (copy_on_read) {
+        if (ro) {
+            error_report("copy-on-read is not supported on read-only drives");
+            goto err;
+        }
+        bdrv_flags |= BDRV_O_COPY_ON_READ;
+    }
+
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
     if (ret < 0) {
         error_report("could not open disk image %s: %s",
@@ -609,7 +691,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -737,7 +819,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -784,3 +866,283 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
+                               int64_t bps_wr, int64_t iops, int64_t iops_rd,
+                               int64_t iops_wr, Error **errp)
+{
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
+    io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = iops;
+    io_limits.iops[BLOCK_IO_LIMIT_READ]  = iops_rd;
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] = iops_wr;
+
+    if (bps < 0 || bps_rd < 0 || bps_wr < 0 ||
+        iops < 0 || iops_rd < 0 || iops_wr < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "bps/iops",
+                  "a non-negative value");
+        return;
+    }
+    if (!do_check_io_limits(&io_limits)) {
+        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+        return;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_enable(bs);
+    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
+        bdrv_io_limits_disable(bs);
+    } else if (bs->io_limits_enabled) {
+        /* the queued requests are re-evaluated against the new limits */
+        qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(rt_clock));
+    }
+}
+
+typedef struct {
+    QEMUBH *bh;
+    DriveInfo *dinfo;
+} DrivePutRefBH;
+
+static void drive_put_ref_bh(void *opaque)
+{
+    DrivePutRefBH *s = opaque;
+
+    drive_put_ref(s->dinfo);
+    qemu_bh_delete(s->bh);
+    g_free(s);
+}
+
+/*
+ * Release a drive reference in a BH
+ *
+ * It is not possible to use drive_put_ref() from a callback function when the
+ * callers still need the drive.  In such cases we schedule a BH to release the
+ * reference.
+ */
+static void drive_put_ref_bh_schedule(DriveInfo *dinfo)
+{
+    DrivePutRefBH *s;
+
+    s = g_new(DrivePutRefBH, 1);
+    s->bh = qemu_bh_new(drive_put_ref_bh, s);
+    s->dinfo = dinfo;
+    qemu_bh_schedule(s->bh);
+}
+
+static QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+static void block_job_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    DriveInfo *dinfo;
+    QObject *obj;
+
+    trace_block_job_cb(bs, bs->job, ret);
+
+    assert(bs->job);
+    obj = qobject_from_block_job(bs->job);
+    if (ret < 0) {
+        QDict *dict = qobject_to_qdict(obj);
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(bs->job)) {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_CANCELLED, obj);
+    } else {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_COMPLETED, obj);
+    }
+    qobject_decref(obj);
+
+    dinfo = drive_get_by_blockdev(bs);
+    if (dinfo) {
+        drive_put_ref_bh_schedule(dinfo);
+    }
+}
+
+void qmp_block_stream(const char *device, bool has_speed, int64_t speed,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    DriveInfo *dinfo;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    if (!bs->backing_hd) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "device",
+                  "a device with a backing file");
+        return;
+    }
+    if (has_speed && speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "speed",
+                  "a non-negative value");
+        return;
+    }
+
+    ret = stream_start(bs, has_speed ? speed : 0, block_job_cb, bs);
+    if (ret < 0) {
+        switch (ret) {
+        case -EBUSY:
+            error_set(errp, QERR_DEVICE_IN_USE, device);
+            return;
+        default:
+            error_set(errp, QERR_NOT_SUPPORTED);
+            return;
+        }
+    }
+
+    /*
+     * Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.  The job may already be over at this point; its
+     * reference is only dropped from a BH.
+     */
+    dinfo = drive_get_by_blockdev(bs);
+    if (dinfo) {
+        drive_get_ref(dinfo);
+    }
+
+    trace_qmp_block_stream(bs, bs->job);
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !bs->job) {
+        return NULL;
+    }
+    return bs->job;
+}
+
+void qmp_block_job_set_speed(const char *device, int64_t value, Error **errp)
+{
+    BlockJob *job = find_block_job(device);
+    int ret;
+
+    if (!job) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+
+    ret = block_job_set_speed(job, value);
+    if (ret == -ENOTSUP) {
+        error_set(errp, QERR_NOT_SUPPORTED);
+    } else if (ret < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a non-negative value");
+    }
+}
+
+void qmp_block_job_cancel(const char *device, Error **errp)
+{
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        error_set(errp, QERR_DEVICE_NOT_ACTIVE, device);
+        return;
+    }
+
+    block_job_cancel(job);
+}
+
+static void do_qmp_query_block_jobs_one(void *opaque, BlockDriverState *bs)
+{
+    BlockJobInfoList **prev = opaque;
+    BlockJob *job = bs->job;
+
+    if (job) {
+        BlockJobInfoList *elem;
+        BlockJobInfo *info = g_new(BlockJobInfo, 1);
+        *info = (BlockJobInfo){
+            .type   = g_strdup(job->job_type->job_type),
+            .device = g_strdup(bdrv_get_device_name(bs)),
+            .len    = job->len,
+            .offset = job->offset,
+            .speed  = job->speed,
+        };
+
+        elem = g_new0(BlockJobInfoList, 1);
+        elem->value = info;
+
+        (*prev)->next = elem;
+        *prev = elem;
+    }
+}
+
+BlockJobInfoList *qmp_query_block_jobs(Error **errp)
+{
+    /* Dummy is a fake list element for holding the head pointer */
+    BlockJobInfoList dummy = {};
+    BlockJobInfoList *prev = &dummy;
+    bdrv_iterate(do_qmp_query_block_jobs_one, &prev);
+    return dummy.next;
+}
+
+AioPoolInfo *qmp_query_aio_pool(Error **errp)
+{
+#ifdef CONFIG_POSIX
+    PaioPoolStats stats;
+    AioPoolInfo *info;
+    AioQueueInfoList *prev = NULL;
+    int i;
+
+    paio_get_stats(&stats);
+
+    info = g_malloc0(sizeof(*info));
+    info->threads = stats.threads;
+    info->idle_threads = stats.idle_threads;
+    info->min_threads = stats.min_threads;
+    info->max_threads = stats.max_threads;
+
+    /* Build the list backwards so that it comes out in queue order */
+    for (i = PAIO_QUEUE_MAX - 1; i >= 0; i--) {
+        PaioQueueStats *qs = &stats.queues[i];
+        AioQueueInfoList *elem = g_malloc0(sizeof(*elem));
+
+        elem->value = g_malloc0(sizeof(*elem->value));
+        elem->value->name = g_strdup(qs->name);
+        elem->value->depth = qs->depth;
+        elem->value->max_depth = qs->max_depth;
+        elem->value->active = qs->active;
+        elem->value->max_active = qs->max_active;
+        elem->value->dispatched = qs->dispatched;
+        elem->value->total_wait_ns = qs->total_wait_ns;
+        elem->value->max_wait_ns = qs->max_wait_ns;
+        elem->next = prev;
+        prev = elem;
+    }
+    info->queues = prev;
+    return info;
+#else
+    error_set(errp, QERR_FEATURE_DISABLED, "aio-pool");
+    return NULL;
+#endif
+}
@@ -435,6 +435,7 @@ void cpu_single_step(CPUState *env, int enabled);
 void cpu_reset(CPUState *s);
 int cpu_is_stopped(CPUState *env);
 void run_on_cpu(CPUState *env, void (*func)(void *data), void *data);
+void async_run_on_cpu(CPUState *env, void (*func)(void *data), void *data);
 
 #define CPU_LOG_TB_OUT_ASM (1 << 0)
 #define CPU_LOG_TB_IN_ASM  (1 << 1)
@@ -489,6 +490,9 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     uint8_t *phys_dirty;
+    /* number of pages with MIGRATION_DIRTY_FLAG and DIRTY_RATE_FLAG set */
+    uint64_t migration_dirty_pages;
+    uint64_t rate_dirty_pages;
     QLIST_HEAD(, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
@@ -517,6 +521,29 @@ extern int mem_prealloc;
 #define VGA_DIRTY_FLAG       0x01
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
+#define DIRTY_RATE_FLAG      0x10
+
+/* Keep the page counts of RAMList in sync with a change of dirty flags */
+static inline void cpu_physical_memory_count_dirty(uint8_t old_flags,
+                                                   uint8_t new_flags)
+{
+    uint8_t changed = old_flags ^ new_flags;
+
+    if (changed & MIGRATION_DIRTY_FLAG) {
+        if (new_flags & MIGRATION_DIRTY_FLAG) {
+            ram_list.migration_dirty_pages++;
+        } else {
+            ram_list.migration_dirty_pages--;
+        }
+    }
+    if (changed & DIRTY_RATE_FLAG) {
+        if (new_flags & DIRTY_RATE_FLAG) {
+            ram_list.rate_dirty_pages++;
+        } else {
+            ram_list.rate_dirty_pages--;
+        }
+    }
+}
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
@@ -537,26 +564,34 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    uint8_t *p = &ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+
+    cpu_physical_memory_count_dirty(*p, 0xff);
+    *p = 0xff;
 }
 
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    uint8_t *p = &ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+
+    cpu_physical_memory_count_dirty(*p, *p | dirty_flags);
+    return *p |= dirty_flags;
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
+                                                        ram_addr_t length,
                                                         int dirty_flags)
 {
-    int i, mask, len;
+    ram_addr_t i, len;
+    int mask;
     uint8_t *p;
 
     len = length >> TARGET_PAGE_BITS;
     mask = ~dirty_flags;
     p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
     for (i = 0; i < len; i++) {
+        cpu_physical_memory_count_dirty(p[i], p[i] & mask);
         p[i] &= mask;
     }
 }
@@ -581,6 +616,8 @@ int cpu_physical_log_stop(target_phys_addr_t start_addr,
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 #endif /* !CONFIG_USER_ONLY */
 
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
                         uint8_t *buf, int len, int is_write);
 
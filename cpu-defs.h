@@ -78,9 +78,20 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* Words of CPU configuration that translated code depends on besides
+   the TB flags, see cpu_get_tb_cache_key() */
+#define TB_CACHE_KEY_WORDS 8
+
 #if !defined(CONFIG_USER_ONLY)
+/* The TLB size is fixed at build time: every TCG backend emits
+   CPU_TLB_SIZE and the tlb_table offsets as constants in the fast path,
+   so it cannot be resized per CPU or at run time.  Conflict misses are
+   absorbed by the victim TLB instead.  */
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Fully associative victim TLB, holding entries recently evicted from
+   the direct mapped TLB above.  It is only searched on the slow path.  */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -114,8 +125,15 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index; /* next victim slot to replace */          \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* statistics, reported by "info jit" */                            \
+    uint64_t tlb_fill_count;                                            \
+    uint64_t tlb_victim_hit_count;                                      \
+    uint64_t tlb_page_flush_count;
 
 #else
 
@@ -169,6 +187,10 @@ typedef struct CPUWatchpoint {
     volatile sig_atomic_t exit_request;                                 \
     CPU_COMMON_TLB                                                      \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
+    /* TB exit statistics, reported by "info jit" */                    \
+    uint64_t tb_exit_count; /* returns to the cpu_exec() loop */        \
+    uint64_t tb_lookup_hit_count; /* goto_ptr lookups from TCG code */  \
+    uint64_t tb_lookup_miss_count;                                      \
     /* buffer for temporaries in the code generator */                  \
     long temp_buf[CPU_TEMP_BUF_NLONGS];                                 \
                                                                         \
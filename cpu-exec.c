@@ -153,6 +153,37 @@ static inline TranslationBlock *tb_find_fast(CPUState *env)
     return tb;
 }
 
+/* Called from generated code at the end of a TB whose successor is not
+   known at translation time (indirect jumps, returns, jumps to another
+   page).  Returns the host code of the next TB if it is in the jump
+   cache, or the TCG epilogue to go back to cpu_exec(), which also takes
+   care of interrupts, exit requests and translation.  */
+void *tb_lookup_ptr(CPUState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        env->tb_lookup_miss_count++;
+        return tcg_ctx.code_gen_epilogue;
+    }
+
+    /* As in cpu_exec(), make the TB current before checking for
+       requests, so that cpu_unlink_tb() can break a loop it enters.  */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(env->exit_request || env->interrupt_request)) {
+        env->tb_lookup_miss_count++;
+        return tcg_ctx.code_gen_epilogue;
+    }
+    env->tb_lookup_hit_count++;
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -564,6 +595,7 @@ int cpu_exec(CPUState *env)
                     tc_ptr = tb->tc_ptr;
                 /* execute the generated code */
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
+                    env->tb_exit_count++;
                     if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
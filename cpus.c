@@ -396,7 +396,7 @@ static void do_vm_stop(RunState state)
         pause_all_vcpus();
         runstate_set(state);
         vm_state_notify(0, state);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
@@ -638,6 +638,7 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
 
     wi.func = func;
     wi.data = data;
+    wi.free = false;
     if (!env->queued_work_first) {
         env->queued_work_first = &wi;
     } else {
@@ -656,6 +657,32 @@ void run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
     }
 }
 
+/* Like run_on_cpu(), but does not wait for @func to complete */
+void async_run_on_cpu(CPUState *env, void (*func)(void *data), void *data)
+{
+    struct qemu_work_item *wi;
+
+    if (qemu_cpu_is_self(env)) {
+        func(data);
+        return;
+    }
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    if (!env->queued_work_first) {
+        env->queued_work_first = wi;
+    } else {
+        env->queued_work_last->next = wi;
+    }
+    env->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+
+    qemu_cpu_kick(env);
+}
+
 static void flush_queued_work(CPUState *env)
 {
     struct qemu_work_item *wi;
@@ -667,7 +694,11 @@ static void flush_queued_work(CPUState *env)
     while ((wi = env->queued_work_first)) {
         env->queued_work_first = wi->next;
         wi->func(wi->data);
-        wi->done = true;
+        if (wi->free) {
+            g_free(wi);
+        } else {
+            wi->done = true;
+        }
     }
     env->queued_work_last = NULL;
     qemu_cond_broadcast(&qemu_work_cond);
@@ -852,6 +883,90 @@ void qemu_mutex_unlock_iothread(void)
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+/* vCPU throttling, used by migration auto-converge.  Every vCPU runs for a
+   timeslice and then sleeps long enough to spend the requested percentage
+   of its time off the host CPU. */
+
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *self_env = cpu_single_env;
+    double pct;
+    long sleeptime_us;
+
+    if (!throttle_percentage) {
+        return;
+    }
+
+    pct = (double)throttle_percentage / 100;
+    sleeptime_us = pct / (1 - pct) * (CPU_THROTTLE_TIMESLICE_NS / 1000);
+
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleeptime_us);
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu_single_env = self_env;
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+
+    /* with TCG a single thread runs all the vCPUs */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        async_run_on_cpu(env, cpu_throttle_thread, NULL);
+        if (!kvm_enabled()) {
+            break;
+        }
+    }
+
+    pct = (double)throttle_percentage / 100;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    throttle_percentage = new_throttle_pct;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *penv = first_cpu;
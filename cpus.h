@@ -7,6 +7,11 @@ void resume_all_vcpus(void);
 void pause_all_vcpus(void);
 void cpu_stop_current(void);
 
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
+
 void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
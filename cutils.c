@@ -298,6 +298,28 @@ void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
     }
 }
 
+/*
+ * Checks if a buffer is all zeroes
+ *
+ * The buffer must be long-aligned and its length a multiple of four longs,
+ * which any whole number of sectors is.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    const long *p = buf;
+    size_t i;
+
+    assert((uintptr_t)buf % sizeof(long) == 0);
+    assert(len % (4 * sizeof(long)) == 0);
+
+    for (i = 0; i < len / sizeof(long); i += 4) {
+        if (p[i] | p[i + 1] | p[i + 2] | p[i + 3]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -91,17 +91,22 @@ void cpu_io_recompile(CPUState *env, void *retaddr);
 TranslationBlock *tb_gen_code(CPUState *env, 
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr);
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size);
 void cpu_exec_init(CPUState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUState *env1);
 int page_unprotect(target_ulong address, unsigned long pc, void *puc);
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
                                    int is_cpu_write_access);
+void *tb_lookup_ptr(CPUState *env);
 void tlb_flush_page(CPUState *env, target_ulong addr);
 void tlb_flush(CPUState *env, int flush_global);
 #if !defined(CONFIG_USER_ONLY)
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool tlb_victim_hit(CPUState *env, int mmu_idx, int index, size_t elt_ofs,
+                    target_ulong page);
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
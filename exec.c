@@ -101,7 +101,7 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
     __attribute__((aligned (32)))
 #endif
 
-uint8_t code_gen_prologue[1024] code_gen_section;
+uint8_t code_gen_prologue[CODE_GEN_PROLOGUE_SIZE] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
@@ -986,7 +986,7 @@ TranslationBlock *tb_gen_code(CPUState *env,
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
-    int code_gen_size;
+    int code_gen_size, cached;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
@@ -1003,7 +1003,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    cached = tb_cache_load(env, tb, &code_gen_size);
+    if (!cached) {
+        cpu_gen_code(env, tb, &code_gen_size);
+    }
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
     /* check next page if needed */
@@ -1012,6 +1015,9 @@ TranslationBlock *tb_gen_code(CPUState *env,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+    if (!cached) {
+        tb_cache_add(env, tb, code_gen_size);
+    }
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
@@ -2005,6 +2011,13 @@ void tlb_flush(CPUState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    env->vtlb_index = 0;
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -2025,6 +2038,17 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+/* Drop any victim TLB entry for the page at addr in one MMU mode */
+static inline void tlb_flush_vtlb_page(CPUState *env, int mmu_idx,
+                                       target_ulong addr)
+{
+    int k;
+
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+    }
+}
+
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
     int i;
@@ -2049,10 +2073,13 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_vtlb_page(env, mmu_idx, addr);
+    }
 
     tlb_flush_jmp_cache(env, addr);
+    env->tlb_page_flush_count++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -2116,6 +2143,10 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
             for(i = 0; i < CPU_TLB_SIZE; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -2195,6 +2226,9 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
+        }
     }
 }
 
@@ -2208,13 +2242,17 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int i, k;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2240,6 +2278,53 @@ static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
     env->tlb_flush_mask = mask;
 }
 
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+static inline bool tlb_entry_maps_page(const CPUTLBEntry *te,
+                                       target_ulong page)
+{
+    return page == (te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+/* Called from the softmmu slow path when the direct mapped TLB misses.
+   elt_ofs selects the addr_read, addr_write or addr_code comparator.
+   On a victim hit the entry is swapped back into the main TLB, so the
+   caller can simply retry the lookup.  */
+bool tlb_victim_hit(CPUState *env, int mmu_idx, int index, size_t elt_ofs,
+                    target_ulong page)
+{
+    int vidx;
+
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if (page == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry *tlb = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmptlb;
+            target_phys_addr_t tmpio;
+
+            tmptlb = *tlb;
+            *tlb = *vtlb;
+            *vtlb = tmptlb;
+
+            tmpio = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpio;
+
+            env->tlb_victim_hit_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
    is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
    supplied size is only used by tlb_flush_page.  */
@@ -2316,8 +2401,23 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* At most one entry per virtual page, so drop a stale victim copy
+       (e.g. a read-only mapping that is being upgraded for writing).  */
+    tlb_flush_vtlb_page(env, mmu_idx, vaddr);
+
+    /* Keep the entry we are replacing around in the victim TLB, unless
+       it is empty or maps the same page.  */
+    if (!tlb_entry_is_empty(te) && !tlb_entry_maps_page(te, vaddr)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    env->tlb_fill_count++;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2989,6 +3089,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0xff, size >> TARGET_PAGE_BITS);
+    ram_list.migration_dirty_pages += size >> TARGET_PAGE_BITS;
+    ram_list.rate_dirty_pages += size >> TARGET_PAGE_BITS;
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -3007,6 +3109,10 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
+            /* drop the block's pages from the dirty page counts */
+            cpu_physical_memory_mask_dirty_range(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG |
+                                                 DIRTY_RATE_FLAG);
             QLIST_REMOVE(block, next);
             g_free(block);
             return;
@@ -3020,6 +3126,10 @@ void qemu_ram_free(ram_addr_t addr)
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
+            /* drop the block's pages from the dirty page counts */
+            cpu_physical_memory_mask_dirty_range(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG |
+                                                 DIRTY_RATE_FLAG);
             QLIST_REMOVE(block, next);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
@@ -4725,6 +4835,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
     TranslationBlock *tb;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -4769,6 +4880,29 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        uint64_t lookups = env->tlb_fill_count + env->tlb_victim_hit_count;
+
+        cpu_fprintf(f, "CPU #%d TLB refills %" PRIu64
+                    " victim hits %" PRIu64 " (%d%%) page flushes %" PRIu64
+                    "\n", env->cpu_index, env->tlb_fill_count,
+                    env->tlb_victim_hit_count,
+                    lookups ? (int)(env->tlb_victim_hit_count * 100 /
+                                    lookups) : 0,
+                    env->tlb_page_flush_count);
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        uint64_t lookups = env->tb_lookup_hit_count +
+                           env->tb_lookup_miss_count;
+
+        cpu_fprintf(f, "CPU #%d TB exits %" PRIu64
+                    " goto_ptr lookups %" PRIu64 " (%d%% hit)\n",
+                    env->cpu_index, env->tb_exit_count, lookups,
+                    lookups ? (int)(env->tb_lookup_hit_count * 100 /
+                                    lookups) : 0);
+    }
+    tcg_dump_opt_info(f, cpu_fprintf);
+    tb_cache_dump_info(f, cpu_fprintf);
 #ifdef CONFIG_PROFILER
     tcg_dump_info(f, cpu_fprintf);
 #endif
@@ -70,6 +70,63 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .mhandler.cmd = hmp_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy data from a backing file into a block device",
+        .mhandler.cmd = hmp_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy data from the backing file chain of @var{device} into its image in the
+background, at most @var{speed} bytes per second, then drop the backing file.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .mhandler.cmd = hmp_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set maximum speed for a background block operation.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active block streaming operation",
+        .mhandler.cmd = hmp_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop an active block streaming operation.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -815,6 +872,98 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .mhandler.cmd = hmp_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration: @code{compress-level},
+@code{compress-threads}, @code{decompress-threads} or
+@code{multifd-channels}.
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Switch the running migration to postcopy",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch the running migration to postcopy.  The guest resumes on the
+destination, which fetches missing pages on demand.  The postcopy-ram
+capability has to be enabled.
+ETEXI
+
+    {
+        .name       = "dirty_rate_start",
+        .args_type  = "period:i?",
+        .params     = "[period]",
+        .help       = "start measuring the guest dirty rate, with periods of "
+                      "'period' milliseconds (default 1000)",
+        .mhandler.cmd = hmp_dirty_rate_start,
+    },
+
+STEXI
+@item dirty_rate_start [@var{period}]
+@findex dirty_rate_start
+Start measuring the rate at which the guest dirties its memory, with periods
+of @var{period} milliseconds.  The result is shown by @code{info dirty_rate}.
+ETEXI
+
+    {
+        .name       = "dirty_rate_stop",
+        .args_type  = "",
+        .params     = "",
+        .help       = "stop measuring the guest dirty rate",
+        .mhandler.cmd = hmp_dirty_rate_stop,
+    },
+
+STEXI
+@item dirty_rate_stop
+@findex dirty_rate_stop
+Stop the measurement started with @code{dirty_rate_start}.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations, "
+                      "the cache size will be rounded down to a whole number "
+                      "of target pages",
+        .mhandler.cmd = hmp_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for xbzrle migrations.
 ETEXI
 
     {
@@ -934,7 +1083,7 @@ ETEXI
     {
         .name       = "host_net_add",
         .args_type  = "device:s,opts:s?",
-        .params     = "tap|user|socket|vde|dump [options]",
+        .params     = "tap|user|socket|vde|packet|dump [options]",
         .help       = "add host VLAN client",
         .mhandler.cmd = net_host_device_add,
     },
@@ -1303,6 +1452,12 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
+@item info aio-pool
+show asynchronous I/O thread pool statistics
+@item info vhost
+show vhost-net backend statistics
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1353,6 +1508,14 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
+@item info migrate_cache_size
+show current migration xbzrle cache size
+@item info dirty_rate
+show the guest dirty rate
 @item info balloon
 show balloon information
 @item info qtree
@@ -131,6 +131,10 @@ void hmp_info_migrate(Monitor *mon)
                        info->ram->remaining >> 10);
         monitor_printf(mon, "total ram: %" PRIu64 " kbytes\n",
                        info->ram->total >> 10);
+        if (info->ram->has_dirty_pages_rate) {
+            monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages/s\n",
+                           info->ram->dirty_pages_rate);
+        }
     }
 
     if (info->has_disk) {
@@ -142,9 +146,94 @@ void hmp_info_migrate(Monitor *mon)
                        info->disk->total >> 10);
     }
 
+    if (info->has_downtime) {
+        monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
+                       info->downtime);
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_xbzrle_cache) {
+        monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
+                       info->xbzrle_cache->cache_size);
+        monitor_printf(mon, "xbzrle transferred: %" PRIu64 " kbytes\n",
+                       info->xbzrle_cache->bytes >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
+                       info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle saved: %" PRIu64 " kbytes\n",
+                       info->xbzrle_cache->bytes_saved >> 10);
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
+void hmp_info_migrate_capabilities(Monitor *mon)
+{
+    MigrationCapabilityStatusList *caps, *cap;
+
+    caps = qmp_query_migrate_capabilities(NULL);
+
+    monitor_printf(mon, "capabilities: ");
+    for (cap = caps; cap; cap = cap->next) {
+        monitor_printf(mon, "%s: %s ",
+                       MigrationCapability_lookup[cap->value->capability],
+                       cap->value->state ? "on" : "off");
+    }
+    monitor_printf(mon, "\n");
+
+    qapi_free_MigrationCapabilityStatusList(caps);
+}
+
+void hmp_info_migrate_parameters(Monitor *mon)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    monitor_printf(mon, "compress-level: %" PRId64 "\n",
+                   params->compress_level);
+    monitor_printf(mon, "compress-threads: %" PRId64 "\n",
+                   params->compress_threads);
+    monitor_printf(mon, "decompress-threads: %" PRId64 "\n",
+                   params->decompress_threads);
+    monitor_printf(mon, "multifd-channels: %" PRId64 "\n",
+                   params->multifd_channels);
+
+    qapi_free_MigrationParameters(params);
+}
+
+void hmp_info_dirty_rate(Monitor *mon)
+{
+    DirtyRateInfo *info;
+
+    info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Dirty rate measurement: %s\n",
+                   info->active ? "active" : "inactive");
+    monitor_printf(mon, "period: %" PRId64 " ms\n", info->period);
+    if (info->has_pages_rate) {
+        monitor_printf(mon, "dirty pages rate: %" PRId64 " pages/s\n",
+                       info->pages_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
+void hmp_info_migrate_cache_size(Monitor *mon)
+{
+    monitor_printf(mon, "xbzrle cache size: %" PRId64 " kbytes\n",
+                   qmp_query_migrate_cache_size(NULL) >> 10);
+}
+
 void hmp_info_cpus(Monitor *mon)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -246,6 +335,8 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " cor_bytes=%" PRId64
+                       " cor_operations=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -254,12 +345,144 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->cor_bytes,
+                       stats->value->stats->cor_operations);
+        if (stats->value->stats->has_l2_cache_hits) {
+            monitor_printf(mon, "    l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64
+                           " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64 "\n",
+                           stats->value->stats->l2_cache_hits,
+                           stats->value->stats->l2_cache_misses,
+                           stats->value->stats->refcount_cache_hits,
+                           stats->value->stats->refcount_cache_misses);
+        }
+        if (stats->value->stats->has_bps) {
+            monitor_printf(mon, "    bps=%" PRId64
+                           " bps_rd=%" PRId64
+                           " bps_wr=%" PRId64
+                           " iops=%" PRId64
+                           " iops_rd=%" PRId64
+                           " iops_wr=%" PRId64 "\n",
+                           stats->value->stats->bps,
+                           stats->value->stats->bps_rd,
+                           stats->value->stats->bps_wr,
+                           stats->value->stats->iops,
+                           stats->value->stats->iops_rd,
+                           stats->value->stats->iops_wr);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
 }
 
+void hmp_info_block_jobs(Monitor *mon)
+{
+    BlockJobInfoList *list, *jobs;
+    Error *err = NULL;
+
+    jobs = qmp_query_block_jobs(&err);
+    assert(!err);
+
+    if (!jobs) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+
+    for (list = jobs; list; list = list->next) {
+        if (strcmp(list->value->type, "stream") == 0) {
+            monitor_printf(mon, "Streaming device %s: Completed %" PRId64
+                           " of %" PRId64 " bytes, speed limit %" PRId64
+                           " bytes/s\n",
+                           list->value->device,
+                           list->value->offset,
+                           list->value->len,
+                           list->value->speed);
+        } else {
+            monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
+                           " of %" PRId64 " bytes, speed limit %" PRId64
+                           " bytes/s\n",
+                           list->value->type,
+                           list->value->device,
+                           list->value->offset,
+                           list->value->len,
+                           list->value->speed);
+        }
+    }
+
+    qapi_free_BlockJobInfoList(jobs);
+}
+
+void hmp_info_aio_pool(Monitor *mon)
+{
+    AioPoolInfo *info;
+    AioQueueInfoList *queue;
+    Error *err = NULL;
+
+    info = qmp_query_aio_pool(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "threads: %" PRId64 " (%" PRId64 " idle, min %"
+                   PRId64 ", max %" PRId64 ")\n", info->threads,
+                   info->idle_threads, info->min_threads, info->max_threads);
+
+    for (queue = info->queues; queue; queue = queue->next) {
+        AioQueueInfo *q = queue->value;
+
+        monitor_printf(mon, "%s: depth=%" PRId64 " max_depth=%" PRId64
+                       " active=%" PRId64 " max_active=%" PRId64
+                       " dispatched=%" PRId64 " avg_wait_ns=%" PRId64
+                       " max_wait_ns=%" PRId64 "\n",
+                       q->name, q->depth, q->max_depth, q->active,
+                       q->max_active, q->dispatched,
+                       q->dispatched ? q->total_wait_ns / q->dispatched : 0,
+                       q->max_wait_ns);
+    }
+
+    qapi_free_AioPoolInfo(info);
+}
+
+void hmp_info_vhost(Monitor *mon)
+{
+    VhostInfoList *list, *entry;
+    VhostQueueInfoList *queue;
+
+    list = qmp_query_vhost(NULL);
+    if (!list) {
+        monitor_printf(mon, "No vhost-net backends\n");
+        return;
+    }
+
+    for (entry = list; entry; entry = entry->next) {
+        VhostInfo *info = entry->value;
+
+        monitor_printf(mon, "%s: %s%s%s\n", info->netdev,
+                       info->started ? "started" : "stopped",
+                       info->fallback ? ", fell back to userspace" : "",
+                       info->zerocopy ? ", zerocopy" : "");
+
+        for (queue = info->queues; queue; queue = queue->next) {
+            VhostQueueInfo *q = queue->value;
+
+            monitor_printf(mon, "    vq %" PRId64 ": size=%" PRId64
+                           " pending=%" PRId64,
+                           q->index, q->size, q->pending);
+            if (q->has_kicks && q->has_calls) {
+                monitor_printf(mon, " kicks=%" PRId64 " calls=%" PRId64,
+                               q->kicks, q->calls);
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    qapi_free_VhostInfoList(list);
+}
+
 void hmp_info_vnc(Monitor *mon)
 {
     VncInfo *info;
@@ -521,3 +744,150 @@ void hmp_cpu(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "invalid CPU index\n");
     }
 }
+
+void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
+{
+    const char *cap = qdict_get_str(qdict, "capability");
+    bool state = qdict_get_bool(qdict, "state");
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; i < MIGRATION_CAPABILITY_MAX; i++) {
+        if (strcmp(cap, MigrationCapability_lookup[i]) == 0) {
+            qmp_migrate_set_capability(i, state, &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_CAPABILITY_MAX) {
+        monitor_printf(mon, "Invalid capability %s\n", cap);
+    } else if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0,
+                                   false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0,
+                                   false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value,
+                                   false, 0, &err);
+    } else if (strcmp(param, "multifd-channels") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   true, value, &err);
+    } else {
+        monitor_printf(mon, "Invalid parameter %s\n", param);
+        return;
+    }
+
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_dirty_rate_start(Monitor *mon, const QDict *qdict)
+{
+    bool has_period = qdict_haskey(qdict, "period");
+    int64_t period = qdict_get_try_int(qdict, "period", 0);
+    Error *err = NULL;
+
+    qmp_dirty_rate_start(has_period, period, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_dirty_rate_stop(Monitor *mon, const QDict *qdict)
+{
+    qmp_dirty_rate_stop(NULL);
+}
+
+void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_cache_size(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_block_set_io_throttle(qdict_get_str(qdict, "device"),
+                              qdict_get_int(qdict, "bps"),
+                              qdict_get_int(qdict, "bps_rd"),
+                              qdict_get_int(qdict, "bps_wr"),
+                              qdict_get_int(qdict, "iops"),
+                              qdict_get_int(qdict, "iops_rd"),
+                              qdict_get_int(qdict, "iops_wr"), &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_block_stream(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+
+    qmp_block_stream(device, qdict_haskey(qdict, "speed"), speed, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_block_job_set_speed(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+
+    qmp_block_job_set_speed(device, value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+void hmp_block_job_cancel(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *device = qdict_get_str(qdict, "device");
+
+    qmp_block_job_cancel(device, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
@@ -0,0 +1,184 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hostmem.h"
+
+/* Drops the mappings of [start, start + size), splitting regions as needed */
+static void hostmem_unassign(HostMem *hostmem, target_phys_addr_t start,
+                             target_phys_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    size_t i = 0;
+
+    while (i < hostmem->num_regions) {
+        HostMemRegion *reg = &hostmem->regions[i];
+        target_phys_addr_t reg_end = reg->guest_addr + reg->size;
+
+        if (reg_end <= start || reg->guest_addr >= end) {
+            i++;
+            continue;
+        }
+
+        if (reg->guest_addr < start && reg_end > end) {
+            /* Punch a hole into the region */
+            HostMemRegion tail = {
+                .guest_addr = end,
+                .size = reg_end - end,
+                .host_addr = (uint8_t *)reg->host_addr +
+                             (end - reg->guest_addr),
+                .readonly = reg->readonly,
+            };
+
+            reg->size = start - reg->guest_addr;
+            hostmem->regions = g_realloc(hostmem->regions,
+                                         (hostmem->num_regions + 1) *
+                                         sizeof(hostmem->regions[0]));
+            memmove(&hostmem->regions[i + 2], &hostmem->regions[i + 1],
+                    (hostmem->num_regions - i - 1) *
+                    sizeof(hostmem->regions[0]));
+            hostmem->regions[i + 1] = tail;
+            hostmem->num_regions++;
+            return;
+        }
+
+        if (reg->guest_addr < start) {
+            /* Drop the end of the region */
+            reg->size = start - reg->guest_addr;
+            i++;
+        } else if (reg_end > end) {
+            /* Drop the start of the region */
+            reg->host_addr = (uint8_t *)reg->host_addr +
+                             (end - reg->guest_addr);
+            reg->size = reg_end - end;
+            reg->guest_addr = end;
+            i++;
+        } else {
+            /* The whole region goes away */
+            memmove(reg, reg + 1, (hostmem->num_regions - i - 1) *
+                    sizeof(hostmem->regions[0]));
+            hostmem->num_regions--;
+        }
+    }
+}
+
+static void hostmem_assign(HostMem *hostmem, const HostMemRegion *new)
+{
+    size_t i;
+
+    for (i = 0; i < hostmem->num_regions; i++) {
+        if (hostmem->regions[i].guest_addr > new->guest_addr) {
+            break;
+        }
+    }
+
+    hostmem->regions = g_realloc(hostmem->regions,
+                                 (hostmem->num_regions + 1) *
+                                 sizeof(hostmem->regions[0]));
+    memmove(&hostmem->regions[i + 1], &hostmem->regions[i],
+            (hostmem->num_regions - i) * sizeof(hostmem->regions[0]));
+    hostmem->regions[i] = *new;
+    hostmem->num_regions++;
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      bool log_dirty)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&hostmem->lock);
+    hostmem_unassign(hostmem, start_addr, size);
+    if (!log_dirty && (flags == IO_MEM_RAM || flags == IO_MEM_ROM)) {
+        HostMemRegion reg = {
+            .guest_addr = start_addr,
+            .size = size,
+            .host_addr = qemu_get_ram_ptr(phys_offset & TARGET_PAGE_MASK),
+            .readonly = flags == IO_MEM_ROM,
+        };
+
+        hostmem_assign(hostmem, &reg);
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+
+    if (hostmem->migration_log) {
+        hostmem->migration_log(hostmem, enable);
+    }
+    return 0;
+}
+
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len, bool is_write)
+{
+    HostMemRegion *reg = NULL;
+    void *host_addr = NULL;
+    size_t lo, hi;
+
+    qemu_mutex_lock(&hostmem->lock);
+
+    /* Binary search for the last region starting at or below phys */
+    lo = 0;
+    hi = hostmem->num_regions;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (hostmem->regions[mid].guest_addr <= phys) {
+            reg = &hostmem->regions[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (reg && phys - reg->guest_addr < reg->size &&
+        len <= reg->size - (phys - reg->guest_addr) &&
+        !(is_write && reg->readonly)) {
+        host_addr = (uint8_t *)reg->host_addr + (phys - reg->guest_addr);
+    }
+
+    qemu_mutex_unlock(&hostmem->lock);
+    return host_addr;
+}
+
+void hostmem_init(HostMem *hostmem,
+                  void (*migration_log)(HostMem *hostmem, bool enable))
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->lock);
+    hostmem->migration_log = migration_log;
+
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    hostmem->client.log_start = NULL;
+    hostmem->client.log_stop = NULL;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->lock);
+    g_free(hostmem->regions);
+    hostmem->regions = NULL;
+    hostmem->num_regions = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "qemu-common.h"
+#include "cpu-common.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    target_phys_addr_t guest_addr;
+    target_phys_addr_t size;
+    void *host_addr;
+    bool readonly;
+} HostMemRegion;
+
+typedef struct HostMem HostMem;
+
+/*
+ * A copy of the guest RAM layout that can be looked up without holding the
+ * global mutex.  Only RAM and ROM are included, MMIO and regions with dirty
+ * logging enabled cannot be accessed through a host pointer.
+ */
+struct HostMem {
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+
+    /* Sorted by guest address, protected by lock */
+    HostMemRegion *regions;
+    size_t num_regions;
+
+    /* Called with the global mutex held when migration starts or stops
+     * logging dirty memory.  Writes through a host pointer are not logged. */
+    void (*migration_log)(HostMem *hostmem, bool enable);
+};
+
+void hostmem_init(HostMem *hostmem,
+                  void (*migration_log)(HostMem *hostmem, bool enable));
+void hostmem_finalize(HostMem *hostmem);
+
+/*
+ * Return a host pointer to guest memory [phys, phys + len) or NULL if the
+ * range is not contiguous guest RAM, or it is ROM and is_write is set
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len, bool is_write);
+
+#endif /* HOSTMEM_H */
@@ -0,0 +1,616 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * Requests are taken off the vring and submitted with Linux AIO straight to
+ * the image file descriptor by a thread that never takes the global mutex.
+ * Guest kicks arrive through the ioeventfd and completions are signalled
+ * through the guest notifier (an irqfd when running under KVM).
+ *
+ * Only raw images opened with cache=none,aio=native are supported.  Block
+ * layer features such as werror/rerror, I/O accounting, throttling, image
+ * formats and block jobs are bypassed, which is why this is opt-in.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <libaio.h>
+#include <poll.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "event_notifier.h"
+#include "iov.h"
+#include "kvm.h"
+#include "hw/virtio-blk.h"
+#include "hostmem.h"
+#include "vring.h"
+#include "virtio-blk.h"
+
+//#define DEBUG_DATA_PLANE
+
+#ifdef DEBUG_DATA_PLANE
+#define DPRINTF(fmt, ...) \
+    do { printf("virtio-blk dataplane: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VRING_MAX,            /* maximum number of requests in flight,
+                                     * the vring has one slot per request */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    unsigned int head;              /* vring descriptor index */
+    unsigned char *status;          /* virtio block status byte */
+    size_t size;                    /* bytes to transfer */
+    bool is_read;
+    void *bounce;                   /* aligned copy of unaligned guest data */
+    struct iovec *read_iov;         /* guest buffers to fill from bounce */
+    unsigned int read_niov;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    BlockDriverState *bs;
+    int fd;                         /* image file descriptor */
+    const char *serial;
+    unsigned int logical_block_size;
+    unsigned short sector_mask;
+
+    bool requested;                 /* the device wants the thread running */
+    bool migration_logging;         /* dirty logging forces the slow path */
+    bool started;
+    bool stopping;
+    QemuThread thread;
+
+    HostMem hostmem;                /* guest memory mapper */
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    EventNotifier *host_notifier;   /* ioeventfd */
+    EventNotifier io_notifier;      /* Linux AIO completion */
+    EventNotifier stop_notifier;    /* wakes the thread for shutdown */
+
+    io_context_t io_ctx;
+    struct iocb *iocbs[REQ_MAX];    /* requests waiting for io_submit() */
+    unsigned int num_iocbs;
+    unsigned int num_reqs;          /* requests in flight */
+    VirtIOBlockRequest requests[REQ_MAX];
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!vring_should_notify(s->vdev, &s->vring)) {
+        return;
+    }
+
+    event_notifier_set(s->guest_notifier);
+}
+
+static void complete_request(VirtIOBlockDataPlane *s,
+                             VirtIOBlockRequest *req, long ret)
+{
+    unsigned char status = VIRTIO_BLK_S_OK;
+    size_t len = 0;
+
+    if (ret < 0 || ret != req->size) {
+        DPRINTF("request %u failed: %ld\n", req->head, ret);
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (req->is_read) {
+        len = req->size;
+        if (req->bounce) {
+            iov_from_buf(req->read_iov, req->read_niov, req->bounce,
+                         0, req->size);
+        }
+    }
+
+    if (req->bounce) {
+        qemu_vfree(req->bounce);
+        g_free(req->read_iov);
+        req->bounce = NULL;
+        req->read_iov = NULL;
+    }
+
+    *req->status = status;
+
+    /* The status byte is written too */
+    vring_push(&s->vring, req->head, len + sizeof(status));
+    s->num_reqs--;
+}
+
+/* Complete a request that did not need to go through Linux AIO */
+static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+                                   unsigned char *status,
+                                   unsigned char status_code, size_t len)
+{
+    *status = status_code;
+    vring_push(&s->vring, head, len + sizeof(*status));
+}
+
+static void submit_iocbs(VirtIOBlockDataPlane *s)
+{
+    unsigned int done = 0;
+    int ret;
+
+    while (done < s->num_iocbs) {
+        ret = io_submit(s->io_ctx, s->num_iocbs - done, &s->iocbs[done]);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            error_report("virtio-blk io_submit failed: %s", strerror(-ret));
+            for (; done < s->num_iocbs; done++) {
+                complete_request(s, container_of(s->iocbs[done],
+                                                 VirtIOBlockRequest, iocb),
+                                 ret);
+            }
+            break;
+        }
+        done += ret;
+    }
+    s->num_iocbs = 0;
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int niov,
+                           unsigned int align)
+{
+    unsigned int i;
+
+    for (i = 0; i < niov; i++) {
+        if ((uintptr_t)iov[i].iov_base % align || iov[i].iov_len % align) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, bool is_read,
+                        struct iovec *iov, unsigned int niov,
+                        uint64_t sector, unsigned int head,
+                        unsigned char *status)
+{
+    VirtIOBlockRequest *req = &s->requests[head];
+    size_t size = iov_size(iov, niov);
+    off_t offset = sector * BDRV_SECTOR_SIZE;
+
+    if ((sector & s->sector_mask) || size % s->logical_block_size) {
+        complete_request_early(s, head, status, VIRTIO_BLK_S_IOERR, 0);
+        return;
+    }
+
+    req->head = head;
+    req->status = status;
+    req->size = size;
+    req->is_read = is_read;
+    req->bounce = NULL;
+    req->read_iov = NULL;
+
+    /* O_DIRECT needs buffers aligned to the logical block size */
+    if (!iov_is_aligned(iov, niov, s->logical_block_size)) {
+        req->bounce = qemu_memalign(s->logical_block_size, size);
+        if (is_read) {
+            req->read_iov = g_malloc(niov * sizeof(iov[0]));
+            memcpy(req->read_iov, iov, niov * sizeof(iov[0]));
+            req->read_niov = niov;
+            io_prep_pread(&req->iocb, s->fd, req->bounce, size, offset);
+        } else {
+            iov_to_buf(iov, niov, req->bounce, 0, size);
+            io_prep_pwrite(&req->iocb, s->fd, req->bounce, size, offset);
+        }
+    } else if (is_read) {
+        io_prep_preadv(&req->iocb, s->fd, iov, niov, offset);
+    } else {
+        io_prep_pwritev(&req->iocb, s->fd, iov, niov, offset);
+    }
+    io_set_eventfd(&req->iocb, event_notifier_get_fd(&s->io_notifier));
+
+    s->iocbs[s->num_iocbs++] = &req->iocb;
+    s->num_reqs++;
+}
+
+static void do_flush_cmd(VirtIOBlockDataPlane *s, unsigned int head,
+                         unsigned char *status)
+{
+    /* Make sure all outstanding writes are posted to the backing device */
+    submit_iocbs(s);
+
+    complete_request_early(s, head, status,
+                           qemu_fdatasync(s->fd) == 0 ?
+                           VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR, 0);
+}
+
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
+                           unsigned int out_num, unsigned int in_num,
+                           unsigned int head)
+{
+    struct iovec *in_iov = &iov[out_num];
+    struct virtio_blk_outhdr outhdr;
+    unsigned char *status;
+    uint32_t type;
+    size_t len;
+
+    if (out_num < 1 || in_num < 1) {
+        error_report("virtio-blk missing headers");
+        return -EFAULT;
+    }
+
+    if (iov[0].iov_len < sizeof(outhdr) ||
+        in_iov[in_num - 1].iov_len < sizeof(*status)) {
+        error_report("virtio-blk header not in correct element");
+        return -EFAULT;
+    }
+
+    /* The guest may change the header under our feet, work on a copy */
+    memcpy(&outhdr, iov[0].iov_base, sizeof(outhdr));
+    status = in_iov[in_num - 1].iov_base;
+    type = ldl_p(&outhdr.type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        do_flush_cmd(s, head, status);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request_early(s, head, status, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        if (in_num < 2) {
+            complete_request_early(s, head, status, VIRTIO_BLK_S_IOERR, 0);
+            return 0;
+        }
+
+        /*
+         * NB: per existing s/n string convention the string is
+         * terminated by '\0' only when shorter than buffer.
+         */
+        len = MIN(in_iov[0].iov_len, VIRTIO_BLK_ID_BYTES);
+        strncpy(in_iov[0].iov_base, s->serial ? s->serial : "", len);
+        complete_request_early(s, head, status, VIRTIO_BLK_S_OK, len);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rdwr_cmd(s, false, &iov[1], out_num - 1, ldq_p(&outhdr.sector),
+                    head, status);
+    } else {
+        do_rdwr_cmd(s, true, in_iov, in_num - 1, ldq_p(&outhdr.sector),
+                    head, status);
+    }
+    return 0;
+}
+
+static void handle_notify(VirtIOBlockDataPlane *s)
+{
+    struct iovec iovecs[VRING_MAX * 2];
+    struct iovec *iov = iovecs;
+    unsigned int out_num, in_num;
+    uint16_t last_used_idx = s->vring.last_used_idx;
+    int head;
+
+    event_notifier_test_and_clear(s->host_notifier);
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            /* io_submit() reads the iovecs, keep them until then */
+            if (iov + VRING_MAX > iovecs + ARRAY_SIZE(iovecs)) {
+                submit_iocbs(s);
+                iov = iovecs;
+            }
+
+            head = vring_pop(s->vdev, &s->vring, iov, VRING_MAX,
+                             &out_num, &in_num);
+            if (head < 0) {
+                break;
+            }
+
+            if (process_request(s, iov, out_num, in_num, head) < 0) {
+                s->vring.broken = true;
+                head = -EFAULT;
+                break;
+            }
+            iov += out_num + in_num;
+        }
+
+        submit_iocbs(s);
+        iov = iovecs;
+
+        if (head != -EAGAIN) {
+            /* The guest corrupted the vring, wait for a reset */
+            break;
+        }
+
+        /* Requests added between the last pop and enabling notifies would
+         * be missed without a kick, so go round again in that case */
+        if (vring_enable_notification(s->vdev, &s->vring)) {
+            break;
+        }
+    }
+
+    /* Flushes, GET_ID and failed requests complete right away */
+    if (s->vring.last_used_idx != last_used_idx) {
+        notify_guest(s);
+    }
+}
+
+static void handle_io(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[REQ_MAX];
+    struct timespec ts = { 0 };
+    uint16_t last_used_idx = s->vring.last_used_idx;
+    int nevents, i;
+
+    event_notifier_test_and_clear(&s->io_notifier);
+    do {
+        nevents = io_getevents(s->io_ctx, 0, REQ_MAX, events, &ts);
+        if (nevents == -EINTR) {
+            nevents = REQ_MAX;
+            continue;
+        }
+        for (i = 0; i < nevents; i++) {
+            VirtIOBlockRequest *req = container_of(events[i].obj,
+                                                   VirtIOBlockRequest, iocb);
+
+            complete_request(s, req, (long)events[i].res);
+        }
+    } while (nevents == REQ_MAX);
+
+    if (s->vring.last_used_idx != last_used_idx) {
+        notify_guest(s);
+    }
+}
+
+enum {
+    POLL_IO,
+    POLL_STOP,
+    POLL_HOST,                      /* must be last, see data_plane_thread */
+    POLL_MAX,
+};
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd fds[POLL_MAX] = {
+        [POLL_IO] = {
+            .fd = event_notifier_get_fd(&s->io_notifier),
+            .events = POLLIN,
+        },
+        [POLL_STOP] = {
+            .fd = event_notifier_get_fd(&s->stop_notifier),
+            .events = POLLIN,
+        },
+        [POLL_HOST] = {
+            .fd = event_notifier_get_fd(s->host_notifier),
+            .events = POLLIN,
+        },
+    };
+
+    while (!s->stopping || s->num_reqs > 0) {
+        /* Once stopping, leave new kicks to the main loop, which picks them
+         * up when the host notifier is released */
+        int nfds = s->stopping ? POLL_HOST : POLL_MAX;
+        int i;
+
+        for (i = 0; i < nfds; i++) {
+            fds[i].revents = 0;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("virtio-blk data plane poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+
+        if (fds[POLL_IO].revents & POLLIN) {
+            handle_io(s);
+        }
+        if (fds[POLL_STOP].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->stop_notifier);
+        }
+        if (nfds > POLL_HOST && (fds[POLL_HOST].revents & POLLIN)) {
+            handle_notify(s);
+        }
+    }
+    return NULL;
+}
+
+static void data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+    VirtQueue *vq;
+
+    if (s->started) {
+        return;
+    }
+
+    /* Without MSI-X the guest notifier cannot be used, stay on the
+     * regular code path */
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers ||
+        !binding->query_guest_notifiers ||
+        !binding->query_guest_notifiers(opaque)) {
+        DPRINTF("guest notifiers not available\n");
+        return;
+    }
+
+    if (!vring_setup(&s->vring, &s->hostmem, vdev, 0)) {
+        return;
+    }
+    assert(s->vring.num <= REQ_MAX);
+
+    vq = virtio_get_queue(vdev, 0);
+    if (binding->set_guest_notifiers(opaque, true) != 0) {
+        error_report("virtio-blk failed to set guest notifier, "
+                     "ensure -enable-kvm is set");
+        return;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    if (binding->set_host_notifier(opaque, 0, true) != 0) {
+        error_report("virtio-blk failed to set host notifier");
+        binding->set_guest_notifiers(opaque, false);
+        return;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    DPRINTF("starting\n");
+    s->stopping = false;
+    s->started = true;
+
+    /* Pick up requests that the guest queued before we took over */
+    event_notifier_set(s->host_notifier);
+
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+}
+
+static void data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+
+    if (!s->started) {
+        return;
+    }
+
+    /* The thread completes requests in flight before exiting */
+    DPRINTF("stopping\n");
+    s->stopping = true;
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    vring_teardown(&s->vring, vdev, 0);
+
+    /* Pending kicks are handled by the regular code path here */
+    binding->set_host_notifier(opaque, 0, false);
+
+    /* Clean up guest notifier (irq) */
+    binding->set_guest_notifiers(opaque, false);
+
+    s->started = false;
+}
+
+/*
+ * Writes from the thread bypass dirty memory tracking, so fall back to the
+ * regular code path while migration needs it.
+ */
+static void data_plane_migration_log(HostMem *hostmem, bool enable)
+{
+    VirtIOBlockDataPlane *s = container_of(hostmem, VirtIOBlockDataPlane,
+                                           hostmem);
+
+    s->migration_logging = enable;
+    if (enable) {
+        data_plane_stop(s);
+    } else if (s->requested) {
+        data_plane_start(s);
+    }
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+    int ret;
+
+    fd = raw_get_aio_fd(conf->bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return NULL;
+    }
+
+    if (!kvm_enabled()) {
+        error_report("x-data-plane requires KVM");
+        return NULL;
+    }
+
+    if (conf->discard_granularity) {
+        error_report("x-data-plane does not support discard");
+        return NULL;
+    }
+
+    if (bdrv_io_limits_enabled(conf->bs)) {
+        error_report("x-data-plane does not support I/O throttling");
+        return NULL;
+    }
+
+    if (bdrv_in_use(conf->bs)) {
+        error_report("cannot start x-data-plane with a drive in use");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->vdev = vdev;
+    s->bs = conf->bs;
+    s->fd = fd;
+    s->serial = serial;
+    s->logical_block_size = conf->logical_block_size;
+    s->sector_mask = (conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
+
+    ret = io_setup(REQ_MAX, &s->io_ctx);
+    if (ret < 0) {
+        error_report("virtio-blk io_setup failed: %s", strerror(-ret));
+        g_free(s);
+        return NULL;
+    }
+
+    if (event_notifier_init(&s->io_notifier, 0) < 0) {
+        error_report("virtio-blk failed to create I/O notifier");
+        goto err_io_ctx;
+    }
+    if (event_notifier_init(&s->stop_notifier, 0) < 0) {
+        error_report("virtio-blk failed to create stop notifier");
+        goto err_io_notifier;
+    }
+
+    s->migration_logging = cpu_physical_memory_get_dirty_tracking();
+    hostmem_init(&s->hostmem, data_plane_migration_log);
+
+    /* Keep block jobs and drive_del away from the image */
+    bdrv_set_in_use(s->bs, 1);
+    return s;
+
+err_io_notifier:
+    event_notifier_cleanup(&s->io_notifier);
+err_io_ctx:
+    io_destroy(s->io_ctx);
+    g_free(s);
+    return NULL;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    hostmem_finalize(&s->hostmem);
+    event_notifier_cleanup(&s->stop_notifier);
+    event_notifier_cleanup(&s->io_notifier);
+    io_destroy(s->io_ctx);
+    bdrv_set_in_use(s->bs, 0);
+    g_free(s);
+}
+
+/* Called with the global mutex held when the guest driver is ready */
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    s->requested = true;
+    if (!s->migration_logging) {
+        data_plane_start(s);
+    }
+}
+
+/* Called with the global mutex held on reset, vm stop and driver unload */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    s->requested = false;
+    data_plane_stop(s);
+}
@@ -0,0 +1,22 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef DATAPLANE_VIRTIO_BLK_H
+#define DATAPLANE_VIRTIO_BLK_H
+
+#include "hw/virtio.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+
+#endif /* DATAPLANE_VIRTIO_BLK_H */
@@ -0,0 +1,331 @@
+/*
+ * Virtqueue access outside the global mutex
+ *
+ * The vring is parsed directly from guest memory, using the layout that the
+ * guest configured through the regular virtio code.  Only one thread may
+ * use a Vring at a time.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-barrier.h"
+#include "qemu-error.h"
+#include "vring.h"
+
+/* The guest writes used_event after the avail ring entries */
+static inline uint16_t *vring_used_event(Vring *vring)
+{
+    return &vring->avail->ring[vring->num];
+}
+
+/* We write avail_event after the used ring entries */
+static inline uint16_t *vring_avail_event(Vring *vring)
+{
+    return (uint16_t *)&vring->used->ring[vring->num];
+}
+
+static bool vring_has_event_idx(VirtIODevice *vdev)
+{
+    return vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX);
+}
+
+/* Map the guest's vring to host memory */
+bool vring_setup(Vring *vring, HostMem *hostmem, VirtIODevice *vdev, int n)
+{
+    target_phys_addr_t addr, size;
+    unsigned int num = virtio_queue_get_num(vdev, n);
+
+    vring->hostmem = hostmem;
+    vring->num = num;
+    vring->broken = false;
+
+    if (num == 0) {
+        error_report("virtqueue %d is not set up", n);
+        return false;
+    }
+
+    addr = virtio_queue_get_desc_addr(vdev, n);
+    size = num * sizeof(VRingDesc);
+    vring->desc = hostmem_lookup(hostmem, addr, size, false);
+
+    addr = virtio_queue_get_avail_addr(vdev, n);
+    size = offsetof(VRingAvail, ring) + sizeof(uint16_t) * (num + 1);
+    vring->avail = hostmem_lookup(hostmem, addr, size, false);
+
+    addr = virtio_queue_get_used_addr(vdev, n);
+    size = offsetof(VRingUsed, ring) + sizeof(VRingUsedElem) * num +
+           sizeof(uint16_t);
+    vring->used = hostmem_lookup(hostmem, addr, size, true);
+
+    if (!vring->desc || !vring->avail || !vring->used) {
+        error_report("failed to map virtqueue %d to host memory", n);
+        return false;
+    }
+
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = vring->used->idx;
+    vring->signalled_used = 0;
+    vring->signalled_used_valid = false;
+    return true;
+}
+
+/* Hand the virtqueue back to the regular virtio code */
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+}
+
+/* Disable guest->host notifies */
+void vring_disable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    /* With EVENT_IDX the guest only kicks when passing avail_event, which
+     * we don't move while processing requests */
+    if (!vring_has_event_idx(vdev)) {
+        vring->used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+}
+
+/*
+ * Enable guest->host notifies
+ *
+ * Return true if the vring is empty, false if there are more requests.
+ */
+bool vring_enable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    if (vring_has_event_idx(vdev)) {
+        *vring_avail_event(vring) = vring->last_avail_idx;
+    } else {
+        vring->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    }
+
+    /* Make the change visible before checking for requests that the guest
+     * added without a kick */
+    smp_mb();
+    return vring->avail->idx == vring->last_avail_idx;
+}
+
+/* This is stolen from linux/drivers/vhost/vhost.c:vhost_notify() */
+bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
+{
+    uint16_t old, new;
+    bool v;
+
+    /* Flush out used index updates.  This is paired with the barrier that
+     * the guest executes when enabling interrupts. */
+    smp_mb();
+
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        vring->avail->idx == vring->last_avail_idx) {
+        return true;
+    }
+
+    if (!vring_has_event_idx(vdev)) {
+        return !(vring->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    old = vring->signalled_used;
+    v = vring->signalled_used_valid;
+    new = vring->signalled_used = vring->last_used_idx;
+    vring->signalled_used_valid = true;
+
+    if (!v) {
+        return true;
+    }
+
+    return virtio_vring_need_event(*vring_used_event(vring), new, old);
+}
+
+/* Return the index of the next descriptor in the chain, or -1 */
+static int vring_next_desc(const VRingDesc *desc)
+{
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
+        return -1;
+    }
+    return desc->next;
+}
+
+static int vring_get_desc(Vring *vring, struct iovec iov[],
+                          unsigned int iov_size, unsigned int *out_num,
+                          unsigned int *in_num, const VRingDesc *desc)
+{
+    bool is_write = desc->flags & VRING_DESC_F_WRITE;
+    struct iovec *entry;
+
+    /* Readable buffers all come before writable ones */
+    if (!is_write && *in_num) {
+        error_report("readable descriptor after writable one");
+        return -EFAULT;
+    }
+
+    if (*out_num + *in_num >= iov_size) {
+        error_report("too many descriptors in a request");
+        return -EFAULT;
+    }
+
+    entry = &iov[*out_num + *in_num];
+    entry->iov_base = hostmem_lookup(vring->hostmem, desc->addr, desc->len,
+                                     is_write);
+    if (!entry->iov_base) {
+        error_report("failed to map descriptor addr %#" PRIx64 " len %u",
+                     desc->addr, desc->len);
+        return -EFAULT;
+    }
+    entry->iov_len = desc->len;
+
+    if (is_write) {
+        (*in_num)++;
+    } else {
+        (*out_num)++;
+    }
+    return 0;
+}
+
+static int vring_get_indirect(Vring *vring, struct iovec iov[],
+                              unsigned int iov_size, unsigned int *out_num,
+                              unsigned int *in_num, const VRingDesc *indirect)
+{
+    VRingDesc *table;
+    VRingDesc desc;
+    unsigned int count, found = 0;
+    int i = 0;
+    int ret;
+
+    if (indirect->len % sizeof(desc)) {
+        error_report("invalid indirect descriptor length %u", indirect->len);
+        return -EFAULT;
+    }
+    count = indirect->len / sizeof(desc);
+
+    table = hostmem_lookup(vring->hostmem, indirect->addr, indirect->len,
+                           false);
+    if (!table) {
+        error_report("failed to map indirect descriptor table addr %#"
+                     PRIx64 " len %u", indirect->addr, indirect->len);
+        return -EFAULT;
+    }
+
+    do {
+        if (i >= count || ++found > count) {
+            error_report("invalid indirect descriptor chain");
+            return -EFAULT;
+        }
+
+        /* The guest may change the table under our feet, work on a copy */
+        desc = table[i];
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            error_report("nested indirect descriptor");
+            return -EFAULT;
+        }
+
+        ret = vring_get_desc(vring, iov, iov_size, out_num, in_num, &desc);
+        if (ret < 0) {
+            return ret;
+        }
+    } while ((i = vring_next_desc(&desc)) != -1);
+
+    return 0;
+}
+
+/*
+ * Take the next request off the avail ring
+ *
+ * Fills iov with the readable buffers followed by the writable ones and
+ * returns the head descriptor index, which must be passed to vring_push()
+ * when the request completes.  Returns -EAGAIN if there are no requests and
+ * -EFAULT if the guest made a mess of the ring, after which the vring stays
+ * broken.
+ */
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], unsigned int iov_size,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    VRingDesc desc;
+    unsigned int num = vring->num;
+    unsigned int head, found = 0;
+    uint16_t avail_idx, last_avail_idx;
+    int i, ret;
+
+    if (vring->broken) {
+        return -EFAULT;
+    }
+
+    last_avail_idx = vring->last_avail_idx;
+    avail_idx = vring->avail->idx;
+
+    /* Read the ring entries only after the index that covers them */
+    smp_rmb();
+
+    if (avail_idx == last_avail_idx) {
+        return -EAGAIN;
+    }
+
+    if ((uint16_t)(avail_idx - last_avail_idx) > num) {
+        error_report("guest moved avail index from %u to %u",
+                     last_avail_idx, avail_idx);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    head = vring->avail->ring[last_avail_idx % num];
+    if (head >= num) {
+        error_report("guest says index %u > %u is available", head, num);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    *out_num = *in_num = 0;
+    i = head;
+    do {
+        if (i >= num || ++found > num) {
+            error_report("invalid descriptor chain, head %u", head);
+            ret = -EFAULT;
+            goto out;
+        }
+
+        desc = vring->desc[i];
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            ret = vring_get_indirect(vring, iov, iov_size, out_num, in_num,
+                                     &desc);
+        } else {
+            ret = vring_get_desc(vring, iov, iov_size, out_num, in_num,
+                                 &desc);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+    } while ((i = vring_next_desc(&desc)) != -1);
+
+    vring->last_avail_idx++;
+    return head;
+
+out:
+    vring->broken = true;
+    return ret;
+}
+
+/*
+ * Put a completed request on the used ring
+ *
+ * len is the number of bytes written to the writable buffers.
+ */
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    VRingUsedElem *elem;
+    uint16_t new;
+
+    elem = &vring->used->ring[vring->last_used_idx % vring->num];
+    elem->id = head;
+    elem->len = len;
+
+    /* Make sure the element is written before the index */
+    smp_wmb();
+
+    new = vring->used->idx = ++vring->last_used_idx;
+
+    /* If we wrapped around the last signalled index, it is meaningless */
+    if ((int16_t)(new - vring->signalled_used) < (uint16_t)1) {
+        vring->signalled_used_valid = false;
+    }
+}
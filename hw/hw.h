@@ -42,6 +42,13 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef int64_t (QEMUFileSetRateLimit)(void *opaque, int64_t new_rate);
 typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Write the buffers described by @iov at the given position.  The iovec
+ * array may be modified.  Returns the number of bytes written, or a negative
+ * error code.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos);
+
 QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileGetBufferFunc *get_buffer,
                          QEMUFileCloseFunc *close,
@@ -51,12 +58,14 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd);
+int qemu_socket_fd(QEMUFile *f);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -85,6 +94,8 @@ uint64_t qemu_get_be64(QEMUFile *f);
 int qemu_file_rate_limit(QEMUFile *f);
 int64_t qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
+void qemu_file_set_writev_buffer(QEMUFile *f,
+                                 QEMUFileWritevBufferFunc *writev_buffer);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int error);
 
@@ -263,6 +274,8 @@ int register_savevm_live(DeviceState *dev,
                          LoadStateHandler *load_state,
                          void *opaque);
 
+int qemu_savevm_set_version(const char *idstr, int instance_id,
+                            int version_id);
 void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque);
 void register_device_unmigratable(DeviceState *dev, const char *idstr,
                                                                 void *opaque);
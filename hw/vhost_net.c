@@ -16,6 +16,9 @@
 #include "virtio-net.h"
 #include "vhost_net.h"
 #include "qemu-error.h"
+#include "qemu-queue.h"
+#include "qerror.h"
+#include "qmp-commands.h"
 
 #include "config.h"
 
@@ -40,8 +43,31 @@ struct vhost_net {
     struct vhost_virtqueue vqs[2];
     int backend;
     VLANClientState *vc;
+    bool zerocopy;
+    QTAILQ_ENTRY(vhost_net) next;
 };
 
+static QTAILQ_HEAD(, vhost_net) vhost_nets =
+    QTAILQ_HEAD_INITIALIZER(vhost_nets);
+
+/* Zero-copy transmit is switched on for the whole host by a vhost_net module
+ * parameter, tap sockets then use it for large enough packets */
+static bool vhost_net_zerocopy_enabled(void)
+{
+    char buf[16] = "";
+    FILE *f;
+
+    f = fopen("/sys/module/vhost_net/parameters/experimental_zcopytx", "r");
+    if (!f) {
+        return false;
+    }
+    if (!fgets(buf, sizeof(buf), f)) {
+        buf[0] = '\0';
+    }
+    fclose(f);
+    return atoi(buf) > 0;
+}
+
 unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
 {
     /* Clear features not supported by host kernel. */
@@ -89,7 +115,7 @@ static int vhost_net_get_fd(VLANClientState *backend)
 }
 
 struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
-                                 bool force)
+                                 bool force, bool zerocopy)
 {
     int r;
     struct vhost_net *net = g_malloc(sizeof *net);
@@ -121,8 +147,16 @@ struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
         goto fail;
     }
 
+    net->zerocopy = vhost_net_zerocopy_enabled();
+    if (zerocopy && !net->zerocopy) {
+        error_report("vhost-net zero-copy transmit requested, but the "
+                     "vhost_net module was loaded without "
+                     "experimental_zcopytx=1");
+    }
+
     /* Set sane init value. Override when guest acks. */
     vhost_net_ack_features(net, 0);
+    QTAILQ_INSERT_TAIL(&vhost_nets, net, next);
     return net;
 fail:
     g_free(net);
@@ -134,14 +168,16 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
 
     r = vhost_dev_enable_notifiers(&net->dev, dev);
     if (r < 0) {
@@ -185,8 +221,8 @@ fail_notifiers:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
@@ -202,17 +238,120 @@ void vhost_net_stop(struct vhost_net *net,
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
 
+/* Queue pair i of the device is handled by nets[i] */
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets, int total_queues)
+{
+    int r, i;
+
+    if (!dev->binding->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        return -ENOSYS;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        error_report("Error binding guest notifier: %d", -r);
+        return r;
+    }
+
+    for (i = 0; i < total_queues; i++) {
+        r = vhost_net_start_one(nets[i], dev, i * 2);
+        if (r < 0) {
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    while (--i >= 0) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+    dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets, int total_queues)
+{
+    int r, i;
+
+    for (i = 0; i < total_queues; i++) {
+        vhost_net_stop_one(nets[i], dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
+    QTAILQ_REMOVE(&vhost_nets, net, next);
     vhost_dev_cleanup(&net->dev);
     if (net->dev.acked_features & (1 << VIRTIO_NET_F_MRG_RXBUF)) {
         tap_set_vnet_hdr_len(net->vc, sizeof(struct virtio_net_hdr));
     }
     g_free(net);
 }
+
+static VhostInfo *vhost_net_query_one(struct vhost_net *net)
+{
+    VhostInfo *info = g_malloc0(sizeof(*info));
+    VhostQueueInfoList **tail = &info->queues;
+    VirtIODevice *vdev;
+    int vq_index, i;
+
+    info->netdev = g_strdup(net->vc->name);
+    info->started = net->dev.started;
+    info->zerocopy = net->zerocopy;
+
+    vdev = virtio_net_get_vhost_vdev(net->vc, &vq_index, &info->fallback);
+    if (!vdev) {
+        return info;
+    }
+
+    for (i = 0; i < 2; i++) {
+        VhostQueueInfoList *entry = g_malloc0(sizeof(*entry));
+        VhostQueueInfo *q = g_malloc0(sizeof(*q));
+        int n = vq_index + i;
+
+        q->index = n;
+        q->size = virtio_queue_get_num(vdev, n);
+        q->pending = virtio_queue_get_pending(vdev, n);
+        /* QEMU does not see the notifications while vhost owns the queue */
+        if (!net->dev.started) {
+            q->has_kicks = true;
+            q->kicks = virtio_queue_get_kicks(vdev, n);
+            q->has_calls = true;
+            q->calls = virtio_queue_get_calls(vdev, n);
+        }
+
+        entry->value = q;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return info;
+}
+
+VhostInfoList *qmp_query_vhost(Error **errp)
+{
+    VhostInfoList *head = NULL, **tail = &head;
+    struct vhost_net *net;
+
+    QTAILQ_FOREACH(net, &vhost_nets, next) {
+        VhostInfoList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = vhost_net_query_one(net);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
 #else
 struct vhost_net *vhost_net_init(VLANClientState *backend, int devfd,
-                                 bool force)
+                                 bool force, bool zerocopy)
 {
     error_report("vhost-net support is not compiled in");
     return NULL;
@@ -223,13 +362,11 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets, int total_queues)
 {
     return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets, int total_queues)
 {
 }
 
@@ -244,4 +381,10 @@ unsigned vhost_net_get_features(struct vhost_net *net, unsigned features)
 void vhost_net_ack_features(struct vhost_net *net, unsigned features)
 {
 }
+
+VhostInfoList *qmp_query_vhost(Error **errp)
+{
+    error_set(errp, QERR_FEATURE_DISABLED, "vhost-net");
+    return NULL;
+}
 #endif
@@ -6,11 +6,12 @@
 struct vhost_net;
 typedef struct vhost_net VHostNetState;
 
-VHostNetState *vhost_net_init(VLANClientState *backend, int devfd, bool force);
+VHostNetState *vhost_net_init(VLANClientState *backend, int devfd, bool force,
+                              bool zerocopy);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
-int vhost_net_start(VHostNetState *net, VirtIODevice *dev);
-void vhost_net_stop(VHostNetState *net, VirtIODevice *dev);
+int vhost_net_start(VirtIODevice *dev, VHostNetState **nets, int total_queues);
+void vhost_net_stop(VirtIODevice *dev, VHostNetState **nets, int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
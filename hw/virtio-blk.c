@@ -17,6 +17,10 @@
 #include "blockdev.h"
 #include "virtio-blk.h"
 #include "scsi-defs.h"
+#include "iov.h"
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "dataplane/virtio-blk.h"
+#endif
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -32,8 +36,14 @@ typedef struct VirtIOBlock
     char *serial;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
+/* bdrv_check_request() works on int byte counts */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS (INT_MAX >> BDRV_SECTOR_BITS)
+
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 {
     return (VirtIOBlock *)vdev;
@@ -122,6 +132,39 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     g_free(req);
 }
 
+static bool virtio_blk_is_write_zeroes(VirtIOBlockReq *req)
+{
+    uint32_t type = ldl_p(&req->out->type) & ~VIRTIO_BLK_T_BARRIER;
+
+    return type == VIRTIO_BLK_T_WRITE_ZEROES;
+}
+
+static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
+{
+    VirtIOBlockReq *req = opaque;
+    bool is_write_zeroes = virtio_blk_is_write_zeroes(req);
+
+    trace_virtio_blk_rw_complete(req, ret);
+
+    if (ret) {
+        /* a failed discard loses nothing, only write zeroes may stop the VM */
+        if (!is_write_zeroes) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+            g_free(req);
+            return;
+        }
+        if (virtio_blk_handle_rw_error(req, -ret, 0)) {
+            return;
+        }
+    }
+
+    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+    if (is_write_zeroes) {
+        bdrv_acct_done(req->dev->bs, &req->acct);
+    }
+    g_free(req);
+}
+
 static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
 {
     VirtIOBlockReq *req = g_malloc(sizeof(*req));
@@ -364,9 +407,73 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
     }
 }
 
+static void virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
+    MultiReqBuffer *mrb)
+{
+    VirtIOBlock *s = req->dev;
+    struct virtio_blk_discard_write_zeroes seg;
+    bool is_write_zeroes = virtio_blk_is_write_zeroes(req);
+    BlockDriverAIOCB *acb;
+    uint64_t sector, capacity;
+    uint32_t nb_sectors, flags;
+    size_t size;
+
+    /* max_discard_seg and max_write_zeroes_seg are 1 */
+    size = iov_size(&req->elem.out_sg[1], req->elem.out_num - 1);
+    if (size != sizeof(seg)) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        g_free(req);
+        return;
+    }
+    iov_to_buf(&req->elem.out_sg[1], req->elem.out_num - 1, &seg, 0,
+               sizeof(seg));
+
+    sector = ldq_p(&seg.sector);
+    nb_sectors = ldl_p(&seg.num_sectors);
+    flags = ldl_p(&seg.flags);
+
+    if (flags & ~(is_write_zeroes ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0)) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        g_free(req);
+        return;
+    }
+
+    /* an invalid request is the guest's fault, never apply werror to it */
+    bdrv_get_geometry(s->bs, &capacity);
+    if ((sector & s->sector_mask) || (nb_sectors & s->sector_mask) ||
+        nb_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+        sector > capacity || nb_sectors > capacity - sector) {
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
+        g_free(req);
+        return;
+    }
+
+    if (is_write_zeroes) {
+        bdrv_acct_start(s->bs, &req->acct,
+                        (int64_t)nb_sectors * BDRV_SECTOR_SIZE,
+                        BDRV_ACCT_WRITE);
+    }
+
+    /* keep the ordering with respect to writes queued so far */
+    virtio_submit_multiwrite(s->bs, mrb);
+
+    if (is_write_zeroes) {
+        acb = bdrv_aio_write_zeroes(s->bs, sector, nb_sectors,
+                                    virtio_blk_discard_write_zeroes_complete,
+                                    req);
+    } else {
+        acb = bdrv_aio_discard(s->bs, sector, nb_sectors,
+                               virtio_blk_discard_write_zeroes_complete, req);
+    }
+    if (!acb) {
+        virtio_blk_discard_write_zeroes_complete(req, -EIO);
+    }
+}
+
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
     MultiReqBuffer *mrb)
 {
+    VirtIOBlock *s = req->dev;
     uint32_t type;
 
     if (req->elem.out_num < 1 || req->elem.in_num < 1) {
@@ -385,13 +492,22 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 
     type = ldl_p(&req->out->type);
 
-    if (type & VIRTIO_BLK_T_FLUSH) {
+    if ((type & ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_DISCARD ||
+        (type & ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES) {
+        int feature = virtio_blk_is_write_zeroes(req) ?
+                      VIRTIO_BLK_F_WRITE_ZEROES : VIRTIO_BLK_F_DISCARD;
+
+        if (!(s->vdev.guest_features & (1 << feature))) {
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+            g_free(req);
+            return;
+        }
+        virtio_blk_handle_discard_write_zeroes(req, mrb);
+    } else if (type & VIRTIO_BLK_T_FLUSH) {
         virtio_blk_handle_flush(req, mrb);
     } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
         virtio_blk_handle_scsi(req);
     } else if (type & VIRTIO_BLK_T_GET_ID) {
-        VirtIOBlock *s = req->dev;
-
         /*
          * NB: per existing s/n string convention the string is
          * terminated by '\0' only when shorter than buffer.
@@ -420,12 +536,17 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
+    /* Hand everything the guest queued to the host in one go */
+    bdrv_io_plug(s->bs);
+
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
 
+    bdrv_io_unplug(s->bs);
+
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -446,12 +567,16 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -470,11 +595,19 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
      */
-    qemu_aio_flush();
+    bdrv_drain_all();
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -501,7 +634,21 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.size_max = 0;
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    if (s->conf->discard_granularity) {
+        uint32_t max_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+
+        max_sectors -= max_sectors % (s->conf->discard_granularity /
+                                      BDRV_SECTOR_SIZE);
+        blkcfg.wce = bdrv_enable_write_cache(s->bs);
+        stl_raw(&blkcfg.max_discard_sectors, max_sectors);
+        stl_raw(&blkcfg.max_discard_seg, 1);
+        stl_raw(&blkcfg.discard_sector_alignment,
+                s->conf->discard_granularity / BDRV_SECTOR_SIZE);
+        stl_raw(&blkcfg.max_write_zeroes_sectors, max_sectors);
+        stl_raw(&blkcfg.max_write_zeroes_seg, 1);
+        blkcfg.write_zeroes_may_unmap = 1;
+    }
+    memcpy(config, &blkcfg, vdev->config_len);
 }
 
 static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
@@ -519,6 +666,11 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (bdrv_is_read_only(s->bs))
         features |= 1 << VIRTIO_BLK_F_RO;
 
+    if (s->conf->discard_granularity) {
+        features |= (1 << VIRTIO_BLK_F_DISCARD);
+        features |= (1 << VIRTIO_BLK_F_WRITE_ZEROES);
+    }
+
     return features;
 }
 
@@ -560,6 +712,20 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    /* Also called on vm start/stop with the current status */
+    if (vdev->vm_running && (status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_blk_data_plane_start(s->dataplane);
+    } else {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
 static void virtio_blk_resize(void *opaque)
 {
     VirtIOBlock *s = opaque;
@@ -572,7 +738,7 @@ static const BlockDevOps virtio_block_ops = {
 };
 
 VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
-                              char **serial)
+                              char **serial, bool data_plane)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -596,8 +762,27 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
         }
     }
 
+    if (conf->discard_granularity % BDRV_SECTOR_SIZE) {
+        error_report("discard_granularity must be a multiple of 512");
+        return NULL;
+    }
+
+#ifndef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (data_plane) {
+        error_report("virtio-blk data plane is not supported in this build");
+        return NULL;
+    }
+#endif
+
+    /*
+     * The discard fields grow the config space; leave it at its old size
+     * unless discard is enabled so that existing guests see no change.
+     */
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
-                                          sizeof(struct virtio_blk_config),
+                                          conf->discard_granularity ?
+                                          sizeof(struct virtio_blk_config) :
+                                          offsetof(struct virtio_blk_config,
+                                                   wce),
                                           sizeof(VirtIOBlock));
 
     s->vdev.get_config = virtio_blk_update_config;
@@ -611,6 +796,16 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (data_plane) {
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, conf, *serial);
+        if (!s->dataplane) {
+            virtio_cleanup(&s->vdev);
+            return NULL;
+        }
+        s->vdev.set_status = virtio_blk_set_status;
+    }
+#endif
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -628,6 +823,10 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     virtio_cleanup(vdev);
 }
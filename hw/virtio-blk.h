@@ -33,6 +33,8 @@
 /* #define VIRTIO_BLK_F_IDENTIFY   8       ATA IDENTIFY supported, DEPRECATED */
 #define VIRTIO_BLK_F_WCACHE     9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
+#define VIRTIO_BLK_F_DISCARD    13      /* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES 14    /* WRITE ZEROES is supported */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -49,6 +51,17 @@ struct virtio_blk_config
     uint8_t alignment_offset;
     uint16_t min_io_size;
     uint32_t opt_io_size;
+    /* only present when discard is enabled, see virtio_blk_init */
+    uint8_t wce;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -64,6 +77,13 @@ struct virtio_blk_config
 /* return the device ID string */
 #define VIRTIO_BLK_T_GET_ID     8
 
+/*
+ * Discard and write zeroes are plain values rather than flags; they share
+ * bits with the commands above and must be compared exactly.
+ */
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -78,6 +98,17 @@ struct virtio_blk_outhdr
     uint64_t sector;
 };
 
+/* Payload of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES */
+struct virtio_blk_discard_write_zeroes
+{
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+/* WRITE ZEROES may deallocate the range */
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
+
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
@@ -746,7 +746,7 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
     vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block,
-                           &proxy->block_serial);
+                           &proxy->block_serial, proxy->block_data_plane);
     if (!vdev) {
         return -1;
     }
@@ -815,8 +815,24 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
     VirtIODevice *vdev;
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
+    if (!vdev) {
+        return -1;
+    }
 
-    vdev->nvectors = proxy->nvectors;
+    if (proxy->nvectors == DEV_NVECTORS_UNSPECIFIED) {
+        int queues = 1;
+
+        if (proxy->nic.peer &&
+            (proxy->host_features & (1 << VIRTIO_NET_F_MQ))) {
+            queues = qemu_find_netdev_queues(proxy->nic.peer->name, NULL,
+                                             MAX_QUEUE_NUM);
+        }
+        /* A vector per virtqueue, including control, plus one for
+         * configuration changes */
+        vdev->nvectors = queues > 1 ? 2 * queues + 2 : 3;
+    } else {
+        vdev->nvectors = proxy->nvectors;
+    }
     virtio_init_pci(proxy, vdev);
 
     /* make the actual value visible */
@@ -873,6 +889,10 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, block_data_plane,
+                            0, false),
+#endif
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_PROP_END_OF_LIST(),
         },
@@ -891,7 +911,8 @@ static PCIDeviceInfo virtio_info[] = {
         .qdev.props = (Property[]) {
             DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags,
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, false),
-            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 3),
+            DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors,
+                               DEV_NVECTORS_UNSPECIFIED),
             DEFINE_VIRTIO_NET_FEATURES(VirtIOPCIProxy, host_features),
             DEFINE_NIC_PROPERTIES(VirtIOPCIProxy, nic),
             DEFINE_PROP_UINT32("x-txtimer", VirtIOPCIProxy,
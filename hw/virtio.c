@@ -22,34 +22,6 @@
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
-typedef struct VRingDesc
-{
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t next;
-} VRingDesc;
-
-typedef struct VRingAvail
-{
-    uint16_t flags;
-    uint16_t idx;
-    uint16_t ring[0];
-} VRingAvail;
-
-typedef struct VRingUsedElem
-{
-    uint32_t id;
-    uint32_t len;
-} VRingUsedElem;
-
-typedef struct VRingUsed
-{
-    uint16_t flags;
-    uint16_t idx;
-    VRingUsedElem ring[0];
-} VRingUsed;
-
 typedef struct VRing
 {
     unsigned int num;
@@ -63,6 +35,8 @@ struct VirtQueue
     VRing vring;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Avail index as last read from the guest */
+    uint16_t shadow_avail_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -79,6 +53,10 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* Guest->host and host->guest notifications handled by QEMU */
+    uint64_t kicks;
+    uint64_t calls;
 };
 
 /* virt queue functions */
@@ -132,7 +110,8 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return lduw_phys(pa);
+    vq->shadow_avail_idx = lduw_phys(pa);
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
@@ -218,6 +197,12 @@ int virtio_queue_ready(VirtQueue *vq)
 
 int virtio_queue_empty(VirtQueue *vq)
 {
+    /* Entries seen by an earlier read and not popped yet are still there,
+     * only go to guest memory once they are used up */
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
+
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
@@ -522,6 +507,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -629,6 +615,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        vq->kicks++;
         vq->handle_output(vdev, vq);
     }
 }
@@ -669,26 +656,24 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+/* Queues must stay contiguous, only the last ones can be deleted */
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
+    vq->calls++;
     vq->vdev->isr |= 0x01;
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-/* Assuming a given event_idx value from the other size, if
- * we have just incremented index from old to new_idx,
- * should we trigger an event? */
-static inline int vring_need_event(uint16_t event, uint16_t new, uint16_t old)
-{
-	/* Note: Xen has similar logic for notification hold-off
-	 * in include/xen/interface/io/ring.h with req_event and req_prod
-	 * corresponding to event_idx + 1 and new respectively.
-	 * Note also that req_event and req_prod in Xen start at 1,
-	 * event indexes in virtio start at 0. */
-	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
-}
-
 static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -707,7 +692,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
     new = vq->signalled_used = vring_used_idx(vq);
-    return !v || vring_need_event(vring_used_event(vq), new, old);
+    return !v || virtio_vring_need_event(vring_used_event(vq), new, old);
 }
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
@@ -717,6 +702,7 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 
     trace_virtio_notify(vdev, vq);
+    vq->calls++;
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -809,6 +795,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         vdev->vq[i].vring.num = qemu_get_be32(f);
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
 
@@ -960,6 +947,34 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
     vdev->vq[n].last_avail_idx = idx;
+    vdev->vq[n].shadow_avail_idx = idx;
+    /* The ring was processed elsewhere, don't trust the old used index */
+    vdev->vq[n].signalled_used_valid = false;
+}
+
+/*
+ * Number of buffers the guest made available that have not been used yet,
+ * read from guest memory so that it is also valid while vhost owns the ring
+ */
+unsigned int virtio_queue_get_pending(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.avail) {
+        return 0;
+    }
+    return (uint16_t)(lduw_phys(vq->vring.avail + offsetof(VRingAvail, idx)) -
+                      vring_used_idx(vq));
+}
+
+uint64_t virtio_queue_get_kicks(VirtIODevice *vdev, int n)
+{
+    return vdev->vq[n].kicks;
+}
+
+uint64_t virtio_queue_get_calls(VirtIODevice *vdev, int n)
+{
+    return vdev->vq[n].calls;
 }
 
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
@@ -967,6 +982,11 @@ VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
     return vdev->vq + n;
 }
 
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
 {
     return &vq->guest_notifier;
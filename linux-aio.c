@@ -20,11 +20,14 @@
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      than this io_submit returns EAGAIN, and the requests it did not take
+ *      stay queued until earlier ones complete.
  */
 #define MAX_EVENTS 128
 
+/* Requests queued while plugged before they are submitted anyway */
+#define MAX_QUEUED_IO 128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -33,15 +36,33 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    /* on either the pending or the failed list */
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+
+    /* io queue for submitting a batch of requests with one io_submit */
+    LaioQueue io_q;
+
+    /* requests io_submit refused, completed from a bottom half */
+    QSIMPLEQ_HEAD(, qemu_laiocb) failed;
+    QEMUBH *failed_bh;
 };
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -98,19 +119,42 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        /*
+         * val completions have been signalled.  Reap as many of them as fit
+         * into the event array with each io_getevents call, which may also
+         * pick up requests that completed since the eventfd was read.
+         */
+        while (val > 0) {
+            do {
+                nevents = io_getevents(s->ctx, MIN(val, MAX_EVENTS),
+                                       MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+
+            if (nevents <= 0) {
+                break;
+            }
+            val = (nevents < val) ? val - nevents : 0;
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+                laiocb->ret = io_event_ret(&events[i]);
+                s->io_q.in_flight--;
+                qemu_laio_process_completion(s, laiocb);
+            }
         }
     }
+
+    /*
+     * Completions made room in the ring for requests io_submit refused.
+     * Don't wait for an unplug here: if everything completed while plugged,
+     * nothing else would restart the queue.
+     */
+    if (s->io_q.blocked) {
+        ioq_submit(s);
+    }
 }
 
 static int qemu_laio_flush_cb(void *opaque)
@@ -120,14 +164,140 @@ static int qemu_laio_flush_cb(void *opaque)
     return (s->count > 0) ? 1 : 0;
 }
 
+static void ioq_init(LaioQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void qemu_laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    /* Completion callbacks may add more failed requests, go on with those */
+    while ((laiocb = QSIMPLEQ_FIRST(&s->failed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->failed, next);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+static void ioq_fail(struct qemu_laio_state *s, struct qemu_laiocb *laiocb,
+                     int ret)
+{
+    QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+    s->io_q.in_queue--;
+    laiocb->ret = ret;
+    QSIMPLEQ_INSERT_TAIL(&s->failed, laiocb, next);
+}
+
+/*
+ * Submits the queued requests.
+ *
+ * If the ring is full io_submit returns EAGAIN, or takes only part of the
+ * batch.  The rest stays queued and the queue is blocked until completions
+ * are reaped, see qemu_laio_completion_cb.  Only if nothing is in flight,
+ * so that no completion will come, is EAGAIN treated as an error.
+ *
+ * Requests the kernel refuses are completed with the error that io_submit
+ * returned.  That happens from a bottom half: ioq_submit may run inside
+ * laio_submit, whose caller must not see its callback before it even got the
+ * ACB.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    struct qemu_laiocb *laiocb;
+    bool failed = false;
+    int len, ret, i;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            iocbs[len++] = &laiocb->iocb;
+            if (len == MAX_QUEUED_IO) {
+                break;
+            }
+        }
+
+        do {
+            ret = io_submit(s->ctx, len, iocbs);
+        } while (ret == -EINTR);
+
+        if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+            break;
+        }
+        if (ret < 0) {
+            /* io_submit reports the error of the first request only */
+            ioq_fail(s, QSIMPLEQ_FIRST(&s->io_q.pending), ret);
+            failed = true;
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        }
+        s->io_q.in_queue -= ret;
+        s->io_q.in_flight += ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (failed) {
+        qemu_bh_schedule(s->failed_bh);
+    }
+}
+
+/* Removes a request that hasn't been submitted yet, returns true if found */
+static bool ioq_cancel(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    struct qemu_laiocb *l;
+
+    QSIMPLEQ_FOREACH(l, &s->io_q.pending, next) {
+        if (l == laiocb) {
+            QSIMPLEQ_REMOVE(&s->io_q.pending, laiocb, qemu_laiocb, next);
+            s->io_q.in_queue--;
+            if (s->io_q.in_queue == 0) {
+                s->io_q.blocked = false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+    s->io_q.in_queue++;
+
+    /* While blocked, resubmission happens when requests complete */
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_QUEUED_IO)) {
+        ioq_submit(s);
+    }
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
     struct io_event event;
     int ret;
 
-    if (laiocb->ret != -EINPROGRESS)
+    /* A failed submission is dropped by the bottom half without callback */
+    if (laiocb->ret != -EINPROGRESS) {
+        laiocb->ret = -ECANCELED;
         return;
+    }
+
+    /* Requests that are still queued never reached the kernel */
+    if (ioq_cancel(laiocb->ctx, laiocb)) {
+        laiocb->ctx->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
 
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
@@ -151,6 +321,24 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
         qemu_laio_completion_cb(laiocb->ctx);
 }
 
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && !s->io_q.blocked &&
+        !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+}
+
 static AIOPool laio_pool = {
     .aiocb_size         = sizeof(struct qemu_laiocb),
     .cancel             = laio_cancel,
@@ -192,12 +380,9 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    ioq_enqueue(s, laiocb);
     return &laiocb->common;
 
-out_dec_count:
-    s->count--;
 out_free_aiocb:
     qemu_aio_release(laiocb);
     return NULL;
@@ -216,6 +401,10 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    ioq_init(&s->io_q);
+    QSIMPLEQ_INIT(&s->failed);
+    s->failed_bh = qemu_bh_new(qemu_laio_failed_bh, s);
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, NULL, s);
 
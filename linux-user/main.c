@@ -54,6 +54,7 @@ unsigned long reserved_va;
 static void usage(void);
 
 static const char *interp_prefix = CONFIG_QEMU_INTERP_PREFIX;
+static const char *tb_cache_filename;
 const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
 
 /* XXX: on x86 MAP_GROWSDOWN only works if ESP <= address + 32, so
@@ -3077,6 +3078,11 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tb_cache(const char *arg)
+{
+    tb_cache_filename = arg;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3129,6 +3135,8 @@ struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"tb-cache",   "QEMU_TB_CACHE",    true,  handle_arg_tb_cache,
+     "file",       "keep translated code in 'file' across runs"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
@@ -3357,6 +3365,9 @@ int main(int argc, char **argv, char **envp)
 #endif
     }
     tcg_exec_init(0);
+    if (tb_cache_filename && tb_cache_open(tb_cache_filename) < 0) {
+        exit(1);
+    }
     cpu_exec_init_all();
     /* NOTE: we need to init the CPU at this stage to get
        qemu_host_page_size */
@@ -4663,6 +4663,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        /* _exit() does not run the atexit handlers */
+        tb_cache_save();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -6397,6 +6399,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
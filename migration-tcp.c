@@ -38,6 +38,45 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+#ifndef _WIN32
+static ssize_t socket_writev(MigrationState *s, const struct iovec *iov,
+                             int iovcnt)
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return sendmsg(s->fd, &msg, 0);
+}
+#endif
+
+/* address of the destination, for the multifd channels */
+static struct sockaddr_in outgoing_addr;
+
+static int tcp_open_channel(MigrationState *s)
+{
+    int fd, ret;
+
+    fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -socket_error();
+    }
+
+    do {
+        ret = connect(fd, (struct sockaddr *)&outgoing_addr,
+                      sizeof(outgoing_addr));
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1) {
+        ret = -socket_error();
+        closesocket(fd);
+        return ret;
+    }
+    return fd;
+}
+
 static int tcp_close(MigrationState *s)
 {
     DPRINTF("tcp_close\n");
@@ -86,7 +125,12 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port)
 
     s->get_error = socket_errno;
     s->write = socket_write;
+#ifndef _WIN32
+    s->writev = socket_writev;
+#endif
     s->close = tcp_close;
+    s->open_channel = tcp_open_channel;
+    outgoing_addr = addr;
 
     s->fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
     if (s->fd == -1) {
@@ -122,7 +166,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -141,7 +185,15 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (migrate_use_multifd()) {
+        multifd_recv_setup(s, f);
+    }
+    ret = process_incoming_migration(f);
+    multifd_recv_cleanup();
+    if (ret) {
+        /* postcopy closes the connection once all pages are received */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -174,7 +226,8 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         goto err;
     }
-    if (listen(s, 1) == -1) {
+    /* the multifd channels connect while the main one is being served */
+    if (listen(s, 1 + MAX_MIGRATE_MULTIFD_CHANNELS) == -1) {
         goto err;
     }
 
@@ -38,6 +38,37 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    return writev(s->fd, iov, iovcnt);
+}
+
+/* address of the destination, for the multifd channels */
+static struct sockaddr_un outgoing_addr;
+
+static int unix_open_channel(MigrationState *s)
+{
+    int fd, ret;
+
+    fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -errno;
+    }
+
+    do {
+        ret = connect(fd, (struct sockaddr *)&outgoing_addr,
+                      sizeof(outgoing_addr));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
 static int unix_close(MigrationState *s)
 {
     DPRINTF("unix_close\n");
@@ -83,7 +114,10 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
+    s->open_channel = unix_open_channel;
+    outgoing_addr = addr;
 
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
     if (s->fd == -1) {
@@ -119,7 +153,7 @@ static void unix_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -138,7 +172,15 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (migrate_use_multifd()) {
+        multifd_recv_setup(s, f);
+    }
+    ret = process_incoming_migration(f);
+    multifd_recv_cleanup();
+    if (ret) {
+        /* postcopy closes the connection once all pages are received */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -171,7 +213,8 @@ int unix_start_incoming_migration(const char *path)
         fprintf(stderr, "bind(unix:%s): %s\n", addr.sun_path, strerror(errno));
         goto err;
     }
-    if (listen(s, 1) == -1) {
+    /* the multifd channels connect while the main one is being served */
+    if (listen(s, 1 + MAX_MIGRATE_MULTIFD_CHANNELS) == -1) {
         fprintf(stderr, "listen(unix:%s): %s\n", addr.sun_path,
                 strerror(errno));
         ret = -errno;
@@ -20,6 +20,7 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "cpus.h"
 
 //#define DEBUG_MIGRATION
 
@@ -41,6 +42,15 @@ enum {
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
+/* Defaults for the compress capability */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
+/* Migration XBZRLE default cache size */
+#define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -53,6 +63,11 @@ static MigrationState *migrate_get_current(void)
     static MigrationState current_migration = {
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
     };
 
     return &current_migration;
@@ -80,7 +95,9 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/* Returns 1 if @f is still in use by postcopy, in which case the caller
+   must not close it. */
+int process_incoming_migration(QEMUFile *f)
 {
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
@@ -97,6 +114,8 @@ void process_incoming_migration(QEMUFile *f)
     } else {
         runstate_set(RUN_STATE_PRELAUNCH);
     }
+
+    return postcopy_ram_incoming_active();
 }
 
 /* amount of nanoseconds we are willing to wait for migration to be down.
@@ -121,13 +140,24 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy ? "postcopy-active" : "active");
+        if (s->postcopy) {
+            info->has_downtime = true;
+            info->downtime = s->downtime;
+        }
 
         info->has_ram = true;
         info->ram = g_malloc0(sizeof(*info->ram));
         info->ram->transferred = ram_bytes_transferred();
         info->ram->remaining = ram_bytes_remaining();
         info->ram->total = ram_bytes_total();
+        info->ram->has_dirty_pages_rate = true;
+        info->ram->dirty_pages_rate = ram_dirty_pages_rate();
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -136,10 +166,24 @@ MigrationInfo *qmp_query_migrate(Error **errp)
             info->disk->remaining = blk_mig_bytes_remaining();
             info->disk->total = blk_mig_bytes_total();
         }
+
+        if (migrate_use_xbzrle()) {
+            info->has_xbzrle_cache = true;
+            info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
+            info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
+            info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
+            info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+            info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+            info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+            info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+            info->xbzrle_cache->bytes_saved = xbzrle_mig_bytes_saved();
+        }
         break;
     case MIG_STATE_COMPLETED:
         info->has_status = true;
         info->status = g_strdup("completed");
+        info->has_downtime = true;
+        info->downtime = s->downtime;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -154,6 +198,267 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+/* Capabilities that rewrite the same part of the page stream */
+static const MigrationCapability incompatible_capabilities[][2] = {
+    { MIGRATION_CAPABILITY_COMPRESS, MIGRATION_CAPABILITY_XBZRLE },
+    { MIGRATION_CAPABILITY_MULTIFD, MIGRATION_CAPABILITY_COMPRESS },
+    { MIGRATION_CAPABILITY_MULTIFD, MIGRATION_CAPABILITY_XBZRLE },
+    { MIGRATION_CAPABILITY_MULTIFD, MIGRATION_CAPABILITY_POSTCOPY_RAM },
+};
+
+void qmp_migrate_set_capability(MigrationCapability capability, bool state,
+                                Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (state && capability == MIGRATION_CAPABILITY_POSTCOPY_RAM &&
+        !postcopy_ram_supported()) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+
+    if (state) {
+        for (i = 0; i < ARRAY_SIZE(incompatible_capabilities); i++) {
+            MigrationCapability a = incompatible_capabilities[i][0];
+            MigrationCapability b = incompatible_capabilities[i][1];
+            char msg[64];
+
+            if ((capability == a && s->enabled_capabilities[b]) ||
+                (capability == b && s->enabled_capabilities[a])) {
+                snprintf(msg, sizeof(msg), "not both '%s' and '%s'",
+                         MigrationCapability_lookup[a],
+                         MigrationCapability_lookup[b]);
+                error_set(errp, QERR_INVALID_PARAMETER_VALUE, "capability",
+                          msg);
+                return;
+            }
+        }
+    }
+
+    s->enabled_capabilities[capability] = state;
+}
+
+MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
+{
+    MigrationCapabilityStatusList *head = NULL, *caps;
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    for (i = MIGRATION_CAPABILITY_MAX - 1; i >= 0; i--) {
+        caps = g_malloc0(sizeof(*caps));
+        caps->value = g_malloc0(sizeof(*caps->value));
+        caps->value->capability = i;
+        caps->value->state = s->enabled_capabilities[i];
+        caps->next = head;
+        head = caps;
+    }
+
+    return head;
+}
+
+void qmp_migrate_set_parameters(bool has_compress_level, int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (has_compress_level && (compress_level < 1 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "an integer in the range of 1 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 0 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 0 to 255");
+        return;
+    }
+    if (has_multifd_channels &&
+        (multifd_channels < 1 ||
+         multifd_channels > MAX_MIGRATE_MULTIFD_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd-channels",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_threads = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+    if (has_multifd_channels) {
+        s->multifd_channels = multifd_channels;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+    MigrationState *s = migrate_get_current();
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_threads;
+    params->decompress_threads = s->decompress_threads;
+    params->multifd_channels = s->multifd_channels;
+
+    return params;
+}
+
+bool migrate_use_compression(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    return migrate_get_current()->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    return migrate_get_current()->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    return migrate_get_current()->decompress_threads;
+}
+
+bool migrate_postcopy_ram(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+bool migrate_use_multifd(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    return migrate_get_current()->multifd_channels;
+}
+
+/* Returns a new connection to the destination, or a negative errno */
+int migrate_open_channel(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!s->open_channel) {
+        return -ENOTSUP;
+    }
+    return s->open_channel(s);
+}
+
+bool migrate_auto_converge(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migration_in_postcopy(void)
+{
+    return migrate_get_current()->postcopy;
+}
+
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int type;
+    socklen_t len = sizeof(type);
+
+    if (!migrate_postcopy_ram()) {
+        error_set(errp, QERR_FEATURE_DISABLED, "postcopy-ram");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_NOT_ACTIVE);
+        return;
+    }
+    /* page requests come back on the migration channel */
+    if (getsockopt(s->fd, SOL_SOCKET, SO_TYPE, (void *)&type, &len) < 0 ||
+        type != SOCK_STREAM) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+
+    s->postcopy_requested = true;
+}
+
+bool migrate_use_xbzrle(void)
+{
+    return migrate_get_current()->enabled_capabilities[
+        MIGRATION_CAPABILITY_XBZRLE];
+}
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return migrate_get_current()->xbzrle_cache_size;
+}
+
+void qmp_migrate_set_cache_size(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t new_size;
+
+    /* Check for truncation */
+    if (value != (size_t)value) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "exceeding address space");
+        return;
+    }
+
+    /* Cache should not be larger than guest ram size */
+    if (value > ram_bytes_total()) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "exceeds guest ram size");
+        return;
+    }
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "is smaller than page size");
+        return;
+    }
+
+    s->xbzrle_cache_size = new_size;
+}
+
+int64_t qmp_query_migrate_cache_size(Error **errp)
+{
+    return migrate_xbzrle_cache_size();
+}
+
 /* shared migration helpers */
 
 static void migrate_fd_monitor_suspend(MigrationState *s, Monitor *mon)
@@ -212,11 +517,21 @@ static void migrate_fd_completed(MigrationState *s)
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
+static void migrate_fd_put_notify(void *opaque);
+static void migrate_fd_return_read(void *opaque);
+
+static void migrate_fd_set_handlers(MigrationState *s, bool put_notify)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy ? migrate_fd_return_read : NULL,
+                         put_notify ? migrate_fd_put_notify : NULL, s);
+}
+
 static void migrate_fd_put_notify(void *opaque)
 {
     MigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    migrate_fd_set_handlers(s, false);
     qemu_file_put_notify(s->file);
     if (s->file && qemu_file_get_error(s->file)) {
         migrate_fd_error(s);
@@ -241,12 +556,111 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
         ret = -(s->get_error(s));
 
     if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+        migrate_fd_set_handlers(s, true);
     }
 
     return ret;
 }
 
+static ssize_t migrate_fd_writev_buffer(void *opaque,
+                                        const struct iovec *iov, int iovcnt)
+{
+    MigrationState *s = opaque;
+    ssize_t ret;
+
+    if (s->state != MIG_STATE_ACTIVE) {
+        return -EIO;
+    }
+
+    do {
+        ret = s->writev(s, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+
+    if (ret == -EAGAIN) {
+        migrate_fd_set_handlers(s, true);
+    }
+
+    return ret;
+}
+
+static void migrate_fd_put_ready(void *opaque);
+
+/* Page requests from the destination: be64 offset, u8 length, block id */
+static void migrate_fd_return_read(void *opaque)
+{
+    MigrationState *s = opaque;
+    ssize_t len;
+
+    do {
+        len = qemu_recv(s->fd, s->return_buf + s->return_len,
+                        sizeof(s->return_buf) - s->return_len, 0);
+    } while (len == -1 && socket_error() == EINTR);
+
+    if (len == -1 && socket_error() == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        /* the destination only hangs up after it got all the pages */
+        fprintf(stderr, "postcopy migration failed, lost connection to the "
+                "destination\n");
+        migrate_fd_error(s);
+        return;
+    }
+    s->return_len += len;
+
+    while (s->return_len >= 9 && s->return_len >= 9 + s->return_buf[8]) {
+        int msg_len = 9 + s->return_buf[8];
+        char idstr[256];
+
+        memcpy(idstr, s->return_buf + 9, s->return_buf[8]);
+        idstr[s->return_buf[8]] = 0;
+        ram_postcopy_request(idstr, ldq_be_p(s->return_buf));
+
+        s->return_len -= msg_len;
+        memmove(s->return_buf, s->return_buf + msg_len, s->return_len);
+    }
+
+    migrate_fd_put_ready(s);
+}
+
+static void migrate_start_postcopy(MigrationState *s)
+{
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+
+    DPRINTF("switching to postcopy\n");
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    s->postcopy = true;
+    if (qemu_savevm_state_postcopy(s->mon, s->file) < 0) {
+        migrate_fd_error(s);
+        return;
+    }
+    qemu_fflush(s->file);
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+
+    /* the guest runs on the destination now, send pages at full speed */
+    qemu_file_set_rate_limit(s->file, INT64_MAX);
+    migrate_fd_set_handlers(s, false);
+}
+
+static void migrate_postcopy_put_ready(MigrationState *s)
+{
+    int ret;
+
+    ret = ram_postcopy_iterate(s->file);
+    if (ret < 0 || qemu_file_get_error(s->file)) {
+        fprintf(stderr, "postcopy migration failed, the guest state on the "
+                "destination is incomplete\n");
+        migrate_fd_error(s);
+    } else if (ret == 1) {
+        DPRINTF("postcopy done\n");
+        migrate_fd_completed(s);
+    }
+}
+
 static void migrate_fd_put_ready(void *opaque)
 {
     MigrationState *s = opaque;
@@ -257,12 +671,24 @@ static void migrate_fd_put_ready(void *opaque)
         return;
     }
 
+    if (s->postcopy_requested && !s->postcopy) {
+        migrate_start_postcopy(s);
+        if (s->state != MIG_STATE_ACTIVE) {
+            return;
+        }
+    }
+    if (s->postcopy) {
+        migrate_postcopy_put_ready(s);
+        return;
+    }
+
     DPRINTF("iterate\n");
     ret = qemu_savevm_state_iterate(s->mon, s->file);
     if (ret < 0) {
         migrate_fd_error(s);
     } else if (ret == 1) {
         int old_vm_running = runstate_is_running();
+        int64_t start_time = qemu_get_clock_ms(rt_clock);
 
         DPRINTF("done iterating\n");
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
@@ -270,6 +696,7 @@ static void migrate_fd_put_ready(void *opaque)
         if (qemu_savevm_state_complete(s->mon, s->file) < 0) {
             migrate_fd_error(s);
         } else {
+            s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
             migrate_fd_completed(s);
         }
         if (s->state != MIG_STATE_COMPLETED) {
@@ -285,6 +712,11 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state != MIG_STATE_ACTIVE)
         return;
 
+    /* the guest already runs on the destination */
+    if (s->postcopy) {
+        return;
+    }
+
     DPRINTF("cancelling migration\n");
 
     s->state = MIG_STATE_CANCELLED;
@@ -362,6 +794,8 @@ void migrate_fd_connect(MigrationState *s)
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+                                      s->writev ? migrate_fd_writev_buffer
+                                                : NULL,
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -380,9 +814,25 @@ static MigrationState *migrate_init(Monitor *mon, int detach, int blk, int inc)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
+    int decompress_threads = s->decompress_threads;
+    int multifd_channels = s->multifd_channels;
+    int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+
+    memcpy(enabled_capabilities, s->enabled_capabilities,
+           sizeof(enabled_capabilities));
 
     memset(s, 0, sizeof(*s));
     s->bandwidth_limit = bandwidth_limit;
+    memcpy(s->enabled_capabilities, enabled_capabilities,
+           sizeof(enabled_capabilities));
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
+    s->multifd_channels = multifd_channels;
+    s->xbzrle_cache_size = xbzrle_cache_size;
     s->blk = blk;
     s->shared = inc;
 
@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "notify.h"
 #include "error.h"
+#include "qapi-types.h"
 
 typedef struct MigrationState MigrationState;
 
@@ -31,12 +32,28 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, lets guest RAM be sent without copying it first */
+    ssize_t (*writev)(MigrationState *s, const struct iovec *iov, int iovcnt);
+    /* optional, opens another blocking connection to the destination */
+    int (*open_channel)(MigrationState *s);
     void *opaque;
     int blk;
     int shared;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    int multifd_channels;
+    int64_t xbzrle_cache_size;
+    bool postcopy_requested;
+    bool postcopy;
+    int64_t downtime;
+    /* page requests from the destination during postcopy */
+    uint8_t return_buf[8 + 1 + 256];
+    int return_len;
 };
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -84,12 +101,57 @@ bool migration_has_failed(MigrationState *);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_dirty_pages_rate(void);
 
+void ram_set_params(int blk_enable, int shared, void *opaque);
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
 
 extern int incoming_expected;
 
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+bool migrate_use_xbzrle(void);
+int64_t migrate_xbzrle_cache_size(void);
+
+bool migrate_postcopy_ram(void);
+bool migrate_auto_converge(void);
+
+#define MAX_MIGRATE_MULTIFD_CHANNELS 255
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_open_channel(void);
+void multifd_recv_setup(int listen_fd, QEMUFile *f);
+void multifd_recv_cleanup(void);
+bool migration_in_postcopy(void);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t xbzrle_mig_bytes_saved(void);
+
+/* postcopy, source side */
+void ram_postcopy_request(const char *idstr, uint64_t offset);
+int ram_postcopy_iterate(QEMUFile *f);
+
+/* postcopy, destination side */
+int ram_postcopy_load(QEMUFile *f);
+bool postcopy_ram_supported(void);
+void postcopy_ram_discard_range(void *host, size_t length);
+int postcopy_ram_incoming_start(QEMUFile *f);
+bool postcopy_ram_incoming_active(void);
+int postcopy_place_page(void *host, const void *from);
+int postcopy_place_zero_page(void *host);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -480,6 +480,12 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -2656,6 +2662,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show block device statistics",
         .mhandler.info = hmp_info_blockstats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .mhandler.info = hmp_info_block_jobs,
+    },
+    {
+        .name       = "aio-pool",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show asynchronous I/O thread pool statistics",
+        .mhandler.info = hmp_info_aio_pool,
+    },
+    {
+        .name       = "vhost",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show vhost-net backend statistics",
+        .mhandler.info = hmp_info_vhost,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2871,6 +2898,34 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show migration status",
         .mhandler.info = hmp_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .mhandler.info = hmp_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "migrate_cache_size",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration xbzrle cache size",
+        .mhandler.info = hmp_info_migrate_cache_size,
+    },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the guest dirty rate",
+        .mhandler.info = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
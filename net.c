@@ -30,6 +30,7 @@
 #include "net/dump.h"
 #include "net/slirp.h"
 #include "net/vde.h"
+#include "net/packet.h"
 #include "net/util.h"
 #include "monitor.h"
 #include "qemu-common.h"
@@ -668,6 +669,30 @@ VLANClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+/*
+ * A multiqueue netdev is a set of clients sharing the same id, one per
+ * queue.  Fill ncs with them indexed by queue and return how many were found.
+ */
+int qemu_find_netdev_queues(const char *id, VLANClientState **ncs, int max)
+{
+    VLANClientState *vc;
+    int n = 0;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+            continue;
+        }
+        if (!strcmp(vc->name, id) && vc->queue_index < max) {
+            if (ncs) {
+                ncs[vc->queue_index] = vc;
+            }
+            n++;
+        }
+    }
+
+    return n;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -942,6 +967,15 @@ static const struct {
                 .name = "fd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened tap",
+            }, {
+                .name = "fds",
+                .type = QEMU_OPT_STRING,
+                .help = "colon separated list of file descriptors of an "
+                        "already opened multiqueue tap",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues to open on the tap interface",
             }, {
                 .name = "script",
                 .type = QEMU_OPT_STRING,
@@ -966,10 +1000,19 @@ static const struct {
                 .name = "vhostfd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened vhost net device",
+            }, {
+                .name = "vhostfds",
+                .type = QEMU_OPT_STRING,
+                .help = "colon separated list of file descriptors of already "
+                        "opened vhost net devices",
             }, {
                 .name = "vhostforce",
                 .type = QEMU_OPT_BOOL,
                 .help = "force vhost on for non-MSIX virtio guests",
+            }, {
+                .name = "vhostzerocopy",
+                .type = QEMU_OPT_BOOL,
+                .help = "expect vhost to transmit without copying",
         },
 #endif /* _WIN32 */
             { /* end of list */ }
@@ -1030,6 +1073,29 @@ static const struct {
             { /* end of list */ }
         },
     },
+#endif
+#ifdef CONFIG_LINUX
+    [NET_CLIENT_TYPE_PACKET] = {
+        .type = "packet",
+        .init = net_init_packet,
+        .desc = {
+            NET_COMMON_PARAMS_DESC,
+            {
+                .name = "ifname",
+                .type = QEMU_OPT_STRING,
+                .help = "host interface to attach to",
+            }, {
+                .name = "frames",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of frames in each ring (256 default)",
+            }, {
+                .name = "framesize",
+                .type = QEMU_OPT_SIZE,
+                .help = "size of each ring frame (2048 default)",
+            },
+            { /* end of list */ }
+        },
+    },
 #endif
     [NET_CLIENT_TYPE_DUMP] = {
         .type = "dump",
@@ -1069,6 +1135,9 @@ int net_client_init(Monitor *mon, QemuOpts *opts, int is_netdev)
 #endif
 #ifdef CONFIG_VDE
             strcmp(type, "vde") != 0 &&
+#endif
+#ifdef CONFIG_LINUX
+            strcmp(type, "packet") != 0 &&
 #endif
             strcmp(type, "socket") != 0) {
             qerror_report(QERR_INVALID_PARAMETER_VALUE, "type",
@@ -1139,6 +1208,9 @@ static int net_host_check_device(const char *device)
 #endif
 #ifdef CONFIG_VDE
                                        ,"vde"
+#endif
+#ifdef CONFIG_LINUX
+                                       ,"packet"
 #endif
     };
     for (i = 0; i < sizeof(valid_param_list) / sizeof(char *); i++) {
@@ -1218,7 +1290,10 @@ int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    /* Multiqueue netdevs have one client per queue */
+    do {
+        qemu_del_vlan_client(vc);
+    } while ((vc = qemu_find_netdev(id)));
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
@@ -1258,48 +1333,55 @@ void do_info_network(Monitor *mon)
     }
 }
 
+static void qemu_set_link_status(VLANClientState *vc, int up)
+{
+    vc->link_down = !up;
+
+    if (vc->info->link_status_changed) {
+        vc->info->link_status_changed(vc);
+    }
+
+    /* Notify peer. Don't update peer link status: this makes it possible to
+     * disconnect from host network without notifying the guest.
+     * FIXME: is disconnected link status change operation useful?
+     *
+     * Current behaviour is compatible with qemu vlans where there could be
+     * multiple clients that can still communicate with each other in
+     * disconnected mode. For now maintain this compatibility. */
+    if (vc->peer && vc->peer->info->link_status_changed) {
+        vc->peer->info->link_status_changed(vc->peer);
+    }
+}
+
 int do_set_link(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     VLANState *vlan;
-    VLANClientState *vc = NULL;
+    VLANClientState *vc;
     const char *name = qdict_get_str(qdict, "name");
     int up = qdict_get_bool(qdict, "up");
+    bool found = false;
 
     QTAILQ_FOREACH(vlan, &vlans, next) {
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
             if (strcmp(vc->name, name) == 0) {
-                goto done;
+                qemu_set_link_status(vc, up);
+                return 0;
             }
         }
     }
+
+    /* The queues of a multiqueue NIC or netdev share their name */
     QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
         if (!strcmp(vc->name, name)) {
-            goto done;
+            qemu_set_link_status(vc, up);
+            found = true;
         }
     }
-done:
 
-    if (!vc) {
+    if (!found) {
         qerror_report(QERR_DEVICE_NOT_FOUND, name);
         return -1;
     }
-
-    vc->link_down = !up;
-
-    if (vc->info->link_status_changed) {
-        vc->info->link_status_changed(vc);
-    }
-
-    /* Notify peer. Don't update peer link status: this makes it possible to
-     * disconnect from host network without notifying the guest.
-     * FIXME: is disconnected link status change operation useful?
-     *
-     * Current behaviour is compatible with qemu vlans where there could be
-     * multiple clients that can still communicate with each other in
-     * disconnected mode. For now maintain this compatibility. */
-    if (vc->peer && vc->peer->info->link_status_changed) {
-        vc->peer->info->link_status_changed(vc->peer);
-    }
     return 0;
 }
 
@@ -1349,6 +1431,7 @@ void net_check_clients(void)
             case NET_CLIENT_TYPE_TAP:
             case NET_CLIENT_TYPE_SOCKET:
             case NET_CLIENT_TYPE_VDE:
+            case NET_CLIENT_TYPE_PACKET:
                 has_host_dev = 1;
                 break;
             default: ;
@@ -11,6 +11,9 @@ struct MACAddr {
     uint8_t a[6];
 };
 
+/* Maximum number of queue pairs of a multiqueue netdev */
+#define MAX_QUEUE_NUM 8
+
 /* qdev nic properties */
 
 typedef struct NICConf {
@@ -36,6 +39,7 @@ typedef enum {
     NET_CLIENT_TYPE_SOCKET,
     NET_CLIENT_TYPE_VDE,
     NET_CLIENT_TYPE_DUMP,
+    NET_CLIENT_TYPE_PACKET,
 
     NET_CLIENT_TYPE_MAX
 } net_client_type;
@@ -70,6 +74,7 @@ struct VLANClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    unsigned queue_index;
 };
 
 typedef struct NICState {
@@ -88,6 +93,7 @@ struct VLANState {
 
 VLANState *qemu_find_vlan(int id, int allocate);
 VLANClientState *qemu_find_netdev(const char *id);
+int qemu_find_netdev_queues(const char *id, VLANClientState **ncs, int max);
 VLANClientState *qemu_new_net_client(NetClientInfo *info,
                                      VLANState *vlan,
                                      VLANClientState *peer,
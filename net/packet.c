@@ -0,0 +1,454 @@
+/*
+ * QEMU AF_PACKET memory-mapped ring network backend
+ *
+ * Attaches to a host interface through a TPACKET_V2 packet socket.  Received
+ * and transmitted frames are exchanged with the kernel through rings shared
+ * with it, so a whole burst costs one wakeup on receive and one send() call
+ * on transmit instead of a syscall per packet.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "net/packet.h"
+
+#include "config-host.h"
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "net.h"
+#include "qemu-char.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-barrier.h"
+#include "qemu_socket.h"
+#include "iov.h"
+
+//#define DEBUG_PACKET
+
+#ifdef DEBUG_PACKET
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stderr, "packet: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) do { } while (0)
+#endif
+
+#ifndef TP_STATUS_VLAN_VALID
+#define TP_STATUS_VLAN_VALID (1 << 4)
+#endif
+
+#define PACKET_DEFAULT_FRAMES       256
+#define PACKET_DEFAULT_FRAME_SIZE   2048
+
+/* Without PACKET_TX_HAS_OFF the kernel expects transmit data right after
+ * the aligned frame header */
+#define PACKET_TX_DATA_OFFSET       TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+typedef struct PacketRing {
+    uint8_t *base;
+    unsigned int frame_size;
+    unsigned int frame_nr;
+    unsigned int head;              /* next frame we look at */
+} PacketRing;
+
+typedef struct PacketState {
+    VLANClientState nc;
+    int fd;
+    void *map;
+    size_t map_size;
+    PacketRing rx;
+    PacketRing tx;
+    QEMUBH *tx_bh;                  /* kicks the kernel once per burst */
+    unsigned int read_poll : 1;
+    unsigned int write_poll : 1;
+} PacketState;
+
+static int packet_can_send(void *opaque);
+static void packet_send(void *opaque);
+static void packet_writable(void *opaque);
+
+static inline struct tpacket2_hdr *packet_ring_frame(PacketRing *ring)
+{
+    return (struct tpacket2_hdr *)(ring->base + ring->head * ring->frame_size);
+}
+
+static inline void packet_ring_advance(PacketRing *ring)
+{
+    if (++ring->head == ring->frame_nr) {
+        ring->head = 0;
+    }
+}
+
+static void packet_update_fd_handler(PacketState *s)
+{
+    qemu_set_fd_handler2(s->fd,
+                         s->read_poll  ? packet_can_send : NULL,
+                         s->read_poll  ? packet_send     : NULL,
+                         s->write_poll ? packet_writable : NULL,
+                         s);
+}
+
+static void packet_read_poll(PacketState *s, int enable)
+{
+    s->read_poll = !!enable;
+    packet_update_fd_handler(s);
+}
+
+static void packet_write_poll(PacketState *s, int enable)
+{
+    s->write_poll = !!enable;
+    packet_update_fd_handler(s);
+}
+
+/* Ask the kernel to transmit every frame marked TP_STATUS_SEND_REQUEST */
+static void packet_flush_tx(PacketState *s)
+{
+    ssize_t ret;
+
+    qemu_bh_cancel(s->tx_bh);
+
+    do {
+        ret = send(s->fd, NULL, 0, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        DPRINTF("send failed: %s\n", strerror(errno));
+    }
+}
+
+static void packet_tx_bh(void *opaque)
+{
+    PacketState *s = opaque;
+
+    packet_flush_tx(s);
+}
+
+static void packet_writable(void *opaque)
+{
+    PacketState *s = opaque;
+
+    packet_write_poll(s, 0);
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t packet_receive_iov(VLANClientState *nc, const struct iovec *iov,
+                                  int iovcnt)
+{
+    PacketState *s = DO_UPCAST(PacketState, nc, nc);
+    struct tpacket2_hdr *hdr = packet_ring_frame(&s->tx);
+    size_t size = iov_size(iov, iovcnt);
+
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        /* Ring is full, push out what is queued and wait for the kernel to
+         * hand frames back */
+        packet_flush_tx(s);
+        packet_write_poll(s, 1);
+        return 0;
+    }
+
+    if (size > s->tx.frame_size - PACKET_TX_DATA_OFFSET) {
+        DPRINTF("dropping %zu byte packet, frame size is %u\n",
+                size, s->tx.frame_size);
+        return size;
+    }
+
+    iov_to_buf(iov, iovcnt, (uint8_t *)hdr + PACKET_TX_DATA_OFFSET, 0, size);
+    hdr->tp_len = size;
+
+    /* The kernel may pick the frame up as soon as the status changes */
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+    packet_ring_advance(&s->tx);
+
+    qemu_bh_schedule(s->tx_bh);
+    return size;
+}
+
+static ssize_t packet_receive(VLANClientState *nc, const uint8_t *buf,
+                              size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return packet_receive_iov(nc, &iov, 1);
+}
+
+static int packet_can_send(void *opaque)
+{
+    PacketState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void packet_send_completed(VLANClientState *nc, ssize_t len)
+{
+    PacketState *s = DO_UPCAST(PacketState, nc, nc);
+    packet_read_poll(s, 1);
+}
+
+/* Pass a received frame on, putting back the VLAN tag the kernel strips */
+static ssize_t packet_deliver(PacketState *s, struct tpacket2_hdr *hdr)
+{
+    uint8_t *data = (uint8_t *)hdr + hdr->tp_mac;
+    size_t size = hdr->tp_snaplen;
+    uint8_t tag[4];
+    struct iovec iov[3];
+
+    if (!(hdr->tp_status & TP_STATUS_VLAN_VALID) && !hdr->tp_vlan_tci) {
+        return qemu_send_packet_async(&s->nc, data, size,
+                                      packet_send_completed);
+    }
+
+    if (size < 2 * ETH_ALEN) {
+        return size;
+    }
+
+    tag[0] = ETH_P_8021Q >> 8;
+    tag[1] = ETH_P_8021Q & 0xff;
+    tag[2] = hdr->tp_vlan_tci >> 8;
+    tag[3] = hdr->tp_vlan_tci & 0xff;
+
+    iov[0].iov_base = data;
+    iov[0].iov_len = 2 * ETH_ALEN;
+    iov[1].iov_base = tag;
+    iov[1].iov_len = sizeof(tag);
+    iov[2].iov_base = data + 2 * ETH_ALEN;
+    iov[2].iov_len = size - 2 * ETH_ALEN;
+
+    return qemu_sendv_packet_async(&s->nc, iov, 3, packet_send_completed);
+}
+
+static void packet_send(void *opaque)
+{
+    PacketState *s = opaque;
+    unsigned int budget = s->rx.frame_nr;
+
+    while (budget-- && qemu_can_send_packet(&s->nc)) {
+        struct tpacket2_hdr *hdr = packet_ring_frame(&s->rx);
+        struct sockaddr_ll *sll;
+        ssize_t size = 1;
+
+        if (!(hdr->tp_status & TP_STATUS_USER)) {
+            break;
+        }
+
+        /* Read the frame only after seeing it handed over */
+        smp_rmb();
+
+        sll = (struct sockaddr_ll *)((uint8_t *)hdr +
+                                     TPACKET_ALIGN(sizeof(*hdr)));
+        if (sll->sll_pkttype == PACKET_OUTGOING) {
+            /* Sent by the host itself, not meant for us */
+        } else if (hdr->tp_snaplen < hdr->tp_len) {
+            DPRINTF("dropping truncated %u byte packet\n", hdr->tp_len);
+        } else {
+            size = packet_deliver(s, hdr);
+        }
+
+        /* Queued packets have been copied, the frame can go back */
+        smp_mb();
+        hdr->tp_status = TP_STATUS_KERNEL;
+        packet_ring_advance(&s->rx);
+
+        if (size == 0) {
+            packet_read_poll(s, 0);
+            break;
+        }
+    }
+}
+
+static void packet_cleanup(VLANClientState *nc)
+{
+    PacketState *s = DO_UPCAST(PacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    packet_read_poll(s, 0);
+    packet_write_poll(s, 0);
+    qemu_bh_delete(s->tx_bh);
+    munmap(s->map, s->map_size);
+    close(s->fd);
+    s->fd = -1;
+}
+
+static NetClientInfo net_packet_info = {
+    .type = NET_CLIENT_TYPE_PACKET,
+    .size = sizeof(PacketState),
+    .receive = packet_receive,
+    .receive_iov = packet_receive_iov,
+    .cleanup = packet_cleanup,
+};
+
+/*
+ * Create the RX and TX rings and map them, RX first.  Returns the mapping
+ * or NULL, with req describing the layout of either ring.
+ */
+static void *packet_setup_rings(int fd, unsigned int frame_size,
+                                unsigned int frames, struct tpacket_req *req)
+{
+    int version = TPACKET_V2;
+    int loss = 1;
+    unsigned int frames_per_block;
+    void *map;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0) {
+        error_report("packet: TPACKET_V2 not supported: %s", strerror(errno));
+        return NULL;
+    }
+
+    /* Drop malformed frames instead of stalling the TX ring on them */
+    if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss)) < 0) {
+        error_report("packet: PACKET_LOSS failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    /* Frames may not cross block boundaries and blocks are whole pages */
+    req->tp_frame_size = frame_size;
+    req->tp_block_size = MAX(getpagesize(), frame_size);
+    frames_per_block = req->tp_block_size / frame_size;
+    req->tp_block_nr = DIV_ROUND_UP(frames, frames_per_block);
+    req->tp_frame_nr = req->tp_block_nr * frames_per_block;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, req, sizeof(*req)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING, req, sizeof(*req)) < 0) {
+        error_report("packet: could not set up rings: %s", strerror(errno));
+        return NULL;
+    }
+
+    map = mmap(NULL, 2 * req->tp_block_size * req->tp_block_nr,
+               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        error_report("packet: could not map rings: %s", strerror(errno));
+        return NULL;
+    }
+    return map;
+}
+
+static int net_packet_init(VLANState *vlan, const char *model,
+                           const char *name, const char *ifname,
+                           unsigned int frame_size, unsigned int frames)
+{
+    VLANClientState *nc;
+    PacketState *s;
+    struct tpacket_req req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    size_t ring_size;
+    void *map;
+    int ifindex;
+    int fd;
+
+    ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        error_report("packet: no such interface '%s'", ifname);
+        return -1;
+    }
+
+    /* No protocol yet, nothing is queued on the socket until it is bound */
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        error_report("packet: could not create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    map = packet_setup_rings(fd, frame_size, frames, &req);
+    if (!map) {
+        close(fd);
+        return -1;
+    }
+    ring_size = req.tp_block_size * req.tp_block_nr;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("packet: could not bind to '%s': %s",
+                     ifname, strerror(errno));
+        goto fail;
+    }
+
+    /* The guest has its own MAC address */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_report("packet: could not make '%s' promiscuous: %s",
+                     ifname, strerror(errno));
+        goto fail;
+    }
+
+    socket_set_nonblock(fd);
+
+    nc = qemu_new_net_client(&net_packet_info, vlan, NULL, model, name);
+
+    snprintf(nc->info_str, sizeof(nc->info_str),
+             "ifname=%s,frames=%u,framesize=%u",
+             ifname, req.tp_frame_nr, req.tp_frame_size);
+
+    s = DO_UPCAST(PacketState, nc, nc);
+
+    s->fd = fd;
+    s->map = map;
+    s->map_size = 2 * ring_size;
+    s->rx.base = map;
+    s->tx.base = (uint8_t *)map + ring_size;
+    s->rx.frame_size = s->tx.frame_size = req.tp_frame_size;
+    s->rx.frame_nr = s->tx.frame_nr = req.tp_frame_nr;
+    s->rx.head = s->tx.head = 0;
+    s->tx_bh = qemu_bh_new(packet_tx_bh, s);
+
+    packet_read_poll(s, 1);
+
+    return 0;
+
+fail:
+    munmap(map, 2 * ring_size);
+    close(fd);
+    return -1;
+}
+
+int net_init_packet(QemuOpts *opts, Monitor *mon, const char *name,
+                    VLANState *vlan)
+{
+    const char *ifname;
+    uint64_t frame_size, frames;
+
+    ifname = qemu_opt_get(opts, "ifname");
+    if (!ifname) {
+        error_report("packet: ifname= is required");
+        return -1;
+    }
+
+    frames = qemu_opt_get_number(opts, "frames", PACKET_DEFAULT_FRAMES);
+    frame_size = qemu_opt_get_size(opts, "framesize",
+                                   PACKET_DEFAULT_FRAME_SIZE);
+
+    if (frame_size < 2 * TPACKET_ALIGNMENT + ETH_FRAME_LEN ||
+        frame_size > 65536 || (frame_size & (frame_size - 1))) {
+        error_report("packet: framesize must be a power of two between "
+                     "2048 and 65536");
+        return -1;
+    }
+
+    if (frames == 0 || frames > 65536) {
+        error_report("packet: frames must be between 1 and 65536");
+        return -1;
+    }
+
+    if (net_packet_init(vlan, "packet", name, ifname,
+                        frame_size, frames) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
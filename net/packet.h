@@ -0,0 +1,20 @@
+/*
+ * QEMU AF_PACKET memory-mapped ring network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_NET_PACKET_H
+#define QEMU_NET_PACKET_H
+
+#include "qemu-common.h"
+#include "qemu-option.h"
+
+#ifdef CONFIG_LINUX
+
+int net_init_packet(QemuOpts *opts, Monitor *mon, const char *name,
+                    VLANState *vlan);
+
+#endif /* CONFIG_LINUX */
+
+#endif /* QEMU_NET_PACKET_H */
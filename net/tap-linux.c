@@ -35,10 +35,12 @@
 
 #define PATH_NET_TUN "/dev/net/tun"
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     struct ifreq ifr;
     int fd, ret;
+    unsigned int features;
 
     TFR(fd = open(PATH_NET_TUN, O_RDWR));
     if (fd < 0) {
@@ -48,11 +50,12 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
 
-    if (*vnet_hdr) {
-        unsigned int features;
+    if (ioctl(fd, TUNGETFEATURES, &features) == -1) {
+        features = 0;
+    }
 
-        if (ioctl(fd, TUNGETFEATURES, &features) == 0 &&
-            features & IFF_VNET_HDR) {
+    if (*vnet_hdr) {
+        if (features & IFF_VNET_HDR) {
             *vnet_hdr = 1;
             ifr.ifr_flags |= IFF_VNET_HDR;
         } else {
@@ -67,6 +70,16 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
         }
     }
 
+    if (mq_required) {
+        if (!(features & IFF_MULTI_QUEUE)) {
+            error_report("multiqueue required, but no kernel "
+                         "support for IFF_MULTI_QUEUE available");
+            close(fd);
+            return -1;
+        }
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+
     if (ifname[0] != '\0')
         pstrcpy(ifr.ifr_name, IFNAMSIZ, ifname);
     else
@@ -167,6 +180,31 @@ void tap_fd_set_vnet_hdr_len(int fd, int len)
     }
 }
 
+/* Attach or detach a queue of a multiqueue tap, the kernel only steers
+ * packets to attached queues */
+static int tap_fd_set_queue(int fd, int flags)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = flags;
+    if (ioctl(fd, TUNSETQUEUE, (void *) &ifr) == -1) {
+        error_report("TUNSETQUEUE ioctl() failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int tap_fd_enable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_ATTACH_QUEUE);
+}
+
+int tap_fd_disable(int fd)
+{
+    return tap_fd_set_queue(fd, IFF_DETACH_QUEUE);
+}
+
 void tap_fd_set_offload(int fd, int csum, int tso4,
                         int tso6, int ecn, int ufo)
 {
@@ -29,11 +29,15 @@
 #define TUNSETSNDBUF   _IOW('T', 212, int)
 #define TUNGETVNETHDRSZ _IOR('T', 215, int)
 #define TUNSETVNETHDRSZ _IOW('T', 216, int)
+#define TUNSETQUEUE  _IOW('T', 217, int)
 
 #endif
 
 /* TUNSETIFF ifr flags */
 #define IFF_TAP		0x0002
+#define IFF_MULTI_QUEUE	0x0100
+#define IFF_ATTACH_QUEUE	0x0200
+#define IFF_DETACH_QUEUE	0x0400
 #define IFF_NO_PI	0x1000
 #define IFF_VNET_HDR	0x4000
 
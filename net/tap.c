@@ -188,10 +188,15 @@ static void tap_send_completed(VLANClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+/* Packets read per wakeup.  Bounds the time spent on a busy tap; the
+ * receiving NIC can batch its guest notification over the lot. */
+#define TAP_SEND_BUDGET 64
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
+    int packets = 0;
 
     do {
         uint8_t *buf = s->buf;
@@ -210,7 +215,8 @@ static void tap_send(void *opaque)
         if (size == 0) {
             tap_read_poll(s, 0);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && ++packets < TAP_SEND_BUDGET &&
+             qemu_can_send_packet(&s->nc));
 }
 
 int tap_has_ufo(VLANClientState *nc)
@@ -302,6 +308,20 @@ static void tap_poll(VLANClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+int tap_enable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    return tap_fd_enable(s->fd);
+}
+
+int tap_disable(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    return tap_fd_disable(s->fd);
+}
+
 int tap_get_fd(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -388,7 +408,8 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq_required,
+                        int run_script)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -405,13 +426,15 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
 
     setup_script = qemu_opt_get(opts, "script");
-    if (setup_script &&
+    if (run_script &&
+        setup_script &&
         setup_script[0] != '\0' &&
         strcmp(setup_script, "no") != 0 &&
         launch_script(setup_script, ifname, fd)) {
@@ -424,54 +447,24 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
-int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+static int net_init_tap_one(QemuOpts *opts, Monitor *mon, VLANState *vlan,
+                            const char *name, int fd, int vnet_hdr,
+                            unsigned queue_index, const char *vhostfdname)
 {
     TAPState *s;
-    int fd, vnet_hdr = 0;
-
-    if (qemu_opt_get(opts, "fd")) {
-        if (qemu_opt_get(opts, "ifname") ||
-            qemu_opt_get(opts, "script") ||
-            qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
-            return -1;
-        }
-
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
-        }
-
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
-    } else {
-        if (!qemu_opt_get(opts, "script")) {
-            qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
-        }
-
-        if (!qemu_opt_get(opts, "downscript")) {
-            qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
-        }
-
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
-            return -1;
-        }
-    }
 
     s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
     if (!s) {
         close(fd);
         return -1;
     }
+    s->nc.queue_index = queue_index;
 
     if (tap_set_sndbuf(s->fd, opts) < 0) {
         return -1;
     }
 
-    if (qemu_opt_get(opts, "fd")) {
+    if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "fds")) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
     } else {
         const char *ifname, *script, *downscript;
@@ -484,18 +477,21 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
                  "ifname=%s,script=%s,downscript=%s",
                  ifname, script, downscript);
 
-        if (strcmp(downscript, "no") != 0) {
+        /* The interface goes away with its last queue, but the first one
+         * is the one that ran the setup script */
+        if (queue_index == 0 && strcmp(downscript, "no") != 0) {
             snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
             snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
         }
     }
 
     if (qemu_opt_get_bool(opts, "vhost", !!qemu_opt_get(opts, "vhostfd") ||
+                          !!qemu_opt_get(opts, "vhostfds") ||
                           qemu_opt_get_bool(opts, "vhostforce", false))) {
         int vhostfd, r;
         bool force = qemu_opt_get_bool(opts, "vhostforce", false);
-        if (qemu_opt_get(opts, "vhostfd")) {
-            r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
+        if (vhostfdname) {
+            r = net_handle_fd_param(mon, vhostfdname);
             if (r == -1) {
                 return -1;
             }
@@ -503,12 +499,14 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         } else {
             vhostfd = -1;
         }
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd, force);
+        s->vhost_net = vhost_net_init(&s->nc, vhostfd, force,
+                                      qemu_opt_get_bool(opts, "vhostzerocopy",
+                                                        false));
         if (!s->vhost_net) {
             error_report("vhost-net requested but could not be initialized");
             return -1;
         }
-    } else if (qemu_opt_get(opts, "vhostfd")) {
+    } else if (vhostfdname) {
         error_report("vhostfd= is not valid without vhost");
         return -1;
     }
@@ -516,6 +514,164 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
     return 0;
 }
 
+/* Split a colon separated list of file descriptors in place */
+static int get_fds(char *str, char *fds[], int max)
+{
+    int n = 0;
+
+    while (str && n < max) {
+        fds[n++] = str;
+        str = strchr(str, ':');
+        if (str) {
+            *str++ = '\0';
+        }
+    }
+    return str ? -1 : n;
+}
+
+static int net_init_tap_fds(QemuOpts *opts, Monitor *mon, const char *name,
+                            VLANState *vlan)
+{
+    char *fds_str, *vhostfds_str = NULL;
+    char *fds[MAX_QUEUE_NUM], *vhostfds[MAX_QUEUE_NUM];
+    int nfds, nvhostfds = 0, fd, vnet_hdr = 0, i, ret = -1;
+
+    if (qemu_opt_get(opts, "fd") ||
+        qemu_opt_get(opts, "vhostfd") ||
+        qemu_opt_get(opts, "queues")) {
+        error_report("fd=, vhostfd= and queues= are invalid with fds=");
+        return -1;
+    }
+
+    fds_str = g_strdup(qemu_opt_get(opts, "fds"));
+    nfds = get_fds(fds_str, fds, MAX_QUEUE_NUM);
+    if (nfds < 0) {
+        error_report("at most %d queues are supported in fds=", MAX_QUEUE_NUM);
+        goto out;
+    }
+
+    if (qemu_opt_get(opts, "vhostfds")) {
+        vhostfds_str = g_strdup(qemu_opt_get(opts, "vhostfds"));
+        nvhostfds = get_fds(vhostfds_str, vhostfds, MAX_QUEUE_NUM);
+        if (nvhostfds != nfds) {
+            error_report("the number of fds= and vhostfds= must match");
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nfds; i++) {
+        int queue_vnet_hdr;
+
+        fd = net_handle_fd_param(mon, fds[i]);
+        if (fd == -1) {
+            goto out;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        queue_vnet_hdr = tap_probe_vnet_hdr(fd);
+        if (i == 0) {
+            vnet_hdr = queue_vnet_hdr;
+        } else if (vnet_hdr != queue_vnet_hdr) {
+            error_report("vnet_hdr not consistent across given tap fds");
+            close(fd);
+            goto out;
+        }
+
+        if (net_init_tap_one(opts, mon, vlan, name, fd, vnet_hdr, i,
+                             nvhostfds ? vhostfds[i] : NULL) < 0) {
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    g_free(fds_str);
+    g_free(vhostfds_str);
+    return ret;
+}
+
+int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
+{
+    int fd, vnet_hdr = 0, queues, i;
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("queues= must be between 1 and %d", MAX_QUEUE_NUM);
+        return -1;
+    }
+
+    if ((queues > 1 || qemu_opt_get(opts, "fds")) && vlan) {
+        error_report("multiqueue tap is only supported with -netdev");
+        return -1;
+    }
+
+    if (qemu_opt_get(opts, "vhostfds") && !qemu_opt_get(opts, "fds")) {
+        error_report("vhostfds= is only valid with fds=");
+        return -1;
+    }
+
+    if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "fds")) {
+        if (qemu_opt_get(opts, "ifname") ||
+            qemu_opt_get(opts, "script") ||
+            qemu_opt_get(opts, "downscript") ||
+            qemu_opt_get(opts, "vnet_hdr")) {
+            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd= or fds=");
+            return -1;
+        }
+
+        if (qemu_opt_get(opts, "fds")) {
+            return net_init_tap_fds(opts, mon, name, vlan);
+        }
+
+        if (queues > 1) {
+            error_report("queues= is invalid with fd=, use fds=");
+            return -1;
+        }
+
+        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+        if (fd == -1) {
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        vnet_hdr = tap_probe_vnet_hdr(fd);
+
+        return net_init_tap_one(opts, mon, vlan, name, fd, vnet_hdr, 0,
+                                qemu_opt_get(opts, "vhostfd"));
+    }
+
+    if (queues > 1 && qemu_opt_get(opts, "vhostfd")) {
+        error_report("vhostfd= is invalid with queues=, use fds= and vhostfds=");
+        return -1;
+    }
+
+    if (!qemu_opt_get(opts, "script")) {
+        qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
+    }
+
+    if (!qemu_opt_get(opts, "downscript")) {
+        qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
+    }
+
+    /* Every queue is a separate file descriptor attached to the same
+     * interface; the setup script runs once, for the first one */
+    for (i = 0; i < queues; i++) {
+        fd = net_tap_init(opts, &vnet_hdr, queues > 1, i == 0);
+        if (fd == -1) {
+            return -1;
+        }
+
+        if (net_init_tap_one(opts, mon, vlan, name, fd, vnet_hdr, i,
+                             qemu_opt_get(opts, "vhostfd")) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 VHostNetState *tap_get_vhost_net(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -0,0 +1,186 @@
+/*
+ * Page cache for QEMU
+ * The cache is a bounded LRU of fixed-size pages keyed by address.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "page_cache.h"
+
+//#define DEBUG_CACHE
+
+#ifdef DEBUG_CACHE
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "cache: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct CacheItem CacheItem;
+
+struct CacheItem {
+    uint64_t addr;
+    uint8_t *data;
+    QLIST_ENTRY(CacheItem) hash_next;
+    QTAILQ_ENTRY(CacheItem) lru;
+};
+
+struct PageCache {
+    CacheItem *items;
+    QLIST_HEAD(, CacheItem) *buckets;
+    uint64_t bucket_mask;
+    /* most recently used first; unused items are kept at the tail */
+    QTAILQ_HEAD(CacheLRU, CacheItem) lru;
+    int64_t num_items;
+    int64_t max_items;
+    unsigned int page_size;
+};
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+    uint64_t nbuckets = 1;
+    int64_t i;
+
+    if (num_pages <= 0 || page_size == 0) {
+        DPRINTF("invalid number of pages %" PRId64 "\n", num_pages);
+        return NULL;
+    }
+
+    while (nbuckets < num_pages) {
+        nbuckets <<= 1;
+    }
+
+    cache = g_malloc0(sizeof(*cache));
+    cache->items = g_try_malloc0(num_pages * sizeof(*cache->items));
+    cache->buckets = g_try_malloc0(nbuckets * sizeof(*cache->buckets));
+    if (!cache->items || !cache->buckets) {
+        g_free(cache->items);
+        g_free(cache->buckets);
+        g_free(cache);
+        return NULL;
+    }
+
+    cache->bucket_mask = nbuckets - 1;
+    cache->max_items = num_pages;
+    cache->page_size = page_size;
+    QTAILQ_INIT(&cache->lru);
+    for (i = 0; i < num_pages; i++) {
+        QTAILQ_INSERT_TAIL(&cache->lru, &cache->items[i], lru);
+    }
+
+    DPRINTF("setting cache buckets to %" PRIu64 " for %" PRId64 " pages\n",
+            nbuckets, num_pages);
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    if (!cache) {
+        return;
+    }
+
+    for (i = 0; i < cache->max_items; i++) {
+        g_free(cache->items[i].data);
+    }
+    g_free(cache->items);
+    g_free(cache->buckets);
+    g_free(cache);
+}
+
+static inline uint64_t cache_get_bucket(const PageCache *cache, uint64_t addr)
+{
+    return (addr / cache->page_size) & cache->bucket_mask;
+}
+
+static CacheItem *cache_find(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it;
+
+    QLIST_FOREACH(it, &cache->buckets[cache_get_bucket(cache, addr)],
+                  hash_next) {
+        if (it->addr == addr) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    if (it != QTAILQ_FIRST(&cache->lru)) {
+        QTAILQ_REMOVE(&cache->lru, it, lru);
+        QTAILQ_INSERT_HEAD(&cache->lru, it, lru);
+    }
+    return it->data;
+}
+
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
+{
+    CacheItem *it = cache_find(cache, addr);
+
+    if (!it) {
+        /* reuse an unused item, or evict the least recently used page */
+        it = QTAILQ_LAST(&cache->lru, CacheLRU);
+        if (it->data) {
+            QLIST_REMOVE(it, hash_next);
+        } else {
+            it->data = g_malloc(cache->page_size);
+            cache->num_items++;
+        }
+        it->addr = addr;
+        QLIST_INSERT_HEAD(&cache->buckets[cache_get_bucket(cache, addr)],
+                          it, hash_next);
+    }
+
+    memcpy(it->data, pdata, cache->page_size);
+    QTAILQ_REMOVE(&cache->lru, it, lru);
+    QTAILQ_INSERT_HEAD(&cache->lru, it, lru);
+
+    return it->data;
+}
+
+PageCache *cache_resize(PageCache *cache, int64_t new_num_pages)
+{
+    PageCache *new_cache;
+    CacheItem *it;
+
+    if (new_num_pages == cache->max_items) {
+        return cache;
+    }
+
+    new_cache = cache_init(new_num_pages, cache->page_size);
+    if (!new_cache) {
+        DPRINTF("Error creating new cache\n");
+        return NULL;
+    }
+
+    /* walk from least to most recently used so the LRU order is kept and
+       the oldest pages are the ones that get dropped */
+    QTAILQ_FOREACH_REVERSE(it, &cache->lru, CacheLRU, lru) {
+        if (it->data) {
+            cache_insert(new_cache, it->addr, it->data);
+        }
+    }
+
+    cache_fini(cache);
+    return new_cache;
+}
+
+int64_t cache_num_pages(PageCache *cache)
+{
+    return cache->max_items;
+}
@@ -0,0 +1,77 @@
+/*
+ * Page cache for QEMU
+ * The cache is a bounded LRU of fixed-size pages keyed by address.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "qemu-common.h"
+
+typedef struct PageCache PageCache;
+
+/**
+ * cache_init: Initialize the page cache
+ *
+ * Returns a new cache or NULL if @num_pages is invalid.
+ *
+ * @num_pages: maximum number of pages the cache holds
+ * @page_size: size of a page in bytes
+ */
+PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+
+/**
+ * cache_fini: free all cache resources
+ *
+ * @cache: the cache to free
+ */
+void cache_fini(PageCache *cache);
+
+/**
+ * cache_lookup: return the cached copy of the page at @addr
+ *
+ * Returns NULL on a miss.  A hit makes the page the most recently used one.
+ * The returned buffer stays valid until the next cache_insert() or
+ * cache_resize().
+ *
+ * @cache: the cache
+ * @addr: page address
+ */
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_insert: store a copy of a page, evicting the least recently used
+ * page if the cache is full.  An existing entry for @addr is overwritten.
+ *
+ * Returns the cached copy.
+ *
+ * @cache: the cache
+ * @addr: page address
+ * @pdata: page data, page_size bytes
+ */
+uint8_t *cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
+
+/**
+ * cache_resize: change the number of pages the cache can hold.  The most
+ * recently used pages are kept.
+ *
+ * Returns the new cache, or NULL on failure in which case @cache is
+ * unchanged.
+ *
+ * @cache: the cache, freed on success
+ * @new_num_pages: new maximum number of pages
+ */
+PageCache *cache_resize(PageCache *cache, int64_t new_num_pages);
+
+/**
+ * cache_num_pages: return the maximum number of pages the cache holds
+ *
+ * @cache: the cache
+ */
+int64_t cache_num_pages(PageCache *cache);
+
+#endif
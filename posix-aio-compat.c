@@ -25,6 +25,7 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "trace.h"
 #include "block_int.h"
 
@@ -48,26 +49,81 @@ struct qemu_paiocb {
     int aio_type;
     ssize_t ret;
     int active;
+    int64_t submit_time;
     struct qemu_paiocb *next;
 };
 
+typedef struct PaioQueue {
+    QTAILQ_HEAD(, qemu_paiocb) requests;
+    int depth;                  /* requests waiting for a thread */
+    int max_depth;
+    int active;                 /* requests being processed */
+    int max_active;             /* limit for active */
+    uint64_t dispatched;        /* requests handed to a thread so far */
+    int64_t total_wait_ns;
+    int64_t max_wait_ns;
+} PaioQueue;
+
 typedef struct PosixAioState {
     int rfd, wfd;
     struct qemu_paiocb *first_aio;
 } PosixAioState;
 
-
+/*
+ * One lock protects the queues and the thread counts.  Submission holds it
+ * only for a list insertion, and completion needs it anyway, so there is no
+ * lock-free submission path.  Workers are not grouped per NUMA node either:
+ * nothing in QEMU knows the host topology or binds threads to nodes.
+ */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
+static int min_threads = 0;     /* threads kept alive when idle */
 static int cur_threads = 0;
 static int idle_threads = 0;
 static int new_threads = 0;     /* backlog of threads we need to create */
 static int pending_threads = 0; /* threads created but not running yet */
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+/*
+ * The pool size follows the time requests wait for a thread.  At the end of
+ * every interval the average wait of the requests dispatched in it (or the
+ * age of the oldest queued request, if larger) is checked:
+ * - if it is above PAIO_WAIT_HIGH_NS while all threads were busy, the
+ *   thread limit doubles;
+ * - if it is below PAIO_WAIT_LOW_NS and fewer than half the threads were
+ *   ever busy, the limit drops by a quarter, but not below twice the peak.
+ * Threads above the limit exit once they are done with their request.
+ * Idle threads are reaped after 10 seconds, except for as many as were
+ * busy at the peak of the last interval.
+ */
+#define PAIO_MIN_THREADS        4
+#define PAIO_MAX_THREADS        128
+#define PAIO_ADAPT_INTERVAL_NS  (100 * 1000 * 1000LL)
+#define PAIO_WAIT_HIGH_NS       (1000 * 1000)
+#define PAIO_WAIT_LOW_NS        (100 * 1000)
+
+static int64_t adapt_start;
+static uint64_t adapt_dispatched;
+static int64_t adapt_wait_ns;
+static int adapt_peak_active;
+static bool adapt_saturated;    /* a request found every thread busy */
+
+/*
+ * Flushes and ioctls can take much longer than reads and writes, so they are
+ * queued separately and may only keep part of the threads busy.  This way a
+ * flush-heavy guest cannot starve reads and writes.  A thread looking for
+ * work takes the request that has waited longest among the queues that are
+ * below their limit.
+ */
+static PaioQueue queues[PAIO_QUEUE_MAX];
+
+static const char *queue_names[PAIO_QUEUE_MAX] = {
+    [PAIO_QUEUE_RW]   = "rw",
+    [PAIO_QUEUE_SYNC] = "sync",
+};
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -106,6 +162,12 @@ static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     return ret;
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
 static void cond_signal(pthread_cond_t *cond)
 {
     int ret = pthread_cond_signal(cond);
@@ -309,6 +371,124 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 
 static void posix_aio_notify_event(void);
 
+static PaioQueue *paio_queue(struct qemu_paiocb *aiocb)
+{
+    if (aiocb->aio_type & (QEMU_AIO_FLUSH | QEMU_AIO_IOCTL)) {
+        return &queues[PAIO_QUEUE_SYNC];
+    }
+    return &queues[PAIO_QUEUE_RW];
+}
+
+static void set_max_threads(int n)
+{
+    max_threads = n;
+    queues[PAIO_QUEUE_RW].max_active = n;
+    queues[PAIO_QUEUE_SYNC].max_active = MAX(n / 2, 1);
+}
+
+static int active_requests(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < PAIO_QUEUE_MAX; i++) {
+        n += queues[i].active;
+    }
+    return n;
+}
+
+/* Resizes the pool at the end of an interval.  Must be called with lock
+   held. */
+static void adapt_pool(int64_t now)
+{
+    int64_t wait_ns = 0;
+    int i, n;
+
+    if (now - adapt_start < PAIO_ADAPT_INTERVAL_NS) {
+        return;
+    }
+
+    if (adapt_dispatched) {
+        wait_ns = adapt_wait_ns / adapt_dispatched;
+    }
+    for (i = 0; i < PAIO_QUEUE_MAX; i++) {
+        struct qemu_paiocb *first = QTAILQ_FIRST(&queues[i].requests);
+
+        if (first && now - first->submit_time > wait_ns) {
+            wait_ns = now - first->submit_time;
+        }
+    }
+
+    n = max_threads;
+    if (wait_ns > PAIO_WAIT_HIGH_NS && adapt_saturated) {
+        n = MIN(max_threads * 2, PAIO_MAX_THREADS);
+    } else if (wait_ns < PAIO_WAIT_LOW_NS &&
+               adapt_peak_active * 2 < max_threads) {
+        n = MAX(max_threads * 3 / 4, adapt_peak_active * 2);
+        n = MAX(n, PAIO_MIN_THREADS);
+    }
+    if (n < max_threads) {
+        /* idle threads above the limit exit when they see the wakeup */
+        cond_broadcast(&cond);
+    }
+    if (n != max_threads) {
+        set_max_threads(n);
+    }
+    min_threads = MIN(adapt_peak_active, max_threads);
+    trace_paio_adapt_pool(min_threads, max_threads, wait_ns,
+                          adapt_peak_active);
+
+    adapt_start = now;
+    adapt_dispatched = 0;
+    adapt_wait_ns = 0;
+    adapt_peak_active = active_requests();
+    adapt_saturated = false;
+}
+
+/* Picks the next request to process.  Must be called with lock held. */
+static struct qemu_paiocb *dequeue_request(void)
+{
+    struct qemu_paiocb *aiocb = NULL;
+    PaioQueue *q = NULL;
+    int64_t now, wait_ns;
+    int i;
+
+    for (i = 0; i < PAIO_QUEUE_MAX; i++) {
+        struct qemu_paiocb *first = QTAILQ_FIRST(&queues[i].requests);
+
+        if (!first || queues[i].active >= queues[i].max_active) {
+            continue;
+        }
+        if (!aiocb || first->submit_time < aiocb->submit_time) {
+            aiocb = first;
+            q = &queues[i];
+        }
+    }
+
+    if (!aiocb) {
+        return NULL;
+    }
+
+    QTAILQ_REMOVE(&q->requests, aiocb, node);
+    aiocb->active = 1;
+    q->depth--;
+    q->active++;
+    q->dispatched++;
+
+    now = get_clock();
+    wait_ns = now - aiocb->submit_time;
+    q->total_wait_ns += wait_ns;
+    if (wait_ns > q->max_wait_ns) {
+        q->max_wait_ns = wait_ns;
+    }
+
+    adapt_dispatched++;
+    adapt_wait_ns += wait_ns;
+    adapt_peak_active = MAX(adapt_peak_active, active_requests());
+    adapt_pool(now);
+
+    return aiocb;
+}
+
 static void *aio_thread(void *unused)
 {
     mutex_lock(&lock);
@@ -317,7 +497,8 @@ static void *aio_thread(void *unused)
     do_spawn_thread();
 
     while (1) {
-        struct qemu_paiocb *aiocb;
+        struct qemu_paiocb *aiocb = NULL;
+        PaioQueue *q;
         ssize_t ret = 0;
         qemu_timeval tv;
         struct timespec ts;
@@ -328,19 +509,24 @@ static void *aio_thread(void *unused)
 
         mutex_lock(&lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
+        /* leave if the pool shrank, or if idle and not among min_threads */
+        while (cur_threads <= max_threads &&
+               !(aiocb = dequeue_request())) {
             idle_threads++;
             ret = cond_timedwait(&cond, &lock, &ts);
             idle_threads--;
+            if (ret == ETIMEDOUT) {
+                if (cur_threads > min_threads) {
+                    break;
+                }
+                ts.tv_sec += 10;
+            }
         }
 
-        if (QTAILQ_EMPTY(&request_list))
+        if (!aiocb)
             break;
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
+        q = paio_queue(aiocb);
         mutex_unlock(&lock);
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
@@ -375,6 +561,11 @@ static void *aio_thread(void *unused)
 
         mutex_lock(&lock);
         aiocb->ret = ret;
+        q->active--;
+        if (q->active == q->max_active - 1 && !QTAILQ_EMPTY(&q->requests)) {
+            /* Requests held back by the limit can run now */
+            cond_broadcast(&cond);
+        }
         mutex_unlock(&lock);
 
         posix_aio_notify_event();
@@ -433,12 +624,22 @@ static void spawn_thread(void)
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioQueue *q = paio_queue(aiocb);
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    aiocb->submit_time = get_clock();
     mutex_lock(&lock);
+    if (idle_threads == 0 && cur_threads >= max_threads) {
+        adapt_saturated = true;
+    }
+    adapt_pool(aiocb->submit_time);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    QTAILQ_INSERT_TAIL(&q->requests, aiocb, node);
+    if (++q->depth > q->max_depth) {
+        q->max_depth = q->depth;
+    }
     mutex_unlock(&lock);
     cond_signal(&cond);
 }
@@ -582,7 +783,10 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
 
     mutex_lock(&lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        PaioQueue *q = paio_queue(acb);
+
+        QTAILQ_REMOVE(&q->requests, acb, node);
+        q->depth--;
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
@@ -658,6 +862,7 @@ int paio_init(void)
     PosixAioState *s;
     int fds[2];
     int ret;
+    int i;
 
     if (posix_aio_state)
         return 0;
@@ -688,9 +893,38 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    for (i = 0; i < PAIO_QUEUE_MAX; i++) {
+        QTAILQ_INIT(&queues[i].requests);
+    }
+    set_max_threads(max_threads);
+    adapt_start = get_clock();
+
     new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
 
     posix_aio_state = s;
     return 0;
 }
+
+void paio_get_stats(PaioPoolStats *stats)
+{
+    int i;
+
+    mutex_lock(&lock);
+    stats->threads = cur_threads;
+    stats->idle_threads = idle_threads;
+    stats->min_threads = min_threads;
+    stats->max_threads = max_threads;
+    for (i = 0; i < PAIO_QUEUE_MAX; i++) {
+        PaioQueueStats *qs = &stats->queues[i];
+
+        qs->name = queue_names[i];
+        qs->depth = queues[i].depth;
+        qs->max_depth = queues[i].max_depth;
+        qs->active = queues[i].active;
+        qs->max_active = queues[i].max_active;
+        qs->dispatched = queues[i].dispatched;
+        qs->total_wait_ns = queues[i].total_wait_ns;
+        qs->max_wait_ns = queues[i].max_wait_ns;
+    }
+    mutex_unlock(&lock);
+}
@@ -0,0 +1,415 @@
+/*
+ * Postcopy migration of guest RAM, destination side
+ *
+ * Once the source switches to postcopy, the guest runs here before all of
+ * its memory has arrived.  Pages that are still missing are discarded and
+ * the RAM blocks are registered with userfaultfd: a fault thread turns
+ * guest (and QEMU) accesses to missing pages into page requests sent back
+ * to the source on the migration socket, while a listen thread reads the
+ * rest of the migration stream and places pages atomically.  When the
+ * stream ends, the listen thread hands its result to the main loop, which
+ * owns everything else and tears the postcopy state down.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "kvm.h"
+#include "migration.h"
+#include "qemu-thread.h"
+#include "qemu_socket.h"
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stdout, "postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#if defined(__linux__) && defined(CONFIG_USERFAULTFD)
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyDiscard {
+    void *host;
+    size_t length;
+} PostcopyDiscard;
+
+static struct {
+    bool active;            /* only changed by the main thread */
+    int uffd;
+    int quit_fds[2];
+    int done_fds[2];
+    int return_fd;
+    QEMUFile *file;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool fault_thread_done;
+    int load_result;
+    PostcopyDiscard *discards;
+    int nb_discards;
+} postcopy;
+
+bool postcopy_ram_supported(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int ufd;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        DPRINTF("target and host page sizes differ\n");
+        return false;
+    }
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        return false;
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd < 0) {
+        DPRINTF("userfaultfd not available: %s\n", strerror(errno));
+        return false;
+    }
+    if (ioctl(ufd, UFFDIO_API, &api) < 0) {
+        close(ufd);
+        return false;
+    }
+    close(ufd);
+
+    return true;
+}
+
+void postcopy_ram_discard_range(void *host, size_t length)
+{
+    postcopy.discards = g_realloc(postcopy.discards,
+                                  (postcopy.nb_discards + 1) *
+                                  sizeof(*postcopy.discards));
+    postcopy.discards[postcopy.nb_discards].host = host;
+    postcopy.discards[postcopy.nb_discards].length = length;
+    postcopy.nb_discards++;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return postcopy.active;
+}
+
+/* Ask the source for the page containing @addr */
+static void postcopy_request_page(uint8_t *addr)
+{
+    RAMBlock *block;
+    uint8_t buf[8 + 1 + 256];
+    ram_addr_t offset;
+    size_t len, done;
+    ssize_t ret;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr >= block->host && addr < block->host + block->length) {
+            break;
+        }
+    }
+    if (!block) {
+        fprintf(stderr, "postcopy: fault at unknown address %p\n", addr);
+        return;
+    }
+
+    offset = (addr - block->host) & TARGET_PAGE_MASK;
+    DPRINTF("requesting %s:" RAM_ADDR_FMT "\n", block->idstr, offset);
+
+    len = strlen(block->idstr);
+    stq_be_p(buf, offset);
+    buf[8] = len;
+    memcpy(buf + 9, block->idstr, len);
+    len += 9;
+
+    for (done = 0; done < len; done += ret) {
+        ret = send(postcopy.return_fd, buf + done, len - done, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                ret = 0;
+                continue;
+            }
+            /* the source is gone once all pages have been sent */
+            DPRINTF("page request failed: %s\n", strerror(errno));
+            return;
+        }
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+
+    for (;;) {
+        pfd[0].fd = postcopy.uffd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = postcopy.quit_fds[0];
+        pfd[1].events = POLLIN;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        if (read(postcopy.uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        postcopy_request_page((uint8_t *)(uintptr_t)msg.arg.pagefault.address);
+    }
+
+    qemu_mutex_lock(&postcopy.mutex);
+    postcopy.fault_thread_done = true;
+    qemu_cond_signal(&postcopy.cond);
+    qemu_mutex_unlock(&postcopy.mutex);
+
+    return NULL;
+}
+
+static void postcopy_ram_incoming_cleanup(void)
+{
+    RAMBlock *block;
+    char c = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)block->host,
+            .len = block->length,
+        };
+        ioctl(postcopy.uffd, UFFDIO_UNREGISTER, &range);
+    }
+
+    if (write(postcopy.quit_fds[1], &c, 1) != 1) {
+        fprintf(stderr, "postcopy: cannot stop the fault thread\n");
+    }
+    qemu_mutex_lock(&postcopy.mutex);
+    while (!postcopy.fault_thread_done) {
+        qemu_cond_wait(&postcopy.cond, &postcopy.mutex);
+    }
+    qemu_mutex_unlock(&postcopy.mutex);
+
+    close(postcopy.uffd);
+    close(postcopy.quit_fds[0]);
+    close(postcopy.quit_fds[1]);
+    close(postcopy.done_fds[0]);
+    close(postcopy.done_fds[1]);
+    qemu_fclose(postcopy.file);
+    close(postcopy.return_fd);
+
+    g_free(postcopy.discards);
+    postcopy.discards = NULL;
+    postcopy.nb_discards = 0;
+    postcopy.active = false;
+}
+
+/* Runs in the main loop once the listen thread is done with the stream */
+static void postcopy_listen_done(void *opaque)
+{
+    char c;
+    int ret;
+
+    ret = read(postcopy.done_fds[0], &c, 1);
+    if (ret != 1) {
+        return;
+    }
+    qemu_set_fd_handler(postcopy.done_fds[0], NULL, NULL, NULL);
+
+    qemu_mutex_lock(&postcopy.mutex);
+    ret = postcopy.load_result;
+    qemu_mutex_unlock(&postcopy.mutex);
+
+    if (ret < 0) {
+        /* The only up to date copy of the missing pages was on the source.
+         * The guest cannot be stopped either, since vCPUs may be blocked on
+         * those pages, and unregistering the RAM would let them read zeroes
+         * instead.  */
+        fprintf(stderr, "postcopy: failed to receive guest RAM: %s\n",
+                strerror(-ret));
+        exit(1);
+    }
+
+    DPRINTF("all pages received\n");
+    postcopy_ram_incoming_cleanup();
+}
+
+static void *postcopy_listen_thread(void *opaque)
+{
+    char c = 0;
+    ssize_t len;
+    int ret;
+
+    ret = ram_postcopy_load(postcopy.file);
+
+    qemu_mutex_lock(&postcopy.mutex);
+    postcopy.load_result = ret;
+    qemu_mutex_unlock(&postcopy.mutex);
+
+    /* the postcopy state must not be touched after this */
+    do {
+        len = write(postcopy.done_fds[1], &c, 1);
+    } while (len < 0 && errno == EINTR);
+    if (len != 1) {
+        fprintf(stderr, "postcopy: cannot notify the main loop: %s\n",
+                strerror(errno));
+    }
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_start(QEMUFile *f)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    RAMBlock *block;
+    int i;
+
+    postcopy.return_fd = qemu_socket_fd(f);
+    if (postcopy.return_fd < 0) {
+        fprintf(stderr, "postcopy: migration must use a socket\n");
+        return -EINVAL;
+    }
+    if (mem_path) {
+        fprintf(stderr, "postcopy: -mem-path is not supported\n");
+        return -ENOTSUP;
+    }
+    if (!postcopy_ram_supported()) {
+        fprintf(stderr, "postcopy: not supported on this host\n");
+        return -ENOTSUP;
+    }
+
+    postcopy.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy.uffd < 0) {
+        return -errno;
+    }
+    if (ioctl(postcopy.uffd, UFFDIO_API, &api) < 0) {
+        close(postcopy.uffd);
+        return -errno;
+    }
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg = {
+            .range.start = (uintptr_t)block->host,
+            .range.len = block->length,
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+
+        if (ioctl(postcopy.uffd, UFFDIO_REGISTER, &reg) < 0 ||
+            !(reg.ioctls & ((uint64_t)1 << _UFFDIO_COPY))) {
+            fprintf(stderr, "postcopy: cannot register RAM block %s: %s\n",
+                    block->idstr, strerror(errno));
+            close(postcopy.uffd);
+            return -EINVAL;
+        }
+    }
+
+    /* from now on, touching these pages blocks until they arrive */
+    for (i = 0; i < postcopy.nb_discards; i++) {
+        qemu_madvise(postcopy.discards[i].host, postcopy.discards[i].length,
+                     QEMU_MADV_DONTNEED);
+    }
+    DPRINTF("discarded %d ranges\n", postcopy.nb_discards);
+
+    if (qemu_pipe(postcopy.quit_fds) < 0) {
+        close(postcopy.uffd);
+        return -errno;
+    }
+    if (qemu_pipe(postcopy.done_fds) < 0) {
+        close(postcopy.quit_fds[0]);
+        close(postcopy.quit_fds[1]);
+        close(postcopy.uffd);
+        return -errno;
+    }
+    qemu_set_fd_handler(postcopy.done_fds[0], postcopy_listen_done, NULL,
+                        NULL);
+
+    postcopy.file = f;
+    postcopy.fault_thread_done = false;
+    postcopy.load_result = 0;
+    postcopy.active = true;
+    qemu_mutex_init(&postcopy.mutex);
+    qemu_cond_init(&postcopy.cond);
+    qemu_thread_create(&postcopy.fault_thread, postcopy_fault_thread, NULL);
+    qemu_thread_create(&postcopy.listen_thread, postcopy_listen_thread, NULL);
+
+    return 0;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)from,
+        .len = TARGET_PAGE_SIZE,
+    };
+
+    /* EEXIST: the page was not discarded, nothing to do */
+    if (ioctl(postcopy.uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero = {
+        .range.start = (uintptr_t)host,
+        .range.len = TARGET_PAGE_SIZE,
+    };
+
+    if (ioctl(postcopy.uffd, UFFDIO_ZEROPAGE, &zero) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+#else
+
+bool postcopy_ram_supported(void)
+{
+    return false;
+}
+
+void postcopy_ram_discard_range(void *host, size_t length)
+{
+}
+
+int postcopy_ram_incoming_start(QEMUFile *f)
+{
+    fprintf(stderr, "postcopy: not supported on this host\n");
+    return -ENOTSUP;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    return -ENOTSUP;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    return -ENOTSUP;
+}
+
+#endif
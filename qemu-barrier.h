@@ -13,6 +13,13 @@
  * load/stores from C code.
  */
 #define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+
+/*
+ * Stores may still be reordered after later loads, so a full barrier
+ * needs a fence.
+ */
+#define smp_mb()    __sync_synchronize()
 
 #elif defined(_ARCH_PPC)
 
@@ -22,6 +29,8 @@
  * each other
  */
 #define smp_wmb()   asm volatile("eieio" ::: "memory")
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
 
 #else
 
@@ -32,6 +41,8 @@
  * be overkill.
  */
 #define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
 
 #endif
 
@@ -130,6 +130,7 @@ int qemu_fls(int i);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 int qemu_parse_fd(const char *param);
+bool buffer_is_zero(const void *buf, size_t len);
 
 /*
  * strtosz() suffixes used to specify the default treatment of an
@@ -244,6 +245,8 @@ typedef uint64_t pcibus_t;
 
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
+int tb_cache_open(const char *filename);
+void tb_cache_save(void);
 
 void cpu_exec_init_all(void);
 
@@ -263,6 +266,7 @@ struct qemu_work_item {
     void (*func)(void *data);
     void *data;
     int done;
+    bool free;
 };
 
 #ifdef CONFIG_USER_ONLY
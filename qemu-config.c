@@ -85,6 +85,46 @@ static QemuOptsList qemu_drive_opts = {
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
             .help = "open drive file as read-only",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 L2 table cache in bytes",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the qcow2 refcount block cache in bytes",
+        },{
+            .name = "cache-clean-interval",
+            .type = QEMU_OPT_NUMBER,
+            .help = "seconds between drops of unused qcow2 cache entries",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy read data from backing file into image file",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -135,7 +135,10 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,l2-cache-size=size]\n"
+    "       [,refcount-cache-size=size][,cache-clean-interval=seconds]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
+    "       [,copy-on-read=on|off]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -186,8 +189,33 @@ host disk is full; report the error to the guest otherwise).
 The default setting is @option{werror=enospc} and @option{rerror=report}.
 @item readonly
 Open drive @option{file} as read-only. Guest write attempts will fail.
+@item l2-cache-size=@var{size},refcount-cache-size=@var{size}
+Set the size in bytes of the qcow2 L2 table and refcount block caches.
+Each cached table covers one cluster, so a 1 MB L2 cache maps 8 GB of a
+qcow2 image with 64 KB clusters.  By default 16 L2 tables and 4 refcount
+blocks are cached.
+@item cache-clean-interval=@var{seconds}
+Every @var{seconds} seconds, drop the qcow2 cache entries that have not
+been used since the last interval and return their memory to the host.
+0 (the default) disables this.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the bandwidth of the drive to @var{b} bytes per second in total, or
+to @var{r} bytes per second for reads and @var{w} for writes.  Requests
+over the limit are queued, not failed.  0 (the default) means no limit.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} requests per second in total, or to @var{r}
+reads and @var{w} writes per second.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy read backing
+file sectors into the image file.  Guest reads then turn a slow or shared
+backing file into a local cache of the data the guest actually uses.
+Copy-on-read needs a writable drive.
 @end table
 
+The total limit and the separate read and write limits of the same kind
+can't be used together.  The limits can be changed at run time with the
+@code{block_set_io_throttle} monitor command.
+
 By default, writethrough caching is used for all block device.  This means that
 the host page cache will be used to read and write data but write notification
 will be sent to the guest only when the data has been reported as written by
@@ -1197,7 +1225,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,vhostzerocopy=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1211,6 +1239,10 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use vhostzerocopy=on to warn if vhost cannot transmit without copying\n"
+    "                use 'queues=n' to open n queues on a multiqueue TAP interface\n"
+    "                use 'fds=x:y:...:z' and 'vhostfds=x:y:...:z' to connect to the\n"
+    "                queues of an already opened multiqueue TAP interface\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
@@ -1223,6 +1255,12 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                on host and listening for incoming connections on 'socketpath'.\n"
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
+#endif
+#ifdef CONFIG_LINUX
+    "-net packet[,vlan=n][,name=str],ifname=name[,frames=n][,framesize=n]\n"
+    "                connect the vlan 'n' to host interface 'name' through\n"
+    "                memory-mapped AF_PACKET rings of 'frames' frames of\n"
+    "                'framesize' bytes each\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1236,6 +1274,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "tap|"
 #ifdef CONFIG_VDE
     "vde|"
+#endif
+#ifdef CONFIG_LINUX
+    "packet|"
 #endif
     "socket],id=str[,option][,option][,...]\n", QEMU_ARCH_ALL)
 STEXI
@@ -1390,6 +1431,21 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues on a
+multiqueue TAP interface, each with its own file descriptor and, with
+@option{vhost=on}, its own vhost-net worker.  @option{fds} and
+@option{vhostfds} pass the already opened queues instead.  A virtio-net
+device with @option{mq=on} exposes them to the guest as separate queue pairs:
+@example
+qemu linux.img -netdev tap,id=hn0,queues=4,vhost=on \
+               -device virtio-net-pci,netdev=hn0,mq=on
+@end example
+
+Zero-copy transmit in vhost-net is enabled for the whole host with the
+@code{experimental_zcopytx=1} parameter of the @code{vhost_net} kernel module.
+@option{vhostzerocopy=on} makes QEMU warn when it is not available.  The
+@code{query-vhost} monitor command reports whether it is in use.
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
@@ -1471,6 +1527,23 @@ vde_switch -F -sock /tmp/myswitch
 qemu linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -net packet[,vlan=@var{n}][,name=@var{name}],ifname=@var{ifname}[,frames=@var{n}][,framesize=@var{size}]
+Connect VLAN @var{n} directly to the host interface @var{ifname}, which is put
+into promiscuous mode.  Packets are exchanged with the host kernel through
+AF_PACKET rings mapped into QEMU, so bursts of packets are received and sent
+without a system call per packet.  Each ring holds @var{n} frames (256 by
+default) of @var{size} bytes (2048 by default); @var{size} must be a power of
+two and larger frames are needed for jumbo frames.  This option is only
+available on Linux hosts and requires CAP_NET_RAW.
+
+Example:
+@example
+# attach a guest to one end of a veth pair
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+qemu linux.img -net nic -net packet,ifname=veth0
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -2480,6 +2553,20 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep translated code in 'file' across runs\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Load translated code from @var{file} at startup and save the code
+translated during this run to it on exit.  Blocks are only reused if the
+guest code is unchanged, so this mostly speeds up booting the same guest
+again.  The file is only valid for the QEMU binary that wrote it and is
+silently rebuilt otherwise.  It is ignored with KVM, and not supported
+for all targets and hosts.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
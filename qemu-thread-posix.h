@@ -14,4 +14,7 @@ struct QemuThread {
     pthread_t thread;
 };
 
+/* Waits for a thread to exit and returns its return value */
+void *qemu_thread_join(QemuThread *thread);
+
 #endif
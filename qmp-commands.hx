@@ -558,6 +558,265 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-set-capability",
+        .args_type  = "capability:s,state:b",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_capability,
+    },
+
+SQMP
+migrate-set-capability
+----------------------
+
+Enable/Disable migration capabilities
+
+- "capability": capability name (json-string)
+- "state": enable or disable the capability (json-bool)
+
+Capabilities that change the stream format make older destinations refuse
+the incoming migration.
+
+- "compress": compress RAM pages with zlib using worker threads
+- "xbzrle": send re-dirtied pages as deltas against a cache of sent pages
+- "postcopy-ram": allow switching to postcopy with migrate-start-postcopy
+- "auto-converge": throttle the vCPUs when the guest dirties memory too fast
+  for the migration to converge (does not change the stream format)
+- "multifd": send RAM pages over several connections (tcp and unix only,
+  must be enabled on the destination too)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-capability" , "arguments":
+     { "capability": "compress", "state": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-capabilities",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
+    },
+
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Query current migration capabilities
+
+- "capabilities": migration capabilities state
+         - "compress" : compress RAM pages (json-bool)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "state": false, "capability": "compress" } ] }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,"
+                      "decompress-threads:i?,multifd-channels:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": zlib compression level, 1 to 9 (json-int, optional)
+- "compress-threads": number of compression threads on the source
+                      (json-int, optional)
+- "decompress-threads": number of decompression threads on the destination,
+                        0 decompresses inline (json-int, optional)
+- "multifd-channels": number of extra connections used by the multifd
+                      capability, 1 to 255 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+     { "compress-level": 1, "compress-threads": 8 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "compress-level": zlib compression level (json-int)
+- "compress-threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+- "multifd-channels": number of multifd connections (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2, "multifd-channels": 2 } }
+
+EQMP
+
+    {
+        .name       = "dirty-rate-start",
+        .args_type  = "period:i?",
+        .mhandler.cmd_new = qmp_marshal_input_dirty_rate_start,
+    },
+
+SQMP
+dirty-rate-start
+----------------
+
+Start measuring the guest dirty rate.  The rate is the number of distinct
+pages written during a period, and is measured until dirty-rate-stop.  A
+migration started meanwhile uses the same period.  Dirty logging is enabled
+while the measurement runs.
+
+Arguments:
+
+- "period": length of a period in milliseconds, 100 to 60000, default 1000
+            (json-int, optional)
+
+Example:
+
+-> { "execute": "dirty-rate-start", "arguments": { "period": 500 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "dirty-rate-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_dirty_rate_stop,
+    },
+
+SQMP
+dirty-rate-stop
+---------------
+
+Stop the measurement started with dirty-rate-start.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "dirty-rate-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the guest dirty rate.
+
+Return a json-object with the following information:
+
+- "active": true if the rate is being measured, because of dirty-rate-start
+            or because a migration is running (json-bool)
+- "period": length of a period in milliseconds (json-int)
+- "pages-rate": number of distinct pages dirtied per second during the last
+                complete period (json-int, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "active": true, "period": 1000, "pages-rate": 2764 } }
+
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the running migration to postcopy.  The guest is stopped, its device
+state is sent and it resumes on the destination; the remaining pages follow
+in the background and on demand.  Requires the postcopy-ram capability.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-cache-size",
+        .args_type  = "value:o",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_cache_size,
+    },
+
+SQMP
+migrate-set-cache-size
+----------------------
+
+Set cache size to be used by XBZRLE migration, the cache size will be rounded
+down to a whole number of target pages
+
+Arguments:
+
+- "value": cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-cache-size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-cache-size",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_cache_size,
+    },
+
+SQMP
+query-migrate-cache-size
+------------------------
+
+Show cache size to be used by XBZRLE migration
+
+Returns the cache size in bytes (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-cache-size" }
+<- { "return": 67108864 }
+
 EQMP
 
     {
@@ -680,6 +939,122 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change I/O throttle limits for a block drive.  Requests over the limits are
+queued until they fit.  A limit of 0 means no limit.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps": total throughput limit in bytes per second (json-int)
+- "bps_rd": read throughput limit in bytes per second (json-int)
+- "bps_wr": write throughput limit in bytes per second (json-int)
+- "iops": total I/O operations per second (json-int)
+- "iops_rd": read I/O operations per second (json-int)
+- "iops_wr": write I/O operations per second (json-int)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                         "bps": 1000000,
+                                                         "bps_rd": 0,
+                                                         "bps_wr": 0,
+                                                         "iops": 0,
+                                                         "iops_rd": 0,
+                                                         "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-stream",
+        .args_type  = "device:B,speed:o?",
+        .mhandler.cmd_new = qmp_marshal_input_block_stream,
+    },
+
+SQMP
+block-stream
+------------
+
+Copy every cluster that a block device still reads from its backing file
+chain into the device's image, in the background.  Guest writes keep going
+to the image meanwhile.  When all data has been copied, the backing file is
+dropped and the BLOCK_JOB_COMPLETED event is emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum speed in bytes per second, 0 for unlimited
+           (json-int, optional)
+
+Example:
+
+-> { "execute": "block-stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-job-set-speed",
+        .args_type  = "device:B,value:o",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_set_speed,
+    },
+
+SQMP
+block-job-set-speed
+-------------------
+
+Set the maximum speed of the block job running on a device.  A speed of 0
+means no limit.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value": maximum speed in bytes per second (json-int)
+
+Example:
+
+-> { "execute": "block-job-set-speed",
+     "arguments": { "device": "virtio0", "value": 10485760 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-job-cancel",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_job_cancel,
+    },
+
+SQMP
+block-job-cancel
+----------------
+
+Stop the block job running on a device.  The command returns at once; the
+BLOCK_JOB_CANCELLED event is emitted once the job has stopped.  A cancelled
+streaming job leaves the backing file in place and can be started again
+later.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block-job-cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1228,6 +1603,25 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "cor_bytes": bytes copied from the backing file into the image by
+                   copy-on-read (json-int)
+    - "cor_operations": copy-on-read operations (json-int)
+    - "l2_cache_hits": L2 table lookups served from the metadata cache,
+                       only for formats with such a cache (json-int, optional)
+    - "l2_cache_misses": L2 table lookups that loaded the table
+                         (json-int, optional)
+    - "refcount_cache_hits": refcount block lookups served from the metadata
+                             cache (json-int, optional)
+    - "refcount_cache_misses": refcount block lookups that loaded the block
+                               (json-int, optional)
+    - "bps": total throughput limit in bytes per second, only while I/O
+             throttling is enabled (json-int, optional)
+    - "bps_rd": read throughput limit in bytes per second (json-int, optional)
+    - "bps_wr": write throughput limit in bytes per second
+                (json-int, optional)
+    - "iops": total I/O operations per second limit (json-int, optional)
+    - "iops_rd": read I/O operations per second limit (json-int, optional)
+    - "iops_wr": write I/O operations per second limit (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1318,6 +1712,179 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
     },
 
+SQMP
+query-block-jobs
+----------------
+
+Show the block jobs that are running.
+
+Each job is a json-object and the returned value is a json-array of all
+jobs.  The json-object contains the following:
+
+- "type": job type, "stream" for image streaming (json-string)
+- "device": device name (json-string)
+- "len": maximum progress value, the device size in bytes (json-int)
+- "offset": current progress value, in bytes (json-int)
+- "speed": rate limit in bytes per second, 0 if unlimited (json-int)
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- {
+      "return":[
+         {
+            "type":"stream",
+            "device":"virtio0",
+            "len":10737418240,
+            "offset":709632,
+            "speed":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-block-jobs",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_block_jobs,
+    },
+
+SQMP
+query-aio-pool
+--------------
+
+Show statistics of the thread pool that performs asynchronous I/O on image
+files.
+
+Return a json-object with the following information:
+
+- "threads": number of worker threads (json-int)
+- "idle-threads": number of worker threads waiting for requests (json-int)
+- "min-threads": number of worker threads kept when idle, the peak number
+                 of busy threads in the last sampling interval (json-int)
+- "max-threads": maximum number of worker threads, adapted to the time
+                 requests wait for a thread (json-int)
+- "queues": a json-array of all request queues, each one a json-object with
+            the following information:
+    - "name": queue name, "rw" for reads and writes, "sync" for flushes
+              and ioctls (json-string)
+    - "depth": number of requests waiting for a thread (json-int)
+    - "max-depth": highest "depth" seen so far (json-int)
+    - "active": number of requests being processed (json-int)
+    - "max-active": number of threads that may process requests from this
+                    queue at the same time (json-int)
+    - "dispatched": number of requests handed to a thread so far (json-int)
+    - "total-wait-ns": total time requests waited for a thread, in
+                       nanoseconds (json-int)
+    - "max-wait-ns": longest time a request waited for a thread, in
+                     nanoseconds (json-int)
+
+Example:
+
+-> { "execute": "query-aio-pool" }
+<- {
+      "return":{
+         "threads":4,
+         "idle-threads":3,
+         "min-threads":1,
+         "max-threads":64,
+         "queues":[
+            {
+               "name":"rw",
+               "depth":0,
+               "max-depth":12,
+               "active":0,
+               "max-active":64,
+               "dispatched":15731,
+               "total-wait-ns":52304618,
+               "max-wait-ns":1845233
+            },
+            {
+               "name":"sync",
+               "depth":0,
+               "max-depth":1,
+               "active":1,
+               "max-active":32,
+               "dispatched":211,
+               "total-wait-ns":803421,
+               "max-wait-ns":40112
+            }
+         ]
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-aio-pool",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_aio_pool,
+    },
+
+SQMP
+query-vhost
+-----------
+
+Show statistics of vhost-net backends.
+
+Return a json-array. Each vhost-net backend is represented by a json-object,
+which contains:
+
+- "netdev": name of the network backend (json-string)
+- "started": true if the host kernel is processing the virtqueues (json-bool)
+- "fallback": true if vhost-net could not be started and the device is
+              processed by QEMU instead (json-bool)
+- "zerocopy": true if the host kernel transmits without copying guest
+              buffers (json-bool)
+- "queues": a json-array of the virtqueues of the backend, each one a
+            json-object with the following information:
+    - "index": virtqueue index in the device (json-int)
+    - "size": number of descriptors in the ring (json-int)
+    - "pending": number of buffers the guest made available that have not
+                 been used yet (json-int)
+    - "kicks": number of guest notifications handled by QEMU (json-int,
+               optional)
+    - "calls": number of interrupts injected by QEMU (json-int, optional)
+
+While vhost is started the host kernel and KVM exchange notifications
+directly through ioeventfd and irqfd, so QEMU cannot count them and "kicks"
+and "calls" are omitted.
+
+Example:
+
+-> { "execute": "query-vhost" }
+<- {
+      "return":[
+         {
+            "netdev":"hostnet0",
+            "started":true,
+            "fallback":false,
+            "zerocopy":true,
+            "queues":[
+               {
+                  "index":0,
+                  "size":256,
+                  "pending":256
+               },
+               {
+                  "index":1,
+                  "size":256,
+                  "pending":0
+               }
+            ]
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-vhost",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_vhost,
+    },
+
 SQMP
 query-cpus
 ----------
@@ -1891,17 +2458,34 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+         - "dirty-pages-rate": pages dirtied per second by the guest
+           (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information (in bytes):
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "downtime": only present if "status" is "postcopy-active" or "completed",
+  time in milliseconds the guest was stopped on the source (json-int)
+- "cpu-throttle-percentage": only present while auto-converge throttles the
+  guest, percentage of time the vCPUs are kept off the host CPU (json-int)
+- "xbzrle-cache": only present if "status" is "active" and the xbzrle
+  capability is enabled, it is a json-object with the following
+  information:
+         - "cache-size": XBZRLE cache size in bytes (json-int)
+         - "bytes": bytes sent as XBZRLE deltas (json-int)
+         - "pages": pages sent as XBZRLE deltas (json-int)
+         - "cache-hit": dirty pages found in the cache (json-int)
+         - "cache-miss": dirty pages not found in the cache (json-int)
+         - "overflow": cache hits sent as full pages (json-int)
+         - "bytes-saved": bytes not sent thanks to XBZRLE (json-int)
 
 Examples:
 
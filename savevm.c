@@ -83,6 +83,7 @@
 #include "qemu-queue.h"
 #include "qemu-timer.h"
 #include "cpus.h"
+#include "iov.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -157,6 +158,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE 64
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
@@ -165,6 +167,7 @@ struct QEMUFile {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
     void *opaque;
     int is_write;
 
@@ -174,6 +177,11 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /* with writev_buffer, the data to write when flushing: pieces of buf
+       and buffers passed to qemu_put_buffer_async() */
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+
     int last_error;
 };
 
@@ -333,6 +341,85 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* Returns the socket behind @f, or -1 if @f was not opened with
+   qemu_fopen_socket(). */
+int qemu_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+    s = f->opaque;
+
+    return s->fd;
+}
+
+/* In-memory files, used to send the device state as a single blob */
+
+typedef struct QEMUFileMem
+{
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+    QEMUFile *file;
+} QEMUFileMem;
+
+static int mem_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileMem *s = opaque;
+
+    if (pos + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, pos + size);
+        s->buf = g_realloc(s->buf, s->capacity);
+    }
+    memcpy(s->buf + pos, buf, size);
+    s->size = MAX(s->size, pos + size);
+
+    return size;
+}
+
+static int mem_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileMem *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->buf + pos, size);
+
+    return size;
+}
+
+static int mem_close(void *opaque)
+{
+    QEMUFileMem *s = opaque;
+
+    g_free(s->buf);
+    g_free(s);
+    return 0;
+}
+
+/* Open an in-memory file.  For reading, @buf is the contents and is owned
+   by the file from then on; for writing @buf must be NULL. */
+static QEMUFile *qemu_fopen_mem(uint8_t *buf, size_t size)
+{
+    QEMUFileMem *s = g_malloc0(sizeof(QEMUFileMem));
+
+    if (buf) {
+        s->buf = buf;
+        s->size = s->capacity = size;
+        s->file = qemu_fopen_ops(s, NULL, mem_get_buffer, mem_close,
+                                 NULL, NULL, NULL);
+    } else {
+        s->file = qemu_fopen_ops(s, mem_put_buffer, NULL, mem_close,
+                                 NULL, NULL, NULL);
+    }
+    return s->file;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -426,6 +513,12 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
     return f;
 }
 
+void qemu_file_set_writev_buffer(QEMUFile *f,
+                                 QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
 int qemu_file_get_error(QEMUFile *f)
 {
     return f->last_error;
@@ -441,6 +534,23 @@ void qemu_fflush(QEMUFile *f)
     if (!f->put_buffer)
         return;
 
+    if (f->writev_buffer) {
+        if (f->is_write && f->iovcnt > 0) {
+            ssize_t len, expect;
+
+            expect = iov_size(f->iov, f->iovcnt);
+            len = f->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                   f->buf_offset);
+            if (len == expect)
+                f->buf_offset += len;
+            else
+                f->last_error = -EINVAL;
+        }
+        f->iovcnt = 0;
+        f->buf_index = 0;
+        return;
+    }
+
     if (f->is_write && f->buf_index > 0) {
         int len;
 
@@ -497,6 +607,46 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt > 0 ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* consecutive puts usually land right after each other in buf */
+    if (last && (uint8_t *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+
+    f->is_write = 1;
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
+/* Like qemu_put_buffer(), but the data is not copied: @buf must stay valid
+   and unchanged until the next qemu_fflush().  Used to send guest RAM to
+   the migration socket straight from guest memory. */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (!f->last_error && size > 0) {
+        add_to_iovec(f, buf, size);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -516,6 +666,9 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         f->buf_index += l;
         buf += l;
         size -= l;
+        if (f->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        }
         if (f->buf_index >= IO_BUF_SIZE)
             qemu_fflush(f);
     }
@@ -531,6 +684,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE)
         qemu_fflush(f);
 }
@@ -619,6 +775,9 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    if (f->writev_buffer && f->is_write) {
+        return f->buf_offset + iov_size(f->iov, f->iovcnt);
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -1116,6 +1275,7 @@ typedef struct SaveStateEntry {
     int instance_id;
     int alias_id;
     int version_id;
+    int save_version_id;
     int section_id;
     SaveSetParamsHandler *set_params;
     SaveLiveStateHandler *save_live_state;
@@ -1181,6 +1341,7 @@ int register_savevm_live(DeviceState *dev,
 
     se = g_malloc0(sizeof(SaveStateEntry));
     se->version_id = version_id;
+    se->save_version_id = version_id;
     se->section_id = global_section_id++;
     se->set_params = set_params;
     se->save_live_state = save_live_state;
@@ -1229,6 +1390,26 @@ int register_savevm(DeviceState *dev,
                                 NULL, NULL, save_state, load_state, opaque);
 }
 
+/* Select the version a section is tagged with in the outgoing stream.  The
+   registered version_id stays the highest one accepted on load, so a handler
+   can keep emitting an older format (loadable by older QEMUs) unless a newer
+   stream feature was asked for. */
+int qemu_savevm_set_version(const char *idstr, int instance_id, int version_id)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!strcmp(se->idstr, idstr) && se->instance_id == instance_id) {
+            if (version_id > se->version_id) {
+                return -EINVAL;
+            }
+            se->save_version_id = version_id;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
 void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
 {
     SaveStateEntry *se, *new_se;
@@ -1267,6 +1448,7 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
 
     se = g_malloc0(sizeof(SaveStateEntry));
     se->version_id = vmsd->version_id;
+    se->save_version_id = vmsd->version_id;
     se->section_id = global_section_id++;
     se->save_live_state = NULL;
     se->save_state = NULL;
@@ -1487,6 +1669,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1534,7 +1717,7 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        qemu_put_be32(f, se->save_version_id);
 
         ret = se->save_live_state(mon, f, QEMU_VM_SECTION_START, se->opaque);
         if (ret < 0) {
@@ -1589,13 +1772,11 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static int qemu_savevm_state_live_end(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
             continue;
@@ -1610,6 +1791,13 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         }
     }
 
+    return 0;
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1626,12 +1814,58 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        qemu_put_be32(f, se->save_version_id);
 
         vmstate_save(f, se);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_live_end(mon, f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_savevm_state_devices(f);
+
+    return qemu_file_get_error(f);
+}
+
+/* Switch a running migration to postcopy.  The live sections are ended
+ * (RAM only sends the list of pages that are still dirty) and the device
+ * state is sent as one blob, so that the destination can load it while
+ * already serving page faults from the rest of the stream.  Everything
+ * written to @f afterwards belongs to the RAM postcopy stream.
+ */
+int qemu_savevm_state_postcopy(Monitor *mon, QEMUFile *f)
+{
+    QEMUFile *mem;
+    QEMUFileMem *m;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_live_end(mon, f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mem = qemu_fopen_mem(NULL, 0);
+    qemu_savevm_state_devices(mem);
+    qemu_fflush(mem);
+    m = mem->opaque;
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+    qemu_put_be32(f, m->size);
+    qemu_put_buffer(f, m->buf, m->size);
+    qemu_fclose(mem);
 
     return qemu_file_get_error(f);
 }
@@ -1776,30 +2010,50 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *loadvm_handlers);
+
+/* The device state blob of a postcopy migration.  Once it has been read,
+   the rest of @f is handed to the RAM postcopy code. */
+static int qemu_loadvm_postcopy_package(QEMUFile *f,
+                                        LoadStateList *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    QEMUFile *mem;
+    uint8_t *buf;
+    uint32_t len;
     int ret;
 
-    if (qemu_savevm_state_blocked(default_mon)) {
-        return -EINVAL;
+    len = qemu_get_be32(f);
+    buf = g_malloc(len);
+    qemu_get_buffer(f, buf, len);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    ret = postcopy_ram_incoming_start(f);
+    if (ret < 0) {
+        g_free(buf);
+        return ret;
+    }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    mem = qemu_fopen_mem(buf, len);
+    ret = qemu_loadvm_state_main(mem, loadvm_handlers);
+    if (ret == 0) {
+        ret = qemu_file_get_error(mem);
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+    qemu_fclose(mem);
+
+    return ret;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1822,16 +2076,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1840,44 +2092,76 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            /* nothing follows the package in @f for the main loop */
+            return qemu_loadvm_postcopy_package(f, loadvm_handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
+    return 0;
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateList loadvm_handlers = QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(default_mon)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret < 0) {
+        goto out;
+    }
+
     cpu_synchronize_all_post_init();
 
     ret = 0;
@@ -1888,7 +2172,8 @@ out:
         g_free(le);
     }
 
-    if (ret == 0) {
+    /* with postcopy, @f now belongs to the RAM postcopy thread */
+    if (ret == 0 && !postcopy_ram_incoming_active()) {
         ret = qemu_file_get_error(f);
     }
 
@@ -2104,7 +2389,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
@@ -136,7 +136,11 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ),
+                            addr & TARGET_PAGE_MASK)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -186,7 +190,11 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ),
+                            addr & TARGET_PAGE_MASK)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -274,7 +282,11 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write),
+                            addr & TARGET_PAGE_MASK)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -321,7 +333,11 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write),
+                            addr & TARGET_PAGE_MASK)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
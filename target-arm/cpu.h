@@ -33,6 +33,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* translated code can be kept in a file across runs */
+#define TARGET_HAS_TB_CACHE
+
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
 #define EXCP_PREFETCH_ABORT  3
@@ -522,6 +525,26 @@ static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
     }
 }
 
+/* CPU configuration that the translator reads besides the TB flags.
+   'key' has TB_CACHE_KEY_WORDS words, cleared by the caller.  */
+static inline void cpu_get_tb_cache_key(CPUState *env, uint32_t *key)
+{
+    int i;
+
+    key[0] = env->features;
+    key[1] = env->teecr;
+    key[2] = env->cp15.c15_cpar;
+    key[3] = env->cp15.c9_pmuserenr;
+    for (i = 0; i < 15; i++) {
+        if (env->cp[i].cp_read) {
+            key[4] |= 1 << i;
+        }
+        if (env->cp[i].cp_write) {
+            key[4] |= 1 << (16 + i);
+        }
+    }
+}
+
 static inline bool cpu_has_work(CPUState *env)
 {
     return env->interrupt_request &
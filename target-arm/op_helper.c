@@ -247,6 +247,11 @@ void HELPER(exception)(uint32_t excp)
     cpu_loop_exit(env);
 }
 
+void *HELPER(lookup_tb_ptr)(void)
+{
+    return tb_lookup_ptr(env);
+}
+
 uint32_t HELPER(cpsr_read)(void)
 {
     return cpsr_read(env) & ~CPSR_EXEC;
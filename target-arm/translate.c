@@ -734,7 +734,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -3544,6 +3544,20 @@ static int disas_vfp_insn(CPUState * env, DisasContext *s, uint32_t insn)
     return 0;
 }
 
+/* Look up the TB for the PC already stored in r15 and jump to it,
+   falling back to the main loop if it is not in the jump cache.  */
+static inline void gen_goto_ptr(void)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 {
     TranslationBlock *tb;
@@ -3555,7 +3569,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
         tcg_gen_exit_tb((tcg_target_long)tb + n);
     } else {
         gen_set_pc_im(dest);
-        tcg_gen_exit_tb(0);
+        gen_goto_ptr();
     }
 }
 
@@ -10054,8 +10068,12 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* only the PC changed, look the next TB up without leaving
+               the generated code */
+            gen_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -36,6 +36,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* translated code can be kept in a file across runs */
+#define TARGET_HAS_TB_CACHE
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -1041,6 +1044,17 @@ static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
         (env->eflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK));
 }
 
+/* CPU configuration that the translator reads besides the TB flags.
+   'key' has TB_CACHE_KEY_WORDS words, cleared by the caller.  */
+static inline void cpu_get_tb_cache_key(CPUState *env, uint32_t *key)
+{
+    key[0] = env->cpuid_features;
+    key[1] = env->cpuid_ext_features;
+    key[2] = env->cpuid_ext2_features;
+    key[3] = env->cpuid_ext3_features;
+    key[4] = env->cpuid_vendor1;
+}
+
 void do_cpu_init(CPUState *env);
 void do_cpu_sipi(CPUState *env);
 
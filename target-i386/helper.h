@@ -7,6 +7,7 @@ DEF_HELPER_0(lock, void)
 DEF_HELPER_0(unlock, void)
 DEF_HELPER_2(write_eflags, void, tl, i32)
 DEF_HELPER_0(read_eflags, tl)
+DEF_HELPER_0(lookup_tb_ptr, ptr)
 DEF_HELPER_1(divb_AL, void, tl)
 DEF_HELPER_1(idivb_AL, void, tl)
 DEF_HELPER_1(divw_AX, void, tl)
@@ -236,6 +236,11 @@ target_ulong helper_read_eflags(void)
     return eflags;
 }
 
+void *helper_lookup_tb_ptr(void)
+{
+    return tb_lookup_ptr(env);
+}
+
 /* return non zero if error */
 static inline int load_segment(uint32_t *e1_ptr, uint32_t *e2_ptr,
                                int selector)
@@ -118,6 +118,7 @@ typedef struct DisasContext {
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_jr(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 
@@ -2289,9 +2290,10 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
         gen_jmp_im(eip);
         tcg_gen_exit_tb((tcg_target_long)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to another page: the mapping may change, so look the
+           TB up at run time */
         gen_jmp_im(eip);
-        gen_eob(s);
+        gen_jr(s);
     }
 }
 
@@ -2691,7 +2693,9 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 
 /* generate a generic end of block. Trace exception is also generated
    if needed */
-static void gen_eob(DisasContext *s)
+/* End of block.  If jr is true, the new eip has already been stored and
+   the next TB is looked up without going back to the main loop.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2705,12 +2709,28 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug();
     } else if (s->tf) {
 	gen_helper_single_step();
+    } else if (jr && TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* End of block after an indirect jump, the new eip is already stored */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -4630,7 +4650,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4657,7 +4677,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -6182,7 +6202,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6190,7 +6210,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = ldsw_code(s->pc);
@@ -0,0 +1,858 @@
+/*
+ * Persistent translation cache
+ *
+ * Translated blocks are saved to a file together with the guest code
+ * they were generated from, and later runs of the same QEMU binary load
+ * them instead of translating the code again.  The backend records every
+ * host address that it embeds in generated code (helpers, the prologue,
+ * the TB itself), so that the code can be relocated to the addresses of
+ * the new process.
+ *
+ * A block is only reused if its guest code is byte for byte identical to
+ * the one in the file.  Reloaded blocks are linked to their pages like
+ * freshly translated ones, so self-modifying code invalidates them in the
+ * usual way.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "softmmu_defs.h"
+#endif
+
+//#define DEBUG_TB_CACHE
+
+#ifdef DEBUG_TB_CACHE
+#define DPRINTF(fmt, ...) \
+    do { fprintf(stderr, "tb-cache: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#if defined(TARGET_HAS_TB_CACHE) && defined(TCG_TARGET_HAS_CODE_RELOCS) && \
+    defined(USE_DIRECT_JUMP) && defined(__linux__)
+
+#define TB_CACHE_MAGIC "QEMUTBC"
+#define TB_CACHE_VERSION 1
+
+/* Bound on the size of the file and of the entries kept in memory */
+#define TB_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+#if defined(CONFIG_USER_ONLY)
+#define TB_CACHE_GUEST_BASE GUEST_BASE
+#else
+#define TB_CACHE_GUEST_BASE 0
+#endif
+
+#define TB_CACHE_HASH_BITS 16
+#define TB_CACHE_HASH_SIZE (1 << TB_CACHE_HASH_BITS)
+
+#define TB_CACHE_MAX_SYMS 4096
+#define TB_CACHE_SYM_HASH_SIZE (2 * TB_CACHE_MAX_SYMS)
+/* relocation against the TranslationBlock itself (exit_tb) */
+#define TB_CACHE_SYM_TB 0xffff
+
+#define TB_CACHE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* The file is in host byte order, it is only valid for the binary that
+   wrote it anyway.  Layout: header, symbol names, entries, data.  */
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_syms;
+    char arch[16];
+    /* identify the QEMU binary */
+    uint64_t exe_size;
+    int64_t exe_mtime;
+    uint64_t exe_ino;
+    uint64_t guest_base;
+    uint32_t nb_entries;
+    uint32_t syms_size;         /* NUL terminated names after the header */
+    uint64_t entries_offset;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cpu_key[TB_CACHE_KEY_WORDS];
+    uint32_t icount;
+    uint16_t size;              /* guest code */
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t pad;
+    uint32_t code_size;         /* host code */
+    uint32_t nb_relocs;
+    uint64_t data_offset;       /* guest code, host code, relocations */
+} TBCacheEntry;
+
+typedef struct TBCacheReloc {
+    uint32_t offset;
+    uint16_t type;              /* TCG_CODE_RELOC_* */
+    uint16_t sym;
+    int64_t addend;
+} TBCacheReloc;
+
+typedef struct TBCacheItem {
+    TBCacheEntry e;
+    const uint8_t *data;
+    int used;                   /* loaded or added during this run */
+    struct TBCacheItem *hash_next;
+} TBCacheItem;
+
+typedef struct TBCacheSym {
+    const char *name;
+    uintptr_t addr;             /* 0 if unknown to this binary */
+} TBCacheSym;
+
+static int tb_cache_enabled;
+static int tb_cache_checked;
+static int tb_cache_dirty;
+static char *tb_cache_filename;
+static pid_t tb_cache_pid;
+static struct stat tb_cache_exe;
+
+static uint8_t *tb_cache_map;
+static size_t tb_cache_map_size;
+static uint64_t tb_cache_file_guest_base;
+
+static TBCacheItem **tb_cache_hash;
+static TBCacheItem *tb_cache_file_items;
+static int tb_cache_nb_file_items;
+static TBCacheItem **tb_cache_new_items;
+static int tb_cache_nb_new_items;
+static int tb_cache_max_new_items;
+static size_t tb_cache_total_size;
+
+static TBCacheSym tb_cache_syms[TB_CACHE_MAX_SYMS];
+static int tb_cache_nb_syms;
+/* index + 1 in tb_cache_syms, by address */
+static uint16_t tb_cache_sym_hash[TB_CACHE_SYM_HASH_SIZE];
+
+static uint64_t tb_cache_lookup_count;
+static uint64_t tb_cache_hit_count;
+
+#if !defined(CONFIG_USER_ONLY)
+/* slow paths of the softmmu loads and stores */
+static const struct {
+    const char *name;
+    void *func;
+} tb_cache_softmmu_syms[] = {
+    { "__ldb_mmu", (void *)__ldb_mmu },
+    { "__ldw_mmu", (void *)__ldw_mmu },
+    { "__ldl_mmu", (void *)__ldl_mmu },
+    { "__ldq_mmu", (void *)__ldq_mmu },
+    { "__stb_mmu", (void *)__stb_mmu },
+    { "__stw_mmu", (void *)__stw_mmu },
+    { "__stl_mmu", (void *)__stl_mmu },
+    { "__stq_mmu", (void *)__stq_mmu },
+};
+#endif
+
+static inline unsigned int tb_cache_hash_func(target_ulong pc,
+                                              target_ulong cs_base,
+                                              uint64_t flags)
+{
+    uint64_t h = (uint64_t)pc ^ cs_base ^ flags;
+
+    h ^= h >> 32;
+    h ^= h >> TB_CACHE_HASH_BITS;
+    return h & (TB_CACHE_HASH_SIZE - 1);
+}
+
+static inline size_t tb_cache_data_size(const TBCacheEntry *e)
+{
+    return TB_CACHE_ALIGN(e->size + e->code_size) +
+        e->nb_relocs * sizeof(TBCacheReloc);
+}
+
+static inline const TBCacheReloc *tb_cache_relocs(const TBCacheItem *item)
+{
+    return (const TBCacheReloc *)(item->data +
+                                  TB_CACHE_ALIGN(item->e.size +
+                                                 item->e.code_size));
+}
+
+static void tb_cache_insert(TBCacheItem *item)
+{
+    unsigned int h = tb_cache_hash_func(item->e.pc, item->e.cs_base,
+                                        item->e.flags);
+
+    item->hash_next = tb_cache_hash[h];
+    tb_cache_hash[h] = item;
+    tb_cache_total_size += sizeof(TBCacheEntry) + tb_cache_data_size(&item->e);
+}
+
+/* Symbols */
+
+static inline unsigned int tb_cache_sym_hash_func(uintptr_t addr)
+{
+    return ((addr >> 4) ^ (addr >> 17)) & (TB_CACHE_SYM_HASH_SIZE - 1);
+}
+
+static void tb_cache_sym_hash_insert(int sym)
+{
+    unsigned int h = tb_cache_sym_hash_func(tb_cache_syms[sym].addr);
+
+    while (tb_cache_sym_hash[h]) {
+        h = (h + 1) & (TB_CACHE_SYM_HASH_SIZE - 1);
+    }
+    tb_cache_sym_hash[h] = sym + 1;
+}
+
+static int tb_cache_sym_hash_find(uintptr_t addr)
+{
+    unsigned int h = tb_cache_sym_hash_func(addr);
+
+    while (tb_cache_sym_hash[h]) {
+        int sym = tb_cache_sym_hash[h] - 1;
+        if (tb_cache_syms[sym].addr == addr) {
+            return sym;
+        }
+        h = (h + 1) & (TB_CACHE_SYM_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+/* Address of 'name' in this binary, or 0 */
+static uintptr_t tb_cache_sym_addr(const char *name)
+{
+#if !defined(CONFIG_USER_ONLY)
+    int i;
+#endif
+
+    if (!strcmp(name, "code_gen_prologue")) {
+        return (uintptr_t)code_gen_prologue;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    for (i = 0; i < ARRAY_SIZE(tb_cache_softmmu_syms); i++) {
+        if (!strcmp(name, tb_cache_softmmu_syms[i].name)) {
+            return (uintptr_t)tb_cache_softmmu_syms[i].func;
+        }
+    }
+#endif
+    return (uintptr_t)tcg_helper_lookup(&tcg_ctx, name);
+}
+
+/* Name the host address 'addr' for the file, or return NULL */
+static const char *tb_cache_sym_name(uintptr_t addr)
+{
+#if !defined(CONFIG_USER_ONLY)
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(tb_cache_softmmu_syms); i++) {
+        if (addr == (uintptr_t)tb_cache_softmmu_syms[i].func) {
+            return tb_cache_softmmu_syms[i].name;
+        }
+    }
+#endif
+    return tcg_helper_get_name(&tcg_ctx, (void *)addr);
+}
+
+/* Return the symbol and addend for the host address 'value', or -1 */
+static int tb_cache_find_sym(uintptr_t value, int64_t *addend)
+{
+    uintptr_t base = value;
+    const char *name;
+    int sym;
+
+    if (value - (uintptr_t)code_gen_prologue < CODE_GEN_PROLOGUE_SIZE) {
+        base = (uintptr_t)code_gen_prologue;
+    }
+    *addend = value - base;
+
+    sym = tb_cache_sym_hash_find(base);
+    if (sym >= 0) {
+        return sym;
+    }
+
+    if (base == (uintptr_t)code_gen_prologue) {
+        name = "code_gen_prologue";
+    } else {
+        name = tb_cache_sym_name(base);
+        if (!name) {
+            DPRINTF("no symbol for host address %p\n", (void *)base);
+            return -1;
+        }
+    }
+    for (sym = 0; sym < tb_cache_nb_syms; sym++) {
+        if (!strcmp(tb_cache_syms[sym].name, name)) {
+            break;
+        }
+    }
+    if (sym == tb_cache_nb_syms) {
+        if (sym == TB_CACHE_MAX_SYMS) {
+            return -1;
+        }
+        tb_cache_syms[sym].name = name;
+        tb_cache_nb_syms++;
+    }
+    tb_cache_syms[sym].addr = base;
+    tb_cache_sym_hash_insert(sym);
+    return sym;
+}
+
+/* Guest code access */
+
+/* Return the host address of the guest code page containing 'addr', or
+   NULL.  Unlike get_page_addr_code(), this never faults: a block that is
+   not mapped yet is translated instead, which raises the fault for the
+   right instruction.  */
+static uint8_t *tb_cache_code_page(CPUState *env, target_ulong addr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+#if defined(CONFIG_USER_ONLY)
+    if ((page_get_flags(page) & (PAGE_VALID | PAGE_READ)) !=
+        (PAGE_VALID | PAGE_READ)) {
+        return NULL;
+    }
+    return g2h(page);
+#else
+    int mmu_idx = cpu_mmu_index(env);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+
+    /* anything but an exact match is not RAM or ROM */
+    if (te->addr_code != page &&
+        (!tlb_victim_hit(env, mmu_idx, index,
+                         offsetof(CPUTLBEntry, addr_code), page) ||
+         te->addr_code != page)) {
+        return NULL;
+    }
+    return (uint8_t *)((uintptr_t)page + te->addend);
+#endif
+}
+
+/* Find the host addresses of the guest code [pc, pc + size[, which can
+   span two pages */
+static int tb_cache_guest_code(CPUState *env, target_ulong pc, int size,
+                               uint8_t **p1, int *len1, uint8_t **p2)
+{
+    int offset = pc & ~TARGET_PAGE_MASK;
+
+    *p1 = tb_cache_code_page(env, pc);
+    if (!*p1) {
+        return 0;
+    }
+    *p1 += offset;
+    *len1 = MIN(size, TARGET_PAGE_SIZE - offset);
+    *p2 = NULL;
+    if (*len1 < size) {
+        *p2 = tb_cache_code_page(env, pc + *len1);
+        if (!*p2) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int tb_cache_usable(CPUState *env, TranslationBlock *tb)
+{
+    /* code generated for debugging or deterministic execution is not
+       worth keeping */
+    return tb_cache_enabled && tb->cflags == 0 && !use_icount &&
+        !singlestep && !env->singlestep_enabled &&
+        QTAILQ_EMPTY(&env->breakpoints);
+}
+
+static void tb_cache_get_key(CPUState *env, uint32_t *key)
+{
+    memset(key, 0, TB_CACHE_KEY_WORDS * sizeof(uint32_t));
+    cpu_get_tb_cache_key(env, key);
+}
+
+/* The symbols of the file can only be resolved once the helpers are
+   registered, so check the file contents at the first translation */
+static void tb_cache_check(void)
+{
+    int i;
+
+    if (tb_cache_checked) {
+        return;
+    }
+    tb_cache_checked = 1;
+
+    if (tb_cache_file_guest_base != (uint64_t)TB_CACHE_GUEST_BASE) {
+        DPRINTF("guest_base changed, ignoring %s\n", tb_cache_filename);
+        memset(tb_cache_hash, 0, TB_CACHE_HASH_SIZE * sizeof(TBCacheItem *));
+        tb_cache_nb_file_items = 0;
+        tb_cache_total_size = 0;
+        return;
+    }
+    for (i = 0; i < tb_cache_nb_syms; i++) {
+        tb_cache_syms[i].addr = tb_cache_sym_addr(tb_cache_syms[i].name);
+        if (tb_cache_syms[i].addr) {
+            tb_cache_sym_hash_insert(i);
+        } else {
+            DPRINTF("unknown symbol %s\n", tb_cache_syms[i].name);
+        }
+    }
+}
+
+/* Copy the host code of 'item' to the TB and fix up its host addresses */
+static int tb_cache_relocate(TranslationBlock *tb, const TBCacheItem *item)
+{
+    const TBCacheReloc *r = tb_cache_relocs(item);
+    uint8_t *code = tb->tc_ptr;
+    int i;
+
+    memcpy(code, item->data + item->e.size, item->e.code_size);
+    for (i = 0; i < item->e.nb_relocs; i++, r++) {
+        uint8_t *field = code + r->offset;
+        uintptr_t target;
+
+        if (r->sym == TB_CACHE_SYM_TB) {
+            target = (uintptr_t)tb;
+        } else {
+            target = tb_cache_syms[r->sym].addr;
+            if (!target) {
+                return 0;
+            }
+        }
+        target += r->addend;
+
+        if (r->type == TCG_CODE_RELOC_ABS) {
+            *(tcg_target_ulong *)field = target;
+        } else {
+            tcg_target_long disp = target - (uintptr_t)(field + 4);
+            if (disp != (int32_t)disp) {
+                return 0;
+            }
+            *(int32_t *)field = disp;
+        }
+    }
+    flush_icache_range((unsigned long)code,
+                       (unsigned long)code + item->e.code_size);
+    return 1;
+}
+
+/* Fill 'tb', whose pc, cs_base, flags and cflags are set, from the cache.
+   Return 0 if the cache has no code for it.  */
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
+{
+    uint32_t key[TB_CACHE_KEY_WORDS];
+    TBCacheItem *item;
+    unsigned int h;
+
+    if (!tb_cache_usable(env, tb)) {
+        return 0;
+    }
+    tb_cache_check();
+    tb_cache_lookup_count++;
+
+    tb_cache_get_key(env, key);
+    h = tb_cache_hash_func(tb->pc, tb->cs_base, tb->flags);
+    for (item = tb_cache_hash[h]; item; item = item->hash_next) {
+        uint8_t *p1, *p2;
+        int len1;
+
+        if (item->e.pc != tb->pc || item->e.cs_base != tb->cs_base ||
+            item->e.flags != tb->flags ||
+            memcmp(item->e.cpu_key, key, sizeof(key))) {
+            continue;
+        }
+        if (!tb_cache_guest_code(env, tb->pc, item->e.size,
+                                 &p1, &len1, &p2) ||
+            memcmp(p1, item->data, len1) ||
+            (p2 && memcmp(p2, item->data + len1, item->e.size - len1))) {
+            continue;
+        }
+        if (!tb_cache_relocate(tb, item)) {
+            continue;
+        }
+
+        tb->size = item->e.size;
+        tb->icount = item->e.icount;
+        tb->tb_next_offset[0] = item->e.tb_next_offset[0];
+        tb->tb_next_offset[1] = item->e.tb_next_offset[1];
+        tb->tb_jmp_offset[0] = item->e.tb_jmp_offset[0];
+        tb->tb_jmp_offset[1] = item->e.tb_jmp_offset[1];
+        *gen_code_size_ptr = item->e.code_size;
+        item->used = 1;
+        tb_cache_hit_count++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Remember a block that was just translated */
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheItem *item;
+    TBCacheReloc *r;
+    uint8_t *p1, *p2, *data;
+    int i, len1, nb_relocs;
+
+    nb_relocs = s->nb_code_relocs;
+    if (!tb_cache_usable(env, tb) || tb->size == 0 ||
+        nb_relocs > TCG_MAX_CODE_RELOCS ||
+        tb_cache_total_size >= TB_CACHE_MAX_SIZE ||
+        !tb_cache_guest_code(env, tb->pc, tb->size, &p1, &len1, &p2)) {
+        return;
+    }
+    tb_cache_check();
+
+    item = g_malloc0(sizeof(*item));
+    item->e.pc = tb->pc;
+    item->e.cs_base = tb->cs_base;
+    item->e.flags = tb->flags;
+    tb_cache_get_key(env, item->e.cpu_key);
+    item->e.icount = tb->icount;
+    item->e.size = tb->size;
+    item->e.tb_next_offset[0] = tb->tb_next_offset[0];
+    item->e.tb_next_offset[1] = tb->tb_next_offset[1];
+    item->e.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    item->e.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    item->e.code_size = gen_code_size;
+    item->e.nb_relocs = nb_relocs;
+
+    data = g_malloc(tb_cache_data_size(&item->e));
+    memcpy(data, p1, len1);
+    if (p2) {
+        memcpy(data + len1, p2, tb->size - len1);
+    }
+    memcpy(data + tb->size, tb->tc_ptr, gen_code_size);
+    item->data = data;
+
+    r = (TBCacheReloc *)tb_cache_relocs(item);
+    for (i = 0; i < nb_relocs; i++, r++) {
+        TCGCodeReloc *cr = &s->code_relocs[i];
+        uintptr_t value = cr->value;
+        int sym;
+
+        r->offset = cr->offset;
+        r->type = cr->type;
+        if (value - (uintptr_t)tb < 4) {
+            /* TB pointer passed to exit_tb */
+            r->sym = TB_CACHE_SYM_TB;
+            r->addend = value - (uintptr_t)tb;
+        } else {
+            sym = tb_cache_find_sym(value, &r->addend);
+            if (sym < 0) {
+                g_free(data);
+                g_free(item);
+                return;
+            }
+            r->sym = sym;
+        }
+    }
+
+    if (tb_cache_nb_new_items == tb_cache_max_new_items) {
+        tb_cache_max_new_items = tb_cache_max_new_items * 2 + 256;
+        tb_cache_new_items = g_realloc(tb_cache_new_items,
+                                       tb_cache_max_new_items *
+                                       sizeof(TBCacheItem *));
+    }
+    tb_cache_new_items[tb_cache_nb_new_items++] = item;
+    item->used = 1;
+    tb_cache_insert(item);
+    tb_cache_dirty = 1;
+}
+
+/* File handling */
+
+static int tb_cache_parse(void)
+{
+    const TBCacheHeader *h = (const TBCacheHeader *)tb_cache_map;
+    const TBCacheEntry *entries;
+    const char *name, *end;
+    size_t size = tb_cache_map_size;
+    int i, j;
+
+    if (size < sizeof(*h) ||
+        memcmp(h->magic, TB_CACHE_MAGIC, sizeof(h->magic)) ||
+        h->version != TB_CACHE_VERSION ||
+        strncmp(h->arch, TARGET_ARCH, sizeof(h->arch)) ||
+        h->exe_size != tb_cache_exe.st_size ||
+        h->exe_mtime != tb_cache_exe.st_mtime ||
+        h->exe_ino != tb_cache_exe.st_ino) {
+        DPRINTF("%s was written by another QEMU binary\n", tb_cache_filename);
+        return -1;
+    }
+
+    if (h->nb_syms > TB_CACHE_MAX_SYMS ||
+        h->syms_size > size - sizeof(*h) ||
+        h->entries_offset > size || (h->entries_offset & 7) ||
+        h->nb_entries > (size - h->entries_offset) / sizeof(TBCacheEntry)) {
+        goto corrupt;
+    }
+
+    name = (const char *)(h + 1);
+    end = name + h->syms_size;
+    for (i = 0; i < h->nb_syms; i++) {
+        int len = qemu_strnlen(name, end - name);
+        if (name + len == end) {
+            goto corrupt;
+        }
+        tb_cache_syms[i].name = name;
+        tb_cache_syms[i].addr = 0;
+        name += len + 1;
+    }
+    tb_cache_nb_syms = h->nb_syms;
+
+    entries = (const TBCacheEntry *)(tb_cache_map + h->entries_offset);
+    tb_cache_file_items = g_malloc0(h->nb_entries * sizeof(TBCacheItem));
+    for (i = 0; i < h->nb_entries; i++) {
+        const TBCacheEntry *e = &entries[i];
+        TBCacheItem *item = &tb_cache_file_items[i];
+
+        if (e->size == 0 || e->size > TARGET_PAGE_SIZE ||
+            e->code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE ||
+            e->nb_relocs > TCG_MAX_CODE_RELOCS ||
+            e->data_offset > size || (e->data_offset & 7) ||
+            tb_cache_data_size(e) > size - e->data_offset) {
+            goto corrupt;
+        }
+        for (j = 0; j < 2; j++) {
+            if (e->tb_next_offset[j] != 0xffff &&
+                (e->tb_next_offset[j] > e->code_size ||
+                 e->tb_jmp_offset[j] + 4 > e->code_size)) {
+                goto corrupt;
+            }
+        }
+        item->e = *e;
+        item->data = tb_cache_map + e->data_offset;
+        for (j = 0; j < e->nb_relocs; j++) {
+            const TBCacheReloc *r = &tb_cache_relocs(item)[j];
+            size_t field_size = r->type == TCG_CODE_RELOC_ABS ?
+                sizeof(tcg_target_ulong) : 4;
+
+            if ((r->type != TCG_CODE_RELOC_ABS &&
+                 r->type != TCG_CODE_RELOC_PCREL32) ||
+                r->offset + field_size > e->code_size ||
+                (r->sym >= tb_cache_nb_syms && r->sym != TB_CACHE_SYM_TB)) {
+                goto corrupt;
+            }
+        }
+        tb_cache_insert(item);
+    }
+    tb_cache_nb_file_items = h->nb_entries;
+    tb_cache_file_guest_base = h->guest_base;
+    return 0;
+
+corrupt:
+    fprintf(stderr, "tb-cache: %s is corrupt, ignoring it\n",
+            tb_cache_filename);
+    g_free(tb_cache_file_items);
+    tb_cache_file_items = NULL;
+    tb_cache_nb_syms = 0;
+    tb_cache_total_size = 0;
+    memset(tb_cache_hash, 0, TB_CACHE_HASH_SIZE * sizeof(TBCacheItem *));
+    return -1;
+}
+
+int tb_cache_open(const char *filename)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    /* the code and the symbols are only valid for this very binary */
+    if (stat("/proc/self/exe", &tb_cache_exe) < 0) {
+        fprintf(stderr, "tb-cache: cannot identify the QEMU binary: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    tb_cache_filename = g_strdup(filename);
+    tb_cache_pid = getpid();
+    tb_cache_hash = g_malloc0(TB_CACHE_HASH_SIZE * sizeof(TBCacheItem *));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "tb-cache: cannot open %s: %s\n", filename,
+                    strerror(errno));
+            return -1;
+        }
+    } else {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                tb_cache_map = map;
+                tb_cache_map_size = st.st_size;
+                if (tb_cache_parse() < 0) {
+                    munmap(tb_cache_map, tb_cache_map_size);
+                    tb_cache_map = NULL;
+                    tb_cache_map_size = 0;
+                }
+            }
+        }
+        close(fd);
+    }
+    DPRINTF("%d entries in %s\n", tb_cache_nb_file_items, filename);
+
+    tcg_ctx.record_code_relocs = 1;
+    tb_cache_enabled = 1;
+    atexit(tb_cache_save);
+    return 0;
+}
+
+/* Write the blocks used or added during this run first, then the other
+   ones from the file until TB_CACHE_MAX_SIZE is reached */
+static int tb_cache_write(FILE *f)
+{
+    static const uint8_t zero[8];
+    TBCacheHeader h;
+    TBCacheEntry e;
+    TBCacheItem **items;
+    uint64_t offset;
+    size_t size;
+    int i, pass, nb_items;
+
+    items = g_malloc((tb_cache_nb_file_items + tb_cache_nb_new_items) *
+                     sizeof(TBCacheItem *));
+    nb_items = 0;
+    size = 0;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < tb_cache_nb_file_items + tb_cache_nb_new_items; i++) {
+            TBCacheItem *item = i < tb_cache_nb_file_items ?
+                &tb_cache_file_items[i] :
+                tb_cache_new_items[i - tb_cache_nb_file_items];
+
+            if (item->used != (pass == 0)) {
+                continue;
+            }
+            size += sizeof(TBCacheEntry) + tb_cache_data_size(&item->e);
+            if (size > TB_CACHE_MAX_SIZE) {
+                break;
+            }
+            items[nb_items++] = item;
+        }
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TB_CACHE_MAGIC, sizeof(h.magic));
+    h.version = TB_CACHE_VERSION;
+    h.nb_syms = tb_cache_nb_syms;
+    strncpy(h.arch, TARGET_ARCH, sizeof(h.arch));
+    h.exe_size = tb_cache_exe.st_size;
+    h.exe_mtime = tb_cache_exe.st_mtime;
+    h.exe_ino = tb_cache_exe.st_ino;
+    h.guest_base = TB_CACHE_GUEST_BASE;
+    h.nb_entries = nb_items;
+    for (i = 0; i < tb_cache_nb_syms; i++) {
+        h.syms_size += strlen(tb_cache_syms[i].name) + 1;
+    }
+    h.entries_offset = TB_CACHE_ALIGN(sizeof(h) + h.syms_size);
+
+    fwrite(&h, sizeof(h), 1, f);
+    for (i = 0; i < tb_cache_nb_syms; i++) {
+        fwrite(tb_cache_syms[i].name, strlen(tb_cache_syms[i].name) + 1, 1, f);
+    }
+    fwrite(zero, h.entries_offset - sizeof(h) - h.syms_size, 1, f);
+
+    offset = h.entries_offset + nb_items * sizeof(TBCacheEntry);
+    for (i = 0; i < nb_items; i++) {
+        e = items[i]->e;
+        e.data_offset = offset;
+        fwrite(&e, sizeof(e), 1, f);
+        offset += tb_cache_data_size(&e);
+    }
+    for (i = 0; i < nb_items; i++) {
+        fwrite(items[i]->data, tb_cache_data_size(&items[i]->e), 1, f);
+    }
+
+    DPRINTF("wrote %d entries to %s\n", nb_items, tb_cache_filename);
+    g_free(items);
+    return ferror(f) ? -1 : 0;
+}
+
+/* Save the cache if this run translated anything new.  Children forked
+   by a linux-user guest leave that to their parent.  */
+void tb_cache_save(void)
+{
+    char *tmpname;
+    size_t len;
+    FILE *f;
+    int fd, ret;
+
+    if (!tb_cache_enabled || !tb_cache_dirty || getpid() != tb_cache_pid) {
+        return;
+    }
+    spin_lock(&tb_lock);
+    tb_cache_dirty = 0;
+
+    /* replace the file atomically, it may be in use by another process */
+    len = strlen(tb_cache_filename) + sizeof(".XXXXXX");
+    tmpname = g_malloc(len);
+    snprintf(tmpname, len, "%s.XXXXXX", tb_cache_filename);
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        fprintf(stderr, "tb-cache: cannot create %s: %s\n", tmpname,
+                strerror(errno));
+        goto out;
+    }
+    f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        ret = -1;
+    } else {
+        ret = tb_cache_write(f);
+        if (fclose(f) != 0) {
+            ret = -1;
+        }
+    }
+    if (ret < 0 || rename(tmpname, tb_cache_filename) < 0) {
+        fprintf(stderr, "tb-cache: cannot write %s: %s\n",
+                tb_cache_filename, strerror(errno));
+        unlink(tmpname);
+    }
+
+out:
+    g_free(tmpname);
+    spin_unlock(&tb_lock);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache_enabled) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s: %d entries loaded, %d new\n",
+                tb_cache_filename, tb_cache_nb_file_items,
+                tb_cache_nb_new_items);
+    cpu_fprintf(f, "TB cache lookups    %" PRIu64 " (%d%% hit)\n",
+                tb_cache_lookup_count,
+                tb_cache_lookup_count ?
+                (int)(tb_cache_hit_count * 100 / tb_cache_lookup_count) : 0);
+}
+
+#else
+
+int tb_cache_open(const char *filename)
+{
+    fprintf(stderr, "tb-cache: not supported for this target or host\n");
+    return -1;
+}
+
+int tb_cache_load(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
+{
+    return 0;
+}
+
+void tb_cache_add(CPUState *env, TranslationBlock *tb, int gen_code_size)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
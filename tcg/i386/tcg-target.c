@@ -546,6 +546,19 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     }
 }
 
+/* Load a host address with a fixed size immediate and record it, so
+   that the translation cache can relocate it */
+static void tcg_out_movi_reloc(TCGContext *s, TCGReg ret,
+                               tcg_target_long arg)
+{
+    tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+    tcg_out_code_reloc(s, TCG_CODE_RELOC_ABS, arg);
+    tcg_out32(s, arg);
+    if (TCG_TARGET_REG_BITS == 64) {
+        tcg_out32(s, arg >> 31 >> 1);
+    }
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -943,11 +956,22 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 {
     tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
 
-    if (disp == (int32_t)disp) {
+    /* The translation cache needs an encoding that does not depend on
+       the distance to dest, which a 64-bit host only has with an
+       indirect branch.  */
+    if (disp == (int32_t)disp
+        && (TCG_TARGET_REG_BITS == 32 || !s->record_code_relocs)) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (s->record_code_relocs) {
+            tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32, dest);
+        }
         tcg_out32(s, disp);
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
+        if (s->record_code_relocs) {
+            tcg_out_movi_reloc(s, TCG_REG_R10, dest);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
+        }
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
@@ -1451,7 +1475,12 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (s->record_code_relocs && args[0]) {
+            /* TB pointer */
+            tcg_out_movi_reloc(s, TCG_REG_EAX, args[0]);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1467,6 +1496,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1778,6 +1811,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_jmp, { "ri" } },
     { INDEX_op_br, { } },
@@ -1969,6 +2003,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     /* jmp *tb.  */
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 
+    /* Return path for goto_ptr: set the return value to 0, as
+       exit_tb(0) would, and fall through to the epilogue.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -91,6 +91,7 @@ typedef enum {
 #define TCG_TARGET_HAS_nand_i32         0
 #define TCG_TARGET_HAS_nor_i32          0
 #define TCG_TARGET_HAS_deposit_i32      1
+#define TCG_TARGET_HAS_goto_ptr         1
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -121,6 +122,10 @@ typedef enum {
 
 #define TCG_TARGET_HAS_GUEST_BASE
 
+/* Host addresses in generated code are recorded for the translation
+   cache when tcg_ctx.record_code_relocs is set */
+#define TCG_TARGET_HAS_CODE_RELOCS
+
 /* Note: must be synced with dyngen-exec.h */
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
@@ -48,10 +48,25 @@ struct tcg_temp_info {
     uint16_t prev_copy;
     uint16_t next_copy;
     tcg_target_ulong val;
+    tcg_target_ulong zero_bits; /* bits known to be zero */
 };
 
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
+/* Stores to the CPU state that nothing has observed yet.  If a later
+   store covers one of them completely, the earlier one is dead.  */
+#define MAX_PENDING_STORES 8
+
+struct tcg_pending_store {
+    int op_index;
+    TCGArg base;
+    tcg_target_long offset;
+    int size;
+};
+
+static struct tcg_pending_store pending_stores[MAX_PENDING_STORES];
+static int nb_pending_stores;
+
 /* Reset TEMP's state to TCG_TEMP_ANY.  If TEMP was a representative of some
    class of equivalent temp's, a new representative should be chosen in this
    class. */
@@ -82,6 +97,7 @@ static void reset_temp(TCGArg temp, int nb_temps, int nb_globals)
         new_base = temps[temp].val;
     }
     temps[temp].state = TCG_TEMP_ANY;
+    temps[temp].zero_bits = 0;
     if (new_base != (TCGArg)-1 && temps[new_base].next_copy == new_base) {
         temps[new_base].state = TCG_TEMP_ANY;
     }
@@ -93,6 +109,12 @@ static int op_bits(TCGOpcode op)
     return def->flags & TCG_OPF_64BIT ? 64 : 32;
 }
 
+/* Mask of the bits that are significant for the result of OP */
+static tcg_target_ulong op_mask(TCGOpcode op)
+{
+    return op_bits(op) == 32 ? 0xffffffffU : (tcg_target_ulong)-1;
+}
+
 static TCGOpcode op_to_movi(TCGOpcode op)
 {
     switch (op_bits(op)) {
@@ -129,6 +151,7 @@ static void tcg_opt_gen_mov(TCGContext *s, TCGArg *gen_args, TCGArg dst,
             temps[temps[dst].next_copy].prev_copy = dst;
             temps[src].next_copy = dst;
         }
+        temps[dst].zero_bits = temps[src].zero_bits;
         gen_args[0] = dst;
         gen_args[1] = src;
 }
@@ -139,6 +162,7 @@ static void tcg_opt_gen_movi(TCGArg *gen_args, TCGArg dst, TCGArg val,
         reset_temp(dst, nb_temps, nb_globals);
         temps[dst].state = TCG_TEMP_CONST;
         temps[dst].val = val;
+        temps[dst].zero_bits = ~val;
         gen_args[0] = dst;
         gen_args[1] = val;
 }
@@ -157,6 +181,34 @@ static TCGOpcode op_to_mov(TCGOpcode op)
     }
 }
 
+/* Replace the operation at OP_INDEX by a copy of SRC to DST, or remove it
+   if DST already holds SRC.  Return the number of arguments generated. */
+static int tcg_opt_gen_copy(TCGContext *s, int op_index, TCGOpcode op,
+                            TCGArg *gen_args, TCGArg dst, TCGArg src,
+                            int nb_temps, int nb_globals)
+{
+    if ((temps[dst].state == TCG_TEMP_COPY && temps[dst].val == src)
+        || dst == src) {
+        gen_opc_buf[op_index] = INDEX_op_nop;
+        s->opt_del_op_count++;
+        return 0;
+    }
+    gen_opc_buf[op_index] = op_to_mov(op);
+    tcg_opt_gen_mov(s, gen_args, dst, src, nb_temps, nb_globals);
+    s->opt_fold_count++;
+    return 2;
+}
+
+/* Replace the operation at OP_INDEX by loading constant VAL to DST */
+static void tcg_opt_gen_const(TCGContext *s, int op_index, TCGOpcode op,
+                              TCGArg *gen_args, TCGArg dst, TCGArg val,
+                              int nb_temps, int nb_globals)
+{
+    gen_opc_buf[op_index] = op_to_movi(op);
+    tcg_opt_gen_movi(gen_args, dst, val, nb_temps, nb_globals);
+    s->opt_fold_count++;
+}
+
 static TCGArg do_constant_folding_2(TCGOpcode op, TCGArg x, TCGArg y)
 {
     switch (op) {
@@ -267,15 +319,316 @@ static TCGArg do_constant_folding(TCGOpcode op, TCGArg x, TCGArg y)
     return res;
 }
 
+static TCGArg do_constant_folding_cond_32(uint32_t x, uint32_t y, TCGCond c)
+{
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LT:
+        return (int32_t)x < (int32_t)y;
+    case TCG_COND_GE:
+        return (int32_t)x >= (int32_t)y;
+    case TCG_COND_LE:
+        return (int32_t)x <= (int32_t)y;
+    case TCG_COND_GT:
+        return (int32_t)x > (int32_t)y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+static TCGArg do_constant_folding_cond_64(uint64_t x, uint64_t y, TCGCond c)
+{
+    switch (c) {
+    case TCG_COND_EQ:
+        return x == y;
+    case TCG_COND_NE:
+        return x != y;
+    case TCG_COND_LT:
+        return (int64_t)x < (int64_t)y;
+    case TCG_COND_GE:
+        return (int64_t)x >= (int64_t)y;
+    case TCG_COND_LE:
+        return (int64_t)x <= (int64_t)y;
+    case TCG_COND_GT:
+        return (int64_t)x > (int64_t)y;
+    case TCG_COND_LTU:
+        return x < y;
+    case TCG_COND_GEU:
+        return x >= y;
+    case TCG_COND_LEU:
+        return x <= y;
+    case TCG_COND_GTU:
+        return x > y;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Result of comparing a value with itself */
+static TCGArg do_constant_folding_cond_eq(TCGCond c)
+{
+    switch (c) {
+    case TCG_COND_EQ:
+    case TCG_COND_GE:
+    case TCG_COND_LE:
+    case TCG_COND_GEU:
+    case TCG_COND_LEU:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Return 2 if the condition can't be simplified, and the result
+   of the condition (0 or 1) if it can */
+static TCGArg do_constant_folding_cond(TCGOpcode op, TCGArg x, TCGArg y,
+                                       TCGCond c)
+{
+    if (temps[x].state == TCG_TEMP_CONST && temps[y].state == TCG_TEMP_CONST) {
+        if (op_bits(op) == 32) {
+            return do_constant_folding_cond_32(temps[x].val, temps[y].val, c);
+        }
+        return do_constant_folding_cond_64(temps[x].val, temps[y].val, c);
+    }
+    if (x == y) {
+        return do_constant_folding_cond_eq(c);
+    }
+    if (temps[y].state == TCG_TEMP_CONST && temps[y].val == 0) {
+        /* Nothing is below zero when unsigned */
+        if (c == TCG_COND_LTU) {
+            return 0;
+        } else if (c == TCG_COND_GEU) {
+            return 1;
+        }
+    }
+    return 2;
+}
+
+/* Same as do_constant_folding_cond for the 64-bit comparisons that 32-bit
+   hosts split in low and high halves (brcond2_i32, setcond2_i32) */
+static TCGArg do_constant_folding_cond2(TCGArg *p1, TCGArg *p2, TCGCond c)
+{
+    TCGArg al = p1[0], ah = p1[1];
+    TCGArg bl = p2[0], bh = p2[1];
+
+    if (temps[al].state == TCG_TEMP_CONST && temps[ah].state == TCG_TEMP_CONST
+        && temps[bl].state == TCG_TEMP_CONST
+        && temps[bh].state == TCG_TEMP_CONST) {
+        uint64_t a = ((uint64_t)temps[ah].val << 32) | (uint32_t)temps[al].val;
+        uint64_t b = ((uint64_t)temps[bh].val << 32) | (uint32_t)temps[bl].val;
+        return do_constant_folding_cond_64(a, b, c);
+    }
+    if (al == bl && ah == bh) {
+        return do_constant_folding_cond_eq(c);
+    }
+    return 2;
+}
+
+static tcg_target_ulong op_zero_bits_2(TCGOpcode op, TCGArg *args)
+{
+    tcg_target_ulong shift;
+
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    case INDEX_op_qemu_ld8u:
+        return ~(tcg_target_ulong)0xff;
+    CASE_OP_32_64(ld16u):
+    case INDEX_op_qemu_ld16u:
+        return ~(tcg_target_ulong)0xffff;
+    case INDEX_op_ld32u_i64:
+        return ~(tcg_target_ulong)0xffffffffU;
+    CASE_OP_32_64(ext8u):
+        return temps[args[1]].zero_bits | ~(tcg_target_ulong)0xff;
+    CASE_OP_32_64(ext16u):
+        return temps[args[1]].zero_bits | ~(tcg_target_ulong)0xffff;
+    case INDEX_op_ext32u_i64:
+        return temps[args[1]].zero_bits | ~(tcg_target_ulong)0xffffffffU;
+    CASE_OP_32_64(and):
+        return temps[args[1]].zero_bits | temps[args[2]].zero_bits;
+    CASE_OP_32_64(or):
+    CASE_OP_32_64(xor):
+        return temps[args[1]].zero_bits & temps[args[2]].zero_bits;
+    CASE_OP_32_64(shr):
+        if (temps[args[2]].state != TCG_TEMP_CONST) {
+            return 0;
+        }
+        shift = temps[args[2]].val & (op_bits(op) - 1);
+        return ((temps[args[1]].zero_bits & op_mask(op)) >> shift)
+               | ~(op_mask(op) >> shift);
+    CASE_OP_32_64(shl):
+        if (temps[args[2]].state != TCG_TEMP_CONST) {
+            return 0;
+        }
+        shift = temps[args[2]].val & (op_bits(op) - 1);
+        return (temps[args[1]].zero_bits << shift)
+               | (((tcg_target_ulong)1 << shift) - 1);
+    CASE_OP_32_64(setcond):
+    case INDEX_op_setcond2_i32:
+        return ~(tcg_target_ulong)1;
+    default:
+        return 0;
+    }
+}
+
+/* Bits known to be zero in the result of OP, computed from its inputs.
+   Must be called before the output temp is reset.  Nothing is claimed
+   about the high half of 32-bit results on 64-bit hosts.  */
+static tcg_target_ulong op_zero_bits(TCGOpcode op, TCGArg *args)
+{
+    return op_zero_bits_2(op, args) & op_mask(op);
+}
+
+static int op_store_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Return true if OP may read memory, leave the TB or fault, so that the
+   pending stores must reach memory before it.  */
+static bool op_observes_stores(TCGOpcode op, const TCGOpDef *def)
+{
+    if (def->flags & (TCG_OPF_BB_END | TCG_OPF_CALL_CLOBBER |
+                      TCG_OPF_SIDE_EFFECTS)) {
+        return true;
+    }
+    switch (op) {
+    case INDEX_op_set_label:
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_ld_i64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Only stores relative to a fixed register (env) that do not overlap the
+   memory of a global are tracked.  The register allocator accesses that
+   memory behind our back.
+
+   Globals themselves are not handled here.  A write to a global that is
+   overwritten before any read, non-const call or end of block is already
+   removed by tcg_liveness_analysis(), and const calls do not sync globals
+   at all.  What remains are the stores the register allocator emits to
+   sync globals before a non-const helper call.  Those cannot be proven
+   dead without knowing which parts of env the helper reads, which TCG
+   does not record.  */
+static bool tcg_opt_store_is_private(TCGContext *s, TCGArg base,
+                                     tcg_target_long offset, int size)
+{
+    TCGTemp *tb = &s->temps[base];
+    int i;
+
+    if (base >= s->nb_globals || !tb->fixed_reg) {
+        return false;
+    }
+    for (i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+        int ts_size = ts->type == TCG_TYPE_I64 ? 8 : 4;
+
+        if (!ts->fixed_reg && ts->mem_reg == tb->reg &&
+            ts->mem_offset < offset + size &&
+            offset < ts->mem_offset + ts_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Remove stores to the CPU state that are overwritten before any
+   operation can observe them.  The dead store keeps its arguments and
+   becomes a nop3.  */
+static void tcg_opt_track_store(TCGContext *s, int op_index, TCGOpcode op,
+                                const TCGOpDef *def, TCGArg *args)
+{
+    int i, size;
+    TCGArg base;
+    tcg_target_long offset;
+
+    size = op_store_size(op);
+    if (size == 0) {
+        /* A const and pure helper only reads its arguments and cannot
+           raise an exception, so the stores may stay pending across it.
+           A helper that is only const may still read fields of env that
+           are not globals (e.g. alpha's store_fpcr).  */
+        if (op == INDEX_op_call) {
+            int nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
+            TCGArg flags = args[nb_call_args + 1];
+
+            if ((flags & (TCG_CALL_CONST | TCG_CALL_PURE)) ==
+                (TCG_CALL_CONST | TCG_CALL_PURE)) {
+                return;
+            }
+        }
+        if (op_observes_stores(op, def)) {
+            nb_pending_stores = 0;
+        }
+        return;
+    }
+
+    base = args[1];
+    offset = args[2];
+    for (i = 0; i < nb_pending_stores; ) {
+        struct tcg_pending_store *p = &pending_stores[i];
+        if (p->base == base && p->offset >= offset &&
+            p->offset + p->size <= offset + size) {
+            gen_opc_buf[p->op_index] = INDEX_op_nop3;
+            s->opt_store_count++;
+            s->opt_del_op_count++;
+            *p = pending_stores[--nb_pending_stores];
+        } else {
+            i++;
+        }
+    }
+
+    if (nb_pending_stores < MAX_PENDING_STORES &&
+        tcg_opt_store_is_private(s, base, offset, size)) {
+        struct tcg_pending_store *p = &pending_stores[nb_pending_stores++];
+        p->op_index = op_index;
+        p->base = base;
+        p->offset = offset;
+        p->size = size;
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
-    int i, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
+    int i, n, nb_ops, op_index, nb_temps, nb_globals, nb_call_args;
     TCGOpcode op;
     const TCGOpDef *def;
     TCGArg *gen_args;
     TCGArg tmp;
+    tcg_target_ulong mask, nonzero;
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
        If this temp is a copy of other ones then this equivalence class'
@@ -286,15 +639,18 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
     memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+    nb_pending_stores = 0;
 
     nb_ops = tcg_opc_ptr - gen_opc_buf;
+    s->opt_op_count += nb_ops;
     gen_args = args;
     for (op_index = 0; op_index < nb_ops; op_index++) {
         op = gen_opc_buf[op_index];
         def = &tcg_op_defs[op];
-        /* Do copy propagation */
-        if (!(def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS))) {
-            assert(op != INDEX_op_call);
+        /* Do copy propagation.  Reading a copy instead of the original is
+           fine for any operation, only calls lay out their arguments
+           differently.  */
+        if (op != INDEX_op_call) {
             for (i = def->nb_oargs; i < def->nb_oargs + def->nb_iargs; i++) {
                 if (temps[args[i]].state == TCG_TEMP_COPY) {
                     args[i] = temps[args[i]].val;
@@ -302,6 +658,8 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
         }
 
+        tcg_opt_track_store(s, op_index, op, def, args);
+
         /* For commutative operations make constant second argument */
         switch (op) {
         CASE_OP_32_64(add):
@@ -318,6 +676,24 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args[2] = tmp;
             }
             break;
+        CASE_OP_32_64(brcond):
+            if (temps[args[0]].state == TCG_TEMP_CONST
+                && temps[args[1]].state != TCG_TEMP_CONST) {
+                tmp = args[0];
+                args[0] = args[1];
+                args[1] = tmp;
+                args[2] = tcg_swap_cond(args[2]);
+            }
+            break;
+        CASE_OP_32_64(setcond):
+            if (temps[args[1]].state == TCG_TEMP_CONST
+                && temps[args[2]].state != TCG_TEMP_CONST) {
+                tmp = args[1];
+                args[1] = args[2];
+                args[2] = tmp;
+                args[3] = tcg_swap_cond(args[3]);
+            }
+            break;
         default:
             break;
         }
@@ -331,50 +707,51 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         CASE_OP_32_64(sar):
         CASE_OP_32_64(rotl):
         CASE_OP_32_64(rotr):
+        CASE_OP_32_64(or):
+        CASE_OP_32_64(xor):
             if (temps[args[1]].state == TCG_TEMP_CONST) {
                 /* Proceed with possible constant folding. */
                 break;
             }
             if (temps[args[2]].state == TCG_TEMP_CONST
                 && temps[args[2]].val == 0) {
-                if ((temps[args[0]].state == TCG_TEMP_COPY
-                    && temps[args[0]].val == args[1])
-                    || args[0] == args[1]) {
-                    args += 3;
-                    gen_opc_buf[op_index] = INDEX_op_nop;
-                } else {
-                    gen_opc_buf[op_index] = op_to_mov(op);
-                    tcg_opt_gen_mov(s, gen_args, args[0], args[1],
-                                    nb_temps, nb_globals);
-                    gen_args += 2;
-                    args += 3;
-                }
+                gen_args += tcg_opt_gen_copy(s, op_index, op, gen_args,
+                                             args[0], args[1],
+                                             nb_temps, nb_globals);
+                args += 3;
                 continue;
             }
             break;
+        default:
+            break;
+        }
+
+        /* Simplify expression for "op r, a, 0 => movi r, 0" cases */
+        switch (op) {
         CASE_OP_32_64(mul):
+        CASE_OP_32_64(and):
             if ((temps[args[2]].state == TCG_TEMP_CONST
                 && temps[args[2]].val == 0)) {
-                gen_opc_buf[op_index] = op_to_movi(op);
-                tcg_opt_gen_movi(gen_args, args[0], 0, nb_temps, nb_globals);
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], 0,
+                                  nb_temps, nb_globals);
                 args += 3;
                 gen_args += 2;
                 continue;
             }
             break;
+        default:
+            break;
+        }
+
+        /* Simplify expression for "op r, a, a => mov r, a" cases */
+        switch (op) {
         CASE_OP_32_64(or):
         CASE_OP_32_64(and):
             if (args[1] == args[2]) {
-                if (args[1] == args[0]) {
-                    args += 3;
-                    gen_opc_buf[op_index] = INDEX_op_nop;
-                } else {
-                    gen_opc_buf[op_index] = op_to_mov(op);
-                    tcg_opt_gen_mov(s, gen_args, args[0], args[1], nb_temps,
-                                    nb_globals);
-                    gen_args += 2;
-                    args += 3;
-                }
+                gen_args += tcg_opt_gen_copy(s, op_index, op, gen_args,
+                                             args[0], args[1],
+                                             nb_temps, nb_globals);
+                args += 3;
                 continue;
             }
             break;
@@ -382,6 +759,62 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             break;
         }
 
+        /* Simplify expression for "op r, a, a => movi r, 0" cases */
+        switch (op) {
+        CASE_OP_32_64(sub):
+        CASE_OP_32_64(xor):
+        CASE_OP_32_64(andc):
+            if (args[1] == args[2]) {
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], 0,
+                                  nb_temps, nb_globals);
+                args += 3;
+                gen_args += 2;
+                continue;
+            }
+            break;
+        default:
+            break;
+        }
+
+        /* Drop zero extensions and masks whose input is already known to
+           have zeroes in all the bits they clear. */
+        mask = 0;
+        switch (op) {
+        CASE_OP_32_64(ext8u):
+            mask = 0xff;
+            break;
+        CASE_OP_32_64(ext16u):
+            mask = 0xffff;
+            break;
+        case INDEX_op_ext32u_i64:
+            mask = 0xffffffffU;
+            break;
+        CASE_OP_32_64(and):
+            if (temps[args[2]].state == TCG_TEMP_CONST) {
+                mask = temps[args[2]].val;
+            }
+            break;
+        default:
+            break;
+        }
+        if (mask != 0 && temps[args[1]].state != TCG_TEMP_CONST) {
+            nonzero = ~temps[args[1]].zero_bits & op_mask(op);
+            if ((nonzero & ~mask) == 0) {
+                gen_args += tcg_opt_gen_copy(s, op_index, op, gen_args,
+                                             args[0], args[1],
+                                             nb_temps, nb_globals);
+                args += def->nb_args;
+                continue;
+            }
+            if ((nonzero & mask) == 0) {
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], 0,
+                                  nb_temps, nb_globals);
+                gen_args += 2;
+                args += def->nb_args;
+                continue;
+            }
+        }
+
         /* Propagate constants through copy operations and do constant
            folding.  Constants will be substituted to arguments by register
            allocator where needed and possible.  Also detect copies. */
@@ -392,6 +825,7 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 || args[0] == args[1]) {
                 args += 2;
                 gen_opc_buf[op_index] = INDEX_op_nop;
+                s->opt_del_op_count++;
                 break;
             }
             if (temps[args[1]].state != TCG_TEMP_CONST) {
@@ -421,14 +855,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         case INDEX_op_ext32s_i64:
         case INDEX_op_ext32u_i64:
             if (temps[args[1]].state == TCG_TEMP_CONST) {
-                gen_opc_buf[op_index] = op_to_movi(op);
                 tmp = do_constant_folding(op, temps[args[1]].val, 0);
-                tcg_opt_gen_movi(gen_args, args[0], tmp, nb_temps, nb_globals);
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], tmp,
+                                  nb_temps, nb_globals);
                 gen_args += 2;
                 args += 2;
                 break;
             } else {
+                mask = op_zero_bits(op, args);
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].zero_bits = mask;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args += 2;
@@ -453,15 +889,17 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         CASE_OP_32_64(nor):
             if (temps[args[1]].state == TCG_TEMP_CONST
                 && temps[args[2]].state == TCG_TEMP_CONST) {
-                gen_opc_buf[op_index] = op_to_movi(op);
                 tmp = do_constant_folding(op, temps[args[1]].val,
                                           temps[args[2]].val);
-                tcg_opt_gen_movi(gen_args, args[0], tmp, nb_temps, nb_globals);
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], tmp,
+                                  nb_temps, nb_globals);
                 gen_args += 2;
                 args += 3;
                 break;
             } else {
+                mask = op_zero_bits(op, args);
                 reset_temp(args[0], nb_temps, nb_globals);
+                temps[args[0]].zero_bits = mask;
                 gen_args[0] = args[0];
                 gen_args[1] = args[1];
                 gen_args[2] = args[2];
@@ -469,6 +907,106 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                 args += 3;
                 break;
             }
+        CASE_OP_32_64(setcond):
+            tmp = do_constant_folding_cond(op, args[1], args[2], args[3]);
+            if (tmp != 2) {
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], tmp,
+                                  nb_temps, nb_globals);
+                gen_args += 2;
+                args += 4;
+                break;
+            }
+            reset_temp(args[0], nb_temps, nb_globals);
+            temps[args[0]].zero_bits = op_zero_bits(op, args);
+            for (i = 0; i < 4; i++) {
+                gen_args[i] = args[i];
+            }
+            gen_args += 4;
+            args += 4;
+            break;
+        case INDEX_op_setcond2_i32:
+            tmp = do_constant_folding_cond2(&args[1], &args[3], args[5]);
+            if (tmp != 2) {
+                tcg_opt_gen_const(s, op_index, op, gen_args, args[0], tmp,
+                                  nb_temps, nb_globals);
+                gen_args += 2;
+                args += 6;
+                break;
+            }
+            reset_temp(args[0], nb_temps, nb_globals);
+            temps[args[0]].zero_bits = op_zero_bits(op, args);
+            for (i = 0; i < 6; i++) {
+                gen_args[i] = args[i];
+            }
+            gen_args += 6;
+            args += 6;
+            break;
+        CASE_OP_32_64(brcond):
+        case INDEX_op_brcond2_i32:
+            if (op == INDEX_op_brcond2_i32) {
+                tmp = do_constant_folding_cond2(&args[0], &args[2], args[4]);
+            } else {
+                tmp = do_constant_folding_cond(op, args[0], args[1], args[2]);
+            }
+            n = def->nb_args;
+            if (tmp == 0) {
+                /* Never taken: the basic block simply continues */
+                gen_opc_buf[op_index] = INDEX_op_nop;
+                s->opt_del_op_count++;
+                s->opt_branch_count++;
+                args += n;
+                break;
+            }
+            memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
+            if (tmp == 1) {
+                /* Always taken: turn it into an unconditional branch */
+                gen_opc_buf[op_index] = INDEX_op_br;
+                gen_args[0] = args[n - 1];
+                gen_args += 1;
+                s->opt_fold_count++;
+                s->opt_branch_count++;
+                args += n;
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                *gen_args = *args;
+                args++;
+                gen_args++;
+            }
+            break;
+        case INDEX_op_add2_i32:
+        case INDEX_op_sub2_i32:
+            /* The nop emitted after add2/sub2 leaves room for the
+               second movi.  */
+            if (temps[args[2]].state == TCG_TEMP_CONST
+                && temps[args[3]].state == TCG_TEMP_CONST
+                && temps[args[4]].state == TCG_TEMP_CONST
+                && temps[args[5]].state == TCG_TEMP_CONST
+                && op_index + 1 < nb_ops
+                && gen_opc_buf[op_index + 1] == INDEX_op_nop) {
+                uint64_t a = ((uint64_t)(uint32_t)temps[args[3]].val << 32)
+                             | (uint32_t)temps[args[2]].val;
+                uint64_t b = ((uint64_t)(uint32_t)temps[args[5]].val << 32)
+                             | (uint32_t)temps[args[4]].val;
+                TCGArg rl = args[0], rh = args[1];
+
+                if (op == INDEX_op_add2_i32) {
+                    a += b;
+                } else {
+                    a -= b;
+                }
+                gen_opc_buf[op_index] = INDEX_op_movi_i32;
+                gen_opc_buf[++op_index] = INDEX_op_movi_i32;
+                tcg_opt_gen_movi(&gen_args[0], rl, (uint32_t)a,
+                                 nb_temps, nb_globals);
+                tcg_opt_gen_movi(&gen_args[2], rh, (uint32_t)(a >> 32),
+                                 nb_temps, nb_globals);
+                s->opt_fold_count++;
+                gen_args += 4;
+                args += 6;
+                break;
+            }
+            goto do_default;
         case INDEX_op_call:
             nb_call_args = (args[0] >> 16) + (args[0] & 0xffff);
             if (!(args[nb_call_args + 1] & (TCG_CALL_CONST | TCG_CALL_PURE))) {
@@ -490,7 +1028,6 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
         case INDEX_op_set_label:
         case INDEX_op_jmp:
         case INDEX_op_br:
-        CASE_OP_32_64(brcond):
             memset(temps, 0, nb_temps * sizeof(struct tcg_temp_info));
             for (i = 0; i < def->nb_args; i++) {
                 *gen_args = *args;
@@ -499,11 +1036,17 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
             break;
         default:
+        do_default:
             /* Default case: we do know nothing about operation so no
-               propagation is done.  We only trash output args.  */
+               propagation is done.  We only trash output args, but keep
+               the known zero bits of zero-extending loads.  */
+            mask = def->nb_oargs == 1 ? op_zero_bits(op, args) : 0;
             for (i = 0; i < def->nb_oargs; i++) {
                 reset_temp(args[i], nb_temps, nb_globals);
             }
+            if (def->nb_oargs == 1) {
+                temps[args[0]].zero_bits = mask;
+            }
             for (i = 0; i < def->nb_args; i++) {
                 gen_args[i] = args[i];
             }
@@ -523,3 +1066,17 @@ TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr,
     res = tcg_constant_folding(s, tcg_opc_ptr, args, tcg_op_defs);
     return res;
 }
+
+void tcg_dump_opt_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    TCGContext *s = &tcg_ctx;
+    int64_t n = s->opt_op_count ? s->opt_op_count : 1;
+
+    cpu_fprintf(f, "TCG optimizer: ops %" PRId64 " removed %" PRId64
+                " (%0.1f%%) folded %" PRId64 " (%0.1f%%)\n",
+                s->opt_op_count,
+                s->opt_del_op_count, s->opt_del_op_count * 100.0 / n,
+                s->opt_fold_count, s->opt_fold_count * 100.0 / n);
+    cpu_fprintf(f, "  branches resolved %" PRId64 " dead stores %" PRId64
+                "\n", s->opt_branch_count, s->opt_store_count);
+}
@@ -25,6 +25,11 @@
 
 int gen_new_label(void);
 
+static inline void tcg_gen_op0(TCGOpcode opc)
+{
+    *gen_opc_ptr++ = opc;
+}
+
 static inline void tcg_gen_op1_i32(TCGOpcode opc, TCGv_i32 arg1)
 {
     *gen_opc_ptr++ = opc;
@@ -847,6 +852,8 @@ static inline void tcg_gen_add_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
     tcg_gen_op6_i32(INDEX_op_add2_i32, TCGV_LOW(ret), TCGV_HIGH(ret),
                     TCGV_LOW(arg1), TCGV_HIGH(arg1), TCGV_LOW(arg2),
                     TCGV_HIGH(arg2));
+    /* Allow the optimizer room to replace add2 with two moves.  */
+    tcg_gen_op0(INDEX_op_nop);
 }
 
 static inline void tcg_gen_sub_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
@@ -854,6 +861,8 @@ static inline void tcg_gen_sub_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
     tcg_gen_op6_i32(INDEX_op_sub2_i32, TCGV_LOW(ret), TCGV_HIGH(ret),
                     TCGV_LOW(arg1), TCGV_HIGH(arg1), TCGV_LOW(arg2),
                     TCGV_HIGH(arg2));
+    /* Allow the optimizer room to replace sub2 with two moves.  */
+    tcg_gen_op0(INDEX_op_nop);
 }
 
 static inline void tcg_gen_and_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
@@ -2171,6 +2180,17 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code at ptr, which is either the start of a TB or
+   tcg_ctx.code_gen_epilogue.  Only valid if TCG_TARGET_HAS_goto_ptr.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#else
+    tcg_gen_op1_i64(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#endif
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
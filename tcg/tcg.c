@@ -173,6 +173,20 @@ int gen_new_label(void)
     return idx;
 }
 
+/* Record a host address that the backend is about to emit at code_ptr */
+static inline void tcg_out_code_reloc(TCGContext *s, int type,
+                                      tcg_target_long value)
+{
+    if (s->nb_code_relocs < TCG_MAX_CODE_RELOCS) {
+        TCGCodeReloc *r = &s->code_relocs[s->nb_code_relocs];
+
+        r->offset = s->code_ptr - s->code_buf;
+        r->type = type;
+        r->value = value;
+    }
+    s->nb_code_relocs++;
+}
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -862,6 +876,27 @@ static TCGHelperInfo *tcg_find_helper(TCGContext *s, tcg_target_ulong val)
     return NULL;
 }
 
+const char *tcg_helper_get_name(TCGContext *s, void *func)
+{
+    TCGHelperInfo *th;
+
+    th = tcg_find_helper(s, (tcg_target_ulong)func);
+    return th ? th->name : NULL;
+}
+
+/* Return the address of the helper registered as 'name', or NULL */
+void *tcg_helper_lookup(TCGContext *s, const char *name)
+{
+    int i;
+
+    for (i = 0; i < s->nb_helpers; i++) {
+        if (!strcmp(s->helpers[i].name, name)) {
+            return (void *)s->helpers[i].func;
+        }
+    }
+    return NULL;
+}
+
 static const char * const cond_name[] =
 {
     [TCG_COND_EQ] = "eq",
@@ -2081,6 +2116,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
 
     args = gen_opparam_buf;
     op_index = 0;
@@ -333,6 +333,20 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* Host addresses embedded in generated code, recorded for the
+   translation cache (tb-cache.c) */
+#define TCG_CODE_RELOC_ABS      0 /* pointer-sized absolute address */
+#define TCG_CODE_RELOC_PCREL32  1 /* 32-bit displacement from the end of
+                                     the field */
+
+#define TCG_MAX_CODE_RELOCS 512
+
+typedef struct TCGCodeReloc {
+    uint32_t offset; /* offset of the field from the start of the TB code */
+    int type;
+    tcg_target_long value; /* address the field refers to */
+} TCGCodeReloc;
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -352,6 +366,17 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* goto_ptr support: epilogue entry that returns 0 to cpu_exec */
+    uint8_t *code_gen_epilogue;
+
+    /* translation cache support: when record_code_relocs is set, the
+       backend encodes host addresses with a fixed size and records them
+       in code_relocs.  nb_code_relocs may exceed TCG_MAX_CODE_RELOCS, in
+       which case the list is incomplete.  */
+    int record_code_relocs;
+    int nb_code_relocs;
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
@@ -373,6 +398,13 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    /* optimizer statistics, reported by "info jit" */
+    int64_t opt_op_count; /* ops seen by tcg_optimize() */
+    int64_t opt_del_op_count; /* ops removed */
+    int64_t opt_fold_count; /* ops replaced by a constant, copy or br */
+    int64_t opt_branch_count; /* conditional branches resolved */
+    int64_t opt_store_count; /* dead stores to the CPU state removed */
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -572,10 +604,12 @@ void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
 
 TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
                      TCGOpDef *tcg_op_def);
+void tcg_dump_opt_info(FILE *f, fprintf_function cpu_fprintf);
 
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
 const char *tcg_helper_get_name(TCGContext *s, void *func);
+void *tcg_helper_lookup(TCGContext *s, const char *name);
 void tcg_dump_ops(TCGContext *s, FILE *outfile);
 
 void dump_ops(const uint16_t *opc_buf, const TCGArg *opparam_buf);
@@ -584,6 +618,8 @@ TCGv_i64 tcg_const_i64(int64_t val);
 TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
+#define CODE_GEN_PROLOGUE_SIZE 1024
+
 extern uint8_t code_gen_prologue[];
 
 /* TCG targets may use a different definition of tcg_qemu_tb_exec. */
@@ -0,0 +1,508 @@
+/*
+ * AF_PACKET ring backend tests
+ *
+ * The backend is attached to one end of a veth pair and a plain packet
+ * socket on the other end plays the outside world.  Creating the pair needs
+ * CAP_NET_ADMIN; without it the tests are skipped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-error.h"
+#include "main-loop.h"
+#include "net.h"
+#include "net/packet.h"
+#include "iov.h"
+
+#define VETH_BACKEND    "qtpkt0"
+#define VETH_PEER       "qtpkt1"
+#define TEST_ETH_P      0x88b5          /* local experimental ethertype */
+#define TEST_FRAMES     8               /* smallest ring net/packet.c makes */
+#define FRAME_LEN       64
+
+/*
+ * Fake net layer and main loop, just enough for net/packet.c
+ */
+
+static VLANClientState *packet_nc;
+static int packet_fd = -1;
+static IOCanReadHandler *packet_can_read;
+static IOHandler *packet_read;
+static IOHandler *packet_write;
+static void *packet_opaque;
+
+static bool peer_busy;                  /* queue instead of delivering */
+static NetPacketSent *pending_sent_cb;
+static int flush_count;
+
+static uint8_t received[32][FRAME_LEN + 4];
+static size_t received_len[32];
+static int nb_received;
+
+static const char *opt_ifname;
+static uint64_t opt_frames;
+
+const char *qemu_opt_get(QemuOpts *opts, const char *name)
+{
+    g_assert(strcmp(name, "ifname") == 0);
+    return opt_ifname;
+}
+
+uint64_t qemu_opt_get_number(QemuOpts *opts, const char *name, uint64_t defval)
+{
+    g_assert(strcmp(name, "frames") == 0);
+    return opt_frames;
+}
+
+uint64_t qemu_opt_get_size(QemuOpts *opts, const char *name, uint64_t defval)
+{
+    return defval;
+}
+
+void error_report(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+void qemu_notify_event(void)
+{
+}
+
+int qemu_set_fd_handler2(int fd, IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque)
+{
+    packet_fd = fd;
+    packet_can_read = fd_read_poll;
+    packet_read = fd_read;
+    packet_write = fd_write;
+    packet_opaque = opaque;
+    return 0;
+}
+
+VLANClientState *qemu_new_net_client(NetClientInfo *info, VLANState *vlan,
+                                     VLANClientState *peer, const char *model,
+                                     const char *name)
+{
+    VLANClientState *nc = g_malloc0(info->size);
+
+    nc->info = info;
+    packet_nc = nc;
+    return nc;
+}
+
+int qemu_can_send_packet(VLANClientState *vc)
+{
+    return 1;
+}
+
+ssize_t qemu_sendv_packet_async(VLANClientState *vc, const struct iovec *iov,
+                                int iovcnt, NetPacketSent *sent_cb)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint16_t proto;
+
+    g_assert(vc == packet_nc);
+
+    /* Ignore anything the host stack may send on the link by itself */
+    g_assert(size >= ETH_HLEN);
+    iov_to_buf(iov, iovcnt, &proto, 2 * ETH_ALEN, sizeof(proto));
+    if (proto == htons(ETH_P_8021Q)) {
+        iov_to_buf(iov, iovcnt, &proto, 2 * ETH_ALEN + 4, sizeof(proto));
+    }
+    if (proto != htons(TEST_ETH_P)) {
+        return size;
+    }
+
+    g_assert(nb_received < ARRAY_SIZE(received));
+    g_assert(size <= sizeof(received[0]));
+    iov_to_buf(iov, iovcnt, received[nb_received], 0, size);
+    received_len[nb_received++] = size;
+
+    if (peer_busy) {
+        pending_sent_cb = sent_cb;
+        return 0;
+    }
+    return size;
+}
+
+ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
+                               int size, NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return qemu_sendv_packet_async(vc, &iov, 1, sent_cb);
+}
+
+void qemu_flush_queued_packets(VLANClientState *vc)
+{
+    flush_count++;
+}
+
+void qemu_purge_queued_packets(VLANClientState *vc)
+{
+}
+
+/*
+ * Helpers
+ */
+
+static int peer_fd = -1;
+
+static bool veth_create(void)
+{
+    if (system("ip link add " VETH_BACKEND " type veth peer name "
+               VETH_PEER " 2>/dev/null") != 0) {
+        return false;
+    }
+    /* Keep IPv6 autoconfiguration chatter off the link */
+    if (system("for i in " VETH_BACKEND " " VETH_PEER "; do "
+               "echo 1 > /proc/sys/net/ipv6/conf/$i/disable_ipv6; "
+               "done 2>/dev/null; "
+               "ip link set " VETH_BACKEND " up && "
+               "ip link set " VETH_PEER " up") != 0) {
+        return false;
+    }
+    return true;
+}
+
+static void veth_destroy(void)
+{
+    if (system("ip link del " VETH_BACKEND " 2>/dev/null") != 0) {
+        fprintf(stderr, "could not delete " VETH_BACKEND "\n");
+    }
+}
+
+static void open_peer(void)
+{
+    struct sockaddr_ll sll;
+
+    peer_fd = socket(AF_PACKET, SOCK_RAW, htons(TEST_ETH_P));
+    g_assert(peer_fd >= 0);
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(TEST_ETH_P);
+    sll.sll_ifindex = if_nametoindex(VETH_PEER);
+    g_assert(bind(peer_fd, (struct sockaddr *)&sll, sizeof(sll)) == 0);
+}
+
+static void start_backend(void)
+{
+    packet_nc = NULL;
+    nb_received = 0;
+    peer_busy = false;
+    pending_sent_cb = NULL;
+    flush_count = 0;
+
+    opt_ifname = VETH_BACKEND;
+    opt_frames = TEST_FRAMES;
+    g_assert(net_init_packet(NULL, NULL, "test", NULL) == 0);
+    g_assert(packet_nc != NULL);
+    g_assert(strstr(packet_nc->info_str, "frames=8,") != NULL);
+
+    open_peer();
+}
+
+static void stop_backend(void)
+{
+    packet_nc->info->cleanup(packet_nc);
+    g_free(packet_nc);
+    packet_nc = NULL;
+    close(peer_fd);
+    peer_fd = -1;
+}
+
+static void make_frame(uint8_t *buf, int seq)
+{
+    static const uint8_t dst[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+    static const uint8_t src[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x57 };
+    int i;
+
+    memcpy(buf, dst, ETH_ALEN);
+    memcpy(buf + ETH_ALEN, src, ETH_ALEN);
+    buf[12] = TEST_ETH_P >> 8;
+    buf[13] = TEST_ETH_P & 0xff;
+    for (i = ETH_HLEN; i < FRAME_LEN; i++) {
+        buf[i] = seq + i;
+    }
+}
+
+/* Insert an 802.1Q tag with the given TCI after the MAC addresses */
+static size_t make_tagged_frame(uint8_t *buf, int seq, uint16_t tci)
+{
+    uint8_t frame[FRAME_LEN];
+
+    make_frame(frame, seq);
+    memcpy(buf, frame, 2 * ETH_ALEN);
+    buf[12] = ETH_P_8021Q >> 8;
+    buf[13] = ETH_P_8021Q & 0xff;
+    buf[14] = tci >> 8;
+    buf[15] = tci & 0xff;
+    memcpy(buf + 16, frame + 2 * ETH_ALEN, FRAME_LEN - 2 * ETH_ALEN);
+    return FRAME_LEN + 4;
+}
+
+static void peer_send(const uint8_t *buf, size_t len)
+{
+    g_assert(send(peer_fd, buf, len, 0) == (ssize_t)len);
+}
+
+/* Run the backend's read handler until @count frames have been passed on */
+static void backend_receive(int count)
+{
+    struct pollfd pfd;
+    int tries = 0;
+
+    while (nb_received < count) {
+        pfd.fd = packet_fd;
+        pfd.events = POLLIN;
+        g_assert(poll(&pfd, 1, 1000) >= 0);
+        g_assert(++tries < 100);
+        if (packet_read && (!packet_can_read ||
+                            packet_can_read(packet_opaque))) {
+            packet_read(packet_opaque);
+        }
+    }
+    g_assert_cmpint(nb_received, ==, count);
+}
+
+/* Return the length of the next frame on the peer, or -1 on timeout */
+static ssize_t peer_receive(uint8_t *buf, size_t len, int timeout)
+{
+    struct pollfd pfd = {
+        .fd = peer_fd,
+        .events = POLLIN,
+    };
+
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return -1;
+    }
+    return recv(peer_fd, buf, len, MSG_DONTWAIT);
+}
+
+/*
+ * Check that frames keep arriving in order after the RX ring wraps
+ */
+
+static void test_rx_wrap(void)
+{
+    uint8_t frame[FRAME_LEN];
+    int round, i, seq;
+
+    start_backend();
+
+    for (round = 0, seq = 0; round < 7; round++) {
+        for (i = 0; i < 3; i++) {
+            make_frame(frame, seq + i);
+            peer_send(frame, FRAME_LEN);
+        }
+        backend_receive(seq + 3);
+        for (i = 0; i < 3; i++, seq++) {
+            make_frame(frame, seq);
+            g_assert_cmpint(received_len[seq], ==, FRAME_LEN);
+            g_assert(memcmp(received[seq], frame, FRAME_LEN) == 0);
+        }
+    }
+    g_assert_cmpint(seq, >, 2 * TEST_FRAMES);
+
+    stop_backend();
+}
+
+/*
+ * Check that the VLAN tag the kernel strips from received frames is put
+ * back, including a tag whose TCI is zero
+ */
+
+static void test_rx_vlan(void)
+{
+    static const uint16_t tcis[] = { 0x2005, 0x0fff, 0x0000 };
+    uint8_t frame[FRAME_LEN + 4];
+    size_t len;
+    int i;
+
+    start_backend();
+
+    for (i = 0; i < ARRAY_SIZE(tcis); i++) {
+        len = make_tagged_frame(frame, i, tcis[i]);
+        peer_send(frame, len);
+        backend_receive(i + 1);
+        g_assert_cmpint(received_len[i], ==, len);
+        g_assert(memcmp(received[i], frame, len) == 0);
+    }
+
+    /* untagged frames are still passed on unchanged */
+    make_frame(frame, 42);
+    peer_send(frame, FRAME_LEN);
+    backend_receive(i + 1);
+    g_assert_cmpint(received_len[i], ==, FRAME_LEN);
+    g_assert(memcmp(received[i], frame, FRAME_LEN) == 0);
+
+    stop_backend();
+}
+
+/*
+ * Check that reading stops while the peer is busy and resumes once the
+ * queued packet has been sent
+ */
+
+static void test_rx_peer_busy(void)
+{
+    uint8_t frame[FRAME_LEN];
+
+    start_backend();
+
+    peer_busy = true;
+    make_frame(frame, 0);
+    peer_send(frame, FRAME_LEN);
+    make_frame(frame, 1);
+    peer_send(frame, FRAME_LEN);
+
+    backend_receive(1);
+    g_assert(packet_read == NULL);
+    g_assert(pending_sent_cb != NULL);
+
+    peer_busy = false;
+    pending_sent_cb(packet_nc, FRAME_LEN);
+    g_assert(packet_read != NULL);
+
+    backend_receive(2);
+    g_assert(memcmp(received[1], frame, FRAME_LEN) == 0);
+
+    stop_backend();
+}
+
+/*
+ * Check that transmitted frames are held in the ring until the bottom half
+ * kicks the kernel with send(NULL)
+ */
+
+static void test_tx_flush(void)
+{
+    uint8_t frame[FRAME_LEN], buf[FRAME_LEN];
+    int i;
+
+    start_backend();
+
+    for (i = 0; i < 3; i++) {
+        make_frame(frame, i);
+        g_assert_cmpint(packet_nc->info->receive(packet_nc, frame, FRAME_LEN),
+                        ==, FRAME_LEN);
+    }
+
+    /* nothing leaves before the flush */
+    g_assert_cmpint(peer_receive(buf, sizeof(buf), 100), ==, -1);
+
+    g_assert(qemu_bh_poll() != 0);
+    for (i = 0; i < 3; i++) {
+        make_frame(frame, i);
+        g_assert_cmpint(peer_receive(buf, sizeof(buf), 1000), ==, FRAME_LEN);
+        g_assert(memcmp(buf, frame, FRAME_LEN) == 0);
+    }
+
+    /* the bottom half only runs once per burst */
+    g_assert(qemu_bh_poll() == 0);
+
+    stop_backend();
+}
+
+/*
+ * Check that a full TX ring is flushed, stops accepting packets until the
+ * kernel hands frames back, and keeps order across the wrap
+ */
+
+static void test_tx_ring_full(void)
+{
+    uint8_t frame[FRAME_LEN], buf[FRAME_LEN];
+    struct pollfd pfd;
+    int i, seq;
+
+    start_backend();
+
+    for (seq = 0; seq < TEST_FRAMES; seq++) {
+        make_frame(frame, seq);
+        g_assert_cmpint(packet_nc->info->receive(packet_nc, frame, FRAME_LEN),
+                        ==, FRAME_LEN);
+    }
+
+    /* no free frame: the ring is flushed and the packet must be queued */
+    make_frame(frame, seq);
+    g_assert_cmpint(packet_nc->info->receive(packet_nc, frame, FRAME_LEN),
+                    ==, 0);
+    g_assert(packet_write != NULL);
+
+    for (i = 0; i < TEST_FRAMES; i++) {
+        make_frame(frame, i);
+        g_assert_cmpint(peer_receive(buf, sizeof(buf), 1000), ==, FRAME_LEN);
+        g_assert(memcmp(buf, frame, FRAME_LEN) == 0);
+    }
+
+    /* once the kernel is done with the frames the queue is flushed */
+    pfd.fd = packet_fd;
+    pfd.events = POLLOUT;
+    g_assert(poll(&pfd, 1, 1000) == 1);
+    packet_write(packet_opaque);
+    g_assert(packet_write == NULL);
+    g_assert_cmpint(flush_count, ==, 1);
+
+    /* continue past the end of the ring */
+    for (i = 0; i < TEST_FRAMES + 2; i++, seq++) {
+        make_frame(frame, seq);
+        g_assert_cmpint(packet_nc->info->receive(packet_nc, frame, FRAME_LEN),
+                        ==, FRAME_LEN);
+        if (i % 3 == 2) {
+            qemu_bh_poll();
+        }
+    }
+    qemu_bh_poll();
+    for (i = TEST_FRAMES; i < seq; i++) {
+        make_frame(frame, i);
+        g_assert_cmpint(peer_receive(buf, sizeof(buf), 1000), ==, FRAME_LEN);
+        g_assert(memcmp(buf, frame, FRAME_LEN) == 0);
+    }
+
+    stop_backend();
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!veth_create()) {
+        veth_destroy();
+        fprintf(stderr, "test-net-packet: cannot create a veth pair, "
+                "skipping\n");
+        return 0;
+    }
+
+    g_test_add_func("/net/packet/rx_wrap", test_rx_wrap);
+    g_test_add_func("/net/packet/rx_vlan", test_rx_vlan);
+    g_test_add_func("/net/packet/rx_peer_busy", test_rx_peer_busy);
+    g_test_add_func("/net/packet/tx_flush", test_tx_flush);
+    g_test_add_func("/net/packet/tx_ring_full", test_tx_ring_full);
+    ret = g_test_run();
+
+    veth_destroy();
+    return ret;
+}
@@ -0,0 +1,503 @@
+/*
+ * Multiqueue tap backend tests
+ *
+ * A tap interface is opened with several queues the way -netdev
+ * tap,queues=N does it.  Packets injected on the host side must be spread
+ * over the queues by flow, and detaching all queues but the first, as
+ * virtio-net does for a driver without multiqueue, must steer everything
+ * to queue 0.  Creating tap interfaces needs CAP_NET_ADMIN; without it the
+ * tests are skipped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-error.h"
+#include "net.h"
+#include "net/tap.h"
+#include "net/tap-linux.h"
+#include "hw/vhost_net.h"
+
+#define TAP_IFNAME      "qttap0"
+#define TEST_UDP_PORT   5555
+#define NB_FLOWS        64
+#define FRAME_LEN       64
+
+/*
+ * Fake options, net layer and main loop, just enough for net/tap.c
+ */
+
+static struct {
+    const char *name;
+    char *value;
+} opts[8];
+
+static VLANClientState *clients[MAX_QUEUE_NUM + 1];
+static int nb_clients;
+
+static struct {
+    IOCanReadHandler *can_read;
+    IOHandler *read;
+    void *opaque;
+} fd_handlers[1024];
+
+static int rx_queue;                    /* queue of the last test packet */
+static uint16_t rx_port;
+static int rx_count[MAX_QUEUE_NUM];
+
+static void opts_reset(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        g_free(opts[i].value);
+        opts[i].name = NULL;
+        opts[i].value = NULL;
+    }
+}
+
+int qemu_opt_set(QemuOpts *unused, const char *name, const char *value)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(opts); i++) {
+        if (!opts[i].name || strcmp(opts[i].name, name) == 0) {
+            opts[i].name = name;
+            g_free(opts[i].value);
+            opts[i].value = g_strdup(value);
+            return 0;
+        }
+    }
+    g_assert(0);
+    return -1;
+}
+
+const char *qemu_opt_get(QemuOpts *unused, const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(opts) && opts[i].name; i++) {
+        if (strcmp(opts[i].name, name) == 0) {
+            return opts[i].value;
+        }
+    }
+    return NULL;
+}
+
+uint64_t qemu_opt_get_number(QemuOpts *unused, const char *name,
+                             uint64_t defval)
+{
+    const char *value = qemu_opt_get(NULL, name);
+
+    return value ? strtoull(value, NULL, 0) : defval;
+}
+
+uint64_t qemu_opt_get_size(QemuOpts *unused, const char *name,
+                           uint64_t defval)
+{
+    return qemu_opt_get_number(NULL, name, defval);
+}
+
+bool qemu_opt_get_bool(QemuOpts *unused, const char *name, bool defval)
+{
+    const char *value = qemu_opt_get(NULL, name);
+
+    return value ? strcmp(value, "on") == 0 : defval;
+}
+
+void error_report(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+int net_handle_fd_param(Monitor *mon, const char *param)
+{
+    return strtol(param, NULL, 0);
+}
+
+VHostNetState *vhost_net_init(VLANClientState *backend, int devfd, bool force,
+                              bool zerocopy)
+{
+    return NULL;
+}
+
+void vhost_net_cleanup(VHostNetState *net)
+{
+}
+
+int qemu_set_fd_handler2(int fd, IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque)
+{
+    g_assert(fd >= 0 && fd < ARRAY_SIZE(fd_handlers));
+    fd_handlers[fd].can_read = fd_read_poll;
+    fd_handlers[fd].read = fd_read;
+    fd_handlers[fd].opaque = opaque;
+    return 0;
+}
+
+VLANClientState *qemu_new_net_client(NetClientInfo *info, VLANState *vlan,
+                                     VLANClientState *peer, const char *model,
+                                     const char *name)
+{
+    VLANClientState *nc = g_malloc0(info->size);
+
+    g_assert(nb_clients < ARRAY_SIZE(clients));
+    nc->info = info;
+    clients[nb_clients++] = nc;
+    return nc;
+}
+
+int qemu_can_send_packet(VLANClientState *vc)
+{
+    return 1;
+}
+
+ssize_t qemu_send_packet_async(VLANClientState *vc, const uint8_t *buf,
+                               int size, NetPacketSent *sent_cb)
+{
+    const uint8_t *ip = buf + ETH_HLEN;
+
+    /* Ignore anything the host stack may send on the link by itself */
+    if (size < ETH_HLEN + 28 || buf[12] != 0x08 || buf[13] != 0x00 ||
+        ip[9] != IPPROTO_UDP || ((ip[22] << 8) | ip[23]) != TEST_UDP_PORT) {
+        return size;
+    }
+
+    rx_queue = vc->queue_index;
+    rx_port = (ip[20] << 8) | ip[21];
+    rx_count[vc->queue_index]++;
+    return size;
+}
+
+void qemu_flush_queued_packets(VLANClientState *vc)
+{
+}
+
+void qemu_purge_queued_packets(VLANClientState *vc)
+{
+}
+
+/*
+ * Helpers
+ */
+
+static int peer_fd = -1;
+
+static int start_tap(int queues)
+{
+    char buf[16];
+
+    nb_clients = 0;
+    opts_reset();
+    qemu_opt_set(NULL, "ifname", TAP_IFNAME);
+    qemu_opt_set(NULL, "script", "no");
+    qemu_opt_set(NULL, "downscript", "no");
+    snprintf(buf, sizeof(buf), "%d", queues);
+    qemu_opt_set(NULL, "queues", buf);
+    return net_init_tap(NULL, NULL, "tap", NULL);
+}
+
+static void set_up(void)
+{
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+    FILE *f;
+    int fd;
+
+    /* Keep IPv6 autoconfiguration chatter off the link */
+    f = fopen("/proc/sys/net/ipv6/conf/" TAP_IFNAME "/disable_ipv6", "w");
+    if (f) {
+        fputs("1\n", f);
+        fclose(f);
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert(fd >= 0);
+    memset(&ifr, 0, sizeof(ifr));
+    pstrcpy(ifr.ifr_name, IFNAMSIZ, TAP_IFNAME);
+    g_assert(ioctl(fd, SIOCGIFFLAGS, &ifr) == 0);
+    ifr.ifr_flags |= IFF_UP;
+    g_assert(ioctl(fd, SIOCSIFFLAGS, &ifr) == 0);
+    close(fd);
+
+    peer_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    g_assert(peer_fd >= 0);
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = if_nametoindex(TAP_IFNAME);
+    g_assert(bind(peer_fd, (struct sockaddr *)&sll, sizeof(sll)) == 0);
+}
+
+static void stop_tap(void)
+{
+    int i;
+
+    for (i = 0; i < nb_clients; i++) {
+        clients[i]->info->cleanup(clients[i]);
+        g_free(clients[i]);
+    }
+    nb_clients = 0;
+    if (peer_fd >= 0) {
+        close(peer_fd);
+        peer_fd = -1;
+    }
+    opts_reset();
+}
+
+/* A UDP packet from port @sport to TEST_UDP_PORT; the port picks the flow */
+static void make_frame(uint8_t *buf, uint16_t sport)
+{
+    static const uint8_t hdr[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,     /* dst */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,     /* src */
+        0x08, 0x00,
+        0x45, 0x00, 0x00, FRAME_LEN - ETH_HLEN, /* IPv4, total length */
+        0x00, 0x00, 0x40, 0x00, 0x40, IPPROTO_UDP,
+        0x00, 0x00,                             /* checksum */
+        10, 0, 2, 15,                           /* src address */
+        10, 0, 2, 2,                            /* dst address */
+    };
+    uint32_t sum = 0;
+    int i;
+
+    memset(buf, 0, FRAME_LEN);
+    memcpy(buf, hdr, sizeof(hdr));
+    for (i = ETH_HLEN; i < ETH_HLEN + 20; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~((sum & 0xffff) + (sum >> 16));
+    buf[ETH_HLEN + 10] = sum >> 8;
+    buf[ETH_HLEN + 11] = sum & 0xff;
+
+    buf[ETH_HLEN + 20] = sport >> 8;
+    buf[ETH_HLEN + 21] = sport & 0xff;
+    buf[ETH_HLEN + 22] = TEST_UDP_PORT >> 8;
+    buf[ETH_HLEN + 23] = TEST_UDP_PORT & 0xff;
+    buf[ETH_HLEN + 25] = FRAME_LEN - ETH_HLEN - 20;
+}
+
+/* Send one packet of flow @sport into the tap and return its queue */
+static int send_to_guest(uint16_t sport)
+{
+    uint8_t frame[FRAME_LEN];
+    struct pollfd pfd[MAX_QUEUE_NUM];
+    int i, tries;
+
+    make_frame(frame, sport);
+    g_assert(send(peer_fd, frame, FRAME_LEN, 0) == FRAME_LEN);
+
+    for (i = 0; i < nb_clients; i++) {
+        pfd[i].fd = tap_get_fd(clients[i]);
+        pfd[i].events = POLLIN;
+    }
+
+    rx_queue = -1;
+    for (tries = 0; rx_queue < 0; tries++) {
+        g_assert(tries < 10);
+        g_assert(poll(pfd, nb_clients, 1000) >= 0);
+        for (i = 0; i < nb_clients; i++) {
+            int fd = pfd[i].fd;
+
+            if ((pfd[i].revents & POLLIN) && fd_handlers[fd].read &&
+                fd_handlers[fd].can_read(fd_handlers[fd].opaque)) {
+                fd_handlers[fd].read(fd_handlers[fd].opaque);
+            }
+        }
+    }
+    g_assert_cmpint(rx_port, ==, sport);
+    return rx_queue;
+}
+
+/* Send a set of flows twice, check that each flow sticks to one queue and
+ * return how many queues got traffic */
+static int spread_flows(void)
+{
+    int queue[NB_FLOWS];
+    int i, used = 0;
+
+    memset(rx_count, 0, sizeof(rx_count));
+    for (i = 0; i < NB_FLOWS; i++) {
+        queue[i] = send_to_guest(10000 + i);
+    }
+    for (i = 0; i < NB_FLOWS; i++) {
+        g_assert_cmpint(send_to_guest(10000 + i), ==, queue[i]);
+    }
+    for (i = 0; i < MAX_QUEUE_NUM; i++) {
+        used += rx_count[i] != 0;
+    }
+    return used;
+}
+
+/*
+ * Check that queues=N opens N queues of one multiqueue interface
+ */
+
+static void test_mq_open(void)
+{
+    struct ifreq ifr;
+    int i, j;
+
+    g_assert(start_tap(4) == 0);
+    g_assert_cmpint(nb_clients, ==, 4);
+
+    for (i = 0; i < nb_clients; i++) {
+        g_assert_cmpint(clients[i]->info->type, ==, NET_CLIENT_TYPE_TAP);
+        g_assert_cmpint(clients[i]->queue_index, ==, i);
+        for (j = 0; j < i; j++) {
+            g_assert(tap_get_fd(clients[i]) != tap_get_fd(clients[j]));
+        }
+
+        memset(&ifr, 0, sizeof(ifr));
+        g_assert(ioctl(tap_get_fd(clients[i]), TUNGETIFF, &ifr) == 0);
+        g_assert_cmpstr(ifr.ifr_name, ==, TAP_IFNAME);
+        g_assert(ifr.ifr_flags & IFF_MULTI_QUEUE);
+    }
+
+    stop_tap();
+}
+
+/*
+ * Check that host to guest traffic is spread over the queues by flow and
+ * that every queue transmits guest packets
+ */
+
+static void test_mq_traffic(void)
+{
+    uint8_t frame[FRAME_LEN], buf[FRAME_LEN];
+    struct pollfd pfd;
+    int i;
+
+    g_assert(start_tap(4) == 0);
+    set_up();
+
+    g_assert_cmpint(spread_flows(), >=, 2);
+
+    for (i = 0; i < nb_clients; i++) {
+        /* the length written includes the vnet header, if any */
+        make_frame(frame, 20000 + i);
+        g_assert_cmpint(clients[i]->info->receive(clients[i], frame,
+                                                  FRAME_LEN), >=, FRAME_LEN);
+
+        pfd.fd = peer_fd;
+        pfd.events = POLLIN;
+        do {
+            g_assert(poll(&pfd, 1, 1000) == 1);
+            g_assert(recv(peer_fd, buf, sizeof(buf), 0) >= FRAME_LEN);
+        } while (memcmp(buf, frame, FRAME_LEN) != 0);
+    }
+
+    stop_tap();
+}
+
+/*
+ * Check that a guest without multiqueue still gets all its traffic: only
+ * the first queue stays attached, as in virtio_net_set_queues()
+ */
+
+static void test_mq_fallback(void)
+{
+    int i;
+
+    g_assert(start_tap(4) == 0);
+    set_up();
+
+    for (i = 1; i < nb_clients; i++) {
+        g_assert(tap_disable(clients[i]) == 0);
+    }
+    g_assert_cmpint(spread_flows(), ==, 1);
+    g_assert_cmpint(rx_count[0], ==, 2 * NB_FLOWS);
+
+    /* the driver enables all pairs again */
+    for (i = 1; i < nb_clients; i++) {
+        g_assert(tap_enable(clients[i]) == 0);
+    }
+    g_assert_cmpint(spread_flows(), >=, 2);
+
+    stop_tap();
+}
+
+/*
+ * Check that a single queue tap is not a multiqueue interface
+ */
+
+static void test_single_queue(void)
+{
+    struct ifreq ifr;
+
+    g_assert(start_tap(1) == 0);
+    g_assert_cmpint(nb_clients, ==, 1);
+
+    memset(&ifr, 0, sizeof(ifr));
+    g_assert(ioctl(tap_get_fd(clients[0]), TUNGETIFF, &ifr) == 0);
+    g_assert(!(ifr.ifr_flags & IFF_MULTI_QUEUE));
+
+    set_up();
+    g_assert_cmpint(spread_flows(), ==, 1);
+    g_assert_cmpint(rx_count[0], ==, 2 * NB_FLOWS);
+
+    stop_tap();
+}
+
+/*
+ * Check the queues= limits
+ */
+
+static void test_invalid(void)
+{
+    VLANState vlan;
+
+    g_assert(start_tap(0) == -1);
+    g_assert(start_tap(MAX_QUEUE_NUM + 1) == -1);
+
+    /* multiqueue needs -netdev */
+    opts_reset();
+    qemu_opt_set(NULL, "queues", "2");
+    g_assert(net_init_tap(NULL, NULL, "tap", &vlan) == -1);
+
+    g_assert_cmpint(nb_clients, ==, 0);
+    opts_reset();
+}
+
+int main(int argc, char **argv)
+{
+    int fd;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/net/tap/invalid", test_invalid);
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0 || geteuid() != 0) {
+        fprintf(stderr, "test-net-tap: cannot create tap interfaces, "
+                "skipping\n");
+    } else {
+        g_test_add_func("/net/tap/mq_open", test_mq_open);
+        g_test_add_func("/net/tap/mq_traffic", test_mq_traffic);
+        g_test_add_func("/net/tap/mq_fallback", test_mq_fallback);
+        g_test_add_func("/net/tap/single_queue", test_single_queue);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return g_test_run();
+}
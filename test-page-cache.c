@@ -0,0 +1,182 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "page_cache.h"
+
+#define PAGE_SIZE 64
+
+/* Page contents are derived from the address so hits can be checked */
+static void fill_page(uint8_t *buf, uint64_t addr)
+{
+    memset(buf, (addr / PAGE_SIZE) & 0xff, PAGE_SIZE);
+}
+
+static void insert_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+
+    fill_page(page, addr);
+    data = cache_insert(cache, addr, page);
+    g_assert(data != NULL);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+}
+
+static bool page_cached(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+
+    data = cache_lookup(cache, addr);
+    if (!data) {
+        return false;
+    }
+    fill_page(page, addr);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+    return true;
+}
+
+/*
+ * Check that an invalid size is refused
+ */
+
+static void test_init_invalid(void)
+{
+    g_assert(cache_init(0, PAGE_SIZE) == NULL);
+    g_assert(cache_init(-1, PAGE_SIZE) == NULL);
+    g_assert(cache_init(4, 0) == NULL);
+}
+
+/*
+ * Check lookups and overwriting an existing page
+ */
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+
+    g_assert(cache != NULL);
+    g_assert_cmpint(cache_num_pages(cache), ==, 4);
+    g_assert(!page_cached(cache, 0));
+
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_cached(cache, addr));
+    }
+    g_assert(!page_cached(cache, 4 * PAGE_SIZE));
+
+    /* overwriting does not take a new slot */
+    memset(page, 0xee, PAGE_SIZE);
+    cache_insert(cache, 2 * PAGE_SIZE, page);
+    g_assert(memcmp(cache_lookup(cache, 2 * PAGE_SIZE), page,
+                    PAGE_SIZE) == 0);
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_lookup(cache, addr) != NULL);
+    }
+
+    cache_fini(cache);
+}
+
+/*
+ * Check that the least recently used page is evicted
+ */
+
+static void test_evict(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+
+    /* page 0 becomes the most recently used, page 1 the least */
+    g_assert(page_cached(cache, 0));
+    insert_page(cache, 4 * PAGE_SIZE);
+    g_assert(!page_cached(cache, 1 * PAGE_SIZE));
+    g_assert(page_cached(cache, 0));
+    g_assert(page_cached(cache, 4 * PAGE_SIZE));
+
+    /* pages 2 and 3 are now the oldest */
+    insert_page(cache, 5 * PAGE_SIZE);
+    insert_page(cache, 6 * PAGE_SIZE);
+    g_assert(!page_cached(cache, 2 * PAGE_SIZE));
+    g_assert(!page_cached(cache, 3 * PAGE_SIZE));
+    g_assert(page_cached(cache, 0));
+    g_assert(page_cached(cache, 4 * PAGE_SIZE));
+    g_assert(page_cached(cache, 5 * PAGE_SIZE));
+    g_assert(page_cached(cache, 6 * PAGE_SIZE));
+
+    cache_fini(cache);
+}
+
+/*
+ * Check that resizing keeps the most recently used pages
+ */
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE);
+    PageCache *new_cache;
+    uint64_t addr;
+
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        insert_page(cache, addr);
+    }
+    g_assert(page_cached(cache, 0));
+
+    /* same size: nothing to do */
+    g_assert(cache_resize(cache, 4) == cache);
+
+    /* invalid size: the old cache is left alone */
+    g_assert(cache_resize(cache, 0) == NULL);
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_cached(cache, addr));
+    }
+
+    /* growing keeps everything */
+    new_cache = cache_resize(cache, 8);
+    g_assert(new_cache != NULL);
+    cache = new_cache;
+    g_assert_cmpint(cache_num_pages(cache), ==, 8);
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(page_cached(cache, addr));
+    }
+
+    /* MRU order is now 3, 2, 1, 0: shrinking keeps 3 and 2 */
+    new_cache = cache_resize(cache, 2);
+    g_assert(new_cache != NULL);
+    cache = new_cache;
+    g_assert_cmpint(cache_num_pages(cache), ==, 2);
+
+    /* the LRU order carried over too, so 2 is evicted before 3 */
+    insert_page(cache, 9 * PAGE_SIZE);
+    g_assert(!page_cached(cache, 0));
+    g_assert(!page_cached(cache, 1 * PAGE_SIZE));
+    g_assert(!page_cached(cache, 2 * PAGE_SIZE));
+    g_assert(page_cached(cache, 3 * PAGE_SIZE));
+    g_assert(page_cached(cache, 9 * PAGE_SIZE));
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/init_invalid", test_init_invalid);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/evict", test_evict);
+    g_test_add_func("/page_cache/resize", test_resize);
+    return g_test_run();
+}
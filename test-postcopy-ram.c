@@ -0,0 +1,398 @@
+/*
+ * Postcopy RAM destination tests
+ *
+ * The destination runs in a child process and the test process plays the
+ * source on the other end of a unix socket pair, the way a unix: migration
+ * URI connects them.  Guest RAM is discarded and registered with
+ * userfaultfd, then touched: each access must turn into a page request on
+ * the return channel, and block until the source sends the page and it is
+ * placed.  The rest of the pages are streamed afterwards and the main loop
+ * must tear postcopy down once the stream ends.
+ *
+ * The migration stream is reduced to what ram_postcopy_load() does with it
+ * after the switch to postcopy, so arch_init.c and savevm.c are not needed.
+ * The time an access stays blocked on a missing page is the stall a vCPU
+ * sees; the perf test reports it.  Without userfaultfd, or when the
+ * target page size differs from the host's, the tests are skipped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "kvm.h"
+#include "main-loop.h"
+#include "migration.h"
+
+#define RAM_PAGES       64
+#define RAM_LEN         (RAM_PAGES * TARGET_PAGE_SIZE)
+#define RAM_IDSTR       "pc.ram"
+
+/* Same flags as arch_init.c */
+#define RAM_SAVE_FLAG_COMPRESS 0x02
+#define RAM_SAVE_FLAG_PAGE     0x08
+#define RAM_SAVE_FLAG_EOS      0x10
+
+/*
+ * Fake RAM list, migration file and main loop, just enough for
+ * postcopy-ram.c
+ */
+
+struct QEMUFile {
+    int fd;
+};
+
+RAMList ram_list;
+const char *mem_path;
+int kvm_allowed;
+
+static RAMBlock block;
+static QEMUFile file;
+
+static IOHandler *done_handler;
+static void *done_opaque;
+static int done_fd = -1;
+
+int kvm_has_sync_mmu(void)
+{
+    return 1;
+}
+
+int qemu_socket_fd(QEMUFile *f)
+{
+    return f->fd;
+}
+
+int qemu_fclose(QEMUFile *f)
+{
+    /* like a socket QEMUFile, this leaves the fd open */
+    return 0;
+}
+
+int qemu_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                        void *opaque)
+{
+    g_assert(fd_write == NULL);
+    done_fd = fd_read ? fd : -1;
+    done_handler = fd_read;
+    done_opaque = opaque;
+    return 0;
+}
+
+/* Every eighth page is sent as a zero page */
+static bool page_is_zero(unsigned int page)
+{
+    return page % 8 == 7;
+}
+
+static void fill_page(uint8_t *buf, unsigned int page)
+{
+    unsigned int i;
+
+    for (i = 0; i < TARGET_PAGE_SIZE; i++) {
+        buf[i] = page_is_zero(page) ? 0 : page + i * 3;
+    }
+}
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    size_t done;
+    ssize_t ret;
+
+    for (done = 0; done < len; done += ret) {
+        ret = read(fd, (uint8_t *)buf + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void write_full(int fd, const void *buf, size_t len)
+{
+    size_t done;
+    ssize_t ret;
+
+    for (done = 0; done < len; done += ret) {
+        ret = write(fd, (const uint8_t *)buf + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        }
+        g_assert(ret >= 0);
+    }
+}
+
+/* The part of the stream sent after the switch to postcopy */
+int ram_postcopy_load(QEMUFile *f)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    uint64_t addr;
+    int flags, ret;
+
+    for (;;) {
+        if (!read_full(f->fd, &addr, sizeof(addr))) {
+            return -EIO;
+        }
+        addr = be64_to_cpu(addr);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            return 0;
+        }
+        g_assert(addr < RAM_LEN);
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            ret = postcopy_place_zero_page(block.host + addr);
+        } else {
+            if (!read_full(f->fd, buf, sizeof(buf))) {
+                return -EIO;
+            }
+            ret = postcopy_place_page(block.host + addr, buf);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+/*
+ * Destination, runs in the child process
+ */
+
+static void run_main_loop(void)
+{
+    while (postcopy_ram_incoming_active()) {
+        struct pollfd pfd = {
+            .fd = done_fd,
+            .events = POLLIN,
+        };
+
+        g_assert(poll(&pfd, 1, 5000) == 1);
+        done_handler(done_opaque);
+    }
+}
+
+static void check_page(unsigned int page)
+{
+    uint8_t expected[TARGET_PAGE_SIZE];
+
+    fill_page(expected, page);
+    g_assert(memcmp(block.host + page * TARGET_PAGE_SIZE, expected,
+                    TARGET_PAGE_SIZE) == 0);
+}
+
+static void run_destination(int fd, const unsigned int *faults,
+                            unsigned int nb_faults)
+{
+    double stall, max_stall = 0, total_stall = 0;
+    unsigned int i;
+
+    /* a hung page request must not hang make check */
+    alarm(10);
+
+    block.host = mmap(NULL, RAM_LEN, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_assert(block.host != MAP_FAILED);
+    block.length = RAM_LEN;
+    pstrcpy(block.idstr, sizeof(block.idstr), RAM_IDSTR);
+    QLIST_INSERT_HEAD(&ram_list.blocks, &block, next);
+
+    /* stale pages from the precopy phase, dirtied again on the source */
+    memset(block.host, 0xaa, RAM_LEN);
+    postcopy_ram_discard_range(block.host, RAM_LEN);
+
+    file.fd = fd;
+    g_assert(postcopy_ram_incoming_start(&file) == 0);
+    g_assert(postcopy_ram_incoming_active());
+
+    for (i = 0; i < nb_faults; i++) {
+        g_test_timer_start();
+        check_page(faults[i]);
+        stall = g_test_timer_elapsed();
+
+        total_stall += stall;
+        max_stall = MAX(max_stall, stall);
+    }
+    if (nb_faults) {
+        g_test_message("%u on-demand pages: average stall %.0f us, "
+                       "max %.0f us\n", nb_faults,
+                       total_stall * 1e6 / nb_faults, max_stall * 1e6);
+    }
+
+    run_main_loop();
+    g_assert(done_fd == -1);
+
+    for (i = 0; i < RAM_PAGES; i++) {
+        check_page(i);
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+/*
+ * Source, runs in the test process
+ */
+
+static void send_page(int fd, unsigned int page)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+    uint64_t addr = (uint64_t)page * TARGET_PAGE_SIZE;
+
+    if (page_is_zero(page)) {
+        addr = cpu_to_be64(addr | RAM_SAVE_FLAG_COMPRESS);
+        write_full(fd, &addr, sizeof(addr));
+    } else {
+        addr = cpu_to_be64(addr | RAM_SAVE_FLAG_PAGE);
+        write_full(fd, &addr, sizeof(addr));
+        fill_page(buf, page);
+        write_full(fd, buf, sizeof(buf));
+    }
+}
+
+/* Page requests from the destination: be64 offset, u8 length, block id */
+static unsigned int read_request(int fd)
+{
+    uint8_t hdr[9];
+    char idstr[256];
+    uint64_t offset;
+
+    g_assert(read_full(fd, hdr, sizeof(hdr)));
+    g_assert(read_full(fd, idstr, hdr[8]));
+    idstr[hdr[8]] = 0;
+    g_assert_cmpstr(idstr, ==, RAM_IDSTR);
+
+    offset = ldq_be_p(hdr);
+    g_assert_cmpuint(offset % TARGET_PAGE_SIZE, ==, 0);
+    g_assert_cmpuint(offset, <, RAM_LEN);
+    return offset / TARGET_PAGE_SIZE;
+}
+
+static pid_t start_destination(int *fd, const unsigned int *faults,
+                               unsigned int nb_faults)
+{
+    int sv[2];
+    pid_t pid;
+
+    g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    g_assert(pid >= 0);
+    if (pid == 0) {
+        close(sv[0]);
+        run_destination(sv[1], faults, nb_faults);
+    }
+    close(sv[1]);
+    *fd = sv[0];
+    return pid;
+}
+
+static int wait_destination(pid_t pid)
+{
+    int status;
+
+    g_assert(waitpid(pid, &status, 0) == pid);
+    g_assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+static void migrate(const unsigned int *faults, unsigned int nb_faults)
+{
+    bool sent[RAM_PAGES] = { false };
+    uint64_t eos = cpu_to_be64(RAM_SAVE_FLAG_EOS);
+    unsigned int i, page;
+    uint8_t c;
+    pid_t pid;
+    int fd;
+
+    pid = start_destination(&fd, faults, nb_faults);
+
+    /* Serve the faults first, in the order the destination touches pages */
+    for (i = 0; i < nb_faults; i++) {
+        page = read_request(fd);
+        g_assert_cmpuint(page, ==, faults[i]);
+        send_page(fd, page);
+        sent[page] = true;
+    }
+
+    /* Then the background transfer of the pages nobody asked for */
+    for (page = 0; page < RAM_PAGES; page++) {
+        if (!sent[page]) {
+            send_page(fd, page);
+        }
+    }
+    write_full(fd, &eos, sizeof(eos));
+
+    /* No more requests, the destination hangs up when it is done */
+    g_assert(read(fd, &c, 1) == 0);
+    close(fd);
+
+    g_assert_cmpint(wait_destination(pid), ==, 0);
+}
+
+static void test_on_demand(void)
+{
+    static const unsigned int faults[] = { 5, 40, 15, 17, 63, 0 };
+
+    migrate(faults, ARRAY_SIZE(faults));
+}
+
+static void test_background(void)
+{
+    migrate(NULL, 0);
+}
+
+static void test_source_lost(void)
+{
+    pid_t pid;
+    int fd;
+
+    pid = start_destination(&fd, NULL, 0);
+
+    /* The only copy of the missing pages is gone, the guest cannot go on */
+    send_page(fd, 3);
+    close(fd);
+
+    g_assert_cmpint(wait_destination(pid), ==, 1);
+}
+
+static void perf_on_demand(void)
+{
+    unsigned int faults[RAM_PAGES];
+    unsigned int i;
+
+    for (i = 0; i < RAM_PAGES; i++) {
+        faults[i] = (i * 37) % RAM_PAGES;
+    }
+    migrate(faults, RAM_PAGES);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (!postcopy_ram_supported()) {
+        fprintf(stderr, "test-postcopy-ram: postcopy not supported on this "
+                "host, skipping\n");
+        return 0;
+    }
+
+    g_test_add_func("/postcopy/on_demand", test_on_demand);
+    g_test_add_func("/postcopy/background", test_background);
+    g_test_add_func("/postcopy/source_lost", test_source_lost);
+    if (g_test_perf()) {
+        g_test_add_func("/postcopy/perf/on_demand", perf_on_demand);
+    }
+
+    return g_test_run();
+}
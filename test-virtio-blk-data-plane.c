@@ -0,0 +1,507 @@
+/*
+ * virtio-blk data plane tests
+ *
+ * The data plane thread is driven the way a guest drives it: requests are
+ * put on a vring in fake guest RAM, the host notifier is kicked and the
+ * guest notifier is waited for.  Reads and writes go to a temporary image
+ * file through Linux AIO.  Starting and stopping dirty logging for
+ * migration must stop the thread and hand the vring back, and restart it
+ * afterwards.
+ *
+ * The temporary file is not opened with O_DIRECT because tmpfs does not
+ * support it, so Linux AIO completes synchronously here.  The irqfd and
+ * ioeventfd wiring done by KVM is replaced by plain event notifiers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <poll.h>
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "qemu-barrier.h"
+#include "event_notifier.h"
+#include "kvm.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/virtio-blk.h"
+
+#define RAM_SIZE        (1 << 20)
+#define QUEUE_SIZE      64
+#define DESC_ADDR       0x0
+#define AVAIL_ADDR      0x1000
+#define USED_ADDR       0x2000
+#define HDR_ADDR        0x10000         /* one 0x100 slot per descriptor */
+#define DATA_ADDR       0x20000
+#define DATA_SIZE       0x1000
+#define TEST_SERIAL     "dataplane-test"
+
+/*
+ * Fake guest RAM, virtio transport and block layer, just enough for
+ * hw/dataplane
+ */
+
+int kvm_allowed = 1;
+
+struct VirtQueue {
+    EventNotifier guest_notifier;
+    EventNotifier host_notifier;
+    uint16_t last_avail_idx;
+};
+
+static uint8_t *ram;
+static CPUPhysMemoryClient *mem_client;
+static int dirty_tracking;
+
+static VirtIODevice vdev;
+static VirtQueue vq;
+static bool host_notifier_assigned;
+static bool guest_notifiers_assigned;
+
+static int image_fd = -1;
+
+static uint16_t next_desc;
+
+void error_report(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+void *qemu_get_ram_ptr(ram_addr_t addr)
+{
+    return ram + addr;
+}
+
+void cpu_register_phys_memory_client(CPUPhysMemoryClient *client)
+{
+    g_assert(mem_client == NULL);
+    mem_client = client;
+    client->set_memory(client, 0, RAM_SIZE, IO_MEM_RAM, false);
+}
+
+void cpu_unregister_phys_memory_client(CPUPhysMemoryClient *client)
+{
+    g_assert(mem_client == client);
+    mem_client = NULL;
+}
+
+int cpu_physical_memory_get_dirty_tracking(void)
+{
+    return dirty_tracking;
+}
+
+/* What ram_save_live() does when migration starts and ends */
+static void set_dirty_tracking(int enable)
+{
+    dirty_tracking = enable;
+    mem_client->migration_log(mem_client, enable);
+}
+
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    return image_fd;
+}
+
+bool bdrv_io_limits_enabled(BlockDriverState *bs)
+{
+    return false;
+}
+
+static int image_in_use;
+
+int bdrv_in_use(BlockDriverState *bs)
+{
+    return image_in_use;
+}
+
+void bdrv_set_in_use(BlockDriverState *bs, int in_use)
+{
+    image_in_use = in_use;
+}
+
+int virtio_queue_get_num(VirtIODevice *vdev, int n)
+{
+    return QUEUE_SIZE;
+}
+
+target_phys_addr_t virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
+{
+    return DESC_ADDR;
+}
+
+target_phys_addr_t virtio_queue_get_avail_addr(VirtIODevice *vdev, int n)
+{
+    return AVAIL_ADDR;
+}
+
+target_phys_addr_t virtio_queue_get_used_addr(VirtIODevice *vdev, int n)
+{
+    return USED_ADDR;
+}
+
+uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    return vq.last_avail_idx;
+}
+
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+{
+    vq.last_avail_idx = idx;
+}
+
+VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
+{
+    return &vq;
+}
+
+EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq)
+{
+    return &vq->guest_notifier;
+}
+
+EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
+{
+    return &vq->host_notifier;
+}
+
+static bool fake_query_guest_notifiers(void *opaque)
+{
+    return true;
+}
+
+static int fake_set_guest_notifiers(void *opaque, bool assigned)
+{
+    guest_notifiers_assigned = assigned;
+    return 0;
+}
+
+static int fake_set_host_notifier(void *opaque, int n, bool assigned)
+{
+    host_notifier_assigned = assigned;
+    return 0;
+}
+
+static const VirtIOBindings bindings = {
+    .query_guest_notifiers = fake_query_guest_notifiers,
+    .set_guest_notifiers = fake_set_guest_notifiers,
+    .set_host_notifier = fake_set_host_notifier,
+};
+
+/*
+ * Guest side of the vring
+ */
+
+static VRingDesc *ring_desc(void)
+{
+    return (VRingDesc *)(ram + DESC_ADDR);
+}
+
+static VRingAvail *ring_avail(void)
+{
+    return (VRingAvail *)(ram + AVAIL_ADDR);
+}
+
+static VRingUsed *ring_used(void)
+{
+    return (VRingUsed *)(ram + USED_ADDR);
+}
+
+static uint16_t add_desc(uint64_t addr, uint32_t len, uint16_t flags)
+{
+    uint16_t i = next_desc;
+
+    next_desc = (next_desc + 1) % QUEUE_SIZE;
+    ring_desc()[i].addr = addr;
+    ring_desc()[i].len = len;
+    ring_desc()[i].flags = flags;
+    ring_desc()[i].next = next_desc;
+    return i;
+}
+
+/*
+ * Queue a request without kicking the host.  Reads and GET_ID fill the
+ * data buffer, writes read it, a zero data_len leaves it out.  The status
+ * byte goes right after the header.
+ */
+static uint16_t queue_request(uint32_t type, uint64_t sector,
+                              uint64_t data_addr, uint32_t data_len)
+{
+    struct virtio_blk_outhdr *hdr;
+    uint16_t head, data_flags;
+    uint64_t hdr_addr;
+    VRingAvail *avail = ring_avail();
+
+    head = next_desc;
+    hdr_addr = HDR_ADDR + head * 0x100;
+    hdr = (struct virtio_blk_outhdr *)(ram + hdr_addr);
+    stl_p(&hdr->type, type);
+    stl_p(&hdr->ioprio, 0);
+    stq_p(&hdr->sector, sector);
+    ram[hdr_addr + sizeof(*hdr)] = 0xff;
+
+    add_desc(hdr_addr, sizeof(*hdr), VRING_DESC_F_NEXT);
+    if (data_len) {
+        data_flags = VRING_DESC_F_NEXT;
+        if (!(type & VIRTIO_BLK_T_OUT)) {
+            data_flags |= VRING_DESC_F_WRITE;
+        }
+        add_desc(data_addr, data_len, data_flags);
+    }
+    add_desc(hdr_addr + sizeof(*hdr), 1, VRING_DESC_F_WRITE);
+
+    avail->ring[avail->idx % QUEUE_SIZE] = head;
+    smp_wmb();
+    avail->idx++;
+    return head;
+}
+
+static uint8_t request_status(uint16_t head)
+{
+    return ram[HDR_ADDR + head * 0x100 + sizeof(struct virtio_blk_outhdr)];
+}
+
+static void kick(void)
+{
+    event_notifier_set(&vq.host_notifier);
+}
+
+/* Wait for the used ring to reach used_idx, false on timeout */
+static bool wait_used(uint16_t used_idx, int timeout_ms)
+{
+    struct pollfd pfd = {
+        .fd = event_notifier_get_fd(&vq.guest_notifier),
+        .events = POLLIN,
+    };
+
+    while (ring_used()->idx != used_idx) {
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return ring_used()->idx == used_idx;
+        }
+        event_notifier_test_and_clear(&vq.guest_notifier);
+    }
+    smp_rmb();
+    return true;
+}
+
+/* Queue a request, kick and wait for it, returns the used ring length */
+static uint32_t do_request(uint32_t type, uint64_t sector,
+                           uint64_t data_addr, uint32_t data_len,
+                           uint8_t expected_status)
+{
+    uint16_t head = queue_request(type, sector, data_addr, data_len);
+    uint16_t used_idx = ring_used()->idx + 1;
+    VRingUsedElem *elem;
+
+    kick();
+    g_assert(wait_used(used_idx, 5000));
+
+    elem = &ring_used()->ring[(used_idx - 1) % QUEUE_SIZE];
+    g_assert_cmpuint(elem->id, ==, head);
+    g_assert_cmpuint(request_status(head), ==, expected_status);
+    return elem->len;
+}
+
+static VirtIOBlockDataPlane *setup(void)
+{
+    BlockConf conf = {
+        .bs = (BlockDriverState *)&image_fd,
+        .logical_block_size = BDRV_SECTOR_SIZE,
+    };
+    char image_path[] = "/tmp/test-virtio-blk-data-plane.XXXXXX";
+    VirtIOBlockDataPlane *s;
+
+    ram = qemu_memalign(0x1000, RAM_SIZE);
+    memset(ram, 0, RAM_SIZE);
+    next_desc = 0;
+    vq.last_avail_idx = 0;
+
+    image_fd = mkstemp(image_path);
+    g_assert(image_fd >= 0);
+    unlink(image_path);
+    g_assert(ftruncate(image_fd, 1 << 20) == 0);
+
+    g_assert(event_notifier_init(&vq.guest_notifier, 0) == 0);
+    g_assert(event_notifier_init(&vq.host_notifier, 0) == 0);
+    memset(&vdev, 0, sizeof(vdev));
+    vdev.binding = &bindings;
+
+    s = virtio_blk_data_plane_create(&vdev, &conf, TEST_SERIAL);
+    g_assert(s != NULL);
+    g_assert(mem_client != NULL);
+    g_assert(image_in_use);
+    return s;
+}
+
+static void teardown(VirtIOBlockDataPlane *s)
+{
+    virtio_blk_data_plane_destroy(s);
+    g_assert(mem_client == NULL);
+    g_assert(!image_in_use);
+    g_assert(!host_notifier_assigned);
+    g_assert(!guest_notifiers_assigned);
+
+    event_notifier_cleanup(&vq.guest_notifier);
+    event_notifier_cleanup(&vq.host_notifier);
+    close(image_fd);
+    qemu_vfree(ram);
+    dirty_tracking = 0;
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = seed + i * 7;
+    }
+}
+
+static void test_rdwr(void)
+{
+    VirtIOBlockDataPlane *s = setup();
+    uint8_t expected[DATA_SIZE], buf[DATA_SIZE];
+    uint8_t *data = ram + DATA_ADDR;
+    uint32_t len;
+
+    virtio_blk_data_plane_start(s);
+    g_assert(host_notifier_assigned);
+    g_assert(guest_notifiers_assigned);
+
+    /* Aligned write, submitted straight from guest memory */
+    fill_pattern(data, DATA_SIZE, 1);
+    len = do_request(VIRTIO_BLK_T_OUT, 8, DATA_ADDR, DATA_SIZE,
+                     VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, 1);
+    g_assert(pread(image_fd, buf, DATA_SIZE, 8 * 512) == DATA_SIZE);
+    g_assert(memcmp(buf, data, DATA_SIZE) == 0);
+
+    /* Unaligned buffer, goes through a bounce buffer */
+    fill_pattern(data + 1, 1024, 2);
+    len = do_request(VIRTIO_BLK_T_OUT, 32, DATA_ADDR + 1, 1024,
+                     VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, 1);
+    g_assert(pread(image_fd, buf, 1024, 32 * 512) == 1024);
+    g_assert(memcmp(buf, data + 1, 1024) == 0);
+
+    /* Read both back, aligned and unaligned */
+    fill_pattern(expected, DATA_SIZE, 1);
+    memset(data, 0, DATA_SIZE);
+    len = do_request(VIRTIO_BLK_T_IN, 8, DATA_ADDR, DATA_SIZE,
+                     VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, DATA_SIZE + 1);
+    g_assert(memcmp(data, expected, DATA_SIZE) == 0);
+
+    fill_pattern(expected, 1024, 2);
+    memset(data, 0, DATA_SIZE);
+    len = do_request(VIRTIO_BLK_T_IN, 32, DATA_ADDR + 3, 1024,
+                     VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, 1024 + 1);
+    g_assert(memcmp(data + 3, expected, 1024) == 0);
+
+    /* Not a multiple of the logical block size */
+    do_request(VIRTIO_BLK_T_IN, 0, DATA_ADDR, 100, VIRTIO_BLK_S_IOERR);
+
+    len = do_request(VIRTIO_BLK_T_FLUSH, 0, 0, 0, VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, 1);
+
+    len = do_request(VIRTIO_BLK_T_GET_ID, 0, DATA_ADDR, VIRTIO_BLK_ID_BYTES,
+                     VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(len, ==, VIRTIO_BLK_ID_BYTES + 1);
+    g_assert_cmpstr((char *)data, ==, TEST_SERIAL);
+
+    do_request(VIRTIO_BLK_T_SCSI_CMD, 0, 0, 0, VIRTIO_BLK_S_UNSUPP);
+
+    /* Several requests in one kick */
+    queue_request(VIRTIO_BLK_T_OUT, 64, DATA_ADDR, 512);
+    queue_request(VIRTIO_BLK_T_OUT, 72, DATA_ADDR + 512, 512);
+    queue_request(VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+    kick();
+    g_assert(wait_used(ring_used()->idx + 3, 5000));
+
+    /* The vring is handed back to the regular code path on stop */
+    virtio_blk_data_plane_stop(s);
+    g_assert(!host_notifier_assigned);
+    g_assert(!guest_notifiers_assigned);
+    g_assert_cmpuint(vq.last_avail_idx, ==, ring_avail()->idx);
+
+    teardown(s);
+}
+
+static void test_migration(void)
+{
+    VirtIOBlockDataPlane *s = setup();
+    uint8_t *data = ram + DATA_ADDR;
+    uint16_t used_idx, head;
+
+    virtio_blk_data_plane_start(s);
+    fill_pattern(data, 512, 3);
+    do_request(VIRTIO_BLK_T_OUT, 0, DATA_ADDR, 512, VIRTIO_BLK_S_OK);
+
+    /* Writes into guest memory from the thread would not be logged */
+    set_dirty_tracking(1);
+    g_assert(!host_notifier_assigned);
+    g_assert(!guest_notifiers_assigned);
+    g_assert_cmpuint(vq.last_avail_idx, ==, ring_avail()->idx);
+
+    /* Kicks are left to the regular virtio-blk code */
+    used_idx = ring_used()->idx;
+    head = queue_request(VIRTIO_BLK_T_IN, 0, DATA_ADDR, 512);
+    kick();
+    g_assert(!wait_used(used_idx + 1, 100));
+
+    /* A reset and driver reload during migration leave it stopped */
+    virtio_blk_data_plane_stop(s);
+    virtio_blk_data_plane_start(s);
+    g_assert(!host_notifier_assigned);
+
+    /* Picks up where it left off once migration is done or cancelled */
+    memset(data, 0, 512);
+    set_dirty_tracking(0);
+    g_assert(host_notifier_assigned);
+    g_assert(wait_used(used_idx + 1, 5000));
+    g_assert_cmpuint(request_status(head), ==, VIRTIO_BLK_S_OK);
+    g_assert_cmpuint(data[1], ==, (uint8_t)(3 + 7));
+
+    /* Stopped by the guest while migrating, not restarted after */
+    virtio_blk_data_plane_stop(s);
+    set_dirty_tracking(1);
+    set_dirty_tracking(0);
+    g_assert(!host_notifier_assigned);
+
+    teardown(s);
+}
+
+static void test_migration_before_start(void)
+{
+    VirtIOBlockDataPlane *s;
+
+    /* Device hotplugged or driver loaded while migration is running */
+    dirty_tracking = 1;
+    s = setup();
+    virtio_blk_data_plane_start(s);
+    g_assert(!host_notifier_assigned);
+
+    set_dirty_tracking(0);
+    g_assert(host_notifier_assigned);
+    do_request(VIRTIO_BLK_T_FLUSH, 0, 0, 0, VIRTIO_BLK_S_OK);
+
+    teardown(s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/virtio-blk/data-plane/rdwr", test_rdwr);
+    g_test_add_func("/virtio-blk/data-plane/migration", test_migration);
+    g_test_add_func("/virtio-blk/data-plane/migration_before_start",
+                    test_migration_before_start);
+
+    return g_test_run();
+}
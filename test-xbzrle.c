@@ -0,0 +1,193 @@
+/*
+ * Xor Based Zero Run Length Encoding unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+#define PAGE_SIZE 4096
+
+static void fill_page(uint8_t *buf, unsigned int seed)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        buf[i] = (i * 31 + seed) & 0xff;
+    }
+}
+
+/* Encode the difference between @old and @new, apply it to a copy of @old
+   and check that the result is @new.  Returns the encoded length. */
+static int round_trip(const uint8_t *old, const uint8_t *new, int dlen)
+{
+    uint8_t *encoded = g_malloc0(dlen);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int elen, dret;
+
+    elen = xbzrle_encode_buffer(old, new, PAGE_SIZE, encoded, dlen);
+    g_assert(elen >= 0 && elen <= dlen);
+
+    memcpy(decoded, old, PAGE_SIZE);
+    dret = xbzrle_decode_buffer(encoded, elen, decoded, PAGE_SIZE);
+    g_assert(dret >= 0 && dret <= PAGE_SIZE);
+    g_assert(memcmp(decoded, new, PAGE_SIZE) == 0);
+
+    g_free(encoded);
+    g_free(decoded);
+    return elen;
+}
+
+/*
+ * Check that an unchanged page encodes to nothing
+ */
+
+static void test_encode_unchanged(void)
+{
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+
+    fill_page(page, 1);
+    g_assert_cmpint(xbzrle_encode_buffer(page, page, PAGE_SIZE,
+                                         buf, PAGE_SIZE), ==, 0);
+    g_assert_cmpint(xbzrle_decode_buffer(buf, 0, page, PAGE_SIZE), ==, 0);
+
+    g_free(page);
+    g_free(buf);
+}
+
+/*
+ * Check that scattered changes survive encoding and decoding
+ */
+
+static void test_round_trip(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    int i;
+
+    fill_page(old, 0);
+    memcpy(new, old, PAGE_SIZE);
+
+    /* first byte, a short run, a run crossing a word boundary, last byte */
+    new[0] ^= 0xff;
+    for (i = 100; i < 103; i++) {
+        new[i] ^= 0x55;
+    }
+    for (i = 1021; i < 1200; i++) {
+        new[i] = ~new[i];
+    }
+    new[PAGE_SIZE - 1] ^= 1;
+
+    round_trip(old, new, PAGE_SIZE);
+
+    g_free(old);
+    g_free(new);
+}
+
+/*
+ * Check runs as long as the page, whose lengths need two ULEB128 bytes
+ */
+
+static void test_page_sized_runs(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    int elen;
+
+    /* a zero run of PAGE_SIZE - 1 followed by one changed byte */
+    fill_page(old, 0);
+    memcpy(new, old, PAGE_SIZE);
+    new[PAGE_SIZE - 1] ^= 0x80;
+    elen = round_trip(old, new, PAGE_SIZE);
+    g_assert_cmpint(elen, ==, 2 + 1 + 1);
+
+    /* every byte changed: zrun 0, nzrun PAGE_SIZE and the whole page */
+    fill_page(new, 7);
+    elen = round_trip(old, new, PAGE_SIZE + 3);
+    g_assert_cmpint(elen, ==, 1 + 2 + PAGE_SIZE);
+
+    g_free(old);
+    g_free(new);
+}
+
+/*
+ * Check that an encoding larger than the destination fails cleanly
+ */
+
+static void test_encode_overflow(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *buf = g_malloc(PAGE_SIZE + 16);
+    int i;
+
+    fill_page(old, 0);
+    fill_page(new, 7);
+    memset(buf, 0xa5, PAGE_SIZE + 16);
+
+    /* one byte short of the full page encoding */
+    g_assert_cmpint(xbzrle_encode_buffer(old, new, PAGE_SIZE,
+                                         buf, PAGE_SIZE + 2), ==, -1);
+    for (i = PAGE_SIZE + 2; i < PAGE_SIZE + 16; i++) {
+        g_assert_cmpint(buf[i], ==, 0xa5);
+    }
+
+    /* no room even for the run lengths */
+    g_assert_cmpint(xbzrle_encode_buffer(old, new, PAGE_SIZE, buf, 1), ==, -1);
+
+    /* every other byte changed: the encoding is larger than the page */
+    memcpy(new, old, PAGE_SIZE);
+    for (i = 0; i < PAGE_SIZE; i += 2) {
+        new[i] ^= 1;
+    }
+    g_assert_cmpint(xbzrle_encode_buffer(old, new, PAGE_SIZE,
+                                         buf, PAGE_SIZE), ==, -1);
+
+    g_free(old);
+    g_free(new);
+    g_free(buf);
+}
+
+/*
+ * Check that malformed or oversized encodings are rejected
+ */
+
+static void test_decode_invalid(void)
+{
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    /* zrun 4, nzrun 2, but only one byte of data */
+    static const uint8_t truncated[] = { 0x04, 0x02, 0xaa };
+    /* zrun 1, nzrun 0 */
+    static const uint8_t empty_nzrun[] = { 0x01, 0x00 };
+    /* zrun 4096, nzrun 1: past the end of the page */
+    static const uint8_t past_end[] = { 0x80, 0x20, 0x01, 0xaa };
+    /* zrun with a ULEB128 length that never ends */
+    static const uint8_t bad_uleb[] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+
+    g_assert_cmpint(xbzrle_decode_buffer(truncated, sizeof(truncated),
+                                         page, PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_decode_buffer(empty_nzrun, sizeof(empty_nzrun),
+                                         page, PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_decode_buffer(past_end, sizeof(past_end),
+                                         page, PAGE_SIZE), ==, -1);
+    g_assert_cmpint(xbzrle_decode_buffer(bad_uleb, sizeof(bad_uleb),
+                                         page, PAGE_SIZE), ==, -1);
+
+    g_free(page);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode_unchanged", test_encode_unchanged);
+    g_test_add_func("/xbzrle/round_trip", test_round_trip);
+    g_test_add_func("/xbzrle/page_sized_runs", test_page_sized_runs);
+    g_test_add_func("/xbzrle/encode_overflow", test_encode_overflow);
+    g_test_add_func("/xbzrle/decode_invalid", test_decode_invalid);
+    return g_test_run();
+}
@@ -267,6 +267,7 @@ int xen_allowed = 0;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static const char *tcg_tb_cache;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -3009,6 +3010,9 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_cache:
+                tcg_tb_cache = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -3247,6 +3251,10 @@ int main(int argc, char **argv, char **envp)
 
     configure_accelerator();
 
+    if (tcg_tb_cache && tcg_enabled() && tb_cache_open(tcg_tb_cache) < 0) {
+        exit(1);
+    }
+
     qemu_init_cpu_loop();
     if (qemu_init_main_loop()) {
         fprintf(stderr, "qemu_init_main_loop failed\n");
@@ -3312,8 +3320,8 @@ int main(int argc, char **argv, char **envp)
     default_drive(default_sdcard, snapshot, machine->use_scsi,
                   IF_SD, 0, SD_OPTS);
 
-    register_savevm_live(NULL, "ram", 0, 4, NULL, ram_save_live, NULL,
-                         ram_load, NULL);
+    register_savevm_live(NULL, "ram", 0, 5, ram_set_params, ram_save_live,
+                         NULL, ram_load, NULL);
 
     if (nb_numa_nodes > 0) {
         int i;
@@ -0,0 +1,144 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+static int uleb128_encode(uint8_t *out, int space, uint32_t n)
+{
+    int len = 0;
+
+    do {
+        uint8_t b = n & 0x7f;
+
+        n >>= 7;
+        if (n) {
+            b |= 0x80;
+        }
+        if (len >= space) {
+            return -1;
+        }
+        out[len++] = b;
+    } while (n);
+
+    return len;
+}
+
+static int uleb128_decode(const uint8_t *in, int avail, uint32_t *n)
+{
+    uint32_t val = 0;
+    int len = 0;
+    uint8_t b;
+
+    do {
+        /* a page is never larger than 2^28 bytes */
+        if (len >= avail || len >= 4) {
+            return -1;
+        }
+        b = in[len];
+        val |= (uint32_t)(b & 0x7f) << (7 * len);
+        len++;
+    } while (b & 0x80);
+
+    *n = val;
+    return len;
+}
+
+/* Length of the run of equal (@equal true) or different bytes at @i */
+static int xbzrle_run(const uint8_t *old_buf, const uint8_t *new_buf,
+                      int i, int slen, bool equal)
+{
+    int start = i;
+
+    if (equal) {
+        /* compare a long at a time once aligned, most pages change little */
+        while (i < slen && ((uintptr_t)(new_buf + i) % sizeof(long))) {
+            if (old_buf[i] != new_buf[i]) {
+                return i - start;
+            }
+            i++;
+        }
+        while (i + (int)sizeof(long) <= slen &&
+               *(const long *)(old_buf + i) == *(const long *)(new_buf + i)) {
+            i += sizeof(long);
+        }
+    }
+
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+
+    return i - start;
+}
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0;
+    int zrun_len, nzrun_len, ret;
+
+    while (i < slen) {
+        zrun_len = xbzrle_run(old_buf, new_buf, i, slen, true);
+        i += zrun_len;
+        if (i == slen) {
+            break;
+        }
+
+        nzrun_len = xbzrle_run(old_buf, new_buf, i, slen, false);
+
+        ret = uleb128_encode(dst + d, dlen - d, zrun_len);
+        if (ret < 0) {
+            return -1;
+        }
+        d += ret;
+
+        ret = uleb128_encode(dst + d, dlen - d, nzrun_len);
+        if (ret < 0 || d + ret + nzrun_len > dlen) {
+            return -1;
+        }
+        d += ret;
+
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen)
+{
+    int i = 0, d = 0;
+    uint32_t count;
+    int ret;
+
+    while (i < slen) {
+        /* zrun: skip unchanged bytes */
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count > dlen - d) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* nzrun: copy the new contents */
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count == 0) {
+            return -1;
+        }
+        i += ret;
+        if (count > dlen - d || count > slen - i) {
+            return -1;
+        }
+        memcpy(dst + d, src + i, count);
+        i += count;
+        d += count;
+    }
+
+    return d;
+}
@@ -0,0 +1,38 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef _XBZRLE_H_
+#define _XBZRLE_H_
+
+#include "qemu-common.h"
+
+/*
+ * The encoding is a sequence of (zrun, nzrun) pairs: the length of a run of
+ * bytes that did not change, followed by the length of a run of changed
+ * bytes and the new contents of those bytes.  Lengths are ULEB128 encoded.
+ * A trailing run of unchanged bytes is not encoded.
+ */
+
+/**
+ * xbzrle_encode_buffer: encode the differences between two buffers
+ *
+ * Returns the encoded length, 0 if the buffers are identical, or -1 if the
+ * encoding would not fit in @dlen bytes.
+ */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_decode_buffer: apply an encoded delta to @dst
+ *
+ * Returns the number of bytes of @dst covered by the delta, or -1 if the
+ * encoding is invalid or does not fit in @dlen bytes.
+ */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst,
+                         int dlen);
+
+#endif
@@ -158,6 +158,8 @@ static void xen_ram_init(ram_addr_t ram_size)
                                        new_block->length >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0xff, new_block->length >> TARGET_PAGE_BITS);
+    ram_list.migration_dirty_pages += new_block->length >> TARGET_PAGE_BITS;
+    ram_list.rate_dirty_pages += new_block->length >> TARGET_PAGE_BITS;
 
     if (ram_size >= HVM_BELOW_4G_RAM_END) {
         above_4g_mem_size = ram_size - HVM_BELOW_4G_RAM_END;